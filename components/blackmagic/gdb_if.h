@@ -26,6 +26,11 @@
 void gdb_usb_out_cb(usbd_device *dev, uint8_t ep);
 #endif*/
 
+/* Thread local storage slot holding the per-task exception state. Any task
+ * that calls into target code needs to set this up before doing so.
+ */
+#define GDB_TLS_INDEX 1
+
 int gdb_if_init(void);
 unsigned char gdb_if_getchar(void);
 unsigned char gdb_if_getchar_to(int timeout);
@@ -0,0 +1,168 @@
+/*
+ * ITM / DWT packet decoder for SWO streams.
+ *
+ * ARM DDI 0403E - ARMv7-M Architecture Reference Manual, Appendix D4
+ *
+ * Packets are identified by their header byte:
+ *
+ *   xxxxxSss  source packet, ss = payload size (1, 2 or 4 bytes),
+ *             S = 0 for software (stimulus port), 1 for hardware (DWT),
+ *             xxxxx = stimulus port or hardware discriminator
+ *   00000000  part of a synchronisation packet (>= 47 zero bits then a one)
+ *   01110000  overflow
+ *   CTTT0000  local timestamp, followed by continuation bytes if C is set
+ *   10x10100  global timestamp, followed by continuation bytes
+ *   CxxxSx00  extension, followed by continuation bytes if C is set
+ */
+
+#include <string.h>
+
+#include "itm_decode.h"
+
+#define ITM_STATE_IDLE    0
+#define ITM_STATE_PAYLOAD 1
+#define ITM_STATE_SKIP    2
+
+/* A synchronisation packet contains at least 47 zero bits, which leaves at
+ * least five whole zero bytes in the stream. No other packet can produce
+ * that many in a row.
+ */
+#define ITM_SYNC_ZEROS 5
+
+void itm_decoder_init(struct itm_decoder *d, itm_stimulus_cb stimulus_cb, itm_hardware_cb hardware_cb, void *ctx)
+{
+	memset(d, 0, sizeof(*d));
+	d->stimulus_cb = stimulus_cb;
+	d->hardware_cb = hardware_cb;
+	d->ctx = ctx;
+	d->channel_mask = 0xffffffff;
+}
+
+void itm_decoder_set_mask(struct itm_decoder *d, uint32_t channel_mask)
+{
+	d->channel_mask = channel_mask;
+}
+
+void itm_decoder_reset(struct itm_decoder *d)
+{
+	d->state = ITM_STATE_IDLE;
+	d->zeros = 0;
+}
+
+static void itm_decode_header(struct itm_decoder *d, uint8_t b)
+{
+	if (b & 0x03) {
+		d->header = b;
+		d->expected = ((b & 0x03) == 0x03) ? 4 : (b & 0x03);
+		d->received = 0;
+		d->state = ITM_STATE_PAYLOAD;
+		return;
+	}
+
+	if (b == 0x70) {
+		d->overflows++;
+		return;
+	}
+
+	/* Local timestamp */
+	if ((b & 0x0f) == 0x00) {
+		if (b & 0x80) {
+			d->state = ITM_STATE_SKIP;
+		}
+		return;
+	}
+
+	/* Extension */
+	if ((b & 0x0b) == 0x08) {
+		if (b & 0x80) {
+			d->state = ITM_STATE_SKIP;
+		}
+		return;
+	}
+
+	/* Global timestamp, formats 1 and 2 */
+	if ((b & 0xdf) == 0x94) {
+		d->state = ITM_STATE_SKIP;
+		return;
+	}
+
+	d->reserved++;
+}
+
+static void itm_decode_emit(struct itm_decoder *d)
+{
+	uint8_t port = d->header >> 3;
+
+	if (d->header & 0x04) {
+		uint32_t value = 0;
+		int i;
+		for (i = d->expected - 1; i >= 0; i--) {
+			value = (value << 8) | d->payload[i];
+		}
+		d->hardware_packets++;
+		if (d->hardware_cb) {
+			d->hardware_cb(d->ctx, port, value, d->expected);
+		}
+		return;
+	}
+
+	if (!(d->channel_mask & (1UL << port))) {
+		d->filtered_packets++;
+		return;
+	}
+	d->stimulus_packets++;
+	if (d->stimulus_cb) {
+		d->stimulus_cb(d->ctx, port, d->payload, d->expected);
+	}
+}
+
+void itm_decode(struct itm_decoder *d, const uint8_t *data, size_t len)
+{
+	while (len-- > 0) {
+		uint8_t b = *data++;
+
+		if (b == 0x00) {
+			if (d->zeros < 0xff) {
+				d->zeros++;
+			}
+			// Zeros between packets, or a run long enough to be a sync
+			// packet, abandon whatever was in progress.
+			if ((d->state == ITM_STATE_IDLE) || (d->zeros >= ITM_SYNC_ZEROS)) {
+				d->state = ITM_STATE_IDLE;
+				continue;
+			}
+		} else {
+			bool sync = (b == 0x80) && (d->zeros >= ITM_SYNC_ZEROS);
+			d->zeros = 0;
+			if (sync) {
+				d->syncs++;
+				d->state = ITM_STATE_IDLE;
+				continue;
+			}
+		}
+
+		switch (d->state) {
+		case ITM_STATE_IDLE:
+			itm_decode_header(d, b);
+			break;
+
+		case ITM_STATE_PAYLOAD:
+			d->payload[d->received++] = b;
+			if (d->received >= d->expected) {
+				d->state = ITM_STATE_IDLE;
+				itm_decode_emit(d);
+			}
+			break;
+
+		case ITM_STATE_SKIP:
+			if (!(b & 0x80)) {
+				d->state = ITM_STATE_IDLE;
+			}
+			break;
+
+		default:
+			d->state = ITM_STATE_IDLE;
+			break;
+		}
+	}
+}
@@ -0,0 +1,57 @@
+/*
+ * ITM / DWT packet decoder for SWO streams.
+ *
+ * ARM DDI 0403E - ARMv7-M Architecture Reference Manual, Appendix D4
+ *
+ * This has no dependencies on the rest of the firmware so it can be built
+ * and exercised on a host.
+ */
+#ifndef __ITM_DECODE_H
+#define __ITM_DECODE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Called with the payload of a stimulus (software source) packet whose
+ * port is enabled in the channel mask.
+ */
+typedef void (*itm_stimulus_cb)(void *ctx, uint8_t port, const uint8_t *data, size_t len);
+
+/* Hardware source discriminator for periodic PC sample packets */
+#define ITM_HW_PC_SAMPLE 2
+
+/* Called with the payload of a hardware source (DWT) packet. `id` is the
+ * discriminator ID, e.g. 2 for periodic PC samples.
+ */
+typedef void (*itm_hardware_cb)(void *ctx, uint8_t id, uint32_t value, size_t len);
+
+struct itm_decoder {
+	uint32_t channel_mask;
+	itm_stimulus_cb stimulus_cb;
+	itm_hardware_cb hardware_cb;
+	void *ctx;
+
+	/* Parser state */
+	uint8_t state;
+	uint8_t header;
+	uint8_t expected;
+	uint8_t received;
+	uint8_t payload[4];
+	uint8_t zeros;
+
+	/* Statistics */
+	uint32_t stimulus_packets;
+	uint32_t hardware_packets;
+	uint32_t filtered_packets;
+	uint32_t overflows;
+	uint32_t syncs;
+	uint32_t reserved;
+};
+
+void itm_decoder_init(struct itm_decoder *d, itm_stimulus_cb stimulus_cb, itm_hardware_cb hardware_cb, void *ctx);
+void itm_decoder_set_mask(struct itm_decoder *d, uint32_t channel_mask);
+void itm_decoder_reset(struct itm_decoder *d);
+void itm_decode(struct itm_decoder *d, const uint8_t *data, size_t len);
+
+#endif /* __ITM_DECODE_H */
@@ -29,6 +29,7 @@
 
 #include "general.h"
 #include "traceswo.h"
+#include "itm_decode.h"
 // #include <esp32/clk.h>
 #include <esp_log.h>
 #include <esp_task_wdt.h>
@@ -36,219 +37,314 @@
 #include <esp_mac.h>
 #include "sdkconfig.h"
 
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+
 #include "driver/uart.h"
 #include "hal/uart_ll.h"
+#include "lwip/sockets.h"
+
+#include "baud_detect.h"
+#include "http.h"
+#include "profile.h"
 
-// static const char TAG[] = "traceswo";
+static const char TAG[] = "traceswo";
 
-// static xTaskHandle rx_pid;
-// static volatile bool should_exit_calibration;
-// static xQueueHandle uart_event_queue;
+static TaskHandle_t rx_pid;
+static QueueHandle_t uart_event_queue;
 
 #define UART_RECALCULATE_BAUD 0x1000
 #define UART_TERMINATE        0x1001
 
+/* Size of the UART driver's receive ring buffer. SWO runs at several Mbaud,
+ * so this needs to cover a few scheduler ticks worth of data.
+ */
+#define SWO_RX_BUFFER_SIZE (16 * 1024)
+
+/* Largest amount of data moved out of the ring buffer at once */
+#define SWO_READ_CHUNK 2048
+
+/* How long the TCP server waits after a socket error, doubling each time */
+#define SWO_NET_BACKOFF_MIN_MS 100
+#define SWO_NET_BACKOFF_MAX_MS 5000
+
+/* Starting point while the baud rate is being detected */
+#define SWO_INITIAL_AUTOBAUD 115200
+
 int swo_active = 0;
 
-// static esp_err_t uart_reset_rx_fifo(uart_port_t uart_num)
-// {
-// 	//Due to hardware issue, we can not use fifo_rst to reset uart fifo.
-// 	//See description about UART_TXFIFO_RST and UART_RXFIFO_RST in <<esp32_technical_reference_manual>> v2.6 or later.
-
-// 	// we read the data out and make `fifo_len == 0 && rd_addr == wr_addr`.
-// 	while (UART_LL_GET_HW(uart_num)->status.rxfifo_cnt != 0 ||
-// 		   (UART_LL_GET_HW(uart_num)->mem_rx_status.wr_addr != UART_LL_GET_HW(uart_num)->mem_rx_status.rd_addr)) {
-// 		READ_PERI_REG(UART_FIFO_REG(uart_num));
-// 	}
-// 	return ESP_OK;
-// }
-
-// static int32_t uart_baud_detect(uart_port_t uart_num, int sample_bits, int max_tries)
-// {
-// 	int low_period = 0;
-// 	int high_period = 0;
-// 	int tries = 0;
-// 	uint32_t intena_reg = UART_LL_GET_HW(uart_num)->int_ena.val;
-
-// 	// Disable the interruput.
-// 	UART_LL_GET_HW(uart_num)->int_ena.val = 0;
-// 	UART_LL_GET_HW(uart_num)->int_clr.val = ~0;
-
-// 	// Filter
-// 	UART_LL_GET_HW(uart_num)->auto_baud.glitch_filt = 4;
-
-// 	// Clear the previous result
-// 	UART_LL_GET_HW(uart_num)->auto_baud.en = 0;
-// 	UART_LL_GET_HW(uart_num)->auto_baud.en = 1;
-// 	ESP_LOGI(__func__, "waiting for %d samples", sample_bits);
-// 	while (UART_LL_GET_HW(uart_num)->rxd_cnt.edge_cnt < sample_bits) {
-// 		if (tries++ >= max_tries) {
-// 			// Disable the baudrate detection
-// 			UART_LL_GET_HW(uart_num)->auto_baud.en = 0;
-
-// 			// Reset the fifo
-// 			ESP_LOGD(__func__, "resetting the fifo");
-// 			uart_reset_rx_fifo(uart_num);
-// 			UART_LL_GET_HW(uart_num)->int_ena.val = intena_reg;
-// 			return -1;
-// 		}
-// 		vTaskDelay(pdMS_TO_TICKS(10));
-// 		// esp_task_wdt_reset();
-// 		// ets_delay_us(10);
-// 	}
-// 	low_period = UART_LL_GET_HW(uart_num)->lowpulse.min_cnt;
-// 	high_period = UART_LL_GET_HW(uart_num)->highpulse.min_cnt;
-
-// 	// Disable the baudrate detection
-// 	UART_LL_GET_HW(uart_num)->auto_baud.en = 0;
-
-// 	// Reset the fifo
-// 	ESP_LOGD(__func__, "resetting the fifo");
-// 	uart_reset_rx_fifo(uart_num);
-// 	UART_LL_GET_HW(uart_num)->int_ena.val = intena_reg;
-
-// 	// Set the clock divider reg
-// 	UART_LL_GET_HW(uart_num)->clk_div.div_int = (low_period > high_period) ? high_period : low_period;
-
-// 	// Return the divider. baud = APB / divider
-// 	return esp_clk_apb_freq() / ((low_period > high_period) ? high_period : low_period);
-// }
-
-// /**
-//  * @brief UART Receive Task
-//  *
-//  */
-// static void swo_uart_rx_task(void *arg)
-// {
-// 	uint32_t default_baud = (uint32_t)arg;
-// 	int baud_rate = default_baud;
-// 	esp_err_t ret;
-// 	uint8_t buf[256];
-// 	int bufpos = 0;
-
-// 	if (baud_rate == 0) {
-// 		baud_rate = 115200;
-// 	}
-
-// 	ret = uart_set_pin(
-// 		CONFIG_TRACE_SWO_UART_IDX, UART_PIN_NO_CHANGE, CONFIG_TDO_GPIO, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
-// 	if (ret != ESP_OK) {
-// 		ESP_LOGE(TAG, "unable to configure SWO UART pin: %s", esp_err_to_name(ret));
-// 		goto out;
-// 	}
-
-// 	uart_config_t uart_config = {
-// 		.baud_rate = baud_rate,
-// 		.data_bits = UART_DATA_8_BITS,
-// 		.parity = UART_PARITY_DISABLE,
-// 		.stop_bits = UART_STOP_BITS_1,
-// 		.flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
-// 	};
-// 	ret = uart_driver_install(CONFIG_TRACE_SWO_UART_IDX, 4096, 256, 16, &uart_event_queue, 0);
-// 	if (ret != ESP_OK) {
-// 		ESP_LOGE(TAG, "unable to install SWO UART driver: %s", esp_err_to_name(ret));
-// 		goto out;
-// 	}
-
-// 	ret = uart_param_config(CONFIG_TRACE_SWO_UART_IDX, &uart_config);
-// 	if (ret != ESP_OK) {
-// 		ESP_LOGE(TAG, "unable to configure SWO UART driver: %s", esp_err_to_name(ret));
-// 		goto out;
-// 	}
-
-// 	const uart_intr_config_t uart_intr = {
-// 		.intr_enable_mask = UART_RXFIFO_FULL_INT_ENA_M | UART_RXFIFO_TOUT_INT_ENA_M | UART_FRM_ERR_INT_ENA_M |
-// 	                        UART_RXFIFO_OVF_INT_ENA_M,
-// 		.rxfifo_full_thresh = 80,
-// 		.rx_timeout_thresh = 2,
-// 		.txfifo_empty_intr_thresh = 10,
-// 	};
-
-// 	ret = uart_intr_config(CONFIG_TRACE_SWO_UART_IDX, &uart_intr);
-// 	if (ret != ESP_OK) {
-// 		ESP_LOGE(TAG, "unable to configure UART interrupt: %s", esp_err_to_name(ret));
-// 		goto out;
-// 	}
-
-// 	if (default_baud == 0) {
-// 		ESP_LOGI(TAG, "baud rate not specified, initiating autobaud detection");
-// 		baud_rate = uart_baud_detect(CONFIG_TRACE_SWO_UART_IDX, 20, 10);
-// 		ESP_LOGI(TAG, "baud rate detected as %d", baud_rate);
-// 	}
-
-// 	ESP_LOGI(TAG, "UART driver started with baud rate of %d, beginning reception...", baud_rate);
-
-// 	while (1) {
-// 		uart_event_t evt;
-
-// 		if (xQueueReceive(uart_event_queue, (void *)&evt, 100)) {
-// 			if (evt.type == UART_FIFO_OVF) {
-// 				// uart_overrun_cnt++;
-// 			}
-// 			if (evt.type == UART_FRAME_ERR) {
-// 				// uart_errors++;
-// 			}
-// 			if (evt.type == UART_BUFFER_FULL) {
-// 				// uart_queue_full_cnt++;
-// 			}
-
-// 			if (evt.type == UART_TERMINATE) {
-// 				break;
-// 			}
-
-// 			if (baud_rate == -1 || evt.type == UART_RECALCULATE_BAUD) {
-// 				esp_err_t ret = uart_set_pin(CONFIG_TRACE_SWO_UART_IDX, UART_PIN_NO_CHANGE, CONFIG_TDO_GPIO,
-// 					UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
-// 				if (ret != ESP_OK) {
-// 					ESP_LOGE(TAG, "unable to configure SWO UART pin: %s", esp_err_to_name(ret));
-// 					goto out;
-// 				}
-
-// 				if ((evt.size != 0) && (evt.type == UART_RECALCULATE_BAUD)) {
-// 					baud_rate = evt.size;
-// 					ESP_LOGI(TAG, "setting baud rate to %d", baud_rate);
-// 					uart_set_baudrate(CONFIG_TRACE_SWO_UART_IDX, baud_rate);
-// 				} else {
-// 					ESP_LOGD(TAG, "detecting baud rate");
-// 					baud_rate = uart_baud_detect(CONFIG_TRACE_SWO_UART_IDX, 20, 50);
-// 					ESP_LOGI(TAG, "baud rate detected as %d", baud_rate);
-// 				}
-// 			}
-
-// 			bufpos = uart_read_bytes(CONFIG_TRACE_SWO_UART_IDX, &buf[bufpos], sizeof(buf) - bufpos, 0);
-
-// 			if (bufpos > 0) {
-// 				char logstr[bufpos * 3 + 1];
-// 				memset(logstr, 0, sizeof(logstr));
-// 				int j;
-// 				for (j = 0; j < bufpos; j++) {
-// 					sprintf(logstr + (j * 3), " %02x", buf[j]);
-// 				}
-// 				ESP_LOGI(TAG, "uart has rx %d bytes: %s", bufpos, logstr);
-// 				// uart_rx_count += bufpos;
-// 				// http_term_broadcast_data(buf, bufpos);
-
-// 				bufpos = 0;
-// 			} // if(bufpos)
-// 		} else if (baud_rate == -1) {
-// 			esp_err_t ret = uart_set_pin(
-// 				CONFIG_TRACE_SWO_UART_IDX, UART_PIN_NO_CHANGE, CONFIG_TDO_GPIO, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
-// 			if (ret != ESP_OK) {
-// 				ESP_LOGE(TAG, "unable to configure SWO UART pin: %s", esp_err_to_name(ret));
-// 				goto out;
-// 			}
-
-// 			ESP_LOGD(TAG, "detecting baud rate");
-// 			baud_rate = uart_baud_detect(CONFIG_TRACE_SWO_UART_IDX, 20, 50);
-// 			ESP_LOGI(TAG, "baud rate detected as %d", baud_rate);
-// 		}
-// 	}
-
-// out:
-// 	uart_driver_delete(CONFIG_TRACE_SWO_UART_IDX);
-// 	rx_pid = NULL;
-// 	vTaskDelete(NULL);
-// }
+// SWO statistics counters
+uint32_t swo_rx_count;
+uint32_t swo_overrun_cnt;
+uint32_t swo_frame_error_cnt;
+uint32_t swo_queue_full_cnt;
+
+static uint32_t swo_channel_mask;
+static struct itm_decoder swo_decoder;
+
+static int swo_tcp_serv_sock = -1;
+static int swo_tcp_client_sock = 0;
+
+static uint8_t swo_out_buf[SWO_READ_CHUNK];
+static size_t swo_out_len;
+
+
+/* Open the listening socket, or return -1 */
+static int swo_net_listen(void)
+{
+	struct sockaddr_in saddr;
+	int opt = 1;
+
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0) {
+		ESP_LOGE(TAG, "socket() failed (%s)", strerror(errno));
+		return -1;
+	}
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void *)&opt, sizeof(opt));
+
+	saddr.sin_addr.s_addr = 0;
+	saddr.sin_port = htons(CONFIG_SWO_TCP_PORT);
+	saddr.sin_family = AF_INET;
+	if (bind(sock, (struct sockaddr *)&saddr, sizeof(saddr)) < 0) {
+		ESP_LOGE(TAG, "bind() to port %d failed (%s)", CONFIG_SWO_TCP_PORT, strerror(errno));
+		close(sock);
+		return -1;
+	}
+	if (listen(sock, 1) < 0) {
+		ESP_LOGE(TAG, "listen() failed (%s)", strerror(errno));
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+static void swo_net_task(void *arg)
+{
+	(void)arg;
+	uint32_t backoff_ms = SWO_NET_BACKOFF_MIN_MS;
+
+	while ((swo_tcp_serv_sock = swo_net_listen()) < 0) {
+		vTaskDelay(pdMS_TO_TICKS(SWO_NET_BACKOFF_MAX_MS));
+	}
+	ESP_LOGI(TAG, "listening for SWO clients on TCP:%d", CONFIG_SWO_TCP_PORT);
+
+	while (1) {
+		int sock = accept(swo_tcp_serv_sock, 0, 0);
+		if (sock < 0) {
+			// Usually out of sockets, which takes a while to clear
+			ESP_LOGE(TAG, "accept() failed (%s), retrying in %u ms", strerror(errno), backoff_ms);
+			vTaskDelay(pdMS_TO_TICKS(backoff_ms));
+			backoff_ms *= 2;
+			if (backoff_ms > SWO_NET_BACKOFF_MAX_MS) {
+				backoff_ms = SWO_NET_BACKOFF_MAX_MS;
+			}
+			continue;
+		}
+		backoff_ms = SWO_NET_BACKOFF_MIN_MS;
+		ESP_LOGI(TAG, "accepted SWO tcp connection");
+
+		int opt = 1;
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void *)&opt, sizeof(opt));
+
+		// Only one client at a time -- a new connection replaces the old one.
+		int old_sock = swo_tcp_client_sock;
+		swo_tcp_client_sock = sock;
+		if (old_sock) {
+			close(old_sock);
+		}
+	}
+}
+
+static void swo_flush(void)
+{
+	if (swo_out_len == 0) {
+		return;
+	}
+
+	http_term_broadcast_swo(swo_out_buf, swo_out_len);
+
+	int sock = swo_tcp_client_sock;
+	if (sock) {
+		int ret = send(sock, swo_out_buf, swo_out_len, MSG_DONTWAIT);
+		if ((ret < 0) && (errno != EAGAIN)) {
+			ESP_LOGE(TAG, "tcp send() failed (%s)", strerror(errno));
+			if (swo_tcp_client_sock == sock) {
+				swo_tcp_client_sock = 0;
+			}
+			close(sock);
+		}
+	}
+	swo_out_len = 0;
+}
+
+static void swo_output(const uint8_t *data, size_t len)
+{
+	while (len > 0) {
+		size_t count = sizeof(swo_out_buf) - swo_out_len;
+		if (count > len) {
+			count = len;
+		}
+		memcpy(swo_out_buf + swo_out_len, data, count);
+		swo_out_len += count;
+		data += count;
+		len -= count;
+		if (swo_out_len == sizeof(swo_out_buf)) {
+			swo_flush();
+		}
+	}
+}
+
+static void swo_baud_detected(uart_port_t port, uint32_t baud, void *ctx)
+{
+	(void)ctx;
+	(void)port;
+	// Bytes received before the rate was found are garbage, so restart the
+	// decoder from the receive task.
+	uart_event_t msg;
+	msg.type = UART_RECALCULATE_BAUD;
+	msg.size = 0;
+	xQueueSend(uart_event_queue, &msg, 0);
+}
+
+static void swo_stimulus_cb(void *ctx, uint8_t port, const uint8_t *data, size_t len)
+{
+	(void)ctx;
+	(void)port;
+	swo_output(data, len);
+}
+
+static void swo_hardware_cb(void *ctx, uint8_t id, uint32_t value, size_t len)
+{
+	(void)ctx;
+	if (id == ITM_HW_PC_SAMPLE) {
+		// A one byte sample means the core was sleeping
+		profile_add_sample((len == 4) ? value : PROFILE_PC_SLEEP);
+	}
+}
+
+static int swo_uart_configure(int baud_rate)
+{
+	esp_err_t ret;
+
+	ret = uart_set_pin(
+		CONFIG_TRACE_SWO_UART_IDX, UART_PIN_NO_CHANGE, CONFIG_TDO_GPIO, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+	if (ret != ESP_OK) {
+		ESP_LOGE(TAG, "unable to configure SWO UART pin: %s", esp_err_to_name(ret));
+		return -1;
+	}
+
+	uart_config_t uart_config = {
+		.baud_rate = baud_rate,
+		.data_bits = UART_DATA_8_BITS,
+		.parity = UART_PARITY_DISABLE,
+		.stop_bits = UART_STOP_BITS_1,
+		.flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+	};
+	ret = uart_driver_install(
+		CONFIG_TRACE_SWO_UART_IDX, SWO_RX_BUFFER_SIZE, 0, 32, &uart_event_queue, ESP_INTR_FLAG_IRAM);
+	if (ret != ESP_OK) {
+		ESP_LOGE(TAG, "unable to install SWO UART driver: %s", esp_err_to_name(ret));
+		return -1;
+	}
+
+	ret = uart_param_config(CONFIG_TRACE_SWO_UART_IDX, &uart_config);
+	if (ret != ESP_OK) {
+		ESP_LOGE(TAG, "unable to configure SWO UART driver: %s", esp_err_to_name(ret));
+		return -1;
+	}
+
+	// Let the FIFO fill most of the way before interrupting, so that each
+	// interrupt moves a large block into the ring buffer.
+	const uart_intr_config_t uart_intr = {
+		.intr_enable_mask = UART_RXFIFO_FULL_INT_ENA_M | UART_RXFIFO_TOUT_INT_ENA_M | UART_FRM_ERR_INT_ENA_M |
+	                        UART_RXFIFO_OVF_INT_ENA_M,
+		.rxfifo_full_thresh = 100,
+		.rx_timeout_thresh = 10,
+		.txfifo_empty_intr_thresh = 10,
+	};
+
+	ret = uart_intr_config(CONFIG_TRACE_SWO_UART_IDX, &uart_intr);
+	if (ret != ESP_OK) {
+		ESP_LOGE(TAG, "unable to configure UART interrupt: %s", esp_err_to_name(ret));
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief UART Receive Task
+ *
+ */
+static void swo_uart_rx_task(void *arg)
+{
+	int baud_rate = (uint32_t)arg;
+	static uint8_t buf[SWO_READ_CHUNK];
+
+	// Install the driver from this task so that the UART interrupt runs on
+	// the same core as the receive loop.
+	if (swo_uart_configure(baud_rate ? baud_rate : SWO_INITIAL_AUTOBAUD) < 0) {
+		goto out;
+	}
+
+	if (baud_rate == SWO_DEFAULT_BAUD) {
+		ESP_LOGI(TAG, "baud rate not specified, initiating autobaud detection");
+		baud_detect_start(CONFIG_TRACE_SWO_UART_IDX, swo_baud_detected, NULL);
+	}
+
+	ESP_LOGI(TAG, "UART driver started with baud rate of %d, beginning reception...", baud_rate);
+
+	while (1) {
+		uart_event_t evt;
+
+		if (!xQueueReceive(uart_event_queue, (void *)&evt, portMAX_DELAY)) {
+			continue;
+		}
+
+		if (evt.type == UART_FIFO_OVF) {
+			swo_overrun_cnt++;
+		} else if (evt.type == UART_FRAME_ERR) {
+			swo_frame_error_cnt++;
+			baud_detect_frame_error(CONFIG_TRACE_SWO_UART_IDX);
+		} else if (evt.type == UART_BUFFER_FULL) {
+			swo_queue_full_cnt++;
+		} else if (evt.type == UART_TERMINATE) {
+			break;
+		} else if (evt.type == UART_RECALCULATE_BAUD) {
+			if (evt.size != 0) {
+				baud_rate = evt.size;
+				ESP_LOGI(TAG, "setting baud rate to %d", baud_rate);
+				baud_detect_stop(CONFIG_TRACE_SWO_UART_IDX);
+				uart_set_baudrate(CONFIG_TRACE_SWO_UART_IDX, baud_rate);
+			}
+			itm_decoder_reset(&swo_decoder);
+			continue;
+		}
+
+		// Drain everything that is buffered, not just what this event covers.
+		int count;
+		while ((count = uart_read_bytes(CONFIG_TRACE_SWO_UART_IDX, buf, sizeof(buf), 0)) > 0) {
+			swo_rx_count += count;
+			if (baud_detect_is_measuring(CONFIG_TRACE_SWO_UART_IDX)) {
+				continue;
+			}
+			if (swo_channel_mask == 0 && !profile_swo_active()) {
+				// Decoding is off, so pass the raw stream through.
+				swo_output(buf, count);
+			} else {
+				itm_decode(&swo_decoder, buf, count);
+			}
+		}
+		swo_flush();
+	}
+
+out:
+	baud_detect_stop(CONFIG_TRACE_SWO_UART_IDX);
+	uart_driver_delete(CONFIG_TRACE_SWO_UART_IDX);
+	rx_pid = NULL;
+	vTaskDelete(NULL);
+}
 
 char *serial_no_read(char *s)
 {
@@ -261,35 +357,57 @@ char *serial_no_read(char *s)
 
 void traceswo_deinit(void)
 {
-	// swo_active = 0;
-	// if (rx_pid) {
-	// 	uart_event_t msg;
-	// 	msg.type = UART_TERMINATE;
-	// 	xQueueSend(uart_event_queue, &msg, portMAX_DELAY);
-
-	// 	while (rx_pid != NULL) {
-	// 		vTaskDelay(pdMS_TO_TICKS(10));
-	// 	}
-	// }
+	swo_active = 0;
+	if (rx_pid) {
+		uart_event_t msg;
+		msg.type = UART_TERMINATE;
+		xQueueSend(uart_event_queue, &msg, portMAX_DELAY);
+
+		while (rx_pid != NULL) {
+			vTaskDelay(pdMS_TO_TICKS(10));
+		}
+	}
 }
+
 void traceswo_init(uint32_t baudrate, uint32_t swo_chan_bitmask)
 {
-	// if (!rx_pid) {
-	// 	ESP_LOGI(TAG, "initializing traceswo");
-	// 	// xTaskCreate(swo_uart_rx_task, "swo_rx_task", 2048, (void *)baudrate, 10, &rx_pid);
-	// 	xTaskCreatePinnedToCore(
-	// 		swo_uart_rx_task, (const char *)"swo_rx_task", 2048, (void *)baudrate, 10, &rx_pid, tskNO_AFFINITY);
-	// } else {
-	// 	ESP_LOGI(TAG, "traceswo already initialized, reinitializing...");
-	// 	traceswo_baud(baudrate);
-	// }
-	// swo_active = 1;
+	static bool net_started;
+	if (!net_started) {
+		xTaskCreate(swo_net_task, "swo_net_task", 3072, NULL, 1, NULL);
+		net_started = true;
+	}
+
+	traceswo_setmask(swo_chan_bitmask);
+
+	if (!rx_pid) {
+		ESP_LOGI(TAG, "initializing traceswo");
+		itm_decoder_init(&swo_decoder, swo_stimulus_cb, swo_hardware_cb, NULL);
+		itm_decoder_set_mask(&swo_decoder, swo_chan_bitmask);
+		xTaskCreatePinnedToCore(swo_uart_rx_task, "swo_rx_task", 4096, (void *)baudrate, 10, &rx_pid, 1);
+	} else {
+		ESP_LOGI(TAG, "traceswo already initialized, reinitializing...");
+		traceswo_baud(baudrate);
+	}
+	swo_active = 1;
+}
+
+void traceswo_setmask(uint32_t mask)
+{
+	swo_channel_mask = mask;
+	itm_decoder_set_mask(&swo_decoder, mask);
 }
 
 void traceswo_baud(unsigned int baud)
 {
-	// uart_event_t msg;
-	// msg.type = 0x1000;
-	// msg.size = baud;
-	// xQueueSend(uart_event_queue, &msg, portMAX_DELAY);
-}
\ No newline at end of file
+	if (!rx_pid) {
+		return;
+	}
+	if (baud == SWO_DEFAULT_BAUD) {
+		baud_detect_start(CONFIG_TRACE_SWO_UART_IDX, swo_baud_detected, NULL);
+		return;
+	}
+	uart_event_t msg;
+	msg.type = UART_RECALCULATE_BAUD;
+	msg.size = baud;
+	xQueueSend(uart_event_queue, &msg, portMAX_DELAY);
+}
@@ -0,0 +1,110 @@
+// Client for the multiplexed /ws websocket. Every message is a run of
+// records, each a channel byte, a flags byte and a little endian 16-bit
+// length followed by the payload. See main/wsmux.h.
+var WsMux = (function () {
+  var CHANNEL_CONTROL = 0;
+  var OP_SUBSCRIBE = 1;
+  var FLAG_END = 0x01;
+  var FLAG_LOST = 0x02;
+  var SEND_CHUNK = 1024;
+
+  var channels = { uart: 1, rtt: 2, debug: 3, swo: 4, pcsample: 5, status: 6, ota: 7 };
+  var handlers = {};
+  var partial = {};
+  var encoder = new TextEncoder();
+  var socket;
+  var mux = {
+    channels: channels,
+    onopen: function () { },
+    onclose: function (event) { },
+    onlost: function (name) { },
+  };
+
+  function record(channel, payload) {
+    var buf = new Uint8Array(4 + payload.length);
+    buf[0] = channel;
+    buf[1] = 0;
+    buf[2] = payload.length & 0xff;
+    buf[3] = payload.length >> 8;
+    buf.set(payload, 4);
+    return buf;
+  }
+
+  function subscribeAll() {
+    var ids = Object.keys(handlers).map(function (name) { return channels[name]; });
+    if (ids.length && socket.readyState == WebSocket.OPEN) {
+      socket.send(record(CHANNEL_CONTROL, [OP_SUBSCRIBE].concat(ids)));
+    }
+  }
+
+  function deliver(channel, flags, payload) {
+    var name = Object.keys(channels).find(function (n) { return channels[n] == channel; });
+    var handler = handlers[name];
+    if (!handler) return;
+    if (flags & FLAG_LOST) mux.onlost(name);
+    if (!handler.whole) {
+      handler.fn(payload);
+      return;
+    }
+    // Whole-message channels are collected until the end marker
+    var parts = partial[channel] || [];
+    parts.push(payload);
+    if (!(flags & FLAG_END)) {
+      partial[channel] = parts;
+      return;
+    }
+    delete partial[channel];
+    var total = parts.reduce(function (n, p) { return n + p.length; }, 0);
+    var msg = new Uint8Array(total);
+    var offset = 0;
+    parts.forEach(function (p) { msg.set(p, offset); offset += p.length; });
+    handler.fn(msg);
+  }
+
+  function connect() {
+    socket = new WebSocket("ws://" + window.location.host + "/ws");
+    socket.binaryType = 'arraybuffer';
+    socket.onopen = function () {
+      subscribeAll();
+      mux.onopen();
+    };
+    socket.onmessage = function (event) {
+      var data = new Uint8Array(event.data);
+      var offset = 0;
+      while (offset + 4 <= data.length) {
+        var len = data[offset + 2] | (data[offset + 3] << 8);
+        var payload = data.subarray(offset + 4, offset + 4 + len);
+        if (data[offset] != CHANNEL_CONTROL) {
+          deliver(data[offset], data[offset + 1], payload);
+        }
+        offset += 4 + len;
+      }
+    };
+    socket.onclose = function (event) {
+      partial = {};
+      mux.onclose(event);
+      setTimeout(connect, 1000);
+    };
+  }
+
+  // Call `fn` with a Uint8Array for everything received on the channel. If
+  // `whole` is set, records are joined up into complete messages first.
+  mux.subscribe = function (name, fn, whole) {
+    handlers[name] = { fn: fn, whole: !!whole };
+    if (socket) subscribeAll();
+  };
+
+  // Send a string, array of byte values or Uint8Array to a channel. Large
+  // pastes go out in small frames that fit the server's receive pool.
+  mux.send = function (name, data) {
+    if (!socket || socket.readyState != WebSocket.OPEN) return;
+    if (typeof data == "string") data = encoder.encode(data);
+    else if (!(data instanceof Uint8Array)) data = Uint8Array.from(data);
+    for (var offset = 0; offset < data.length; offset += SEND_CHUNK) {
+      socket.send(record(channels[name], data.subarray(offset, offset + SEND_CHUNK)));
+    }
+  };
+
+  mux.connect = connect;
+  return mux;
+})();
@@ -0,0 +1,237 @@
+/*
+ * Baud rate detection service.
+ *
+ * The UART peripheral can count RX edges and record the shortest high and
+ * low pulse it has seen. The shortest pulse is one bit time, so the baud
+ * rate falls out as the UART clock divided by that count. Measurements are
+ * taken while the UART keeps receiving, so nothing downstream stalls while
+ * a rate is being found; bytes received at the old rate are simply garbage
+ * until the new rate is applied.
+ *
+ * A rate is accepted once two consecutive measurement windows agree, which
+ * at the 10 ms tick takes 20-30 ms given a steady stream of data.
+ */
+
+#include <string.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "esp_log.h"
+#include "esp_private/esp_clk.h"
+#include "hal/uart_ll.h"
+
+#include "baud_detect.h"
+
+#define TAG "baud-detect"
+
+/* Number of RX edges that make up one measurement window */
+#define BAUD_DETECT_MIN_EDGES 32
+
+/* Two windows are considered to agree if within this many percent */
+#define BAUD_DETECT_AGREE_PCT 3
+
+/* Snap to a standard rate if within this many percent of it */
+#define BAUD_DETECT_SNAP_PCT 2
+
+/* Frame errors within the window that trigger a new measurement */
+#define BAUD_DETECT_ERROR_THRESHOLD 8
+#define BAUD_DETECT_ERROR_WINDOW_MS 100
+
+#define BAUD_DETECT_POLL_MS 10
+
+enum baud_detect_state {
+	BAUD_DETECT_OFF = 0,
+	BAUD_DETECT_MEASURING,
+	BAUD_DETECT_LOCKED,
+};
+
+struct baud_detect_port {
+	volatile enum baud_detect_state state;
+	baud_detect_cb_t cb;
+	void *ctx;
+	uint32_t candidate;
+	uint32_t measure_start_ms;
+	volatile uint32_t frame_errors;
+	uint32_t window_errors;
+	uint32_t window_start_ms;
+};
+
+static struct baud_detect_port ports[UART_NUM_MAX];
+static TaskHandle_t baud_detect_pid;
+
+static const uint32_t standard_rates[] = {
+	1200, 2400, 4800, 9600, 14400, 19200, 38400, 57600, 115200, 230400, 250000, 460800, 500000, 921600, 1000000,
+	1500000, 2000000, 3000000,
+};
+
+static uint32_t baud_detect_snap(uint32_t baud)
+{
+	int i;
+	for (i = 0; i < sizeof(standard_rates) / sizeof(*standard_rates); i++) {
+		uint32_t rate = standard_rates[i];
+		uint32_t delta = (baud > rate) ? baud - rate : rate - baud;
+		if (delta * 100 <= rate * BAUD_DETECT_SNAP_PCT) {
+			return rate;
+		}
+	}
+	return baud;
+}
+
+static void baud_detect_rearm(uart_port_t port)
+{
+	uart_dev_t *hw = UART_LL_GET_HW(port);
+	uart_ll_set_autobaud_en(hw, false);
+	uart_ll_set_autobaud_en(hw, true);
+}
+
+static void baud_detect_begin(uart_port_t port, uint32_t now)
+{
+	struct baud_detect_port *p = &ports[port];
+	p->candidate = 0;
+	p->measure_start_ms = now;
+	p->state = BAUD_DETECT_MEASURING;
+	baud_detect_rearm(port);
+}
+
+static void baud_detect_measure(uart_port_t port, uint32_t now)
+{
+	struct baud_detect_port *p = &ports[port];
+	uart_dev_t *hw = UART_LL_GET_HW(port);
+
+	if (uart_ll_get_rxd_edge_cnt(hw) < BAUD_DETECT_MIN_EDGES) {
+		return;
+	}
+
+	uint32_t low = uart_ll_get_low_pulse_cnt(hw);
+	uint32_t high = uart_ll_get_high_pulse_cnt(hw);
+	uint32_t min_pulse = (low < high) ? low : high;
+	baud_detect_rearm(port);
+	if (min_pulse == 0) {
+		return;
+	}
+
+	uint32_t baud = esp_clk_apb_freq() / min_pulse;
+	uint32_t candidate = p->candidate;
+	p->candidate = baud;
+	if (candidate == 0) {
+		return;
+	}
+
+	uint32_t delta = (baud > candidate) ? baud - candidate : candidate - baud;
+	if (delta * 100 > candidate * BAUD_DETECT_AGREE_PCT) {
+		return;
+	}
+
+	baud = baud_detect_snap((baud + candidate) / 2);
+	uart_ll_set_autobaud_en(hw, false);
+	uart_set_baudrate(port, baud);
+	uart_flush_input(port);
+
+	p->state = BAUD_DETECT_LOCKED;
+	p->frame_errors = 0;
+	p->window_errors = 0;
+	p->window_start_ms = now;
+	ESP_LOGI(TAG, "UART%d locked to %u baud after %u ms", port, baud, now - p->measure_start_ms);
+
+	if (p->cb) {
+		p->cb(port, baud, p->ctx);
+	}
+}
+
+static void baud_detect_check_errors(uart_port_t port, uint32_t now)
+{
+	struct baud_detect_port *p = &ports[port];
+	uint32_t errors = p->frame_errors;
+
+	if (now - p->window_start_ms >= BAUD_DETECT_ERROR_WINDOW_MS) {
+		p->window_errors = errors;
+		p->window_start_ms = now;
+		return;
+	}
+
+	if (errors - p->window_errors >= BAUD_DETECT_ERROR_THRESHOLD) {
+		ESP_LOGW(TAG, "UART%d saw %u frame errors, detecting baud rate again", port, errors - p->window_errors);
+		baud_detect_begin(port, now);
+	}
+}
+
+static void baud_detect_task(void *arg)
+{
+	(void)arg;
+
+	while (1) {
+		bool any_active = false;
+		uint32_t now = xTaskGetTickCount() * portTICK_PERIOD_MS;
+		int port;
+
+		for (port = 0; port < UART_NUM_MAX; port++) {
+			switch (ports[port].state) {
+			case BAUD_DETECT_MEASURING:
+				baud_detect_measure(port, now);
+				any_active = true;
+				break;
+			case BAUD_DETECT_LOCKED:
+				baud_detect_check_errors(port, now);
+				any_active = true;
+				break;
+			default:
+				break;
+			}
+		}
+
+		if (any_active) {
+			vTaskDelay(pdMS_TO_TICKS(BAUD_DETECT_POLL_MS));
+		} else {
+			ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		}
+	}
+}
+
+esp_err_t baud_detect_start(uart_port_t port, baud_detect_cb_t cb, void *ctx)
+{
+	if (port >= UART_NUM_MAX) {
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	if (!baud_detect_pid) {
+		if (xTaskCreate(baud_detect_task, "baud_detect", 2048, NULL, 5, &baud_detect_pid) != pdPASS) {
+			ESP_LOGE(TAG, "unable to start baud detection task");
+			return ESP_ERR_NO_MEM;
+		}
+	}
+
+	ports[port].cb = cb;
+	ports[port].ctx = ctx;
+	ports[port].frame_errors = 0;
+	ESP_LOGI(TAG, "detecting baud rate on UART%d", port);
+	baud_detect_begin(port, xTaskGetTickCount() * portTICK_PERIOD_MS);
+	xTaskNotifyGive(baud_detect_pid);
+	return ESP_OK;
+}
+
+void baud_detect_stop(uart_port_t port)
+{
+	if (port >= UART_NUM_MAX || ports[port].state == BAUD_DETECT_OFF) {
+		return;
+	}
+	ports[port].state = BAUD_DETECT_OFF;
+	uart_ll_set_autobaud_en(UART_LL_GET_HW(port), false);
+}
+
+bool baud_detect_is_auto(uart_port_t port)
+{
+	return (port < UART_NUM_MAX) && (ports[port].state != BAUD_DETECT_OFF);
+}
+
+bool baud_detect_is_measuring(uart_port_t port)
+{
+	return (port < UART_NUM_MAX) && (ports[port].state == BAUD_DETECT_MEASURING);
+}
+
+void baud_detect_frame_error(uart_port_t port)
+{
+	if (port < UART_NUM_MAX) {
+		ports[port].frame_errors++;
+	}
+}
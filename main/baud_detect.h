@@ -0,0 +1,33 @@
+#ifndef FARPATCH_BAUD_DETECT_H__
+#define FARPATCH_BAUD_DETECT_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "driver/uart.h"
+
+/* A baud rate of 0 means "detect automatically" wherever one is accepted */
+#define BAUD_AUTO 0
+
+/* Called from the detection task whenever a new baud rate has been applied */
+typedef void (*baud_detect_cb_t)(uart_port_t port, uint32_t baud, void *ctx);
+
+/* Put a UART into automatic mode. The rate is measured from the edges seen
+ * on RX while reception carries on normally, and is measured again whenever
+ * frame errors reported through baud_detect_frame_error() spike.
+ */
+esp_err_t baud_detect_start(uart_port_t port, baud_detect_cb_t cb, void *ctx);
+
+/* Leave automatic mode. The current baud rate is kept. */
+void baud_detect_stop(uart_port_t port);
+
+/* True if the port is in automatic mode */
+bool baud_detect_is_auto(uart_port_t port);
+
+/* True if the port is in automatic mode and has not locked onto a rate yet */
+bool baud_detect_is_measuring(uart_port_t port);
+
+/* Report a UART_FRAME_ERR event for a port */
+void baud_detect_frame_error(uart_port_t port);
+
+#endif /* FARPATCH_BAUD_DETECT_H__ */
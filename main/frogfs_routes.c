@@ -0,0 +1,204 @@
+/*
+ * URL routing for files in frogfs.
+ *
+ * The routing table is a minimal perfect hash built by
+ * tools/frogfs_routes.py. The first hash of a URL picks a displacement; a
+ * negative displacement is the slot itself, and a positive one is the seed
+ * for a second hash that gives the slot. Either way the slot is compared
+ * against the URL once, as unknown URLs land on arbitrary slots too.
+ *
+ * The table travels in the web UI partition with the image it describes.
+ * Its fixed size records are copied out when it is loaded, and its strings
+ * are used where they are mapped. Where each file lives in the mapped image
+ * is only known once frogfs is mounted, so that is filled in then too.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+
+#include "frogfs_routes.h"
+
+#define TAG "frogfs-routes"
+
+/* The layout written by pack_routes() in tools/frogfs_routes.py. Offsets
+   are from the start of the table. */
+struct frogfs_routes_header {
+	uint16_t file_count;
+	uint16_t slot_count;
+} __attribute__((packed));
+
+struct frogfs_routes_file_record {
+	uint32_t path;
+	uint32_t mime_type;
+	uint32_t etag;
+} __attribute__((packed));
+
+struct frogfs_routes_slot_record {
+	/* 0 for an empty slot */
+	uint32_t url;
+	uint16_t file;
+	int16_t displace;
+} __attribute__((packed));
+
+struct frogfs_route_slot {
+	const char *url;
+	uint16_t file;
+	int16_t displace;
+};
+
+static struct frogfs_route_file *route_files;
+static struct frogfs_route_entry *route_entries;
+static size_t route_file_count;
+static struct frogfs_route_slot *route_slots;
+static size_t route_slot_count;
+
+/* Seeded FNV-1a, must match route_hash() in tools/frogfs_routes.py */
+static uint32_t frogfs_route_hash(uint32_t seed, const char *key, size_t len)
+{
+	uint32_t hash = seed ? seed : 0x811c9dc5;
+	while (len-- > 0) {
+		hash = (hash ^ (uint8_t)*key++) * 0x01000193;
+	}
+	return hash;
+}
+
+/* A string inside the table, or NULL if the offset doesn't lead to one */
+static const char *frogfs_routes_string(const uint8_t *table, size_t len, uint32_t offset)
+{
+	if (offset == 0 || offset >= len || !memchr(table + offset, '\0', len - offset)) {
+		return NULL;
+	}
+	return (const char *)table + offset;
+}
+
+static bool frogfs_routes_load(const uint8_t *table, size_t len)
+{
+	struct frogfs_routes_header header;
+	size_t pos = sizeof(header);
+	size_t i;
+
+	if (len < sizeof(header)) {
+		return false;
+	}
+	memcpy(&header, table, sizeof(header));
+	route_file_count = header.file_count;
+	route_slot_count = header.slot_count;
+	if (route_slot_count == 0 || (route_slot_count & (route_slot_count - 1)) != 0 ||
+		pos + route_file_count * sizeof(struct frogfs_routes_file_record) +
+				route_slot_count * sizeof(struct frogfs_routes_slot_record) >
+			len) {
+		return false;
+	}
+
+	route_files = calloc(route_file_count, sizeof(*route_files));
+	route_entries = calloc(route_file_count, sizeof(*route_entries));
+	route_slots = calloc(route_slot_count, sizeof(*route_slots));
+	if ((route_file_count && (!route_files || !route_entries)) || !route_slots) {
+		ESP_LOGE(TAG, "unable to allocate route table");
+		return false;
+	}
+
+	for (i = 0; i < route_file_count; i++, pos += sizeof(struct frogfs_routes_file_record)) {
+		struct frogfs_routes_file_record record;
+		memcpy(&record, table + pos, sizeof(record));
+		route_files[i].path = frogfs_routes_string(table, len, record.path);
+		route_files[i].mime_type = frogfs_routes_string(table, len, record.mime_type);
+		route_files[i].etag = frogfs_routes_string(table, len, record.etag);
+		if (!route_files[i].path || !route_files[i].mime_type || !route_files[i].etag) {
+			return false;
+		}
+	}
+
+	for (i = 0; i < route_slot_count; i++, pos += sizeof(struct frogfs_routes_slot_record)) {
+		struct frogfs_routes_slot_record record;
+		memcpy(&record, table + pos, sizeof(record));
+		route_slots[i].displace = record.displace;
+		if (record.displace < -(int32_t)route_slot_count) {
+			return false;
+		}
+		if (record.url == 0) {
+			continue;
+		}
+		route_slots[i].url = frogfs_routes_string(table, len, record.url);
+		route_slots[i].file = record.file;
+		if (!route_slots[i].url || record.file >= route_file_count) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool frogfs_routes_init(frogfs_fs_t *fs, const void *table, size_t len)
+{
+	size_t i;
+
+	if (!frogfs_routes_load(table, len)) {
+		ESP_LOGE(TAG, "routing table is malformed");
+		frogfs_routes_deinit();
+		return false;
+	}
+
+	for (i = 0; i < route_file_count; i++) {
+		struct frogfs_route_entry *entry = &route_entries[i];
+		frogfs_file_t *file = frogfs_fopen(fs, route_files[i].path);
+		frogfs_stat_t st;
+
+		if (!file) {
+			ESP_LOGW(TAG, "%s is missing from the image", route_files[i].path);
+			continue;
+		}
+		frogfs_fstat(file, &st);
+		entry->file = &route_files[i];
+		entry->gzip = (st.flags & FROGFS_FLAG_GZIP) != 0;
+		entry->len = st.size;
+		if (st.compression == FROGFS_COMPRESSION_NONE) {
+			void *data;
+			entry->len = frogfs_faccess(file, &data);
+			entry->data = data;
+		}
+		frogfs_fclose(file);
+	}
+	ESP_LOGI(TAG, "%u files in %u slots", route_file_count, route_slot_count);
+	return true;
+}
+
+void frogfs_routes_deinit(void)
+{
+	free(route_slots);
+	free(route_entries);
+	free(route_files);
+	route_slots = NULL;
+	route_entries = NULL;
+	route_files = NULL;
+	route_file_count = 0;
+	route_slot_count = 0;
+}
+
+const struct frogfs_route_entry *frogfs_route_lookup(const char *uri)
+{
+	size_t len = strcspn(uri, "?");
+	uint32_t hash = frogfs_route_hash(0, uri, len);
+	int16_t displace;
+	uint32_t slot;
+
+	if (!route_slots) {
+		return NULL;
+	}
+
+	displace = route_slots[hash & (route_slot_count - 1)].displace;
+	if (displace < 0) {
+		slot = -displace - 1;
+	} else {
+		slot = frogfs_route_hash(displace, uri, len) & (route_slot_count - 1);
+	}
+
+	const struct frogfs_route_slot *route = &route_slots[slot];
+	if (!route->url || strncmp(route->url, uri, len) || route->url[len] != '\0') {
+		return NULL;
+	}
+
+	const struct frogfs_route_entry *entry = &route_entries[route->file];
+	return entry->file ? entry : NULL;
+}
@@ -0,0 +1,40 @@
+#ifndef FARPATCH_FROGFS_ROUTES_H__
+#define FARPATCH_FROGFS_ROUTES_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "frogfs/frogfs.h"
+
+/* Built by tools/frogfs_routes.py and stored in the web UI partition ahead of
+ * the frogfs image. The strings point into the mapped partition.
+ */
+struct frogfs_route_file {
+	const char *path;
+	const char *mime_type;
+	const char *etag;
+};
+
+/* A file with everything needed to answer a request for it */
+struct frogfs_route_entry {
+	const struct frogfs_route_file *file;
+	/* Stored bytes in the mapped image, or NULL if frogfs has to decompress
+	 * them on the way out.
+	 */
+	const void *data;
+	size_t len;
+	bool gzip;
+};
+
+/* Load the routing table at `table` and resolve every file in it against the
+   mounted image. The table has to stay mapped until frogfs_routes_deinit().
+   false if the table is malformed.
+ */
+bool frogfs_routes_init(frogfs_fs_t *fs, const void *table, size_t len);
+void frogfs_routes_deinit(void);
+
+/* Look up the file served for a request URI. Any query string is ignored. */
+const struct frogfs_route_entry *frogfs_route_lookup(const char *uri);
+
+#endif /* FARPATCH_FROGFS_ROUTES_H__ */
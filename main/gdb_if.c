@@ -43,12 +43,11 @@
 #include "general.h"
 #include "hex_utils.h"
 #include "target.h"
+#include "rtt_cache.h"
 
 #include <string.h>
 #include <assert.h>
 
-#define GDB_TLS_INDEX 1
-
 static int num_clients;
 
 static QueueHandle_t gdb_mutex;
@@ -69,6 +68,7 @@ int gdb_main_loop(struct target_controller *tc, bool in_syscall);
 static void gdb_target_destroy_callback(struct target_controller *tc, target *t)
 {
 	(void)tc;
+	rtt_cache_target_lost(t);
 	if (cur_target == t)
 		cur_target = NULL;
 
@@ -156,6 +156,10 @@ static void gdb_wifi_task(void *arg)
 
 	num_clients++;
 
+	// Held for as long as this task is doing something other than waiting on
+	// the client, see gdb_wifi_if_getchar_to() and gdb_wifi_if_getchar().
+	platform_target_lock();
+
 	while (true) {
 		struct exception e;
 		TRY_CATCH (e, EXCEPTION_ALL) {
@@ -210,7 +214,11 @@ unsigned char gdb_wifi_if_getchar_to(struct gdb_wifi_instance *instance, int tim
 	FD_ZERO(&fds);
 	FD_SET(instance->sock, &fds);
 
-	if (select(instance->sock + 1, &fds, NULL, NULL, (timeout >= 0) ? &tv : NULL) > 0) {
+	platform_target_unlock();
+	int ready = select(instance->sock + 1, &fds, NULL, NULL, (timeout >= 0) ? &tv : NULL);
+	platform_target_lock();
+
+	if (ready > 0) {
 		char c = gdb_wifi_if_getchar(instance);
 		return c;
 	}
@@ -223,12 +231,14 @@ static unsigned char gdb_wifi_if_getchar(struct gdb_wifi_instance *instance)
 	uint8_t tmp;
 
 	int ret;
+	platform_target_unlock();
 	ret = recv(instance->sock, &tmp, 1, 0);
 	if (ret <= 0) {
 		gdb_wifi_destroy(instance);
 		// should not be reached
 		return 0;
 	}
+	platform_target_lock();
 	// if((tmp == '\x03') || (tmp == '\x04')) {
 	// 	ESP_LOGW(__func__, "Got Interrupt request");
 	// }
@@ -242,6 +252,7 @@ static void gdb_wifi_if_putchar(struct gdb_wifi_instance *instance, unsigned cha
 		if (instance->sock > 0) {
 			int ret = send(instance->sock, instance->buf, instance->bufsize, 0);
 			if (ret <= 0) {
+				platform_target_unlock();
 				gdb_wifi_destroy(instance);
 				// should not be reached
 				return;
@@ -284,6 +295,11 @@ unsigned char gdb_if_getchar_to(int timeout)
 {
 	void **ptr = (void **)pvTaskGetThreadLocalStoragePointer(NULL, GDB_TLS_INDEX);
 	assert(ptr);
+	// gdb_main polls for input between calls to poll_rtt() while the target
+	// runs, so this is the place to prime the RTT search.
+	if (timeout == 0) {
+		rtt_cache_poll();
+	}
 	return gdb_wifi_if_getchar_to(ptr[0], timeout);
 }
 
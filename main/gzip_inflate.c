@@ -0,0 +1,357 @@
+/*
+ * Streaming gzip decompression for HTTP clients that don't accept gzip.
+ *
+ * Web assets are stored gzipped in frogfs, and most browsers take them
+ * that way. For anything else (curl without --compressed, scripts, health
+ * checks) the entry is inflated on the fly with the tinfl decompressor in
+ * ROM. Its output buffer doubles as the 32 KB deflate window, and each time
+ * it fills up, the new part goes out as one chunk. The decompressor state
+ * and window take about 43 KB, so they are only allocated for as long as a
+ * response is being inflated, and a mutex keeps it to one response at a time.
+ *
+ * The same decompressor also unpacks data that arrives a piece at a time,
+ * such as compressed firmware updates. Each of those streams has a work
+ * area of its own for as long as it lasts.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "rom/miniz.h"
+
+#include "gzip_inflate.h"
+
+#define TAG "gzip-inflate"
+
+#define GZIP_FHCRC    (1 << 1)
+#define GZIP_FEXTRA   (1 << 2)
+#define GZIP_FNAME    (1 << 3)
+#define GZIP_FCOMMENT (1 << 4)
+
+/* CRC32 and ISIZE */
+#define GZIP_TRAILER_SIZE 8
+
+struct gzip_inflate_work {
+	tinfl_decompressor inflator;
+	uint8_t window[TINFL_LZ_DICT_SIZE];
+};
+
+static SemaphoreHandle_t inflate_mutex;
+static struct gzip_inflate_stats inflate_stats = {
+	.work_size = sizeof(struct gzip_inflate_work),
+};
+
+void gzip_inflate_init(void)
+{
+	inflate_mutex = xSemaphoreCreateMutex();
+}
+
+/* Length of the gzip member header at the start of `data`, 0 if more data
+   is needed to tell, or -1 if it isn't one */
+static int gzip_header_parse(const uint8_t *data, size_t len)
+{
+	size_t pos = 10;
+
+	if ((len >= 1 && data[0] != 0x1f) || (len >= 2 && data[1] != 0x8b) || (len >= 3 && data[2] != 8)) {
+		return -1;
+	}
+	if (len < pos) {
+		return 0;
+	}
+	uint8_t flags = data[3];
+
+	if (flags & GZIP_FEXTRA) {
+		if (len < pos + 2) {
+			return 0;
+		}
+		pos += 2 + (data[pos] | (data[pos + 1] << 8));
+	}
+	if (flags & GZIP_FNAME) {
+		while (pos < len && data[pos++] != '\0') {
+		}
+	}
+	if (flags & GZIP_FCOMMENT) {
+		while (pos < len && data[pos++] != '\0') {
+		}
+	}
+	if (flags & GZIP_FHCRC) {
+		pos += 2;
+	}
+	return (pos < len) ? (int)pos : 0;
+}
+
+/* Length of the gzip member header, or 0 if it isn't one */
+static size_t gzip_header_len(const uint8_t *data, size_t len)
+{
+	int pos = gzip_header_parse(data, len);
+	return (pos > 0 && (size_t)pos + GZIP_TRAILER_SIZE <= len) ? (size_t)pos : 0;
+}
+
+static esp_err_t gzip_inflate_stream(
+	httpd_req_t *req, struct gzip_inflate_work *work, const uint8_t *data, size_t len, size_t *out_total)
+{
+	size_t header_len = gzip_header_len(data, len);
+	if (header_len == 0) {
+		ESP_LOGE(TAG, "not a gzip stream");
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	const uint8_t *in = data + header_len;
+	size_t in_remaining = len - header_len - GZIP_TRAILER_SIZE;
+	size_t window_pos = 0;
+	tinfl_status status;
+
+	tinfl_init(&work->inflator);
+	do {
+		size_t in_bytes = in_remaining;
+		size_t out_bytes = TINFL_LZ_DICT_SIZE - window_pos;
+
+		status = tinfl_decompress(
+			&work->inflator, in, &in_bytes, work->window, work->window + window_pos, &out_bytes, 0);
+		in += in_bytes;
+		in_remaining -= in_bytes;
+
+		if (out_bytes) {
+			esp_err_t ret = httpd_resp_send_chunk(req, (const char *)work->window + window_pos, out_bytes);
+			if (ret != ESP_OK) {
+				return ret;
+			}
+			*out_total += out_bytes;
+		}
+		window_pos = (window_pos + out_bytes) & (TINFL_LZ_DICT_SIZE - 1);
+	} while (status == TINFL_STATUS_HAS_MORE_OUTPUT);
+
+	if (status != TINFL_STATUS_DONE) {
+		ESP_LOGE(TAG, "inflate failed: %d", status);
+		return ESP_FAIL;
+	}
+	return ESP_OK;
+}
+
+esp_err_t gzip_inflate_send(httpd_req_t *req, const uint8_t *data, size_t len)
+{
+	xSemaphoreTake(inflate_mutex, portMAX_DELAY);
+
+	struct gzip_inflate_work *work = malloc(sizeof(*work));
+	if (!work) {
+		inflate_stats.failures++;
+		xSemaphoreGive(inflate_mutex);
+		ESP_LOGE(TAG, "unable to allocate %u byte work area", sizeof(*work));
+		return httpd_resp_send_500(req);
+	}
+
+	uint32_t start_ms = xTaskGetTickCount() * portTICK_PERIOD_MS;
+	size_t out_total = 0;
+	esp_err_t ret = gzip_inflate_stream(req, work, data, len, &out_total);
+	uint32_t elapsed_ms = xTaskGetTickCount() * portTICK_PERIOD_MS - start_ms;
+	free(work);
+
+	inflate_stats.requests++;
+	inflate_stats.bytes_in += len;
+	inflate_stats.bytes_out += out_total;
+	inflate_stats.time_ms += elapsed_ms;
+	if (ret != ESP_OK) {
+		inflate_stats.failures++;
+	}
+	xSemaphoreGive(inflate_mutex);
+
+	ESP_LOGD(TAG, "inflated %u bytes to %u in %u ms", len, out_total, elapsed_ms);
+	if (ret != ESP_OK) {
+		// Once part of the body is out, all that can be done is to drop the
+		// connection.
+		return (out_total == 0) ? httpd_resp_send_500(req) : ret;
+	}
+	// An empty chunk ends the response
+	return httpd_resp_sendstr_chunk(req, NULL);
+}
+
+void gzip_inflate_get_stats(struct gzip_inflate_stats *stats)
+{
+	*stats = inflate_stats;
+}
+
+/* Longest gzip header that gzip_inflater will wait for, file name included */
+#define GZIP_INFLATER_MAX_HEADER 256
+
+struct gzip_inflater {
+	struct gzip_inflate_work work;
+	gzip_inflater_out_t out;
+	void *ctx;
+	size_t window_pos;
+	tinfl_status status;
+	uint32_t crc;
+	uint32_t size;
+	/* Header until it has been parsed, then the last bytes received, which
+	   end up being the trailer */
+	uint8_t edge[GZIP_INFLATER_MAX_HEADER];
+	size_t edge_len;
+	bool in_body;
+};
+
+struct gzip_inflater *gzip_inflater_new(gzip_inflater_out_t out, void *ctx)
+{
+	struct gzip_inflater *inflater = malloc(sizeof(*inflater));
+	if (!inflater) {
+		ESP_LOGE(TAG, "unable to allocate %u byte stream work area", sizeof(*inflater));
+		return NULL;
+	}
+	tinfl_init(&inflater->work.inflator);
+	inflater->out = out;
+	inflater->ctx = ctx;
+	inflater->window_pos = 0;
+	inflater->status = TINFL_STATUS_NEEDS_MORE_INPUT;
+	inflater->crc = 0;
+	inflater->size = 0;
+	inflater->edge_len = 0;
+	inflater->in_body = false;
+	return inflater;
+}
+
+/* Collect bytes until the header is complete, returning how many of `len`
+   were part of it */
+static size_t gzip_inflater_header(struct gzip_inflater *inflater, const uint8_t *data, size_t len, esp_err_t *err)
+{
+	size_t before = inflater->edge_len;
+	size_t count = sizeof(inflater->edge) - before;
+	if (count > len) {
+		count = len;
+	}
+	memcpy(inflater->edge + before, data, count);
+	inflater->edge_len += count;
+
+	int header_len = gzip_header_parse(inflater->edge, inflater->edge_len);
+	if (header_len < 0 || (header_len == 0 && inflater->edge_len == sizeof(inflater->edge))) {
+		ESP_LOGE(TAG, "not a gzip stream");
+		*err = ESP_ERR_INVALID_ARG;
+		return count;
+	}
+	*err = ESP_OK;
+	if (header_len == 0) {
+		return count;
+	}
+
+	/* The rest of this write is compressed data */
+	inflater->in_body = true;
+	inflater->edge_len = 0;
+	return header_len - before;
+}
+
+/* Run the decompressor over `data` until it has taken all of it or reached
+   the end of the deflate stream, leaving `data` and `len` at whatever it
+   didn't take */
+static esp_err_t gzip_inflater_run(struct gzip_inflater *inflater, const uint8_t **data, size_t *len)
+{
+	while (inflater->status != TINFL_STATUS_DONE && (*len || inflater->status == TINFL_STATUS_HAS_MORE_OUTPUT)) {
+		size_t in_bytes = *len;
+		size_t out_bytes = TINFL_LZ_DICT_SIZE - inflater->window_pos;
+		uint8_t *out = inflater->work.window + inflater->window_pos;
+
+		inflater->status = tinfl_decompress(&inflater->work.inflator, *data, &in_bytes, inflater->work.window, out,
+			&out_bytes, TINFL_FLAG_HAS_MORE_INPUT);
+		*data += in_bytes;
+		*len -= in_bytes;
+
+		if (inflater->status < 0) {
+			ESP_LOGE(TAG, "inflate failed: %d", inflater->status);
+			return ESP_FAIL;
+		}
+		if (out_bytes) {
+			inflater->crc = esp_rom_crc32_le(inflater->crc, out, out_bytes);
+			inflater->size += out_bytes;
+			esp_err_t err = inflater->out(inflater->ctx, out, out_bytes);
+			if (err != ESP_OK) {
+				return err;
+			}
+		}
+		inflater->window_pos = (inflater->window_pos + out_bytes) & (TINFL_LZ_DICT_SIZE - 1);
+	}
+	return ESP_OK;
+}
+
+esp_err_t gzip_inflater_write(struct gzip_inflater *inflater, const uint8_t *data, size_t len)
+{
+	esp_err_t err;
+
+	if (!inflater->in_body) {
+		size_t used = gzip_inflater_header(inflater, data, len, &err);
+		if (err != ESP_OK || !inflater->in_body) {
+			return err;
+		}
+		data += used;
+		len -= used;
+	}
+
+	/* The last GZIP_TRAILER_SIZE bytes so far may be the trailer, so they
+	   wait in `edge` until more data pushes them out. The tinfl in ROM
+	   reads ahead and keeps what it read, so it must never see the trailer
+	   until gzip_inflater_finish(). */
+	if (inflater->edge_len + len <= GZIP_TRAILER_SIZE) {
+		memcpy(inflater->edge + inflater->edge_len, data, len);
+		inflater->edge_len += len;
+		return ESP_OK;
+	}
+	size_t feed = inflater->edge_len + len - GZIP_TRAILER_SIZE;
+	size_t from_edge = (feed < inflater->edge_len) ? feed : inflater->edge_len;
+	const uint8_t *held = inflater->edge;
+	size_t held_len = from_edge;
+	size_t from_data = feed - from_edge;
+
+	err = gzip_inflater_run(inflater, &held, &held_len);
+	if (err == ESP_OK && held_len == 0) {
+		err = gzip_inflater_run(inflater, &data, &from_data);
+	}
+	if (err != ESP_OK) {
+		return err;
+	}
+	if (held_len || from_data) {
+		ESP_LOGE(TAG, "unexpected data after the gzip trailer");
+		return ESP_ERR_INVALID_SIZE;
+	}
+	size_t kept = inflater->edge_len - from_edge;
+	memmove(inflater->edge, inflater->edge + from_edge, kept);
+	memcpy(inflater->edge + kept, data, GZIP_TRAILER_SIZE - kept);
+	inflater->edge_len = GZIP_TRAILER_SIZE;
+	return ESP_OK;
+}
+
+esp_err_t gzip_inflater_finish(struct gzip_inflater *inflater)
+{
+	if (!inflater->in_body || inflater->edge_len != GZIP_TRAILER_SIZE) {
+		ESP_LOGE(TAG, "gzip stream is truncated");
+		return ESP_ERR_INVALID_SIZE;
+	}
+
+	/* The end of the compressed data may only be found by reading ahead
+	   into the trailer. Whatever the decompressor takes of it, the trailer
+	   itself stays in `edge`. */
+	const uint8_t *trailer = inflater->edge;
+	size_t trailer_len = GZIP_TRAILER_SIZE;
+	esp_err_t err = gzip_inflater_run(inflater, &trailer, &trailer_len);
+	if (err != ESP_OK) {
+		return err;
+	}
+	if (inflater->status != TINFL_STATUS_DONE) {
+		ESP_LOGE(TAG, "gzip stream is truncated");
+		return ESP_ERR_INVALID_SIZE;
+	}
+
+	trailer = inflater->edge;
+	uint32_t crc = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16) | ((uint32_t)trailer[3] << 24);
+	uint32_t size = trailer[4] | (trailer[5] << 8) | (trailer[6] << 16) | ((uint32_t)trailer[7] << 24);
+	if (crc != inflater->crc || size != inflater->size) {
+		ESP_LOGE(TAG, "gzip trailer doesn't match the %u bytes inflated", inflater->size);
+		return ESP_ERR_INVALID_CRC;
+	}
+	return ESP_OK;
+}
+
+void gzip_inflater_free(struct gzip_inflater *inflater)
+{
+	free(inflater);
+}
@@ -0,0 +1,38 @@
+#ifndef FARPATCH_GZIP_INFLATE_H__
+#define FARPATCH_GZIP_INFLATE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <esp_http_server.h>
+
+struct gzip_inflate_stats {
+	uint32_t requests;
+	uint32_t failures;
+	uint32_t bytes_in;
+	uint32_t bytes_out;
+	uint32_t time_ms;
+	/* Size of the decompressor state and window, allocated for each response */
+	size_t work_size;
+};
+
+void gzip_inflate_init(void);
+
+/* Decompress a complete gzip member and send it as a chunked response */
+esp_err_t gzip_inflate_send(httpd_req_t *req, const uint8_t *data, size_t len);
+
+void gzip_inflate_get_stats(struct gzip_inflate_stats *stats);
+
+/* Decompresses a gzip stream that arrives in pieces of any size, passing
+ * the output to `out` as it is produced. Uses about 43 KB of heap.
+ */
+struct gzip_inflater;
+typedef esp_err_t (*gzip_inflater_out_t)(void *ctx, const uint8_t *data, size_t len);
+
+struct gzip_inflater *gzip_inflater_new(gzip_inflater_out_t out, void *ctx);
+esp_err_t gzip_inflater_write(struct gzip_inflater *inflater, const uint8_t *data, size_t len);
+/* Checks the stream was complete and its CRC and length match */
+esp_err_t gzip_inflater_finish(struct gzip_inflater *inflater);
+void gzip_inflater_free(struct gzip_inflater *inflater);
+
+#endif /* FARPATCH_GZIP_INFLATE_H__ */
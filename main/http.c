@@ -1,24 +1,40 @@
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/param.h>
 // typedef uint8_t uint8;
 
 #include "frogfs/frogfs.h"
+#include "frogfs_routes.h"
 #include <esp_http_server.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <freertos/semphr.h>
 #include <freertos/queue.h>
 #include <freertos/list.h>
+#include <freertos/timers.h>
 #include "platform.h"
+#include "baud_detect.h"
+#include "gzip_inflate.h"
 #include "hashmap.h"
+#include "http.h"
+#include "offline_prog.h"
+#include "ota_writer.h"
+#include "pcsample.h"
+#include "profile.h"
+#include "target_file.h"
 #include "websocket.h"
+#include "webui.h"
 #include "wifi.h"
+#include "wsmux.h"
 #include "driver/uart.h"
 
 #include "esp_attr.h"
 #include "esp_ota_ops.h"
 #include "esp_partition.h"
+#include "esp_system.h"
 #include "hal/interrupt_controller_hal.h"
+#include "lwip/sockets.h"
 
 const static char http_cache_control_hdr[] = "Cache-Control";
 const static char http_cache_control_no_cache[] = "no-store, no-cache, must-revalidate, max-age=0";
@@ -26,14 +42,18 @@ const static char http_cache_control_no_cache[] = "no-store, no-cache, must-reva
 const static char http_pragma_hdr[] = "Pragma";
 const static char http_pragma_no_cache[] = "no-cache";
 
-extern const uint8_t frogfs_bin[];
-extern const size_t frogfs_bin_len;
 extern void platform_set_baud(uint32_t);
-static frogfs_fs_t *frog_fs;
 httpd_handle_t http_daemon;
 
 #define TAG "httpd"
 
+/* Firmware uploads are read from the socket this much at a time */
+#define FLASH_UPLOAD_READ_SIZE 8192
+/* Receive timeouts in a row, each recv_wait_timeout long, before an upload
+   is abandoned. Until then the upload keeps hold of whatever it writes to,
+   such as the target. */
+#define HTTP_RECV_BODY_MAX_TIMEOUTS 3
+
 esp_err_t cgi_uart_break(httpd_req_t *req)
 {
 	void uart_send_break();
@@ -50,22 +70,28 @@ static esp_err_t cgi_baud(httpd_req_t *req)
 	int len;
 	char buff[12];
 	char querystring[64];
+	char response[48];
 
 	httpd_req_get_url_query_str(req, querystring, sizeof(querystring));
 	if (ESP_OK == httpd_query_key_value(querystring, "set", buff, sizeof(buff))) {
-		int baud = atoi(buff);
-		// printf("baud %d\n", baud);
-		if (baud) {
-			platform_set_baud(baud);
+		if (!strcmp(buff, "auto")) {
+			platform_set_baud(BAUD_AUTO);
+		} else {
+			int baud = atoi(buff);
+			// printf("baud %d\n", baud);
+			if (baud) {
+				platform_set_baud(baud);
+			}
 		}
 	}
 
 	uint32_t baud = 0;
-	uart_get_baudrate(0, &baud);
+	uart_get_baudrate(CONFIG_TARGET_UART_IDX, &baud);
 
-	len = snprintf(buff, sizeof(buff), "{\"baudrate\": %u }", baud);
+	len = snprintf(response, sizeof(response), "{\"baudrate\": %u, \"auto\": %s }", baud,
+		baud_detect_is_auto(CONFIG_TARGET_UART_IDX) ? "true" : "false");
 	httpd_resp_set_type(req, "text/json");
-	httpd_resp_send(req, buff, len);
+	httpd_resp_send(req, response, len);
 
 	return ESP_OK;
 }
@@ -78,6 +104,12 @@ extern uint32_t uart_tx_count;
 extern uint32_t uart_irq_count;
 extern uint32_t uart_rx_data_relay;
 
+extern int swo_active;
+extern uint32_t swo_rx_count;
+extern uint32_t swo_overrun_cnt;
+extern uint32_t swo_frame_error_cnt;
+extern uint32_t swo_queue_full_cnt;
+
 #if CONFIG_FREERTOS_USE_TRACE_FACILITY
 static int task_status_cmp(const void *a, const void *b)
 {
@@ -116,7 +148,7 @@ static const char *core_str(int core_id)
 
 int32_t adc_read_system_voltage(void);
 
-static esp_err_t cgi_status_header(httpd_req_t *req)
+static void http_status_write_header(http_status_out_t out, void *ctx)
 {
 	char buffer[256];
 
@@ -125,26 +157,25 @@ static esp_err_t cgi_status_header(httpd_req_t *req)
 	uint32_t swo_baud = 0;
 	uart_get_baudrate(0, &esp_debug_baud);
 	uart_get_baudrate(1, &target_baud);
-	// 	extern int swo_active;
-	// 	if (swo_active) {
-	// 		uart_get_baudrate(2, &baud2);
-	// 	}
+	if (swo_active) {
+		uart_get_baudrate(CONFIG_TRACE_SWO_UART_IDX, &swo_baud);
+	}
 
 	snprintf(buffer, sizeof(buffer),
 		"free_heap: %u\n"
 		"uptime: %d\n",
 		esp_get_free_heap_size(), xTaskGetTickCount() * portTICK_PERIOD_MS);
-	httpd_resp_sendstr_chunk(req, buffer);
+	out(ctx, buffer, strlen(buffer));
 
 	snprintf(buffer, sizeof(buffer),
 		"debug_baud_rate: %d\n"
 		"target_baud_rate: %d\n"
 		"swo_baud_rate: %d\n",
 		esp_debug_baud, target_baud, swo_baud);
-	httpd_resp_sendstr_chunk(req, buffer);
+	out(ctx, buffer, strlen(buffer));
 
 	snprintf(buffer, sizeof(buffer), "target voltage: %d mV\n", adc_read_system_voltage());
-	httpd_resp_sendstr_chunk(req, buffer);
+	out(ctx, buffer, strlen(buffer));
 
 	snprintf(buffer, sizeof(buffer),
 		"uart_overruns: %d\n"
@@ -156,7 +187,26 @@ static esp_err_t cgi_status_header(httpd_req_t *req)
 		"uart_rx_data_relay: %d\n",
 		uart_overrun_cnt, uart_frame_error_cnt, uart_queue_full_cnt, uart_rx_count, uart_tx_count, uart_irq_count,
 		uart_rx_data_relay);
-	httpd_resp_sendstr_chunk(req, buffer);
+	out(ctx, buffer, strlen(buffer));
+
+	snprintf(buffer, sizeof(buffer),
+		"swo_overruns: %d\n"
+		"swo_frame_errors: %d\n"
+		"swo_queue_full_cnt: %d\n"
+		"swo_rx_count: %d\n",
+		swo_overrun_cnt, swo_frame_error_cnt, swo_queue_full_cnt, swo_rx_count);
+	out(ctx, buffer, strlen(buffer));
+
+	struct gzip_inflate_stats inflate;
+	gzip_inflate_get_stats(&inflate);
+	snprintf(buffer, sizeof(buffer),
+		"gzip_inflate_requests: %u\n"
+		"gzip_inflate_failures: %u\n"
+		"gzip_inflate_kBps: %u\n"
+		"gzip_inflate_work_bytes: %u\n",
+		inflate.requests, inflate.failures, inflate.time_ms ? inflate.bytes_out / inflate.time_ms : 0,
+		inflate.work_size);
+	out(ctx, buffer, strlen(buffer));
 
 	const esp_partition_t *current_partition = esp_ota_get_running_partition();
 	const esp_partition_t *next_partition = NULL;
@@ -191,14 +241,58 @@ static esp_err_t cgi_status_header(httpd_req_t *req)
 		"%s",
 		current_partition->address, current_partition_state, next_partition_address, next_partition_state,
 		update_status);
-	httpd_resp_sendstr_chunk(req, buffer);
+	out(ctx, buffer, strlen(buffer));
 
-	httpd_resp_sendstr_chunk(req, "tasks:\n");
+	static const char *const ota_digest_names[] = {
+		[OTA_WRITER_DIGEST_NONE] = "readback",
+		[OTA_WRITER_DIGEST_SENDER] = "sender",
+		[OTA_WRITER_DIGEST_APPENDED] = "appended",
+	};
+	struct ota_writer_stats ota;
+	ota_writer_get_stats(&ota);
+	const char *ota_format = "";
+	if (ota.compressed) {
+		ota_format = ota.delta ? " (gzip delta)" : " (gzip)";
+	} else if (ota.delta) {
+		ota_format = " (delta)";
+	}
+	snprintf(buffer, sizeof(buffer),
+		"ota_updates: %u\n"
+		"ota_failures: %u\n"
+		"ota_last_received: %u%s\n"
+		"ota_last_received_kBps: %u\n"
+		"ota_last_inflate_ms: %u\n",
+		ota.updates, ota.failures, ota.received, ota_format,
+		ota.elapsed_ms ? ota.received / ota.elapsed_ms : 0, ota.inflate_ms);
+	out(ctx, buffer, strlen(buffer));
 
-	return ESP_OK;
+	snprintf(buffer, sizeof(buffer),
+		"ota_last_bytes: %u\n"
+		"ota_last_kBps: %u\n"
+		"ota_last_flash_ms: %u\n"
+		"ota_last_hash_ms: %u\n"
+		"ota_last_digest: %s\n"
+		"ota_last_commit_verify_ms: %u\n"
+		"ota_last_stalls: %u (%u ms)\n",
+		ota.bytes, ota.elapsed_ms ? ota.bytes / ota.elapsed_ms : 0, ota.write_ms, ota.hash_ms,
+		ota_digest_names[ota.digest], ota.commit_ms, ota.stalls, ota.stall_ms);
+	out(ctx, buffer, strlen(buffer));
+
+	struct websocket_rx_stats ws_rx;
+	websocket_rx_get_stats(&ws_rx);
+	snprintf(buffer, sizeof(buffer),
+		"websocket_rx_pool_hits: %u\n"
+		"websocket_rx_pool_misses: %u\n"
+		"websocket_rx_oversize: %u\n",
+		ws_rx.hits, ws_rx.misses, ws_rx.oversize);
+	out(ctx, buffer, strlen(buffer));
+
+	wsmux_write_status(out, ctx);
+
+	out(ctx, "tasks:\n", 6);
 }
 
-static esp_err_t cgi_status(httpd_req_t *req)
+void http_status_write(http_status_out_t out, void *ctx)
 {
 	TaskStatus_t *pxTaskStatusArray;
 	int i;
@@ -210,12 +304,7 @@ static esp_err_t cgi_status(httpd_req_t *req)
 		task_times = hashmap_new();
 	}
 
-	httpd_resp_set_type(req, "text/plain");
-	httpd_resp_set_hdr(req, http_cache_control_hdr, http_cache_control_no_cache);
-	httpd_resp_set_hdr(req, http_pragma_hdr, http_pragma_no_cache);
-	httpd_resp_set_hdr(req, "Refresh", "1");
-
-	cgi_status_header(req);
+	http_status_write_header(out, ctx);
 
 #if CONFIG_FREERTOS_USE_TRACE_FACILITY
 	uxArraySize = uxTaskGetNumberOfTasks();
@@ -279,12 +368,27 @@ static esp_err_t cgi_status(httpd_req_t *req)
 			core_str((int)tsk->xCoreID),
 #endif
 			tsk->ulRunTimeCounter / totalRuntime, (*((uint32_t **)tsk->xHandle))[1]);
-		httpd_resp_send_chunk(req, buff, len);
+		out(ctx, buff, len);
 	}
 
 	if (pxTaskStatusArray != NULL) {
 		free(pxTaskStatusArray);
 	}
+}
+
+static void http_status_out_chunk(void *ctx, const char *data, size_t len)
+{
+	httpd_resp_send_chunk((httpd_req_t *)ctx, data, len);
+}
+
+static esp_err_t cgi_status(httpd_req_t *req)
+{
+	httpd_resp_set_type(req, "text/plain");
+	httpd_resp_set_hdr(req, http_cache_control_hdr, http_cache_control_no_cache);
+	httpd_resp_set_hdr(req, http_pragma_hdr, http_pragma_no_cache);
+	httpd_resp_set_hdr(req, "Refresh", "1");
+
+	http_status_write(http_status_out_chunk, req);
 
 	// ESP_LOGI(__func__, "finishing connection");
 	httpd_resp_sendstr_chunk(req, NULL);
@@ -301,102 +405,492 @@ static esp_err_t cgi_redirect(httpd_req_t *req)
 	return ESP_OK;
 }
 
-//Struct to keep extension->mime data in
-typedef struct {
-	const char *ext;
-	const char *mimetype;
-} MimeMap;
+static esp_err_t cgi_flash_next(httpd_req_t *req)
+{
+	const esp_partition_t *next = esp_ota_get_next_update_partition(NULL);
 
-//The mappings from file extensions to mime types. If you need an extra mime type,
-//add it here.
-static const MimeMap mimeTypes[] = {
-	{"htm", "text/html"}, {"html", "text/html"}, {"css", "text/css"}, {"js", "text/javascript"}, {"txt", "text/plain"},
-	{"jpg", "image/jpeg"}, {"jpeg", "image/jpeg"}, {"png", "image/png"}, {"svg", "image/svg+xml"}, {"xml", "text/xml"},
-	{"json", "application/json"}, {NULL, "text/html"}, //default value
-};
+	httpd_resp_set_type(req, "text/plain");
+	return httpd_resp_sendstr(req, next ? next->label : "nothing");
+}
 
-//Returns a static char* to a mime type for a given url to a file.
-const char *frogfs_get_mime_type(const char *url)
+static esp_err_t flash_upload_result(httpd_req_t *req, const char *status, const char *error)
 {
-	char *urlp = (char *)url;
-	int i = 0;
-	//Go find the extension
-	const char *ext = urlp + (strlen(urlp) - 1);
-	while (ext != urlp && *ext != '.')
-		ext--;
-	if (*ext == '.')
-		ext++;
+	char response[96];
 
-	while (mimeTypes[i].ext != NULL && strcasecmp(ext, mimeTypes[i].ext) != 0)
-		i++;
-	return mimeTypes[i].mimetype;
+	httpd_resp_set_type(req, "text/json");
+	if (!error) {
+		return httpd_resp_sendstr(req, "{\"success\": true}");
+	}
+	// Whatever is left of the body isn't worth reading
+	httpd_resp_set_hdr(req, "Connection", "close");
+	httpd_resp_set_status(req, status);
+	snprintf(response, sizeof(response), "{\"success\": false, \"error\": \"%s\"}", error);
+	return httpd_resp_sendstr(req, response);
 }
 
-static bool frogfs_is_gzip(frogfs_file_t *file)
+/* Pass the body of an upload to `write_fn` a piece at a time, like the TFTP
+   server's sinks. If the body can't be read or `write_fn` fails, `abort_fn`
+   is called to drop whatever was started and the error is returned. That is
+   ESP_ERR_TIMEOUT if the client stopped sending. A response for a
+   connection that has gone just fails to send, which closes the session.
+ */
+static esp_err_t http_recv_body(
+	httpd_req_t *req, esp_err_t (*write_fn)(const void *data, size_t len), void (*abort_fn)(void))
 {
-	frogfs_stat_t st;
-	frogfs_fstat(file, &st);
-	return (st.flags & FROGFS_FLAG_GZIP) != 0;
+	uint8_t *buf = malloc(FLASH_UPLOAD_READ_SIZE);
+	if (!buf) {
+		ESP_LOGE(TAG, "no memory for a %u byte upload buffer", FLASH_UPLOAD_READ_SIZE);
+		abort_fn();
+		return ESP_ERR_NO_MEM;
+	}
+
+	size_t remaining = req->content_len;
+	int timeouts = 0;
+	esp_err_t err = ESP_OK;
+	while (remaining > 0 && err == ESP_OK) {
+		int ret = httpd_req_recv(req, (char *)buf, MIN(remaining, FLASH_UPLOAD_READ_SIZE));
+		if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
+			if (++timeouts < HTTP_RECV_BODY_MAX_TIMEOUTS) {
+				continue;
+			}
+			ESP_LOGW(TAG, "upload stalled with %u bytes to go", remaining);
+			err = ESP_ERR_TIMEOUT;
+			break;
+		}
+		if (ret <= 0) {
+			ESP_LOGW(TAG, "upload ended with %u bytes to go", remaining);
+			err = ESP_FAIL;
+			break;
+		}
+		timeouts = 0;
+		remaining -= ret;
+		err = write_fn(buf, ret);
+	}
+	free(buf);
+
+	if (err != ESP_OK) {
+		abort_fn();
+	}
+	return err;
 }
 
-static esp_err_t cgi_frog_fs_hook(httpd_req_t *req)
+/* Respond to a failed http_recv_body() with `status` and `error`, unless
+   it was memory that ran out or the client that stalled */
+static esp_err_t http_recv_body_result(httpd_req_t *req, esp_err_t err, const char *status, const char *error)
 {
-	char chunk[512];
-	int chunk_bytes;
+	if (err == ESP_ERR_NO_MEM) {
+		return flash_upload_result(req, "503 Service Unavailable", "out of memory");
+	} else if (err == ESP_ERR_TIMEOUT) {
+		return flash_upload_result(req, "408 Request Timeout", "timed out waiting for the upload");
+	}
+	return flash_upload_result(req, status, error);
+}
 
-	ESP_LOGI(__func__, "uri: %s", req->uri);
-	bool is_gzip;
-	frogfs_file_t *file = frogfs_fopen(frog_fs, req->uri);
-	httpd_resp_set_hdr(req, "Connection", "Close");
+/* Stream a firmware image from the request body into the OTA writer, which
+   verifies it and makes it the boot image. The body can be anything the
+   TFTP server accepts: a plain, gzipped or delta image. An X-SHA256 header
+   with the hex digest of the final image is checked if present.
+ */
+static esp_err_t cgi_flash_upload(httpd_req_t *req)
+{
+	char digest_hex[OTA_WRITER_DIGEST_SIZE * 2 + 1];
+	uint8_t digest[OTA_WRITER_DIGEST_SIZE];
+	esp_err_t err;
 
-	if (file != NULL) {
-		httpd_resp_set_type(req, frogfs_get_mime_type(req->uri));
-	} else {
-		size_t uri_len = strlen(req->uri);
-		// If the URI ends in a `/`, don't add an extra one.
-		if (req->uri[uri_len - 1] == '/') {
-			snprintf(chunk, sizeof(chunk) - 1, "%sindex.html", req->uri);
-		} else {
-			snprintf(chunk, sizeof(chunk) - 1, "%s/index.html", req->uri);
+	if (req->content_len == 0) {
+		return httpd_resp_send_err(req, HTTPD_411_LENGTH_REQUIRED, "Content-Length is required");
+	}
+	if (ota_writer_begin(req->content_len) != ESP_OK) {
+		return flash_upload_result(req, "503 Service Unavailable", "unable to start update");
+	}
+	if (httpd_req_get_hdr_value_str(req, "X-SHA256", digest_hex, sizeof(digest_hex)) == ESP_OK) {
+		if (!ota_writer_parse_digest(digest_hex, digest)) {
+			ota_writer_abort();
+			return flash_upload_result(req, "400 Bad Request", "X-SHA256 must be 64 hex digits");
 		}
-		file = frogfs_fopen(frog_fs, chunk);
+		ota_writer_set_digest(digest);
+	}
+
+	err = http_recv_body(req, ota_writer_write, ota_writer_abort);
+	if (err != ESP_OK) {
+		return http_recv_body_result(req, err, "422 Unprocessable Entity",
+			(err == ESP_ERR_INVALID_VERSION) ? "patch is for a different image" : "unable to write image");
+	}
+	err = ota_writer_finish();
+	if (err != ESP_OK) {
+		return flash_upload_result(req, "422 Unprocessable Entity",
+			(err == ESP_ERR_INVALID_CRC) ? "SHA-256 mismatch" : "image verification failed");
+	}
+	if (ota_writer_commit() != ESP_OK) {
+		return flash_upload_result(req, "500 Internal Server Error", "unable to select the new image");
+	}
+	return flash_upload_result(req, NULL, NULL);
+}
 
-		if (file == NULL) {
-			return httpd_resp_send_404(req);
+/* Program the body of a PUT to /target/flash.bin or /target/flash@ADDR into
+   the target's flash, as a TFTP upload to the same name would. The response
+   waits until the image has been read back and checked.
+ */
+static esp_err_t cgi_target_upload(httpd_req_t *req)
+{
+	char name[48];
+	esp_err_t err;
+
+	if (req->content_len == 0) {
+		return httpd_resp_send_err(req, HTTPD_411_LENGTH_REQUIRED, "Content-Length is required");
+	}
+	/* Skip the leading slash, and stop at any query */
+	strlcpy(name, req->uri + 1, sizeof(name));
+	name[strcspn(name, "?")] = '\0';
+
+	err = target_file_create(name, req->content_len);
+	if (err == ESP_ERR_NOT_FOUND) {
+		return flash_upload_result(req, "404 Not Found", "no such file, or no target");
+	} else if (err == ESP_ERR_INVALID_SIZE) {
+		return flash_upload_result(req, "413 Payload Too Large", "image is larger than the target's flash");
+	} else if (err != ESP_OK) {
+		return flash_upload_result(req, "503 Service Unavailable", "unable to program the target");
+	}
+
+	err = http_recv_body(req, target_file_write, target_file_close);
+	if (err != ESP_OK) {
+		return http_recv_body_result(req, err, "500 Internal Server Error", "unable to program the target");
+	}
+	err = target_file_commit();
+	if (err == ESP_ERR_INVALID_CRC) {
+		return flash_upload_result(req, "422 Unprocessable Entity", "target flash CRC mismatch");
+	} else if (err != ESP_OK) {
+		return flash_upload_result(req, "500 Internal Server Error", "unable to program the target");
+	}
+	return flash_upload_result(req, NULL, NULL);
+}
+
+/* Only plain names are stored, so they can go in the status JSON as they are */
+static bool offline_image_name_valid(const char *name)
+{
+	for (; *name; name++) {
+		if (*name < ' ' || *name == '"' || *name == '\\' || *name == '%') {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Store the body of a PUT to /offline/image?addr=ADDR for offline
+   programming. `target` limits it to targets whose driver name starts with
+   that, and `label` is shown in the status. An X-SHA256 header is checked
+   if present.
+ */
+static esp_err_t cgi_offline_image_upload(httpd_req_t *req)
+{
+	char querystring[128];
+	char value[16];
+	char digest_hex[TARGET_IMAGE_DIGEST_SIZE * 2 + 1];
+	uint8_t digest[TARGET_IMAGE_DIGEST_SIZE];
+	bool has_digest = false;
+	struct target_image_info info = {0};
+	esp_err_t err;
+
+	if (req->content_len == 0) {
+		return httpd_resp_send_err(req, HTTPD_411_LENGTH_REQUIRED, "Content-Length is required");
+	}
+	if (httpd_req_get_url_query_str(req, querystring, sizeof(querystring)) != ESP_OK ||
+		httpd_query_key_value(querystring, "addr", value, sizeof(value)) != ESP_OK) {
+		return flash_upload_result(req, "400 Bad Request", "addr is required");
+	}
+	info.addr = strtoul(value, NULL, 0);
+	info.size = req->content_len;
+	httpd_query_key_value(querystring, "target", info.target, sizeof(info.target));
+	httpd_query_key_value(querystring, "label", info.label, sizeof(info.label));
+	if (!offline_image_name_valid(info.target) || !offline_image_name_valid(info.label)) {
+		return flash_upload_result(req, "400 Bad Request", "target and label must be plain text");
+	}
+	if (httpd_req_get_hdr_value_str(req, "X-SHA256", digest_hex, sizeof(digest_hex)) == ESP_OK) {
+		if (!ota_writer_parse_digest(digest_hex, digest)) {
+			return flash_upload_result(req, "400 Bad Request", "X-SHA256 must be 64 hex digits");
 		}
-		httpd_resp_set_type(req, frogfs_get_mime_type(chunk));
+		has_digest = true;
 	}
 
-	is_gzip = frogfs_is_gzip(file);
+	// A run in progress holds the image, but one that has only been asked
+	// for hasn't taken it yet
+	if (offline_prog_running()) {
+		return flash_upload_result(req, "409 Conflict", "the image is being programmed");
+	}
+	err = target_image_begin(&info);
+	if (err == ESP_ERR_INVALID_SIZE) {
+		return flash_upload_result(req, "413 Payload Too Large", "image is larger than the image partition");
+	} else if (err == ESP_ERR_INVALID_STATE) {
+		return flash_upload_result(req, "409 Conflict", "the image is in use");
+	} else if (err != ESP_OK) {
+		return flash_upload_result(req, "503 Service Unavailable", "unable to store the image");
+	}
 
-	// Check the browser's "Accept-Encoding" header. If the client does not
-	// advertise that he accepts GZIP send a warning message (telnet users for e.g.)
-	{
-		char accept_encoding_buffer[64];
-		bool found = (httpd_req_get_hdr_value_str(
-						  req, "Accept-Encoding", accept_encoding_buffer, sizeof(accept_encoding_buffer)) == ESP_OK);
-		if (!found || (strstr(accept_encoding_buffer, "gzip") == NULL)) {
-			//No Accept-Encoding: gzip header present
-			frogfs_fclose(file);
-			return httpd_resp_send_err(
-				req, HTTPD_501_METHOD_NOT_IMPLEMENTED, "your browser does not support gzip-compressed data");
+	err = http_recv_body(req, target_image_write, target_image_abort);
+	if (err != ESP_OK) {
+		return http_recv_body_result(req, err, "500 Internal Server Error", "unable to store the image");
+	}
+	err = target_image_finish(has_digest ? digest : NULL);
+	if (err == ESP_ERR_INVALID_CRC) {
+		return flash_upload_result(req, "422 Unprocessable Entity", "SHA-256 mismatch");
+	} else if (err != ESP_OK) {
+		return flash_upload_result(req, "500 Internal Server Error", "unable to store the image");
+	}
+	return flash_upload_result(req, NULL, NULL);
+}
+
+/* Replace the web UI with the body of a PUT to /webui/image, which is the
+   webui.bin the build produces. It is checked and mounted before the
+   response goes out.
+ */
+static esp_err_t cgi_webui_upload(httpd_req_t *req)
+{
+	esp_err_t err;
+
+	if (req->content_len == 0) {
+		return httpd_resp_send_err(req, HTTPD_411_LENGTH_REQUIRED, "Content-Length is required");
+	}
+	err = webui_update_begin(req->content_len);
+	if (err == ESP_ERR_INVALID_SIZE) {
+		return flash_upload_result(req, "413 Payload Too Large", "image is larger than the web UI partition");
+	} else if (err != ESP_OK) {
+		return flash_upload_result(req, "503 Service Unavailable", "unable to update the web UI");
+	}
+
+	err = http_recv_body(req, webui_update_write, webui_update_abort);
+	if (err != ESP_OK) {
+		return http_recv_body_result(req, err, "500 Internal Server Error", "unable to write the web UI");
+	}
+	err = webui_update_finish();
+	if (err == ESP_ERR_INVALID_CRC) {
+		return flash_upload_result(req, "422 Unprocessable Entity", "not a valid web UI image");
+	} else if (err != ESP_OK) {
+		return flash_upload_result(req, "500 Internal Server Error", "unable to mount the web UI");
+	}
+	return flash_upload_result(req, NULL, NULL);
+}
+
+static esp_err_t cgi_flash_reboot(httpd_req_t *req)
+{
+	httpd_resp_set_type(req, "text/json");
+	httpd_resp_sendstr(req, "{}");
+	// Give the response a moment to get out
+	vTaskDelay(pdMS_TO_TICKS(250));
+	esp_restart();
+	return ESP_OK;
+}
+
+static bool frogfs_etag_matches(httpd_req_t *req, const char *etag)
+{
+	char if_none_match[128];
+	if (httpd_req_get_hdr_value_str(req, "If-None-Match", if_none_match, sizeof(if_none_match)) != ESP_OK) {
+		return false;
+	}
+	return !strcmp(if_none_match, "*") || strstr(if_none_match, etag) != NULL;
+}
+
+// Parse a single "bytes=" range against a body of `len` bytes. Returns 1 and
+// fills in [first, last] for a usable range, 0 if the header should be
+// ignored, and -1 if the range can't be satisfied.
+static int http_parse_range(const char *range, size_t len, size_t *first, size_t *last)
+{
+	char *end;
+
+	if (strncmp(range, "bytes=", 6) || strchr(range, ',')) {
+		return 0;
+	}
+	range += 6;
+
+	if (*range == '-') {
+		// Suffix range, the last N bytes
+		unsigned long suffix = strtoul(range + 1, &end, 10);
+		if (end == range + 1 || *end != '\0') {
+			return 0;
+		}
+		if (suffix == 0 || len == 0) {
+			return -1;
 		}
+		*first = (suffix < len) ? len - suffix : 0;
+		*last = len - 1;
+		return 1;
 	}
 
-	if (is_gzip) {
-		httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+	unsigned long start = strtoul(range, &end, 10);
+	if (end == range || *end != '-') {
+		return 0;
+	}
+	range = end + 1;
+	unsigned long stop = len ? len - 1 : 0;
+	if (*range != '\0') {
+		stop = strtoul(range, &end, 10);
+		if (*end != '\0' || stop < start) {
+			return 0;
+		}
+	}
+	if (start >= len) {
+		return -1;
 	}
+	*first = start;
+	*last = (stop < len) ? stop : len - 1;
+	return 1;
+}
+
+// Send a body that is entirely in memory, honouring a single Range request.
+// `etag` is what If-Range is checked against; without one only dates could
+// match, so ranges are not served.
+esp_err_t http_resp_send_ranged(httpd_req_t *req, const void *data, size_t len, const char *etag)
+{
+	char header[64];
+	size_t first;
+	size_t last;
 
-	// httpd_resp_send(req, "testing", strlen("testing"));
+	httpd_resp_set_hdr(req, "Accept-Ranges", "bytes");
+	if (httpd_req_get_hdr_value_str(req, "Range", header, sizeof(header)) != ESP_OK) {
+		return httpd_resp_send(req, data, len);
+	}
+	int range = http_parse_range(header, len, &first, &last);
 
+	// If-Range means "send the range only if it still is this version"
+	char if_range[40];
+	if (httpd_req_get_hdr_value_str(req, "If-Range", if_range, sizeof(if_range)) == ESP_OK) {
+		if (!etag || strcmp(if_range, etag)) {
+			range = 0;
+		}
+	}
+
+	if (range == 0) {
+		return httpd_resp_send(req, data, len);
+	}
+	if (range < 0) {
+		snprintf(header, sizeof(header), "bytes */%u", len);
+		httpd_resp_set_hdr(req, "Content-Range", header);
+		httpd_resp_set_status(req, "416 Range Not Satisfiable");
+		return httpd_resp_send(req, NULL, 0);
+	}
+
+	snprintf(header, sizeof(header), "bytes %u-%u/%u", first, last, len);
+	httpd_resp_set_hdr(req, "Content-Range", header);
+	httpd_resp_set_status(req, "206 Partial Content");
+	return httpd_resp_send(req, (const char *)data + first, last - first + 1);
+}
+
+// Entries that are stored as-is, which includes everything the build has
+// gzipped, are sent straight out of the memory mapped image in a single
+// response with a Content-Length, or as a range of it. Anything else has to
+// be decompressed by frogfs and goes out whole, in chunks.
+static esp_err_t frogfs_send_file(httpd_req_t *req, const struct frogfs_route_entry *route, const char *etag)
+{
+#if CONFIG_HTTP_FROGFS_ZERO_COPY
+	if (route->data) {
+		return http_resp_send_ranged(req, route->data, route->len, etag);
+	}
+#endif
+
+	frogfs_file_t *file = frogfs_fopen(webui_fs(), route->file->path);
+	if (file == NULL) {
+		return httpd_resp_send_404(req);
+	}
+
+	char chunk[512];
+	int chunk_bytes;
+	esp_err_t ret = ESP_OK;
 	while ((chunk_bytes = frogfs_fread(file, chunk, sizeof(chunk))) > 0) {
-		httpd_resp_send_chunk(req, chunk, chunk_bytes);
+		ret = httpd_resp_send_chunk(req, chunk, chunk_bytes);
+		if (ret != ESP_OK) {
+			break;
+		}
 	}
-	// Empty chunk closes the connection
-	httpd_resp_sendstr_chunk(req, NULL);
 	frogfs_fclose(file);
 
-	return ESP_OK;
+	// An empty chunk ends the response
+	return (ret == ESP_OK) ? httpd_resp_sendstr_chunk(req, NULL) : ret;
+}
+
+static esp_err_t frogfs_send_route(httpd_req_t *req)
+{
+	const struct frogfs_route_entry *route = frogfs_route_lookup(req->uri);
+
+	if (route == NULL) {
+		return httpd_resp_send_404(req);
+	}
+	httpd_resp_set_type(req, route->file->mime_type);
+
+	// The build stores most files gzipped. They go out as they are to
+	// clients that accept gzip, and are inflated on the way out for anyone
+	// else. The two are different representations, so they get different
+	// ETags.
+	bool inflate = false;
+	char etag[32];
+	strlcpy(etag, route->file->etag, sizeof(etag));
+	if (route->gzip) {
+		char accept_encoding[64];
+		bool accepts_gzip = (httpd_req_get_hdr_value_str(req, "Accept-Encoding", accept_encoding,
+								 sizeof(accept_encoding)) == ESP_OK) &&
+			(strstr(accept_encoding, "gzip") != NULL);
+		httpd_resp_set_hdr(req, "Vary", "Accept-Encoding");
+		if (!accepts_gzip) {
+			if (route->data == NULL) {
+				return httpd_resp_send_err(
+					req, HTTPD_501_METHOD_NOT_IMPLEMENTED, "your browser does not support gzip-compressed data");
+			}
+			inflate = true;
+			// Turn "hash" into "hash-identity"
+			etag[strlen(etag) - 1] = '\0';
+			strlcat(etag, "-identity\"", sizeof(etag));
+		}
+	}
+
+	httpd_resp_set_hdr(req, "ETag", etag);
+	// Pages are revalidated on every load so that a web UI update shows
+	// up straight away, which costs a 304 when nothing changed. Scripts and
+	// stylesheets are trusted for a day before they are revalidated.
+	bool is_page = !strcmp(route->file->mime_type, "text/html");
+	httpd_resp_set_hdr(req, "Cache-Control", is_page ? "no-cache" : "public, max-age=86400");
+	if (frogfs_etag_matches(req, etag)) {
+		httpd_resp_set_status(req, "304 Not Modified");
+		return httpd_resp_send(req, NULL, 0);
+	}
+
+	if (inflate) {
+		return gzip_inflate_send(req, route->data, route->len);
+	}
+	if (route->gzip) {
+		httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+	}
+
+	return frogfs_send_file(req, route, etag);
+}
+
+// Served for / when the web UI partition doesn't hold a valid image, so that
+// one can still be uploaded from a browser
+static const char webui_fallback_page[] =
+	"<!DOCTYPE html><html><head><meta charset=\"utf-8\"><title>Farpatch</title></head><body>"
+	"<h1>Farpatch</h1><p>The web UI isn't installed, or is damaged. Everything else still works.</p>"
+	"<p>Upload <code>build/webui.bin</code> to put it back:</p>"
+	"<input type=\"file\" id=\"image\"> <button onclick=\"upload()\">Upload</button> <span id=\"result\"></span>"
+	"<script>function upload(){var f=document.getElementById('image').files[0];if(!f)return;"
+	"var r=document.getElementById('result');r.textContent='Uploading...';"
+	"fetch('/webui/image',{method:'PUT',body:f}).then(function(x){return x.json();}).then(function(j){"
+	"if(j.success)location.reload();else r.textContent=j.error;}).catch(function(e){r.textContent=e;});}"
+	"</script></body></html>";
+
+static esp_err_t cgi_frog_fs_hook(httpd_req_t *req)
+{
+	esp_err_t ret;
+
+	ESP_LOGI(__func__, "uri: %s", req->uri);
+	webui_lock();
+	if (webui_fs()) {
+		ret = frogfs_send_route(req);
+	} else if (!strcmp(req->uri, "/") || !strcmp(req->uri, "/index.html")) {
+		httpd_resp_set_type(req, "text/html");
+		httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+		ret = httpd_resp_send(req, webui_fallback_page, sizeof(webui_fallback_page) - 1);
+	} else {
+		ret = httpd_resp_send_404(req);
+	}
+	webui_unlock();
+	return ret;
 }
 
 static const httpd_uri_t basic_handlers[] = {
@@ -406,14 +900,57 @@ static const httpd_uri_t basic_handlers[] = {
 		.handler = cgi_redirect,
 		.user_ctx = (void *)"/wifi.html",
 	},
-	// {
-	// 	.uri = "/flash/?",
-	// 	.method = HTTP_GET,
-	// 	.handler = cgi_redirect,
-	// 	.user_ctx = (void *)"/flash/index.html",
-	// },
-	// {"/flash/next", cgiGetFirmwareNext, &uploadParams, 0}, {"/flash/upload", cgiUploadFirmware, &uploadParams, 0},
-	// {"/flash/reboot", cgiRebootFirmware, NULL, 0},
+	{
+		.uri = "/flash/?",
+		.method = HTTP_GET,
+		.handler = cgi_redirect,
+		.user_ctx = (void *)"/flash/index.html",
+	},
+	{
+		.uri = "/flash/next",
+		.method = HTTP_GET,
+		.handler = cgi_flash_next,
+	},
+	{
+		.uri = "/flash/upload",
+		.method = HTTP_POST,
+		.handler = cgi_flash_upload,
+	},
+	{
+		.uri = "/flash/upload",
+		.method = HTTP_PUT,
+		.handler = cgi_flash_upload,
+	},
+	{
+		.uri = "/flash/reboot",
+		.method = HTTP_GET,
+		.handler = cgi_flash_reboot,
+	},
+	{
+		.uri = "/target/*",
+		.method = HTTP_PUT,
+		.handler = cgi_target_upload,
+	},
+	{
+		.uri = "/offline",
+		.method = HTTP_GET,
+		.handler = cgi_offline_status,
+	},
+	{
+		.uri = "/offline/image",
+		.method = HTTP_PUT,
+		.handler = cgi_offline_image_upload,
+	},
+	{
+		.uri = "/offline/program",
+		.method = HTTP_POST,
+		.handler = cgi_offline_program,
+	},
+	{
+		.uri = "/webui/image",
+		.method = HTTP_PUT,
+		.handler = cgi_webui_upload,
+	},
 
 	// Routines to make the /wifi URL and everything beneath it work.
 	//
@@ -432,6 +969,35 @@ static const httpd_uri_t basic_handlers[] = {
 		.method = HTTP_GET,
 		.handler = cgi_status,
 	},
+	{
+		.uri = "/profile",
+		.method = HTTP_GET,
+		.handler = cgi_profile,
+	},
+	{
+		.uri = "/profile/map",
+		.method = HTTP_POST,
+		.handler = cgi_profile_map,
+	},
+	{
+		.uri = "/pcsample",
+		.method = HTTP_GET,
+		.handler = cgi_pcsample,
+	},
+	{
+		.uri = "/pcsample/stream",
+		.method = HTTP_GET,
+		.handler = cgi_websocket,
+		.user_ctx = (void *)&pcsample_websocket,
+		.is_websocket = true,
+	},
+	{
+		.uri = "/ws",
+		.method = HTTP_GET,
+		.handler = cgi_websocket,
+		.user_ctx = (void *)&mux_websocket,
+		.is_websocket = true,
+	},
 	{
 		.uri = "/terminal",
 		.method = HTTP_GET,
@@ -453,6 +1019,13 @@ static const httpd_uri_t basic_handlers[] = {
 		.user_ctx = (void *)&rtt_websocket,
 		.is_websocket = true,
 	},
+	{
+		.uri = "/swo",
+		.method = HTTP_GET,
+		.handler = cgi_websocket,
+		.user_ctx = (void *)&swo_websocket,
+		.is_websocket = true,
+	},
 
 	// Wifi Manager
 	{
@@ -491,14 +1064,100 @@ static const httpd_uri_t basic_handlers[] = {
 
 static const int basic_handlers_count = sizeof(basic_handlers) / sizeof(*basic_handlers);
 
+// How often sessions are checked for being idle
+#define HTTP_SESSION_SWEEP_MS 5000
+
+// Connections are kept open between requests. Each session records when
+// it last received anything so that idle ones can be closed before the
+// socket limit is reached. All of this runs on the httpd task, so the table
+// needs no locking.
+struct http_session {
+	int fd;
+	uint32_t last_active_ms;
+};
+
+static struct http_session http_sessions[CONFIG_LWIP_MAX_SOCKETS];
+
+static struct http_session *http_session_find(int fd)
+{
+	int i;
+	for (i = 0; i < sizeof(http_sessions) / sizeof(*http_sessions); i++) {
+		if (http_sessions[i].fd == fd) {
+			return &http_sessions[i];
+		}
+	}
+	return NULL;
+}
+
+static int http_session_recv(httpd_handle_t hd, int sockfd, char *buf, size_t buf_len, int flags)
+{
+	(void)hd;
+	int ret = recv(sockfd, buf, buf_len, flags);
+	if (ret < 0) {
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? HTTPD_SOCK_ERR_TIMEOUT : HTTPD_SOCK_ERR_FAIL;
+	}
+
+	struct http_session *session = http_session_find(sockfd);
+	if (session) {
+		session->last_active_ms = platform_time_ms();
+	}
+	return ret;
+}
+
+static esp_err_t http_session_open(httpd_handle_t hd, int sockfd)
+{
+	struct http_session *session = http_session_find(0);
+	if (session) {
+		session->fd = sockfd;
+		session->last_active_ms = platform_time_ms();
+	}
+	httpd_sess_set_recv_override(hd, sockfd, http_session_recv);
+	return ESP_OK;
+}
+
+static void http_session_close(httpd_handle_t hd, int sockfd)
+{
+	(void)hd;
+	struct http_session *session = http_session_find(sockfd);
+	if (session) {
+		session->fd = 0;
+	}
+	wsmux_remove_client(sockfd);
+	close(sockfd);
+}
+
+static void http_session_sweep(void *arg)
+{
+	(void)arg;
+	uint32_t now = platform_time_ms();
+	int i;
+
+	for (i = 0; i < sizeof(http_sessions) / sizeof(*http_sessions); i++) {
+		struct http_session *session = &http_sessions[i];
+		if (session->fd == 0 || (now - session->last_active_ms) < CONFIG_HTTP_SESSION_IDLE_TIMEOUT * 1000) {
+			continue;
+		}
+		// Websockets are long lived and mostly quiet in the receive direction
+		if (httpd_ws_get_fd_info(http_daemon, session->fd) == HTTPD_WS_CLIENT_WEBSOCKET) {
+			continue;
+		}
+		ESP_LOGD(TAG, "closing idle session %d", session->fd);
+		httpd_sess_trigger_close(http_daemon, session->fd);
+		session->last_active_ms = now;
+	}
+}
+
+static void http_session_timer(TimerHandle_t timer)
+{
+	(void)timer;
+	httpd_queue_work(http_daemon, http_session_sweep, NULL);
+}
+
 httpd_handle_t webserver_start(void)
 {
 	int i;
-	static frogfs_config_t frogfs_config = {
-		.addr = frogfs_bin,
-	};
-	frog_fs = frogfs_init(&frogfs_config);
-	assert(frog_fs != NULL);
+	webui_init();
+	gzip_inflate_init();
 	httpd_config_t config = HTTPD_DEFAULT_CONFIG();
 	config.max_uri_handlers = basic_handlers_count + 5;
 	config.server_port = 80;
@@ -507,6 +1166,12 @@ httpd_handle_t webserver_start(void)
 	/* This check should be a part of http_server */
 	config.max_open_sockets = (CONFIG_LWIP_MAX_SOCKETS - 4);
 
+	// Once every socket is in use, a new connection replaces the least
+	// recently used one rather than being refused.
+	config.lru_purge_enable = true;
+	config.open_fn = http_session_open;
+	config.close_fn = http_session_close;
+
 	if (httpd_start(&http_daemon, &config) != ESP_OK) {
 		ESP_LOGE(TAG, "Unable to start HTTP server");
 		return NULL;
@@ -515,6 +1180,13 @@ httpd_handle_t webserver_start(void)
 	for (i = 0; i < basic_handlers_count; i++) {
 		httpd_register_uri_handler(http_daemon, &basic_handlers[i]);
 	}
+	wsmux_init(http_daemon);
+
+	TimerHandle_t sweep_timer =
+		xTimerCreate("http_idle", pdMS_TO_TICKS(HTTP_SESSION_SWEEP_MS), pdTRUE, NULL, http_session_timer);
+	if (sweep_timer) {
+		xTimerStart(sweep_timer, 0);
+	}
 
 	ESP_LOGI(TAG, "Started HTTP server on port: '%d'", config.server_port);
 	ESP_LOGI(TAG, "Max URI handlers: '%d'", config.max_uri_handlers);
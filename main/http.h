@@ -14,6 +14,15 @@
 void http_term_broadcast_data(uint8_t *data, size_t len);
 void http_debug_putc(uint8_t c, int flush);
 void http_term_broadcast_rtt(uint8_t *data, size_t len);
+void http_term_broadcast_swo(uint8_t *data, size_t len);
+void http_term_broadcast_pcsample(uint8_t *data, size_t len);
+
+/* send an in-memory body, honouring a single Range/If-Range request */
+esp_err_t http_resp_send_ranged(httpd_req_t *req, const void *data, size_t len, const char *etag);
+
+/* write the /status report a piece at a time, so it can go to a response or a websocket */
+typedef void (*http_status_out_t)(void *ctx, const char *data, size_t len);
+void http_status_write(http_status_out_t out, void *ctx);
 
 /* start the http server */
 httpd_handle_t webserver_start(void);
@@ -29,6 +29,8 @@
 #undef SCNx32
 #define SCNx32 "x"
 
+#include <stdbool.h>
+
 #include "esp_log.h"
 #include "esp_attr.h"
 #include "timing.h"
@@ -37,6 +39,11 @@
 void platform_buffer_flush(void);
 void platform_set_baud(uint32_t baud);
 
+/* Exclusive access to the debug port for tasks other than GDB */
+void platform_target_lock(void);
+bool platform_target_trylock(uint32_t timeout_ms);
+void platform_target_unlock(void);
+
 #define SET_RUN_STATE(state)
 #define SET_IDLE_STATE(state)
 #define SET_ERROR_STATE(state) gpio_set_level(CONFIG_LED_GPIO, !state)
@@ -110,4 +117,6 @@ void platform_set_baud(uint32_t baud);
 #define NUM_TRACE_PACKETS (128) /* This is an 8K buffer */
 #define TRACESWO_PROTOCOL 2     /* 1 = Manchester, 2 = NRZ / async */
 
+#define PLATFORM_HAS_CUSTOM_COMMANDS
+
 	extern uint32_t swd_delay_cnt;
\ No newline at end of file
@@ -0,0 +1,317 @@
+/*
+ * Offline programming.
+ *
+ * A run feeds the stored image through target_file, the same path a TFTP
+ * or HTTP upload to target/flash@ADDR takes. The image is mapped from the
+ * probe's flash, so handing it over costs only a copy, and the target is
+ * erased, programmed, read back and reset as fast as the debug port allows.
+ * Each run records how long every phase took, so cycle time per board can
+ * be measured.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+#include <freertos/task.h>
+
+#include "driver/gpio.h"
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "offline_prog.h"
+#include "target_file.h"
+#include "target_image.h"
+
+#define TAG "offline-prog"
+
+#define OFFLINE_PROG_TASK_PRIO 2
+
+/* target_file copies the image into its own buffers, so this only sets how
+   often the task checks for a failure */
+#define OFFLINE_PROG_CHUNK_SIZE 16384
+
+/* Why the task was woken */
+#define OFFLINE_PROG_TRIGGER_REQUEST BIT0
+#define OFFLINE_PROG_TRIGGER_BUTTON  BIT1
+#define OFFLINE_PROG_DEBOUNCE_MS     30
+
+/* Set whenever no run is in progress */
+#define OFFLINE_PROG_DONE BIT0
+
+/* How long POST /offline/program waits for the result */
+#define OFFLINE_PROG_HTTP_WAIT_MS 120000
+
+static TaskHandle_t prog_task;
+static EventGroupHandle_t prog_events;
+static struct offline_prog_stats prog_stats;
+static volatile bool prog_running;
+
+static const char *offline_prog_state_names[] = {
+	[OFFLINE_PROG_IDLE] = "idle",
+	[OFFLINE_PROG_ATTACHING] = "attaching",
+	[OFFLINE_PROG_PROGRAMMING] = "programming",
+	[OFFLINE_PROG_VERIFYING] = "verifying",
+	[OFFLINE_PROG_PASSED] = "passed",
+	[OFFLINE_PROG_FAILED] = "failed",
+};
+
+/* Forget the previous run as a new one starts */
+static void offline_prog_clear_run(void)
+{
+	prog_stats.state = OFFLINE_PROG_ATTACHING;
+	prog_stats.error = NULL;
+	prog_stats.driver[0] = '\0';
+	prog_stats.bytes = 0;
+	prog_stats.attach_ms = 0;
+	prog_stats.erase_ms = 0;
+	prog_stats.program_ms = 0;
+	prog_stats.verify_ms = 0;
+	prog_stats.total_ms = 0;
+}
+
+/* Program the image described by `info`, returning why it failed or NULL */
+static const char *offline_prog_program(const struct target_image_info *info)
+{
+	struct target_file_stats file_stats;
+	char name[32];
+	const uint8_t *data;
+	uint32_t pos;
+
+	snprintf(name, sizeof(name), TARGET_FILE_PREFIX "flash@0x%08x", info->addr);
+	esp_err_t err = target_file_create(name, info->size);
+	target_file_get_stats(&file_stats);
+	strlcpy(prog_stats.driver, file_stats.driver, sizeof(prog_stats.driver));
+	prog_stats.attach_ms = file_stats.attach_ms;
+	if (err == ESP_ERR_INVALID_SIZE) {
+		return "image doesn't fit in the target's flash";
+	} else if (err != ESP_OK) {
+		return file_stats.driver[0] ? "no flash at the image address" : "no target found";
+	}
+	if (info->target[0] && strncmp(file_stats.driver, info->target, strlen(info->target))) {
+		target_file_close();
+		return "wrong target";
+	}
+	if (target_image_map((const void **)&data) != ESP_OK) {
+		target_file_close();
+		return "unable to map the image";
+	}
+
+	prog_stats.state = OFFLINE_PROG_PROGRAMMING;
+	for (pos = 0; pos < info->size && err == ESP_OK; pos += OFFLINE_PROG_CHUNK_SIZE) {
+		err = target_file_write(data + pos, MIN(info->size - pos, OFFLINE_PROG_CHUNK_SIZE));
+	}
+	if (err == ESP_OK) {
+		prog_stats.state = OFFLINE_PROG_VERIFYING;
+		err = target_file_commit();
+	} else {
+		target_file_close();
+	}
+	target_image_unmap();
+
+	target_file_get_stats(&file_stats);
+	prog_stats.bytes = file_stats.bytes;
+	prog_stats.erase_ms = file_stats.erase_ms;
+	prog_stats.program_ms = file_stats.program_ms;
+	prog_stats.verify_ms = file_stats.verify_ms;
+	if (err == ESP_ERR_INVALID_CRC) {
+		return "verify failed";
+	} else if (err != ESP_OK) {
+		return "programming failed";
+	}
+	return NULL;
+}
+
+/* Program the stored image, which can't be replaced until the run is over,
+   returning why it failed or NULL */
+static const char *offline_prog_run(void)
+{
+	struct target_image_info info;
+
+	esp_err_t err = target_image_get(&info);
+	if (err == ESP_ERR_INVALID_CRC) {
+		return "stored image is corrupt";
+	} else if (err == ESP_ERR_INVALID_STATE) {
+		return "image is in use";
+	} else if (err != ESP_OK) {
+		return "no image stored";
+	}
+	const char *error = offline_prog_program(&info);
+	target_image_put();
+	return error;
+}
+
+static void offline_prog_task(void *ignored)
+{
+	uint32_t triggers;
+
+	while (1) {
+		xTaskNotifyWait(0, UINT32_MAX, &triggers, portMAX_DELAY);
+#if CONFIG_OFFLINE_PROG_GPIO >= 0
+		/* Only a press that is still held counts */
+		if (triggers == OFFLINE_PROG_TRIGGER_BUTTON) {
+			vTaskDelay(pdMS_TO_TICKS(OFFLINE_PROG_DEBOUNCE_MS));
+			if (gpio_get_level(CONFIG_OFFLINE_PROG_GPIO) != 0) {
+				continue;
+			}
+		}
+#endif
+		prog_running = true;
+		xEventGroupClearBits(prog_events, OFFLINE_PROG_DONE);
+		offline_prog_clear_run();
+
+		int64_t start = esp_timer_get_time();
+		prog_stats.error = offline_prog_run();
+		prog_stats.total_ms = (esp_timer_get_time() - start) / 1000;
+		prog_stats.runs++;
+
+		if (prog_stats.error) {
+			prog_stats.failures++;
+			prog_stats.state = OFFLINE_PROG_FAILED;
+			ESP_LOGE(TAG, "run %u failed after %u ms: %s", prog_stats.runs, prog_stats.total_ms, prog_stats.error);
+		} else {
+			prog_stats.passes++;
+			prog_stats.state = OFFLINE_PROG_PASSED;
+			ESP_LOGI(TAG,
+				"run %u passed, %s, %u bytes: attach %u ms, erase %u ms, program %u ms, verify %u ms, total %u ms",
+				prog_stats.runs, prog_stats.driver, prog_stats.bytes, prog_stats.attach_ms, prog_stats.erase_ms,
+				prog_stats.program_ms, prog_stats.verify_ms, prog_stats.total_ms);
+		}
+
+		/* Presses during the run don't queue up another one */
+		xTaskNotifyStateClear(NULL);
+		ulTaskNotifyValueClear(NULL, UINT32_MAX);
+		prog_running = false;
+		xEventGroupSetBits(prog_events, OFFLINE_PROG_DONE);
+	}
+}
+
+#if CONFIG_OFFLINE_PROG_GPIO >= 0
+static void IRAM_ATTR offline_prog_button_isr(void *arg)
+{
+	BaseType_t woken = pdFALSE;
+	(void)arg;
+
+	xTaskNotifyFromISR(prog_task, OFFLINE_PROG_TRIGGER_BUTTON, eSetBits, &woken);
+	portYIELD_FROM_ISR(woken);
+}
+#endif
+
+/* Called after platform_init(), which installs the GPIO ISR service */
+void offline_prog_init(void)
+{
+	prog_events = xEventGroupCreate();
+	xEventGroupSetBits(prog_events, OFFLINE_PROG_DONE);
+	xTaskCreate(offline_prog_task, "offline_prog", 4096, NULL, OFFLINE_PROG_TASK_PRIO, &prog_task);
+
+#if CONFIG_OFFLINE_PROG_GPIO >= 0
+	const gpio_config_t gpio_conf = {
+		.pin_bit_mask = BIT64(CONFIG_OFFLINE_PROG_GPIO),
+		.mode = GPIO_MODE_INPUT,
+		.pull_up_en = GPIO_PULLUP_ENABLE,
+		.pull_down_en = 0,
+		.intr_type = GPIO_INTR_NEGEDGE,
+	};
+	gpio_config(&gpio_conf);
+	gpio_isr_handler_add(CONFIG_OFFLINE_PROG_GPIO, offline_prog_button_isr, NULL);
+#endif
+}
+
+esp_err_t offline_prog_start(void)
+{
+	if (prog_running) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	prog_running = true;
+	xEventGroupClearBits(prog_events, OFFLINE_PROG_DONE);
+	offline_prog_clear_run();
+	xTaskNotify(prog_task, OFFLINE_PROG_TRIGGER_REQUEST, eSetBits);
+	return ESP_OK;
+}
+
+bool offline_prog_running(void)
+{
+	return prog_running;
+}
+
+bool offline_prog_wait(uint32_t timeout_ms)
+{
+	EventBits_t bits = xEventGroupWaitBits(prog_events, OFFLINE_PROG_DONE, pdFALSE, pdTRUE, pdMS_TO_TICKS(timeout_ms));
+	return (bits & OFFLINE_PROG_DONE) != 0;
+}
+
+void offline_prog_get_stats(struct offline_prog_stats *stats)
+{
+	*stats = prog_stats;
+}
+
+static esp_err_t offline_prog_send_status(httpd_req_t *req, const char *status)
+{
+	struct target_image_info info;
+	char digest[TARGET_IMAGE_DIGEST_SIZE * 2 + 1];
+	char image[256];
+	char response[768];
+	int i;
+
+	esp_err_t err = target_image_get(&info);
+	if (err == ESP_OK) {
+		target_image_put();
+		for (i = 0; i < TARGET_IMAGE_DIGEST_SIZE; i++) {
+			sprintf(digest + i * 2, "%02x", info.sha256[i]);
+		}
+		snprintf(image, sizeof(image),
+			"{\"addr\": %u, \"size\": %u, \"target\": \"%s\", \"label\": \"%s\", \"sha256\": \"%s\"}", info.addr,
+			info.size, info.target, info.label, digest);
+	} else {
+		// The image can't be looked at while it is being stored or checked
+		strlcpy(image, (err == ESP_ERR_INVALID_STATE) ? "\"busy\"" : "null", sizeof(image));
+	}
+
+	int len = snprintf(response, sizeof(response),
+		"{\"state\": \"%s\", \"runs\": %u, \"passes\": %u, \"failures\": %u, \"error\": %s%s%s, \"driver\": \"%s\", "
+		"\"bytes\": %u, \"attach_ms\": %u, \"erase_ms\": %u, \"program_ms\": %u, \"verify_ms\": %u, "
+		"\"total_ms\": %u, \"image\": %s}",
+		offline_prog_state_names[prog_stats.state], prog_stats.runs, prog_stats.passes, prog_stats.failures,
+		prog_stats.error ? "\"" : "", prog_stats.error ? prog_stats.error : "null", prog_stats.error ? "\"" : "",
+		prog_stats.driver, prog_stats.bytes, prog_stats.attach_ms, prog_stats.erase_ms, prog_stats.program_ms,
+		prog_stats.verify_ms, prog_stats.total_ms, image);
+
+	if (status) {
+		httpd_resp_set_status(req, status);
+	}
+	httpd_resp_set_type(req, "text/json");
+	return httpd_resp_send(req, response, len);
+}
+
+esp_err_t cgi_offline_status(httpd_req_t *req)
+{
+	return offline_prog_send_status(req, NULL);
+}
+
+/* Waits for the run to finish unless given ?wait=0, so that a line can
+   program a board with one curl --fail */
+esp_err_t cgi_offline_program(httpd_req_t *req)
+{
+	char querystring[32];
+	char value[8];
+	bool wait = true;
+
+	if (httpd_req_get_url_query_str(req, querystring, sizeof(querystring)) == ESP_OK &&
+		httpd_query_key_value(querystring, "wait", value, sizeof(value)) == ESP_OK) {
+		wait = strcmp(value, "0") != 0;
+	}
+
+	if (offline_prog_start() != ESP_OK) {
+		return offline_prog_send_status(req, "409 Conflict");
+	}
+	if (!wait) {
+		return offline_prog_send_status(req, "202 Accepted");
+	}
+	if (!offline_prog_wait(OFFLINE_PROG_HTTP_WAIT_MS)) {
+		return offline_prog_send_status(req, "504 Gateway Timeout");
+	}
+	return offline_prog_send_status(req, prog_stats.error ? "500 Internal Server Error" : NULL);
+}
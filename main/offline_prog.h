@@ -0,0 +1,65 @@
+#ifndef FARPATCH_OFFLINE_PROG_H__
+#define FARPATCH_OFFLINE_PROG_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <esp_err.h>
+#include <esp_http_server.h>
+
+
+/* Programs the image kept by target_image.h into whatever target is on the
+ * debug port, without a host. A run is started from the web server or by
+ * pulling CONFIG_OFFLINE_PROG_GPIO low.
+ */
+
+enum offline_prog_state {
+	OFFLINE_PROG_IDLE,
+	OFFLINE_PROG_ATTACHING,
+	/* Handing the image over to be erased and programmed */
+	OFFLINE_PROG_PROGRAMMING,
+	/* Waiting for the last of it to be programmed and read back */
+	OFFLINE_PROG_VERIFYING,
+	OFFLINE_PROG_PASSED,
+	OFFLINE_PROG_FAILED,
+};
+
+struct offline_prog_stats {
+	enum offline_prog_state state;
+	uint32_t runs;
+	uint32_t passes;
+	uint32_t failures;
+
+	/* The most recent run. `error` is NULL if it passed. */
+	const char *error;
+	char driver[32];
+	uint32_t bytes;
+	uint32_t attach_ms;
+	uint32_t erase_ms;
+	uint32_t program_ms;
+	uint32_t verify_ms;
+	/* From the trigger to the target being reset */
+	uint32_t total_ms;
+};
+
+void offline_prog_init(void);
+
+/* Start programming the target in the background. ESP_ERR_INVALID_STATE if
+   a run is already in progress.
+ */
+esp_err_t offline_prog_start(void);
+
+/* Whether a run has been started and hasn't finished yet */
+bool offline_prog_running(void);
+
+/* Wait for the run in progress to finish. false if it is still going. */
+bool offline_prog_wait(uint32_t timeout_ms);
+
+void offline_prog_get_stats(struct offline_prog_stats *stats);
+
+/* GET /offline reports the stored image and the last run, POST
+   /offline/program runs the programmer and waits for the result */
+esp_err_t cgi_offline_status(httpd_req_t *req);
+esp_err_t cgi_offline_program(httpd_req_t *req);
+
+#endif /* FARPATCH_OFFLINE_PROG_H__ */
@@ -7,8 +7,12 @@
  * BSD Licensed as described in the file LICENSE
  */
 #include <freertos/FreeRTOS.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/param.h>
 
 #include "lwip/err.h"
 #include "lwip/api.h"
@@ -20,10 +24,14 @@
 
 #include "esp_ota_ops.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "esp_flash_partitions.h"
 #include "esp_image_format.h"
 
 #include "ota-tftp.h"
+#include "ota_writer.h"
+#include "target_file.h"
+#include "webui.h"
 
 /* Read a 16 bit wide unsigned integer, stored host order, from the netbuf */
 inline static u16_t netbuf_read_u16_h(struct netbuf *netbuf, u16_t offs)
@@ -47,6 +55,9 @@ inline static u8_t netbuf_read_u8(struct netbuf *netbuf, u16_t offs)
 }
 
 #define TFTP_FIRMWARE_FILE "firmware.bin"
+/* Compressed images are recognised by their contents, this name is just allowed */
+#define TFTP_FIRMWARE_GZ_FILE "firmware.bin.gz"
+#define TFTP_WEBUI_FILE    "webui.bin"
 #define TFTP_OCTET_MODE    "octet" /* non-case-sensitive */
 
 #define TFTP_OP_RRQ   1
@@ -60,19 +71,109 @@ inline static u8_t netbuf_read_u8(struct netbuf *netbuf, u16_t offs)
 #define TFTP_ERR_FULL         3
 #define TFTP_ERR_ILLEGAL      4
 #define TFTP_ERR_BADID        5
+#define TFTP_ERR_OPTION       8
+
+#define TFTP_DEFAULT_BLKSIZE 512
+/* IP reassembly is disabled, so a block has to fit in one 1500 byte frame
+   along with the IP, UDP and TFTP headers */
+#define TFTP_MAX_BLKSIZE (1500 - 20 - 8 - 4)
+/* Every block of a window may be waiting in the UDP mailbox at once */
+#define TFTP_MAX_WINDOWSIZE CONFIG_LWIP_UDP_RECVMBOX_SIZE
+/* How long to wait for an ACK before sending a window again */
+#define TFTP_ACK_TIMEOUT_MS 1000
+/* Duplicate ACKs this soon after a window went out were set off by it */
+#define TFTP_DUP_ACK_HOLDOFF_MS 200
+
+/* Transfer options, negotiated as per RFC 2347 */
+struct tftp_options {
+	uint16_t blksize;    /* RFC 2348 */
+	uint16_t windowsize; /* RFC 7440 */
+	uint32_t tsize;      /* RFC 2349, 0 if not given */
+	/* SHA-256 of the whole file, as 64 hex digits */
+	uint8_t sha256[OTA_WRITER_DIGEST_SIZE];
+	/* Options the peer asked for. Only these go in the OACK. */
+	bool has_blksize;
+	bool has_windowsize;
+	bool has_tsize;
+	bool has_sha256;
+};
+
+static const struct tftp_options tftp_default_options = {
+	.blksize = TFTP_DEFAULT_BLKSIZE,
+	.windowsize = 1,
+};
+
+/* Where received data goes: the OTA writer, the target's flash or the web UI
+   partition */
+struct tftp_sink {
+	esp_err_t (*write)(const void *data, size_t len);
+	/* Called once the last block is in, before it is ACKed */
+	esp_err_t (*finish)(void);
+	/* Message for the ERROR packet when either of the above fails */
+	const char *(*error_message)(esp_err_t err, bool finishing);
+};
+
+static const char *tftp_ota_error_message(esp_err_t err, bool finishing)
+{
+	if (finishing) {
+		return (err == ESP_ERR_INVALID_CRC) ? "SHA-256 mismatch" : "Image verification failed";
+	}
+	return (err == ESP_ERR_INVALID_VERSION) ? "Patch is for a different image" : "Unable to write image";
+}
+
+static const char *tftp_target_error_message(esp_err_t err, bool finishing)
+{
+	if (err == ESP_ERR_INVALID_CRC) {
+		return "Target flash CRC mismatch";
+	} else if (err == ESP_ERR_INVALID_SIZE) {
+		return finishing ? "Image is shorter than its tsize" : "Image is longer than its tsize";
+	}
+	return "Unable to program the target";
+}
+
+static const char *tftp_webui_error_message(esp_err_t err, bool finishing)
+{
+	if (err == ESP_ERR_INVALID_CRC) {
+		return "Not a valid web UI image";
+	} else if (err == ESP_ERR_INVALID_SIZE) {
+		return finishing ? "Image is shorter than its tsize" : "Image is larger than the web UI partition";
+	}
+	return "Unable to write the web UI";
+}
+
+static const struct tftp_sink tftp_ota_sink = {
+	.write = ota_writer_write,
+	.finish = ota_writer_finish,
+	.error_message = tftp_ota_error_message,
+};
 
-#define MAX_IMAGE_SIZE 0x100000 /*1MB images max at the moment */
+static const struct tftp_sink tftp_target_sink = {
+	.write = target_file_write,
+	.finish = target_file_commit,
+	.error_message = tftp_target_error_message,
+};
+
+static const struct tftp_sink tftp_webui_sink = {
+	.write = webui_update_write,
+	.finish = webui_update_finish,
+	.error_message = tftp_webui_error_message,
+};
 
 static void tftp_task(void *port_p);
+static bool tftp_has_options(const struct tftp_options *opts);
 static char *tftp_get_field(int field, struct netbuf *netbuf);
-static err_t tftp_receive_data(
-	struct netconn *nc, size_t *received_len, ip_addr_t *peer_addr, int peer_port, tftp_receive_cb receive_cb);
-static err_t tftp_send_ack(struct netconn *nc, int block);
+static void tftp_parse_options(struct netbuf *netbuf, struct tftp_options *opts);
+static err_t tftp_receive_data(struct netconn *nc, size_t *received_len, ip_addr_t *peer_addr, int peer_port,
+	const struct tftp_options *opts, const struct tftp_sink *sink, tftp_receive_cb receive_cb);
+static void tftp_create_target_file(struct netconn *nc, const char *filename, struct tftp_options *opts);
+static void tftp_serve_target_file(struct netconn *nc, const char *filename, struct tftp_options *opts);
+static void tftp_update_webui(struct netconn *nc, struct tftp_options *opts);
+static err_t tftp_send_file(struct netconn *nc, const struct tftp_options *opts, uint32_t size);
+static err_t tftp_send_ack(struct netconn *nc, uint16_t block);
+static err_t tftp_send_oack(struct netconn *nc, const struct tftp_options *opts);
 static err_t tftp_send_rrq(struct netconn *nc, const char *filename);
 static void tftp_send_error(struct netconn *nc, int err_code, const char *err_msg);
 
-esp_ota_handle_t update_handle;
-const esp_partition_t *update_part;
 const esp_partition_t *configured_part;
 const esp_partition_t *running_part;
 
@@ -80,10 +181,10 @@ const esp_partition_t *running_part;
 
 void ota_tftp_init_server(int listen_port, int prio)
 {
-	xTaskCreate(tftp_task, "tftpOTATask", 2500, (void *)listen_port, prio, NULL);
+	xTaskCreate(tftp_task, "tftpOTATask", 3072, (void *)listen_port, prio, NULL);
 }
 
-static int ota_tftp_init()
+static int ota_tftp_init(size_t image_size)
 {
 	configured_part = esp_ota_get_boot_partition();
 	running_part = esp_ota_get_running_partition();
@@ -102,19 +203,8 @@ static int ota_tftp_init()
 	ESP_LOGI(TAG, "Running partition type %d subtype %d (offset 0x%08x)", running_part->type, running_part->subtype,
 		running_part->address);
 
-	update_part = esp_ota_get_next_update_partition(NULL);
-
-	if (update_part == NULL) {
-		ESP_LOGE(TAG, "update_partition not found!");
-		return ERR_VAL;
-	}
-	ESP_LOGI(TAG, "esp_ota_begin");
-	err_t err = esp_ota_begin(update_part, OTA_SIZE_UNKNOWN, &update_handle);
-	if (err != ESP_OK) {
-		ESP_LOGE(TAG, "esp_ota_begin failed, error=%d", err);
+	if (ota_writer_begin(image_size) != ESP_OK) {
 		return ERR_VAL;
-	} else {
-		ESP_LOGI(TAG, "esp_ota_begin succeeded");
 	}
 	return ERR_OK;
 }
@@ -124,7 +214,7 @@ err_t ota_tftp_download(
 {
 	err_t err;
 
-	if ((err = ota_tftp_init()) < 0) {
+	if ((err = ota_tftp_init(0)) < 0) {
 		return ERR_VAL;
 	}
 
@@ -162,7 +252,10 @@ err_t ota_tftp_download(
 	}
 
 	size_t received_len;
-	err = tftp_receive_data(nc, &received_len, &addr, port, receive_cb);
+	err = tftp_receive_data(nc, &received_len, &addr, port, &tftp_default_options, &tftp_ota_sink, receive_cb);
+	if (err != ERR_OK) {
+		ota_writer_abort();
+	}
 	netconn_delete(nc);
 	return err;
 }
@@ -183,7 +276,8 @@ static void tftp_task(void *listen_port)
 	netconn_bind(nc, IP_ADDR_ANY, (int)listen_port);
 	//bind(sock, (struct socaddr*)&addr, sizeof(addr));
 
-	/* We expect a WRQ packet with filename "firmware.bin" and "octet" mode,
+	/* We expect a WRQ packet with filename "firmware.bin" or "webui.bin" and
+       "octet" mode, or an RRQ or WRQ for one of the target files
     */
 	while (1) {
 		/* wait as long as needed for a WRQ packet */
@@ -196,68 +290,120 @@ static void tftp_task(void *listen_port)
 		}
 		uint16_t len = netbuf_len(netbuf);
 		if (len < 6) {
-			ESP_LOGE(__func__, "OTA TFTP Error: Packet too short for a valid WRQ");
+			ESP_LOGE(__func__, "OTA TFTP Error: Packet too short for a valid request");
 			netbuf_delete(netbuf);
 			continue;
 		}
 
 		uint16_t opcode = netbuf_read_u16_n(netbuf, 0);
-		if (opcode != TFTP_OP_WRQ) {
-			ESP_LOGE(__func__, "OTA TFTP Error: Invalid opcode 0x%04x didn't match WRQ", opcode);
+		if (opcode != TFTP_OP_WRQ && opcode != TFTP_OP_RRQ) {
+			ESP_LOGE(__func__, "OTA TFTP Error: Invalid opcode 0x%04x didn't match WRQ or RRQ", opcode);
 			netbuf_delete(netbuf);
 			continue;
 		}
 
+		/* establish a connection back to the sender from this netbuf, which
+           also lets it see any error about the request */
+		netconn_connect(nc, netbuf_fromaddr(netbuf), netbuf_fromport(netbuf));
+
 		/* check filename */
 		char *filename = tftp_get_field(0, netbuf);
-		if (!filename || strcmp(filename, TFTP_FIRMWARE_FILE)) {
-			tftp_send_error(nc, TFTP_ERR_FILENOTFOUND, "File must be firmware.bin");
+		const char *filename_err = NULL;
+		bool target_file = filename && !strncmp(filename, TARGET_FILE_PREFIX, strlen(TARGET_FILE_PREFIX));
+		if (!filename) {
+			filename_err = "Missing filename";
+		} else if (opcode == TFTP_OP_RRQ && !target_file) {
+			filename_err = "Only target/ files can be read";
+		} else if (opcode == TFTP_OP_WRQ && !target_file && strcmp(filename, TFTP_FIRMWARE_FILE) &&
+				   strcmp(filename, TFTP_FIRMWARE_GZ_FILE) && strcmp(filename, TFTP_WEBUI_FILE)) {
+			filename_err = "File must be firmware.bin, firmware.bin.gz, webui.bin or under target/";
+		}
+		if (filename_err) {
+			tftp_send_error(nc, TFTP_ERR_FILENOTFOUND, filename_err);
 			free(filename);
 			netbuf_delete(netbuf);
+			netconn_disconnect(nc);
 			continue;
 		}
-		free(filename);
 
 		/* check mode */
 		char *mode = tftp_get_field(1, netbuf);
 		if (!mode || strcmp(TFTP_OCTET_MODE, mode)) {
 			tftp_send_error(nc, TFTP_ERR_ILLEGAL, "Mode must be octet/binary");
+			free(filename);
 			free(mode);
 			netbuf_delete(netbuf);
+			netconn_disconnect(nc);
 			continue;
 		}
 		free(mode);
 
-		/* establish a connection back to the sender from this netbuf */
-		netconn_connect(nc, netbuf_fromaddr(netbuf), netbuf_fromport(netbuf));
+		struct tftp_options opts = tftp_default_options;
+		tftp_parse_options(netbuf, &opts);
 		netbuf_delete(netbuf);
 
-		/* ACK the WRQ */
-		int ack_err = tftp_send_ack(nc, 0);
+		if (opcode == TFTP_OP_RRQ) {
+			tftp_serve_target_file(nc, filename, &opts);
+			free(filename);
+			netconn_disconnect(nc);
+			continue;
+		}
+		if (target_file) {
+			/* The target file keeps hold of the name until it is closed */
+			tftp_create_target_file(nc, filename, &opts);
+			free(filename);
+			netconn_disconnect(nc);
+			continue;
+		}
+		if (!strcmp(filename, TFTP_WEBUI_FILE)) {
+			tftp_update_webui(nc, &opts);
+			free(filename);
+			netconn_disconnect(nc);
+			continue;
+		}
+		free(filename);
+
+		/* turn away images that can't fit before any data is sent */
+		const esp_partition_t *next_part = esp_ota_get_next_update_partition(NULL);
+		if (next_part && opts.tsize > next_part->size) {
+			tftp_send_error(nc, TFTP_ERR_FULL, "Image is larger than the OTA partition");
+			netconn_disconnect(nc);
+			continue;
+		}
+
+		/* ACK the WRQ, or acknowledge the options we accepted */
+		int ack_err = tftp_has_options(&opts) ? tftp_send_oack(nc, &opts) : tftp_send_ack(nc, 0);
 		if (ack_err != 0) {
 			ESP_LOGE(__func__, "OTA TFTP initial ACK failed");
 			netconn_disconnect(nc);
 			continue;
 		}
+		ESP_LOGI(TAG, "receiving %u bytes with blksize %u, windowsize %u", opts.tsize, opts.blksize,
+			opts.windowsize);
 
 		/* init ota system */
 
-		ota_tftp_init();
+		if (ota_tftp_init(opts.tsize) != ERR_OK) {
+			tftp_send_error(nc, TFTP_ERR_ILLEGAL, "Unable to start OTA update");
+			netconn_disconnect(nc);
+			continue;
+		}
+		if (opts.has_sha256) {
+			ota_writer_set_digest(opts.sha256);
+		}
 
 		/* Finished WRQ phase, start TFTP data transfer */
 		size_t received_len;
 		netconn_set_recvtimeout(nc, 10000);
-		int recv_err = tftp_receive_data(nc, &received_len, NULL, 0, NULL);
+		int recv_err = tftp_receive_data(nc, &received_len, NULL, 0, &opts, &tftp_ota_sink, NULL);
 
 		netconn_disconnect(nc);
 		ESP_LOGI(TAG, "OTA TFTP receive data result %d, bytes %d", recv_err, received_len);
-		if (recv_err == ERR_OK) {
-			err = esp_ota_set_boot_partition(update_part);
-			if (err != ESP_OK) {
-				ESP_LOGE(TAG, "esp_ota_set_boot_partition failed! err=0x%x", err);
-				continue;
-			}
-
+		if (recv_err != ERR_OK) {
+			ota_writer_abort();
+			continue;
+		}
+		if (ota_writer_commit() == ESP_OK) {
 			esp_restart();
 		}
 	}
@@ -297,14 +443,63 @@ static char *tftp_get_field(int field, struct netbuf *netbuf)
 	return result;
 }
 
+static bool tftp_has_options(const struct tftp_options *opts)
+{
+	return opts->has_blksize || opts->has_windowsize || opts->has_tsize || opts->has_sha256;
+}
+
+/* Pick out the options that follow the filename and mode of a request. Unknown
+   options are ignored, and values out of range are clamped, as RFC 2347
+   allows the server to do.
+ */
+static void tftp_parse_options(struct netbuf *netbuf, struct tftp_options *opts)
+{
+	int field;
+	for (field = 2;; field += 2) {
+		char *name = tftp_get_field(field, netbuf);
+		char *value = tftp_get_field(field + 1, netbuf);
+		if (!name || !value) {
+			free(name);
+			free(value);
+			return;
+		}
+
+		unsigned long v = strtoul(value, NULL, 10);
+		if (!strcasecmp(name, "blksize") && v >= 8) {
+			opts->blksize = (v > TFTP_MAX_BLKSIZE) ? TFTP_MAX_BLKSIZE : v;
+			opts->has_blksize = true;
+		} else if (!strcasecmp(name, "windowsize") && v >= 1) {
+			opts->windowsize = (v > TFTP_MAX_WINDOWSIZE) ? TFTP_MAX_WINDOWSIZE : v;
+			opts->has_windowsize = true;
+		} else if (!strcasecmp(name, "tsize")) {
+			opts->tsize = v;
+			opts->has_tsize = true;
+		} else if (!strcasecmp(name, "sha256")) {
+			opts->has_sha256 = ota_writer_parse_digest(value, opts->sha256);
+		}
+		free(name);
+		free(value);
+	}
+}
+
 #define TFTP_TIMEOUT_RETRANSMITS 10
 
-static err_t tftp_receive_data(
-	struct netconn *nc, size_t *received_len, ip_addr_t *peer_addr, int peer_port, tftp_receive_cb receive_cb)
+/* Receive DATA blocks, ACKing once per window of opts->windowsize blocks.
+
+   With a window of more than one block, a block that isn't the next one
+   expected means either that data was lost or that the sender missed an ACK
+   and went back. Either way the sender restarts from the block after the
+   one named in the ACK, so the last block received in order is ACKed, once,
+   rather than for every stray block of the window.
+ */
+static err_t tftp_receive_data(struct netconn *nc, size_t *received_len, ip_addr_t *peer_addr, int peer_port,
+	const struct tftp_options *opts, const struct tftp_sink *sink, tftp_receive_cb receive_cb)
 {
 	*received_len = 0;
-	const int DATA_PACKET_SZ = 512 + 4; /*( packet size plus header */
-	int block = 1;
+	const int data_packet_sz = opts->blksize + 4; /* packet size plus header */
+	uint16_t block = 1;
+	int window = 0;
+	bool resynced = false;
 
 	struct netbuf *netbuf = 0;
 	int retries = TFTP_TIMEOUT_RETRANSMITS;
@@ -331,11 +526,17 @@ static err_t tftp_receive_data(
 		}
 
 		if (err == ERR_TIMEOUT) {
-			if (retries-- > 0 && block > 1) {
-				/* Retransmit the last ACK, wait for repeat data block.
-
-                 This doesn't work for the first block, have to time out and start again. */
-				tftp_send_ack(nc, block - 1);
+			if (retries-- > 0 && (block > 1 || !peer_addr)) {
+				/* Retransmit the last ACK, or the OACK, and wait for the sender to
+                 go back to the block after it.
+
+                 As a client this doesn't work for the first block, have to time out and start again. */
+				if (block == 1 && tftp_has_options(opts)) {
+					tftp_send_oack(nc, opts);
+				} else {
+					tftp_send_ack(nc, block - 1);
+				}
+				window = 0;
 				continue;
 			}
 			tftp_send_error(nc, TFTP_ERR_ILLEGAL, "Timeout");
@@ -355,18 +556,18 @@ static err_t tftp_receive_data(
 		uint16_t client_block = netbuf_read_u16_n(netbuf, 2);
 		if (client_block != block) {
 			netbuf_delete(netbuf);
-			if (client_block == block - 1) {
-				/* duplicate block, means our ack got lost */
+			/* In lock-step, a duplicate block means our ack got lost */
+			if (!resynced || opts->windowsize == 1) {
 				tftp_send_ack(nc, block - 1);
-				continue;
-			} else {
-				tftp_send_error(nc, TFTP_ERR_ILLEGAL, "Block# out of order");
-				return ERR_VAL;
+				resynced = true;
 			}
+			window = 0;
+			continue;
 		}
 
 		/* Reset retry count if we got valid data */
 		retries = TFTP_TIMEOUT_RETRANSMITS;
+		resynced = false;
 
 		/* One UDP packet can be more than one netbuf segment, so iterate all the
            segments in the netbuf and write them to flash
@@ -384,9 +585,12 @@ static err_t tftp_receive_data(
 				first_chunk = false;
 			}
 
-			err = esp_ota_write(update_handle, chunk, chunk_len);
-			if (err != ESP_OK) {
-				ESP_LOGE(TAG, "Error: esp_ota_write failed! err=0x%x", err);
+			/* Returns once the data is buffered, flash is written in the background */
+			esp_err_t write_err = sink->write(chunk, chunk_len);
+			if (write_err != ESP_OK) {
+				ESP_LOGE(TAG, "Error: write failed! err=0x%x", write_err);
+				netbuf_delete(netbuf);
+				tftp_send_error(nc, TFTP_ERR_FULL, sink->error_message(write_err, false));
 				return ERR_VAL;
 			}
 
@@ -395,40 +599,298 @@ static err_t tftp_receive_data(
 		netbuf_delete(netbuf);
 
 		*received_len += len - 4;
-
-		//        if(len < DATA_PACKET_SZ) {
-		//            /* This was the last block, but verify the image before we ACK
-		//               it so the client gets an indication if things were successful.
-		//            */
-		//            const char *err = "Unknown validation error";
-		//            uint32_t image_length;
-		//            if(!rboot_verify_image(start_offs, &image_length, &err)
-		//               || image_length != *received_len) {
-		//                tftp_send_error(nc, TFTP_ERR_ILLEGAL, err);
-		//                return ERR_VAL;
-		//            }
-		//        }
-
-		err_t ack_err = tftp_send_ack(nc, block);
-		if (ack_err != ERR_OK) {
-			ESP_LOGE(__func__, "OTA TFTP failed to send ACK.");
-			return ack_err;
+		window++;
+
+		if (len < data_packet_sz) {
+			/* This was the last block, but wait for it to reach flash and verify
+               the image before we ACK it so the client gets an indication if
+               things were successful.
+            */
+			esp_err_t verify_err = sink->finish();
+			if (verify_err != ESP_OK) {
+				tftp_send_error(nc, TFTP_ERR_ILLEGAL, sink->error_message(verify_err, true));
+				return ERR_VAL;
+			}
 		}
 
-		// Make sure ack was successful before calling callback.
-		if (receive_cb) {
-			receive_cb(*received_len);
+		if (len < data_packet_sz || window == opts->windowsize) {
+			err_t ack_err = tftp_send_ack(nc, block);
+			if (ack_err != ERR_OK) {
+				ESP_LOGE(__func__, "OTA TFTP failed to send ACK.");
+				return ack_err;
+			}
+			window = 0;
+
+			// Make sure ack was successful before calling callback.
+			if (receive_cb) {
+				receive_cb(*received_len);
+			}
 		}
 
-		if (len < DATA_PACKET_SZ) {
+		if (len < data_packet_sz) {
 			return ERR_OK;
 		}
 
+		/* Block numbers roll over to 0 past 65535 */
 		block++;
 	}
 }
 
-static err_t tftp_send_ack(struct netconn *nc, int block)
+/* Answer an RRQ for one of the target files */
+static void tftp_serve_target_file(struct netconn *nc, const char *filename, struct tftp_options *opts)
+{
+	uint32_t size;
+
+	esp_err_t err = target_file_open(filename, &size);
+	if (err != ESP_OK) {
+		tftp_send_error(nc, TFTP_ERR_FILENOTFOUND,
+			(err == ESP_ERR_NOT_FOUND) ? "No such file, or no target" : "Unable to read the target");
+		return;
+	}
+
+	/* The request's tsize is 0, the answer is the size of the file */
+	opts->tsize = size;
+	/* Only meaningful for uploads */
+	opts->has_sha256 = false;
+
+	ESP_LOGI(TAG, "sending %s, %u bytes with blksize %u, windowsize %u", filename, size, opts->blksize,
+		opts->windowsize);
+	int64_t start = esp_timer_get_time();
+	err_t send_err = tftp_send_file(nc, opts, size);
+	target_file_close();
+	if (send_err == ERR_OK) {
+		ESP_LOGI(TAG, "sent %s in %u ms", filename, (uint32_t)((esp_timer_get_time() - start) / 1000));
+	}
+}
+
+/* Answer a WRQ for one of the target files by programming it into flash */
+static void tftp_create_target_file(struct netconn *nc, const char *filename, struct tftp_options *opts)
+{
+	/* The flash is checked with a CRC of its own */
+	opts->has_sha256 = false;
+
+	esp_err_t err = target_file_create(filename, opts->tsize);
+	if (err != ESP_OK) {
+		if (err == ESP_ERR_INVALID_SIZE) {
+			tftp_send_error(nc, TFTP_ERR_FULL, "Image is larger than the target's flash");
+		} else {
+			tftp_send_error(nc, TFTP_ERR_FILENOTFOUND,
+				(err == ESP_ERR_NOT_FOUND) ? "No such file, or no target" : "Unable to program the target");
+		}
+		return;
+	}
+
+	int ack_err = tftp_has_options(opts) ? tftp_send_oack(nc, opts) : tftp_send_ack(nc, 0);
+	if (ack_err != 0) {
+		ESP_LOGE(__func__, "OTA TFTP initial ACK failed");
+		target_file_close();
+		return;
+	}
+	ESP_LOGI(TAG, "programming %s, %u bytes with blksize %u, windowsize %u", filename, opts->tsize, opts->blksize,
+		opts->windowsize);
+
+	size_t received_len;
+	int64_t start = esp_timer_get_time();
+	netconn_set_recvtimeout(nc, 10000);
+	err_t recv_err = tftp_receive_data(nc, &received_len, NULL, 0, opts, &tftp_target_sink, NULL);
+	if (recv_err != ERR_OK) {
+		/* Harmless if the data was all received, and the commit failed */
+		target_file_close();
+		return;
+	}
+	ESP_LOGI(TAG, "programmed %s, %u bytes in %u ms", filename, received_len,
+		(uint32_t)((esp_timer_get_time() - start) / 1000));
+}
+
+/* Answer a WRQ for webui.bin by writing it to the web UI partition, which
+   is mounted again once it checks out */
+static void tftp_update_webui(struct netconn *nc, struct tftp_options *opts)
+{
+	/* The image carries a SHA-256 of its own */
+	opts->has_sha256 = false;
+
+	esp_err_t err = webui_update_begin(opts->tsize);
+	if (err != ESP_OK) {
+		if (err == ESP_ERR_INVALID_SIZE) {
+			tftp_send_error(nc, TFTP_ERR_FULL, "Image is larger than the web UI partition");
+		} else {
+			tftp_send_error(nc, TFTP_ERR_ILLEGAL, "Unable to update the web UI");
+		}
+		return;
+	}
+
+	int ack_err = tftp_has_options(opts) ? tftp_send_oack(nc, opts) : tftp_send_ack(nc, 0);
+	if (ack_err != 0) {
+		ESP_LOGE(__func__, "OTA TFTP initial ACK failed");
+		webui_update_abort();
+		return;
+	}
+	ESP_LOGI(TAG, "receiving web UI, %u bytes with blksize %u, windowsize %u", opts->tsize, opts->blksize,
+		opts->windowsize);
+
+	size_t received_len;
+	int64_t start = esp_timer_get_time();
+	netconn_set_recvtimeout(nc, 10000);
+	err_t recv_err = tftp_receive_data(nc, &received_len, NULL, 0, opts, &tftp_webui_sink, NULL);
+	if (recv_err != ERR_OK) {
+		/* Harmless if the data was all received, and the check failed */
+		webui_update_abort();
+		return;
+	}
+	ESP_LOGI(TAG, "updated web UI, %u bytes in %u ms", received_len,
+		(uint32_t)((esp_timer_get_time() - start) / 1000));
+}
+
+static err_t tftp_send_data(struct netconn *nc, uint16_t block, const uint8_t *data, size_t len)
+{
+	struct netbuf *resp = netbuf_new();
+	uint16_t *data_buf = (uint16_t *)netbuf_alloc(resp, 4 + len);
+	if (!data_buf) {
+		netbuf_delete(resp);
+		return ERR_MEM;
+	}
+	data_buf[0] = htons(TFTP_OP_DATA);
+	data_buf[1] = htons(block);
+	memcpy(&data_buf[2], data, len);
+	err_t err = netconn_send(nc, resp);
+	netbuf_delete(resp);
+	return err;
+}
+
+/* Wait for an ACK, returning its block number. -1 on timeout or for any
+   other packet, such as the request again when the OACK was lost, and -2 if
+   the client sent an error.
+ */
+static int tftp_wait_ack(struct netconn *nc)
+{
+	struct netbuf *netbuf;
+
+	if (netconn_recv(nc, &netbuf) != ERR_OK) {
+		return -1;
+	}
+	uint16_t opcode = (netbuf_len(netbuf) >= 4) ? netbuf_read_u16_n(netbuf, 0) : 0;
+	uint16_t block = netbuf_read_u16_n(netbuf, 2);
+	netbuf_delete(netbuf);
+	if (opcode == TFTP_OP_ACK) {
+		return block;
+	}
+	return (opcode == TFTP_OP_ERROR) ? -2 : -1;
+}
+
+/* Send the open target file a window of opts->windowsize blocks at a time.
+
+   Block n holds the file from (n - 1) * blksize, and the first block shorter
+   than blksize, which may be empty, ends the transfer. The blocks of the
+   current window stay in `window` until they are ACKed. An ACK for part of
+   a window moves the window up to the block after it and sends from there,
+   which also covers blocks lost on the way, as RFC 7440 describes.
+
+   A client that lost a block may ACK the one before it for every block of
+   the window that follows, so a duplicate ACK only sends the window again
+   if the window has been out for a while. Otherwise each resend would set
+   off a burst of resends.
+ */
+static err_t tftp_send_file(struct netconn *nc, const struct tftp_options *opts, uint32_t size)
+{
+	const uint32_t last_block = size / opts->blksize + 1;
+	const size_t window_size = (size_t)opts->blksize * opts->windowsize;
+	uint32_t base = 1; /* first block of the window, counted past 65535 */
+	size_t window_len = 0;
+	int retries = TFTP_TIMEOUT_RETRANSMITS;
+	bool send = true;
+	int64_t sent_us = 0;
+	int ack;
+
+	netconn_set_recvtimeout(nc, TFTP_ACK_TIMEOUT_MS);
+
+	if (tftp_has_options(opts)) {
+		/* Data starts once the client ACKs block 0 */
+		do {
+			if (retries-- == 0) {
+				tftp_send_error(nc, TFTP_ERR_ILLEGAL, "Timeout");
+				return ERR_TIMEOUT;
+			}
+			tftp_send_oack(nc, opts);
+			ack = tftp_wait_ack(nc);
+			if (ack == -2) {
+				return ERR_ABRT;
+			}
+		} while (ack != 0);
+		retries = TFTP_TIMEOUT_RETRANSMITS;
+	}
+
+	uint8_t *window = malloc(window_size);
+	if (!window) {
+		tftp_send_error(nc, TFTP_ERR_ILLEGAL, "Out of memory");
+		return ERR_MEM;
+	}
+
+	err_t err = ERR_OK;
+	while (1) {
+		uint32_t count = MIN(opts->windowsize, last_block - base + 1);
+
+		if (send) {
+			/* Top the window up from the reader, which has been reading ahead
+               while the last window was in flight */
+			size_t copied;
+			if (target_file_read(window + window_len, window_size - window_len, &copied) != ESP_OK) {
+				tftp_send_error(nc, TFTP_ERR_ILLEGAL, "Target read failed");
+				err = ERR_VAL;
+				break;
+			}
+			window_len += copied;
+
+			uint32_t i;
+			for (i = 0; i < count && err == ERR_OK; i++) {
+				size_t offset = (size_t)i * opts->blksize;
+				size_t len = (window_len > offset) ? MIN(window_len - offset, opts->blksize) : 0;
+				err = tftp_send_data(nc, base + i, window + offset, len);
+			}
+			if (err != ERR_OK) {
+				break;
+			}
+			sent_us = esp_timer_get_time();
+		}
+
+		ack = tftp_wait_ack(nc);
+		if (ack == -2) {
+			err = ERR_ABRT;
+			break;
+		}
+		if (ack == -1) {
+			if (retries-- == 0) {
+				tftp_send_error(nc, TFTP_ERR_ILLEGAL, "Timeout");
+				err = ERR_TIMEOUT;
+				break;
+			}
+			send = true;
+			continue;
+		}
+
+		/* Blocks of this window the ACK covers, allowing for block numbers
+           wrapping around */
+		uint32_t acked = (uint16_t)(ack - (uint16_t)(base - 1));
+		if (acked == 0 || acked > count) {
+			send = esp_timer_get_time() - sent_us > TFTP_DUP_ACK_HOLDOFF_MS * 1000;
+			continue;
+		}
+		retries = TFTP_TIMEOUT_RETRANSMITS;
+		send = true;
+
+		base += acked;
+		if (base > last_block) {
+			break;
+		}
+		size_t consumed = MIN((size_t)acked * opts->blksize, window_len);
+		memmove(window, window + consumed, window_len - consumed);
+		window_len -= consumed;
+	}
+
+	free(window);
+	return err;
+}
+
+static err_t tftp_send_ack(struct netconn *nc, uint16_t block)
 {
 	/* Send ACK */
 	struct netbuf *resp = netbuf_new();
@@ -440,6 +902,39 @@ static err_t tftp_send_ack(struct netconn *nc, int block)
 	return ack_err;
 }
 
+static err_t tftp_send_oack(struct netconn *nc, const struct tftp_options *opts)
+{
+	char options[128];
+	int len = 0;
+	int i;
+
+	/* Each option is echoed back as a pair of NUL terminated strings */
+	if (opts->has_blksize) {
+		len += snprintf(options + len, sizeof(options) - len, "blksize%c%u", 0, opts->blksize) + 1;
+	}
+	if (opts->has_windowsize) {
+		len += snprintf(options + len, sizeof(options) - len, "windowsize%c%u", 0, opts->windowsize) + 1;
+	}
+	if (opts->has_tsize) {
+		len += snprintf(options + len, sizeof(options) - len, "tsize%c%u", 0, opts->tsize) + 1;
+	}
+	if (opts->has_sha256) {
+		len += snprintf(options + len, sizeof(options) - len, "sha256%c", 0) + 1;
+		for (i = 0; i < OTA_WRITER_DIGEST_SIZE; i++) {
+			len += snprintf(options + len, sizeof(options) - len, "%02x", opts->sha256[i]);
+		}
+		options[len++] = '\0';
+	}
+
+	struct netbuf *resp = netbuf_new();
+	uint16_t *oack_buf = (uint16_t *)netbuf_alloc(resp, 2 + len);
+	oack_buf[0] = htons(TFTP_OP_OACK);
+	memcpy(&oack_buf[1], options, len);
+	err_t err = netconn_send(nc, resp);
+	netbuf_delete(resp);
+	return err;
+}
+
 static void tftp_send_error(struct netconn *nc, int err_code, const char *err_msg)
 {
 	ESP_LOGE(__func__, "OTA TFTP Error: %s", err_msg);
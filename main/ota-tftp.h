@@ -26,6 +26,36 @@ typedef void (*tftp_receive_cb)(size_t bytes_received);
  * TFTP protocol implemented as per RFC1350:
  * https://tools.ietf.org/html/rfc1350
  *
+ * Uploads may negotiate larger blocks (RFC2348, up to one unfragmented
+ * frame), several blocks per ACK (RFC7440) and the image size (RFC2349),
+ * which is checked against the OTA partition before any data is accepted.
+ * A "sha256" option with the hex digest of the file is checked before the
+ * final ACK; without it, the digest esptool appends to the image is used:
+ * curl -T firmware/myprogram.bin --tftp-blksize 1468 tftp://ESP_IP/firmware.bin
+ *
+ * A gzip compressed image (gzip -9 -c myprogram.bin > myprogram.bin.gz) is
+ * inflated as it arrives, and may be sent as either firmware.bin or
+ * firmware.bin.gz. tsize is then the compressed size, and sha256 the digest
+ * of the uncompressed image.
+ *
+ * A patch from tools/ota_delta.py is also accepted in place of an image,
+ * compressed or not, and rebuilds the new image from the running one.
+ *
+ * The same server answers read requests for the target's memory, see
+ * target_file.h. Reads negotiate blksize and windowsize the same way, and
+ * tsize comes back as the size of the file:
+ * curl --tftp-blksize 1468 -o flash.bin tftp://ESP_IP/target/flash.bin
+ * curl -o ram.bin 'tftp://ESP_IP/target/mem@0x20000000+0x10000'
+ *
+ * Writing target/flash.bin or target/flash@ADDR programs the target's flash
+ * instead. The image is read back and its CRC checked before the final ACK,
+ * then the target is reset. sha256 is not used:
+ * curl --tftp-blksize 1468 -T image.bin tftp://ESP_IP/target/flash@0x08000000
+ *
+ * webui.bin from the build replaces the web UI, which is checked against its
+ * own SHA-256 and mounted before the final ACK. No reboot is needed:
+ * curl --tftp-blksize 1468 -T build/webui.bin tftp://ESP_IP/webui.bin
+ *
  * IMPORTANT: TFTP is not a secure protocol.
  * Only allow TFTP OTA updates on trusted networks.
  *
@@ -46,7 +76,9 @@ void ota_tftp_init_server(int listen_port, int prio);
 
    Returns 0 on success, LWIP err.h values for errors.
 
-   Does not change the current firmware slot, or reboot.
+   Does not change the current firmware slot, or reboot. On success the
+   update is left finished, so call ota_writer_commit() to boot it or
+   ota_writer_abort() to keep the current one.
 
    receive_cb: called repeatedly after each successful packet that
    has been written to flash and ACKed.  Can pass NULL to omit.
@@ -0,0 +1,250 @@
+/*
+ * Streaming delta patcher for firmware updates.
+ *
+ * The running image is mapped into the data address space, so reading it
+ * back for each diff byte costs no RAM and no flash driver calls. Patch
+ * data is consumed as it arrives: the only state kept between writes is the
+ * record being worked on and a partly received header.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+
+#include "ota_delta.h"
+
+#define TAG "ota-delta"
+
+#define OTA_DELTA_DIGEST_SIZE  32
+#define OTA_DELTA_HEADER_SIZE  (4 + 4 + OTA_DELTA_DIGEST_SIZE)
+#define OTA_DELTA_CONTROL_SIZE 12
+
+enum ota_delta_state {
+	OTA_DELTA_HEADER,
+	OTA_DELTA_CONTROL,
+	OTA_DELTA_DIFF,
+	OTA_DELTA_EXTRA,
+	OTA_DELTA_DONE,
+};
+
+struct ota_delta {
+	const esp_partition_t *source;
+	const uint8_t *source_map;
+	esp_partition_mmap_handle_t source_map_handle;
+	ota_delta_out_t out;
+	void *ctx;
+
+	enum ota_delta_state state;
+	/* The header or control record being received */
+	uint8_t fields[OTA_DELTA_HEADER_SIZE];
+	size_t fields_len;
+
+	uint32_t target_size;
+	uint32_t produced;
+	uint32_t source_pos;
+	uint32_t diff_left;
+	uint32_t extra_left;
+	int32_t seek;
+
+	uint8_t work[256];
+};
+
+static uint32_t ota_delta_u32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+bool ota_delta_detect(const uint8_t *data, size_t len)
+{
+	size_t magic_len = strlen(OTA_DELTA_MAGIC);
+	return !memcmp(data, OTA_DELTA_MAGIC, (len < magic_len) ? len : magic_len);
+}
+
+struct ota_delta *ota_delta_new(const esp_partition_t *source, ota_delta_out_t out, void *ctx)
+{
+	struct ota_delta *delta = calloc(1, sizeof(*delta));
+	if (!delta) {
+		return NULL;
+	}
+
+	esp_err_t err = esp_partition_mmap(source, 0, source->size, ESP_PARTITION_MMAP_DATA,
+		(const void **)&delta->source_map, &delta->source_map_handle);
+	if (err != ESP_OK) {
+		ESP_LOGE(TAG, "unable to map the source partition: %s", esp_err_to_name(err));
+		free(delta);
+		return NULL;
+	}
+	delta->source = source;
+	delta->out = out;
+	delta->ctx = ctx;
+	delta->state = OTA_DELTA_HEADER;
+	return delta;
+}
+
+/* Collect the fixed size header or control record, returning how many
+   bytes of `data` were used */
+static size_t ota_delta_fields(struct ota_delta *delta, const uint8_t *data, size_t len, size_t size)
+{
+	size_t count = size - delta->fields_len;
+	if (count > len) {
+		count = len;
+	}
+	memcpy(delta->fields + delta->fields_len, data, count);
+	delta->fields_len += count;
+	return count;
+}
+
+static esp_err_t ota_delta_check_header(struct ota_delta *delta)
+{
+	uint8_t source_digest[OTA_DELTA_DIGEST_SIZE];
+
+	if (memcmp(delta->fields, OTA_DELTA_MAGIC, 4)) {
+		ESP_LOGE(TAG, "not a delta patch");
+		return ESP_ERR_INVALID_ARG;
+	}
+	delta->target_size = ota_delta_u32(delta->fields + 4);
+
+	/* For an app partition this is the digest appended to the image */
+	esp_err_t err = esp_partition_get_sha256(delta->source, source_digest);
+	if (err != ESP_OK) {
+		ESP_LOGE(TAG, "unable to hash the running image: %s", esp_err_to_name(err));
+		return err;
+	}
+	if (memcmp(source_digest, delta->fields + 8, OTA_DELTA_DIGEST_SIZE)) {
+		ESP_LOGE(TAG, "patch was made for a different image");
+		return ESP_ERR_INVALID_VERSION;
+	}
+	ESP_LOGI(TAG, "patching running image to a %u byte image", delta->target_size);
+	return ESP_OK;
+}
+
+static esp_err_t ota_delta_check_control(struct ota_delta *delta)
+{
+	delta->diff_left = ota_delta_u32(delta->fields);
+	delta->extra_left = ota_delta_u32(delta->fields + 4);
+	delta->seek = (int32_t)ota_delta_u32(delta->fields + 8);
+
+	if (delta->diff_left + (uint64_t)delta->extra_left > delta->target_size - delta->produced) {
+		ESP_LOGE(TAG, "record goes past the end of the image");
+		return ESP_ERR_INVALID_SIZE;
+	}
+	if (delta->source_pos + (uint64_t)delta->diff_left > delta->source->size) {
+		ESP_LOGE(TAG, "record reads past the end of the source");
+		return ESP_ERR_INVALID_SIZE;
+	}
+	return ESP_OK;
+}
+
+esp_err_t ota_delta_write(struct ota_delta *delta, const uint8_t *data, size_t len)
+{
+	esp_err_t err;
+	size_t count;
+	size_t i;
+
+	while (1) {
+		switch (delta->state) {
+		case OTA_DELTA_HEADER:
+		case OTA_DELTA_CONTROL: {
+			size_t size = (delta->state == OTA_DELTA_HEADER) ? OTA_DELTA_HEADER_SIZE : OTA_DELTA_CONTROL_SIZE;
+			count = ota_delta_fields(delta, data, len, size);
+			data += count;
+			len -= count;
+			if (delta->fields_len < size) {
+				return ESP_OK;
+			}
+			err = (delta->state == OTA_DELTA_HEADER) ? ota_delta_check_header(delta) : ota_delta_check_control(delta);
+			if (err != ESP_OK) {
+				return err;
+			}
+			delta->fields_len = 0;
+			delta->state = (delta->state == OTA_DELTA_HEADER) ? OTA_DELTA_CONTROL : OTA_DELTA_DIFF;
+			if (delta->target_size == 0) {
+				delta->state = OTA_DELTA_DONE;
+			}
+			break;
+		}
+
+		case OTA_DELTA_DIFF:
+			if (delta->diff_left == 0) {
+				delta->state = OTA_DELTA_EXTRA;
+				break;
+			}
+			if (len == 0) {
+				return ESP_OK;
+			}
+			count = len;
+			if (count > delta->diff_left) {
+				count = delta->diff_left;
+			}
+			if (count > sizeof(delta->work)) {
+				count = sizeof(delta->work);
+			}
+			for (i = 0; i < count; i++) {
+				delta->work[i] = delta->source_map[delta->source_pos + i] + data[i];
+			}
+			err = delta->out(delta->ctx, delta->work, count);
+			if (err != ESP_OK) {
+				return err;
+			}
+			delta->source_pos += count;
+			delta->diff_left -= count;
+			delta->produced += count;
+			data += count;
+			len -= count;
+			break;
+
+		case OTA_DELTA_EXTRA:
+			if (delta->extra_left == 0) {
+				if (delta->seek < 0 && (uint32_t)-delta->seek > delta->source_pos) {
+					ESP_LOGE(TAG, "record seeks before the start of the source");
+					return ESP_ERR_INVALID_SIZE;
+				}
+				delta->source_pos += delta->seek;
+				delta->state = (delta->produced == delta->target_size) ? OTA_DELTA_DONE : OTA_DELTA_CONTROL;
+				break;
+			}
+			if (len == 0) {
+				return ESP_OK;
+			}
+			count = len;
+			if (count > delta->extra_left) {
+				count = delta->extra_left;
+			}
+			err = delta->out(delta->ctx, data, count);
+			if (err != ESP_OK) {
+				return err;
+			}
+			delta->extra_left -= count;
+			delta->produced += count;
+			data += count;
+			len -= count;
+			break;
+
+		case OTA_DELTA_DONE:
+			if (len) {
+				ESP_LOGE(TAG, "unexpected data after the end of the patch");
+				return ESP_ERR_INVALID_SIZE;
+			}
+			return ESP_OK;
+		}
+	}
+}
+
+esp_err_t ota_delta_finish(struct ota_delta *delta)
+{
+	if (delta->state != OTA_DELTA_DONE) {
+		ESP_LOGE(TAG, "patch is truncated after %u of %u bytes", delta->produced, delta->target_size);
+		return ESP_ERR_INVALID_SIZE;
+	}
+	return ESP_OK;
+}
+
+void ota_delta_free(struct ota_delta *delta)
+{
+	if (!delta) {
+		return;
+	}
+	esp_partition_munmap(delta->source_map_handle);
+	free(delta);
+}
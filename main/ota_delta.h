@@ -0,0 +1,52 @@
+#ifndef FARPATCH_OTA_DELTA_H__
+#define FARPATCH_OTA_DELTA_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <esp_err.h>
+#include <esp_partition.h>
+
+/* A delta update rebuilds the new image from the one that is running,
+ * using a patch made by tools/ota_delta.py. All values are little endian.
+ *
+ *   char     magic[4]          "FPD1"
+ *   uint32_t target_size       size of the image the patch produces
+ *   uint8_t  source_sha256[32] digest of the image it must be applied to
+ *
+ * followed by records, in the same form as bsdiff, until target_size bytes
+ * have been produced:
+ *
+ *   uint32_t diff_len
+ *   uint32_t extra_len
+ *   int32_t  seek
+ *   uint8_t  diff[diff_len]    added bytewise to the source image
+ *   uint8_t  extra[extra_len]  copied as they are
+ *
+ * Each record reads the source image from where the last one left off,
+ * moved by its seek once the extra bytes are done. Diff bytes are mostly
+ * zero, so a patch is usually sent gzip compressed.
+ */
+#define OTA_DELTA_MAGIC "FPD1"
+
+struct ota_delta;
+typedef esp_err_t (*ota_delta_out_t)(void *ctx, const uint8_t *data, size_t len);
+
+/* True if `data` could be the start of a patch */
+bool ota_delta_detect(const uint8_t *data, size_t len);
+
+/* Start applying a patch to the image in `source`, passing the new image
+   to `out` as it is rebuilt */
+struct ota_delta *ota_delta_new(const esp_partition_t *source, ota_delta_out_t out, void *ctx);
+
+/* Feed patch data in pieces of any size. ESP_ERR_INVALID_VERSION if the
+   patch was made for a different source image. */
+esp_err_t ota_delta_write(struct ota_delta *delta, const uint8_t *data, size_t len);
+
+/* Checks the patch was complete */
+esp_err_t ota_delta_finish(struct ota_delta *delta);
+
+void ota_delta_free(struct ota_delta *delta);
+
+#endif /* FARPATCH_OTA_DELTA_H__ */
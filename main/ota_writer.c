@@ -0,0 +1,554 @@
+/*
+ * Pipelined firmware update writer.
+ *
+ * Erasing and programming flash takes milliseconds per sector, and doing it
+ * inline in the receive path adds that to every round trip of a transfer.
+ * Instead, incoming data is copied into one of a few large buffers, and a
+ * writer task erases and programs a whole buffer at a time while the next
+ * one fills up. The receiver only waits when every buffer is queued for
+ * flash, so an update runs at network or flash speed, whichever is lower.
+ *
+ * Sectors are erased as they are written, so the erase is spread over the
+ * transfer instead of happening all at once in esp_ota_begin().
+ *
+ * The writer task also feeds each buffer to the SHA accelerator after
+ * writing it. The image is checked against a digest supplied by the sender
+ * or, failing that, the one esptool appends to the image, so a good image
+ * doesn't need to be read back from flash by esp_ota_end(). The last 32
+ * bytes seen are held back from the hash, since they may turn out to be
+ * that appended digest.
+ *
+ * An update that starts with the gzip magic rather than the image magic is
+ * inflated on the way in. What comes out may in turn be a delta patch,
+ * which is applied against the running image. Either way the buffers, the
+ * hash and the checks all see the plain image.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+#include "esp_image_format.h"
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_timer.h"
+#include "mbedtls/sha256.h"
+
+#include "gzip_inflate.h"
+#include "ota_delta.h"
+#include "ota_writer.h"
+#include "websocket.h"
+
+#define TAG "ota-writer"
+
+#define OTA_WRITER_TASK_PRIO 3
+
+#define GZIP_MAGIC 0x1f
+
+/* Received bytes between progress reports */
+#define OTA_WRITER_PROGRESS_STEP (64 * 1024)
+
+struct ota_writer_block {
+	uint8_t *data;
+	size_t len;
+};
+
+enum ota_writer_state {
+	OTA_WRITER_IDLE,
+	OTA_WRITER_ACTIVE,
+	/* Written and verified, waiting for ota_writer_commit() */
+	OTA_WRITER_FINISHED,
+};
+
+static QueueHandle_t free_blocks;
+/* A block without data tells the writer task to signal writer_drained */
+static QueueHandle_t full_blocks;
+static SemaphoreHandle_t writer_drained;
+static TaskHandle_t writer_pid;
+
+static enum ota_writer_state writer_state;
+static portMUX_TYPE writer_state_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint8_t *block_memory;
+static struct ota_writer_block current;
+static esp_ota_handle_t update_handle;
+static const esp_partition_t *update_part;
+static volatile esp_err_t writer_err;
+static struct gzip_inflater *inflater;
+static struct ota_delta *delta;
+static size_t plain_received;
+static size_t update_size;
+static size_t progress_next;
+
+static mbedtls_sha256_context image_sha;
+static uint8_t image_tail[OTA_WRITER_DIGEST_SIZE];
+static size_t image_tail_len;
+static size_t image_written;
+static bool image_hash_appended;
+static bool expected_digest_set;
+static uint8_t expected_digest[OTA_WRITER_DIGEST_SIZE];
+
+static struct ota_writer_stats writer_stats;
+static int64_t update_start_us;
+static int64_t write_us;
+static int64_t stall_us;
+static int64_t hash_us;
+static int64_t inflate_us;
+
+/* Hash everything but the most recent OTA_WRITER_DIGEST_SIZE bytes */
+static void ota_writer_hash(const uint8_t *data, size_t len)
+{
+	if (len >= OTA_WRITER_DIGEST_SIZE) {
+		mbedtls_sha256_update(&image_sha, image_tail, image_tail_len);
+		mbedtls_sha256_update(&image_sha, data, len - OTA_WRITER_DIGEST_SIZE);
+		memcpy(image_tail, data + len - OTA_WRITER_DIGEST_SIZE, OTA_WRITER_DIGEST_SIZE);
+		image_tail_len = OTA_WRITER_DIGEST_SIZE;
+		return;
+	}
+
+	size_t spill = 0;
+	if (image_tail_len + len > OTA_WRITER_DIGEST_SIZE) {
+		spill = image_tail_len + len - OTA_WRITER_DIGEST_SIZE;
+	}
+	mbedtls_sha256_update(&image_sha, image_tail, spill);
+	memmove(image_tail, image_tail + spill, image_tail_len - spill);
+	image_tail_len -= spill;
+	memcpy(image_tail + image_tail_len, data, len);
+	image_tail_len += len;
+}
+
+static void ota_writer_progress(const char *state)
+{
+	char msg[128];
+	int len = snprintf(msg, sizeof(msg), "{\"state\":\"%s\",\"received\":%u,\"total\":%u,\"written\":%u}", state,
+		writer_stats.received, update_size, writer_stats.bytes);
+	http_term_broadcast_ota((uint8_t *)msg, len);
+}
+
+static void ota_writer_task(void *ignored)
+{
+	struct ota_writer_block block;
+
+	while (1) {
+		xQueueReceive(full_blocks, &block, portMAX_DELAY);
+		if (!block.data) {
+			xSemaphoreGive(writer_drained);
+			continue;
+		}
+
+		/* After a failure, keep recycling buffers so the receiver never blocks */
+		if (writer_err == ESP_OK) {
+			if (image_written == 0 && block.len >= sizeof(esp_image_header_t)) {
+				image_hash_appended = ((const esp_image_header_t *)block.data)->hash_appended == 1;
+			}
+
+			int64_t start = esp_timer_get_time();
+			esp_err_t err = esp_ota_write(update_handle, block.data, block.len);
+			int64_t written = esp_timer_get_time();
+			write_us += written - start;
+			if (err != ESP_OK) {
+				ESP_LOGE(TAG, "esp_ota_write failed: %s", esp_err_to_name(err));
+				writer_err = err;
+			} else {
+				ota_writer_hash(block.data, block.len);
+				image_written += block.len;
+				hash_us += esp_timer_get_time() - written;
+			}
+		}
+
+		block.len = 0;
+		xQueueSend(free_blocks, &block, portMAX_DELAY);
+	}
+}
+
+static esp_err_t ota_writer_start_task(void)
+{
+	if (writer_pid) {
+		return ESP_OK;
+	}
+	free_blocks = xQueueCreate(CONFIG_OTA_WRITER_BUFFERS, sizeof(struct ota_writer_block));
+	full_blocks = xQueueCreate(CONFIG_OTA_WRITER_BUFFERS + 1, sizeof(struct ota_writer_block));
+	writer_drained = xSemaphoreCreateBinary();
+	if (!free_blocks || !full_blocks || !writer_drained) {
+		return ESP_ERR_NO_MEM;
+	}
+	if (xTaskCreate(ota_writer_task, "ota_writer", 3072, NULL, OTA_WRITER_TASK_PRIO, &writer_pid) != pdPASS) {
+		return ESP_ERR_NO_MEM;
+	}
+	return ESP_OK;
+}
+
+/* Wait until the writer task has been through every queued block, then
+   release the buffers. The partly filled block is written out first if
+   `write_current` is set, or dropped otherwise.
+ */
+static void ota_writer_drain(bool write_current)
+{
+	struct ota_writer_block sentinel = {0};
+
+	if (write_current && current.len) {
+		xQueueSend(full_blocks, &current, portMAX_DELAY);
+	}
+	xQueueSend(full_blocks, &sentinel, portMAX_DELAY);
+	xSemaphoreTake(writer_drained, portMAX_DELAY);
+
+	xQueueReset(free_blocks);
+	memset(&current, 0, sizeof(current));
+	free(block_memory);
+	block_memory = NULL;
+}
+
+static void ota_writer_set_state(enum ota_writer_state state)
+{
+	portENTER_CRITICAL(&writer_state_lock);
+	writer_state = state;
+	portEXIT_CRITICAL(&writer_state_lock);
+}
+
+esp_err_t ota_writer_begin(size_t image_size)
+{
+	esp_err_t err;
+	int i;
+
+	portENTER_CRITICAL(&writer_state_lock);
+	/* A finished update still owns its partition until it is committed,
+	   which reads the whole image back */
+	bool busy = writer_state != OTA_WRITER_IDLE;
+	if (!busy) {
+		writer_state = OTA_WRITER_ACTIVE;
+	}
+	portEXIT_CRITICAL(&writer_state_lock);
+	if (busy) {
+		ESP_LOGE(TAG, "an update is already in progress");
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	err = ota_writer_start_task();
+	if (err != ESP_OK) {
+		goto fail;
+	}
+
+	update_part = esp_ota_get_next_update_partition(NULL);
+	if (!update_part) {
+		ESP_LOGE(TAG, "no OTA partition to update");
+		err = ESP_ERR_NOT_FOUND;
+		goto fail;
+	}
+	if (image_size > update_part->size) {
+		ESP_LOGE(TAG, "%u byte image doesn't fit in %u byte partition", image_size, update_part->size);
+		err = ESP_ERR_INVALID_SIZE;
+		goto fail;
+	}
+
+	block_memory = malloc(CONFIG_OTA_WRITER_BUFFERS * CONFIG_OTA_WRITER_BUFFER_SIZE);
+	if (!block_memory) {
+		ESP_LOGE(TAG, "unable to allocate %u byte write buffers",
+			CONFIG_OTA_WRITER_BUFFERS * CONFIG_OTA_WRITER_BUFFER_SIZE);
+		err = ESP_ERR_NO_MEM;
+		goto fail;
+	}
+
+	err = esp_ota_begin(update_part, OTA_WITH_SEQUENTIAL_WRITES, &update_handle);
+	if (err != ESP_OK) {
+		ESP_LOGE(TAG, "esp_ota_begin failed: %s", esp_err_to_name(err));
+		free(block_memory);
+		block_memory = NULL;
+		goto fail;
+	}
+
+	for (i = 0; i < CONFIG_OTA_WRITER_BUFFERS; i++) {
+		struct ota_writer_block block = {
+			.data = block_memory + i * CONFIG_OTA_WRITER_BUFFER_SIZE,
+		};
+		xQueueSend(free_blocks, &block, 0);
+	}
+	xQueueReceive(free_blocks, &current, 0);
+
+	mbedtls_sha256_init(&image_sha);
+	mbedtls_sha256_starts(&image_sha, 0);
+	image_tail_len = 0;
+	image_written = 0;
+	image_hash_appended = false;
+	expected_digest_set = false;
+
+	writer_err = ESP_OK;
+	writer_stats.updates++;
+	writer_stats.bytes = 0;
+	writer_stats.received = 0;
+	writer_stats.compressed = false;
+	writer_stats.delta = false;
+	plain_received = 0;
+	update_size = image_size;
+	progress_next = OTA_WRITER_PROGRESS_STEP;
+	writer_stats.elapsed_ms = 0;
+	writer_stats.stalls = 0;
+	writer_stats.digest = OTA_WRITER_DIGEST_NONE;
+	writer_stats.commit_ms = 0;
+	write_us = 0;
+	stall_us = 0;
+	hash_us = 0;
+	inflate_us = 0;
+	update_start_us = esp_timer_get_time();
+	ESP_LOGI(TAG, "writing to partition at 0x%08x", update_part->address);
+	ota_writer_progress("receiving");
+	return ESP_OK;
+
+fail:
+	writer_stats.failures++;
+	ota_writer_set_state(OTA_WRITER_IDLE);
+	return err;
+}
+
+/* Copy plain image data into the buffers, handing each one to the writer
+   task as it fills up */
+static esp_err_t ota_writer_queue(void *ctx, const uint8_t *src, size_t len)
+{
+	while (len > 0) {
+		if (writer_err != ESP_OK) {
+			return writer_err;
+		}
+
+		size_t count = CONFIG_OTA_WRITER_BUFFER_SIZE - current.len;
+		if (count > len) {
+			count = len;
+		}
+		memcpy(current.data + current.len, src, count);
+		current.len += count;
+		src += count;
+		len -= count;
+		writer_stats.bytes += count;
+
+		if (current.len == CONFIG_OTA_WRITER_BUFFER_SIZE) {
+			xQueueSend(full_blocks, &current, portMAX_DELAY);
+			if (xQueueReceive(free_blocks, &current, 0) != pdTRUE) {
+				int64_t start = esp_timer_get_time();
+				xQueueReceive(free_blocks, &current, portMAX_DELAY);
+				stall_us += esp_timer_get_time() - start;
+				writer_stats.stalls++;
+			}
+		}
+	}
+	return writer_err;
+}
+
+/* Take data once it has been inflated, and apply it as a patch if it is one */
+static esp_err_t ota_writer_plain(void *ctx, const uint8_t *data, size_t len)
+{
+	if (plain_received == 0 && len && ota_delta_detect(data, len)) {
+		delta = ota_delta_new(esp_ota_get_running_partition(), ota_writer_queue, NULL);
+		if (!delta) {
+			return ESP_ERR_NO_MEM;
+		}
+		writer_stats.delta = true;
+	}
+	plain_received += len;
+
+	if (!delta) {
+		return ota_writer_queue(NULL, data, len);
+	}
+	return ota_delta_write(delta, data, len);
+}
+
+esp_err_t ota_writer_write(const void *data, size_t len)
+{
+	if (writer_state != OTA_WRITER_ACTIVE) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	if (len == 0) {
+		return writer_err;
+	}
+
+	if (writer_stats.received == 0 && ((const uint8_t *)data)[0] == GZIP_MAGIC) {
+		inflater = gzip_inflater_new(ota_writer_plain, NULL);
+		if (!inflater) {
+			return ESP_ERR_NO_MEM;
+		}
+		writer_stats.compressed = true;
+	}
+	writer_stats.received += len;
+	if (writer_stats.received >= progress_next) {
+		progress_next += OTA_WRITER_PROGRESS_STEP;
+		ota_writer_progress("receiving");
+	}
+
+	if (!inflater) {
+		return ota_writer_plain(NULL, data, len);
+	}
+	/* Waiting for a free buffer doesn't count as time spent inflating */
+	int64_t start = esp_timer_get_time() - stall_us;
+	esp_err_t err = gzip_inflater_write(inflater, data, len);
+	inflate_us += esp_timer_get_time() - stall_us - start;
+	return err;
+}
+
+static void ota_writer_free_stages(void)
+{
+	gzip_inflater_free(inflater);
+	inflater = NULL;
+	ota_delta_free(delta);
+	delta = NULL;
+}
+
+static int ota_writer_hex_digit(char c)
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	c |= 0x20;
+	if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+	return -1;
+}
+
+bool ota_writer_parse_digest(const char *hex, uint8_t digest[OTA_WRITER_DIGEST_SIZE])
+{
+	int i;
+	if (strlen(hex) != OTA_WRITER_DIGEST_SIZE * 2) {
+		return false;
+	}
+	for (i = 0; i < OTA_WRITER_DIGEST_SIZE; i++) {
+		int hi = ota_writer_hex_digit(hex[i * 2]);
+		int lo = ota_writer_hex_digit(hex[i * 2 + 1]);
+		if (hi < 0 || lo < 0) {
+			return false;
+		}
+		digest[i] = (hi << 4) | lo;
+	}
+	return true;
+}
+
+void ota_writer_set_digest(const uint8_t digest[OTA_WRITER_DIGEST_SIZE])
+{
+	memcpy(expected_digest, digest, OTA_WRITER_DIGEST_SIZE);
+	expected_digest_set = true;
+}
+
+/* Compare the hash of what was written with the digest we were given, or
+   the one at the end of the image. ESP_ERR_NOT_SUPPORTED if there is neither.
+ */
+static esp_err_t ota_writer_check_digest(void)
+{
+	uint8_t digest[OTA_WRITER_DIGEST_SIZE];
+	const uint8_t *expected;
+
+	if (expected_digest_set) {
+		/* The sender's digest covers the whole file, tail included */
+		mbedtls_sha256_update(&image_sha, image_tail, image_tail_len);
+		expected = expected_digest;
+		writer_stats.digest = OTA_WRITER_DIGEST_SENDER;
+	} else if (image_hash_appended && image_tail_len == OTA_WRITER_DIGEST_SIZE) {
+		expected = image_tail;
+		writer_stats.digest = OTA_WRITER_DIGEST_APPENDED;
+	} else {
+		writer_stats.digest = OTA_WRITER_DIGEST_NONE;
+		return ESP_ERR_NOT_SUPPORTED;
+	}
+
+	mbedtls_sha256_finish(&image_sha, digest);
+	if (memcmp(digest, expected, sizeof(digest))) {
+		ESP_LOGE(TAG, "SHA-256 of the %u byte image doesn't match", image_written);
+		return ESP_ERR_INVALID_CRC;
+	}
+	return ESP_OK;
+}
+
+esp_err_t ota_writer_finish(void)
+{
+	if (writer_state != OTA_WRITER_ACTIVE) {
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	ota_writer_progress("verifying");
+
+	esp_err_t err = ESP_OK;
+	if (inflater) {
+		err = gzip_inflater_finish(inflater);
+	}
+	if (delta && err == ESP_OK) {
+		err = ota_delta_finish(delta);
+	}
+	ota_writer_free_stages();
+	ota_writer_drain(true);
+
+	if (err == ESP_OK) {
+		err = writer_err;
+	}
+	if (err == ESP_OK) {
+		err = ota_writer_check_digest();
+	}
+	if (err == ESP_ERR_NOT_SUPPORTED) {
+		/* Nothing to compare against, so have esp_ota_end() read the image
+		   back and check it. It releases the handle either way. */
+		err = esp_ota_end(update_handle);
+		if (err != ESP_OK) {
+			ESP_LOGE(TAG, "image verification failed: %s", esp_err_to_name(err));
+		}
+	} else {
+		/* Images end on a 16 byte boundary, so even with flash encryption
+		   esp_ota_end() would have nothing left to write. Skip its read back
+		   and just release the handle. This saves only one of two passes:
+		   esp_ota_set_boot_partition() in ota_writer_commit() still reads
+		   the whole image back and hashes it with esp_image_verify(). */
+		esp_ota_abort(update_handle);
+	}
+	mbedtls_sha256_free(&image_sha);
+
+	writer_stats.elapsed_ms = (esp_timer_get_time() - update_start_us) / 1000;
+	if (err != ESP_OK) {
+		writer_stats.failures++;
+		ota_writer_set_state(OTA_WRITER_IDLE);
+		ota_writer_progress("failed");
+		return err;
+	}
+
+	ota_writer_progress("verified");
+	ESP_LOGI(TAG, "wrote %u bytes in %u ms, %u ms of it programming flash, receiver stalled %u times",
+		writer_stats.bytes, writer_stats.elapsed_ms, (uint32_t)(write_us / 1000), writer_stats.stalls);
+	ota_writer_set_state(OTA_WRITER_FINISHED);
+	return ESP_OK;
+}
+
+esp_err_t ota_writer_commit(void)
+{
+	if (writer_state != OTA_WRITER_FINISHED) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	/* Verifies the image again, reading it all back from flash */
+	int64_t start_us = esp_timer_get_time();
+	esp_err_t err = esp_ota_set_boot_partition(update_part);
+	writer_stats.commit_ms = (esp_timer_get_time() - start_us) / 1000;
+	if (err != ESP_OK) {
+		ESP_LOGE(TAG, "esp_ota_set_boot_partition failed: %s", esp_err_to_name(err));
+	}
+	ota_writer_set_state(OTA_WRITER_IDLE);
+	return err;
+}
+
+void ota_writer_abort(void)
+{
+	if (writer_state == OTA_WRITER_ACTIVE) {
+		ota_writer_free_stages();
+		ota_writer_drain(false);
+		esp_ota_abort(update_handle);
+		mbedtls_sha256_free(&image_sha);
+		writer_stats.failures++;
+		writer_stats.elapsed_ms = (esp_timer_get_time() - update_start_us) / 1000;
+		ESP_LOGW(TAG, "update aborted after %u bytes", writer_stats.bytes);
+		ota_writer_progress("failed");
+	}
+	ota_writer_set_state(OTA_WRITER_IDLE);
+}
+
+void ota_writer_get_stats(struct ota_writer_stats *stats)
+{
+	*stats = writer_stats;
+	stats->write_ms = write_us / 1000;
+	stats->stall_ms = stall_us / 1000;
+	stats->hash_ms = hash_us / 1000;
+	stats->inflate_ms = inflate_us / 1000;
+}
@@ -0,0 +1,89 @@
+#ifndef FARPATCH_OTA_WRITER_H__
+#define FARPATCH_OTA_WRITER_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <esp_err.h>
+
+#define OTA_WRITER_DIGEST_SIZE 32
+
+enum ota_writer_digest {
+	/* Checked by esp_ota_end() reading the image back from flash */
+	OTA_WRITER_DIGEST_NONE,
+	/* SHA-256 given by the sender with ota_writer_set_digest() */
+	OTA_WRITER_DIGEST_SENDER,
+	/* SHA-256 that esptool appends to the image */
+	OTA_WRITER_DIGEST_APPENDED,
+};
+
+struct ota_writer_stats {
+	uint32_t updates;
+	uint32_t failures;
+	/* Bytes received and written by the most recent update, and how long it
+	   took from ota_writer_begin() until it was verified. They only differ
+	   for a compressed image. */
+	uint32_t received;
+	uint32_t bytes;
+	uint32_t elapsed_ms;
+	bool compressed;
+	/* Rebuilt from a patch against the running image */
+	bool delta;
+	/* Time the receiver spent decompressing */
+	uint32_t inflate_ms;
+	/* Time the writer task spent in esp_ota_write() for that update */
+	uint32_t write_ms;
+	/* Time the writer task spent hashing, and what the hash was checked against */
+	uint32_t hash_ms;
+	enum ota_writer_digest digest;
+	/* Time ota_writer_commit() took. esp_ota_set_boot_partition() reads the
+	   image back and checks it with esp_image_verify() whatever the digest. */
+	uint32_t commit_ms;
+	/* Times the receiver had to wait for a buffer to be written */
+	uint32_t stalls;
+	uint32_t stall_ms;
+};
+
+/* Start writing an image to the next OTA partition. `image_size` may be 0
+   if it isn't known. Only one update can be in progress at a time. Progress
+   is published on the websocket OTA channel as it goes.
+ */
+esp_err_t ota_writer_begin(size_t image_size);
+
+/* Expect the whole image, appended digest and all, to have this SHA-256.
+   For a compressed or delta update this is the digest of the image that
+   is finally written.
+   Without it, the digest at the end of the image is used if there is one.
+ */
+void ota_writer_set_digest(const uint8_t digest[OTA_WRITER_DIGEST_SIZE]);
+
+/* Decode a digest written as 64 hex digits */
+bool ota_writer_parse_digest(const char *hex, uint8_t digest[OTA_WRITER_DIGEST_SIZE]);
+
+/* Queue image data. Returns as soon as the data has been copied, unless
+   every buffer is waiting to be written to flash. A failure in the writer
+   task is reported by the next call. If the first byte written is the gzip
+   magic, the whole update is treated as a gzip stream. If the data (once
+   inflated) starts with OTA_DELTA_MAGIC, it is a patch against the running
+   image.
+ */
+esp_err_t ota_writer_write(const void *data, size_t len);
+
+/* Write out anything still buffered and verify the image. Does not change
+   the boot partition. ESP_ERR_INVALID_CRC if the digest doesn't match. No
+   other update can begin until this one is committed or aborted.
+ */
+esp_err_t ota_writer_finish(void);
+
+/* Boot the image from the last successful ota_writer_finish() on the next
+   restart.
+ */
+esp_err_t ota_writer_commit(void);
+
+/* Give up on the update in progress or the finished one, if there is one */
+void ota_writer_abort(void);
+
+void ota_writer_get_stats(struct ota_writer_stats *stats);
+
+#endif /* FARPATCH_OTA_WRITER_H__ */
@@ -0,0 +1,345 @@
+/*
+ * PC sampling over SWD.
+ *
+ * For boards without SWO, the DWT_PCSR register gives the same information
+ * as the DWT PC sample packets: every read returns the PC of a recently
+ * executed instruction. A timer wakes the sampler task at the requested
+ * rate, which reads DWT_PCSR and any extra words of target memory and
+ * pushes the result into a ring. A second task drains the ring into the
+ * profiler histogram and streams it as CSV to the /pcsample/stream
+ * websocket, one line per sample:
+ *
+ *   time_us,pc[,word0[,word1...]]
+ *
+ * The sampler only touches the target between GDB commands. If GDB keeps
+ * the debug port busy, samples are skipped and counted instead, so the
+ * achieved rate is reported alongside the requested one.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "general.h"
+#include "exception.h"
+#include "gdb_if.h"
+#include "gdb_packet.h"
+#include "target.h"
+#include "target_internal.h"
+
+#include "CBUF.h"
+#include "http.h"
+#include "pcsample.h"
+#include "profile.h"
+
+#define TAG "pcsample"
+
+#define DWT_PCSR 0xe000101c
+
+/* DWT_PCSR reads as all ones while the core is halted */
+#define PCSAMPLE_PC_HALTED 0xffffffff
+
+#define PCSAMPLE_DEFAULT_HZ 1000
+#define PCSAMPLE_MAX_HZ     20000
+
+/* How long the sampler waits for GDB to finish with the debug port */
+#define PCSAMPLE_LOCK_WAIT_MS 1
+
+/* How often the ring is drained, and the achieved rate worked out */
+#define PCSAMPLE_DRAIN_MS 50
+#define PCSAMPLE_RATE_WINDOW_MS 1000
+
+struct pcsample_entry {
+	uint32_t time_us;
+	uint32_t pc;
+	uint32_t words[PCSAMPLE_MAX_WATCH];
+};
+
+static struct {
+	volatile uint16_t m_get_idx;
+	volatile uint16_t m_put_idx;
+	struct pcsample_entry m_entry[256];
+} pcsample_ring;
+
+static TaskHandle_t sampler_pid;
+static TaskHandle_t drain_pid;
+static esp_timer_handle_t sampler_timer;
+
+static volatile bool sampler_running;
+static uint32_t sampler_rate;
+static uint32_t sampler_watch[PCSAMPLE_MAX_WATCH];
+static int sampler_watch_count;
+
+/* Statistics */
+static uint32_t pcsample_count;
+static uint32_t pcsample_busy;
+static uint32_t pcsample_halted;
+static uint32_t pcsample_errors;
+static uint32_t pcsample_overruns;
+static uint32_t pcsample_achieved;
+
+static target *pcsample_attached_target(void)
+{
+	target *t;
+	for (t = target_list; t; t = t->next) {
+		if (t->attached) {
+			return t;
+		}
+	}
+	return NULL;
+}
+
+static void pcsample_take(void)
+{
+	if (!platform_target_trylock(PCSAMPLE_LOCK_WAIT_MS)) {
+		pcsample_busy++;
+		return;
+	}
+
+	target *t = pcsample_attached_target();
+	if (!t) {
+		platform_target_unlock();
+		pcsample_halted++;
+		return;
+	}
+
+	struct pcsample_entry sample;
+	struct exception e;
+	int i;
+
+	sample.time_us = esp_timer_get_time();
+	TRY_CATCH (e, EXCEPTION_ALL) {
+		sample.pc = target_mem_read32(t, DWT_PCSR);
+		for (i = 0; i < sampler_watch_count; i++) {
+			sample.words[i] = target_mem_read32(t, sampler_watch[i]);
+		}
+	}
+	bool failed = e.type || target_check_error(t);
+	platform_target_unlock();
+
+	if (failed) {
+		pcsample_errors++;
+		return;
+	}
+	if (sample.pc == PCSAMPLE_PC_HALTED) {
+		pcsample_halted++;
+		return;
+	}
+	if (CBUF_Space(pcsample_ring) == 0) {
+		pcsample_overruns++;
+		return;
+	}
+	*CBUF_GetPushEntryPtr(pcsample_ring) = sample;
+	CBUF_AdvancePushIdx(pcsample_ring);
+	pcsample_count++;
+}
+
+static void pcsample_task(void *arg)
+{
+	(void)arg;
+	void *tls[2] = {};
+	vTaskSetThreadLocalStoragePointer(NULL, GDB_TLS_INDEX, tls); // used for exception handling
+
+	while (1) {
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		if (sampler_running) {
+			pcsample_take();
+		}
+	}
+}
+
+static void pcsample_timer_cb(void *arg)
+{
+	(void)arg;
+	xTaskNotifyGive(sampler_pid);
+}
+
+static void pcsample_drain_task(void *arg)
+{
+	(void)arg;
+	static char csv[1024];
+	uint32_t window_start = platform_time_ms();
+	uint32_t window_count = pcsample_count;
+
+	while (1) {
+		size_t len = 0;
+
+		vTaskDelay(pdMS_TO_TICKS(PCSAMPLE_DRAIN_MS));
+
+		while (!CBUF_IsEmpty(pcsample_ring)) {
+			const struct pcsample_entry *sample = CBUF_GetPopEntryPtr(pcsample_ring);
+			int i;
+
+			profile_add_sample(sample->pc);
+
+			if (sizeof(csv) - len < 32 + 11 * PCSAMPLE_MAX_WATCH) {
+				http_term_broadcast_pcsample((uint8_t *)csv, len);
+				len = 0;
+			}
+			len += snprintf(csv + len, sizeof(csv) - len, "%u,0x%08x", sample->time_us, sample->pc);
+			for (i = 0; i < sampler_watch_count; i++) {
+				len += snprintf(csv + len, sizeof(csv) - len, ",0x%08x", sample->words[i]);
+			}
+			csv[len++] = '\n';
+			CBUF_AdvancePopIdx(pcsample_ring);
+		}
+		if (len) {
+			http_term_broadcast_pcsample((uint8_t *)csv, len);
+		}
+
+		uint32_t now = platform_time_ms();
+		if (now - window_start >= PCSAMPLE_RATE_WINDOW_MS) {
+			uint32_t count = pcsample_count;
+			pcsample_achieved = ((count - window_count) * 1000) / (now - window_start);
+			window_start = now;
+			window_count = count;
+		}
+	}
+}
+
+esp_err_t pcsample_start(uint32_t rate_hz, const uint32_t *watch, int watch_count)
+{
+	if (rate_hz == 0 || rate_hz > PCSAMPLE_MAX_HZ || watch_count > PCSAMPLE_MAX_WATCH) {
+		return ESP_ERR_INVALID_ARG;
+	}
+
+	if (!sampler_pid) {
+		const esp_timer_create_args_t timer_args = {
+			.callback = pcsample_timer_cb,
+			.name = "pcsample",
+		};
+		if (esp_timer_create(&timer_args, &sampler_timer) != ESP_OK) {
+			return ESP_ERR_NO_MEM;
+		}
+		CBUF_Init(pcsample_ring);
+		// Above GDB so that it gets the debug port as soon as GDB lets go
+		xTaskCreate(pcsample_task, "pcsample", 3072, NULL, 2, &sampler_pid);
+		xTaskCreate(pcsample_drain_task, "pcsample_drain", 3072, NULL, 1, &drain_pid);
+	}
+
+	pcsample_stop();
+
+	memcpy(sampler_watch, watch, watch_count * sizeof(*watch));
+	sampler_watch_count = watch_count;
+	sampler_rate = rate_hz;
+	pcsample_count = 0;
+	pcsample_busy = 0;
+	pcsample_halted = 0;
+	pcsample_errors = 0;
+	pcsample_overruns = 0;
+	pcsample_achieved = 0;
+	profile_reset();
+
+	sampler_running = true;
+	esp_timer_start_periodic(sampler_timer, 1000000 / rate_hz);
+	ESP_LOGI(TAG, "sampling at %u Hz with %d extra words", rate_hz, watch_count);
+	return ESP_OK;
+}
+
+void pcsample_stop(void)
+{
+	if (!sampler_running) {
+		return;
+	}
+	esp_timer_stop(sampler_timer);
+	sampler_running = false;
+}
+
+bool pcsample_running(void)
+{
+	return sampler_running;
+}
+
+static int pcsample_parse_watch(const char **args, int count, uint32_t *watch)
+{
+	int i;
+	for (i = 0; i < count && i < PCSAMPLE_MAX_WATCH; i++) {
+		watch[i] = strtoul(args[i], NULL, 0);
+	}
+	return i;
+}
+
+bool cmd_pcsample(target *t, int argc, const char **argv)
+{
+	(void)t;
+
+	if (argc >= 2 && !strcmp(argv[1], "start")) {
+		uint32_t rate = (argc > 2) ? strtoul(argv[2], NULL, 0) : PCSAMPLE_DEFAULT_HZ;
+		uint32_t watch[PCSAMPLE_MAX_WATCH];
+		int watch_count = (argc > 3) ? pcsample_parse_watch(argv + 3, argc - 3, watch) : 0;
+
+		if (pcsample_start(rate, watch, watch_count) != ESP_OK) {
+			gdb_outf("Unable to sample at %u Hz (maximum %u Hz, %u words)\n", rate, PCSAMPLE_MAX_HZ,
+				PCSAMPLE_MAX_WATCH);
+			return false;
+		}
+		gdb_outf("Sampling at %u Hz, see `monitor profile show`\n", rate);
+		return true;
+	}
+
+	if (argc >= 2 && !strcmp(argv[1], "stop")) {
+		pcsample_stop();
+		gdb_out("Sampling stopped\n");
+		return true;
+	}
+
+	if (argc < 2 || !strcmp(argv[1], "status")) {
+		gdb_outf("%s, requested %u Hz, achieved %u Hz\n", sampler_running ? "Running" : "Stopped", sampler_rate,
+			pcsample_achieved);
+		gdb_outf("samples %u, busy %u, halted %u, errors %u, overruns %u\n", pcsample_count, pcsample_busy,
+			pcsample_halted, pcsample_errors, pcsample_overruns);
+		return true;
+	}
+
+	gdb_out("usage: monitor pcsample [start [rate_hz [addr ...]] | stop | status]\n");
+	return false;
+}
+
+esp_err_t cgi_pcsample(httpd_req_t *req)
+{
+	char querystring[128];
+	char value[64];
+	char response[256];
+	int len;
+
+	if (httpd_req_get_url_query_str(req, querystring, sizeof(querystring)) == ESP_OK) {
+		if (httpd_query_key_value(querystring, "stop", value, sizeof(value)) == ESP_OK) {
+			pcsample_stop();
+		} else if (httpd_query_key_value(querystring, "rate", value, sizeof(value)) == ESP_OK) {
+			uint32_t rate = strtoul(value, NULL, 0);
+			uint32_t watch[PCSAMPLE_MAX_WATCH];
+			int watch_count = 0;
+
+			// Extra words are given as a comma separated list
+			if (httpd_query_key_value(querystring, "watch", value, sizeof(value)) == ESP_OK) {
+				char *save;
+				char *tok;
+				for (tok = strtok_r(value, ",", &save); tok && watch_count < PCSAMPLE_MAX_WATCH;
+					 tok = strtok_r(NULL, ",", &save)) {
+					watch[watch_count++] = strtoul(tok, NULL, 0);
+				}
+			}
+			if (pcsample_start(rate, watch, watch_count) != ESP_OK) {
+				httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "invalid sample rate");
+				return ESP_OK;
+			}
+		}
+	}
+
+	len = snprintf(response, sizeof(response),
+		"{\"running\": %s, \"rate\": %u, \"achieved\": %u, \"samples\": %u, \"busy\": %u, \"halted\": %u, "
+		"\"errors\": %u, \"overruns\": %u}",
+		sampler_running ? "true" : "false", sampler_rate, pcsample_achieved, pcsample_count, pcsample_busy,
+		pcsample_halted, pcsample_errors, pcsample_overruns);
+	httpd_resp_set_type(req, "text/json");
+	httpd_resp_send(req, response, len);
+	return ESP_OK;
+}
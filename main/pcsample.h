@@ -0,0 +1,27 @@
+#ifndef FARPATCH_PCSAMPLE_H__
+#define FARPATCH_PCSAMPLE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <esp_http_server.h>
+
+#include "target.h"
+
+/* Number of extra words that can be read alongside each PC sample */
+#define PCSAMPLE_MAX_WATCH 4
+
+/* Start sampling DWT_PCSR, plus `watch_count` words of target memory, at
+ * `rate_hz` samples per second.
+ */
+esp_err_t pcsample_start(uint32_t rate_hz, const uint32_t *watch, int watch_count);
+void pcsample_stop(void);
+bool pcsample_running(void);
+
+/* GDB `monitor pcsample` */
+bool cmd_pcsample(target *t, int argc, const char **argv);
+
+/* GET /pcsample reports and changes the sampler state */
+esp_err_t cgi_pcsample(httpd_req_t *req);
+
+#endif /* FARPATCH_PCSAMPLE_H__ */
@@ -24,6 +24,7 @@
 #include "gdb_packet.h"
 #include "gdb_main.h"
 #include "target.h"
+#include "command.h"
 #include "exception.h"
 #include "gdb_packet.h"
 #include "morse.h"
@@ -36,6 +37,7 @@
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
+#include <freertos/semphr.h>
 
 #include "dhcpserver/dhcpserver.h"
 #include "http.h"
@@ -57,6 +59,10 @@
 #include "driver/gpio.h"
 #include "driver/uart.h"
 
+#include "baud_detect.h"
+#include "offline_prog.h"
+#include "pcsample.h"
+#include "profile.h"
 #include "uart.h"
 #include "wifi_manager.h"
 #include "wifi.h"
@@ -240,6 +246,27 @@ const char *platform_target_voltage(void)
 	return voltage;
 }
 
+/* Serialises access to the debug port. The GDB task holds this whenever it
+ * isn't waiting for input from the client, so anything else that talks to
+ * the target in the background only gets in between GDB commands.
+ */
+static SemaphoreHandle_t target_lock;
+
+void platform_target_lock(void)
+{
+	xSemaphoreTakeRecursive(target_lock, portMAX_DELAY);
+}
+
+bool platform_target_trylock(uint32_t timeout_ms)
+{
+	return xSemaphoreTakeRecursive(target_lock, pdMS_TO_TICKS(timeout_ms)) == pdTRUE;
+}
+
+void platform_target_unlock(void)
+{
+	xSemaphoreGiveRecursive(target_lock);
+}
+
 uint32_t platform_time_ms(void)
 {
 	return xTaskGetTickCount() * portTICK_PERIOD_MS;
@@ -259,7 +286,12 @@ int platform_hwversion(void)
 
 void platform_set_baud(uint32_t baud)
 {
-	uart_set_baudrate(CONFIG_TARGET_UART_IDX, baud);
+	if (baud == BAUD_AUTO) {
+		baud_detect_start(CONFIG_TARGET_UART_IDX, NULL, NULL);
+	} else {
+		baud_detect_stop(CONFIG_TARGET_UART_IDX);
+		uart_set_baudrate(CONFIG_TARGET_UART_IDX, baud);
+	}
 	nvs_set_u32(h_nvs_conf, "uartbaud", baud);
 }
 
@@ -268,9 +300,15 @@ bool cmd_setbaud(target *t, int argc, const char **argv)
 	if (argc == 1) {
 		uint32_t baud;
 		uart_get_baudrate(CONFIG_TARGET_UART_IDX, &baud);
-		gdb_outf("Current baud: %d\n", baud);
+		gdb_outf("Current baud: %d%s\n", baud, baud_detect_is_auto(CONFIG_TARGET_UART_IDX) ? " (auto)" : "");
 	}
 	if (argc == 2) {
+		if (!strcmp(argv[1], "auto")) {
+			gdb_outf("Detecting baud\n");
+			platform_set_baud(BAUD_AUTO);
+			return 1;
+		}
+
 		int baud = atoi(argv[1]);
 		gdb_outf("Setting baud: %d\n", baud);
 
@@ -280,6 +318,12 @@ bool cmd_setbaud(target *t, int argc, const char **argv)
 	return 1;
 }
 
+const struct command_s platform_cmd_list[] = {
+	{"pcsample", cmd_pcsample, "Sample the target PC over SWD: (start [rate_hz [addr ...]]|stop|status)"},
+	{"profile", cmd_profile, "Sample the target PC over SWO: (start [cycles [traceclk baud]]|stop|reset|show [n])"},
+	{NULL, NULL, NULL},
+};
+
 int vprintf_noop(const char *s, va_list va)
 {
 	return 1;
@@ -315,15 +359,22 @@ void app_main(void)
 	bm_update_wifi_ssid();
 	bm_update_wifi_ps();
 
+	target_lock = xSemaphoreCreateRecursiveMutex();
+	profile_init();
+
 	ESP_LOGI(TAG, "starting wifi manager");
 	wifi_manager_start();
-	ESP_LOGI(TAG, "starting web server");
-
-	webserver_start();
 
 	ESP_LOGI(TAG, "initializing platform");
 	platform_init();
 
+	// Before the web server, which can start a run as soon as it is up
+	offline_prog_init();
+
+	ESP_LOGI(TAG, "starting web server");
+
+	webserver_start();
+
 	uart_init();
 
 	xTaskCreate(&gdb_net_task, "gdb_net", 8192, NULL, 1, NULL);
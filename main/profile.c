@@ -0,0 +1,637 @@
+/*
+ * Statistical PC profiler.
+ *
+ * The target's DWT is set up to emit a periodic PC sample packet every N
+ * cycles, which ITM forwards over SWO. The SWO receive task decodes these
+ * and drops each PC into a fixed size open addressing hash table here, so
+ * memory use does not depend on how long the profile runs. A PC is only
+ * looked for in a few slots from where it hashes to, so a sample costs a
+ * bounded time with interrupts masked. Samples for a new PC that finds
+ * those slots taken are counted as dropped. Boards without SWO can feed the same histogram from the SWD
+ * sampler in pcsample.c instead.
+ *
+ * The histogram can be dumped by address, or by function if a symbol map in
+ * `nm -S` format has been uploaded to /profile/map, e.g.
+ *
+ *   arm-none-eabi-nm -S -C firmware.elf | curl --data-binary @- http://blackmagic/profile/map
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include "esp_log.h"
+
+#include "general.h"
+#include "gdb_packet.h"
+#include "target.h"
+#include "traceswo.h"
+
+#include "profile.h"
+
+#define TAG "profile"
+
+#define PROFILE_HASH_MASK (CONFIG_PROFILE_HASH_ENTRIES - 1)
+
+/* Largest symbol map that can be uploaded */
+#define PROFILE_MAX_SYMBOLS   1024
+#define PROFILE_MAX_NAME_POOL (16 * 1024)
+
+/* Slots a PC is looked for in, counting the one it hashes to */
+#define PROFILE_MAX_PROBES 16
+
+/* Entries listed by default */
+#define PROFILE_DEFAULT_LIMIT 20
+
+#define DEMCR         0xe000edfc
+#define DEMCR_TRCENA  (1 << 24)
+#define ITM_LAR       0xe0000fb0
+#define ITM_LAR_KEY   0xc5acce55
+#define ITM_TCR       0xe0000e80
+#define ITM_TCR_ITMENA  (1 << 0)
+#define ITM_TCR_SYNCENA (1 << 2)
+#define ITM_TCR_TXENA   (1 << 3)
+#define ITM_TCR_BUSID   (1 << 16)
+#define DWT_CTRL      0xe0001000
+#define DWT_CTRL_CYCCNTENA   (1 << 0)
+#define DWT_CTRL_POSTPRESET  (0xf << 1)
+#define DWT_CTRL_CYCTAP      (1 << 9)
+#define DWT_CTRL_PCSAMPLENA  (1 << 12)
+#define TPIU_ACPR     0xe0040010
+#define TPIU_SPPR     0xe00400f0
+#define TPIU_SPPR_NRZ 2
+#define TPIU_FFCR     0xe0040304
+#define TPIU_FFCR_TRIGIN (1 << 8)
+
+#if (CONFIG_PROFILE_HASH_ENTRIES & (CONFIG_PROFILE_HASH_ENTRIES - 1)) != 0
+#error "CONFIG_PROFILE_HASH_ENTRIES must be a power of two"
+#endif
+
+struct profile_bucket {
+	uint32_t pc;
+	uint32_t count;
+};
+
+struct profile_symbol {
+	uint32_t addr;
+	uint32_t size;
+	uint16_t name;
+};
+
+struct profile_map {
+	struct profile_symbol *symbols;
+	char *names;
+	size_t count;
+	size_t names_len;
+};
+
+typedef void (*profile_print_fn)(void *ctx, const char *fmt, ...);
+
+extern int swo_active;
+
+static portMUX_TYPE profile_lock = portMUX_INITIALIZER_UNLOCKED;
+static struct profile_bucket profile_table[CONFIG_PROFILE_HASH_ENTRIES];
+static uint32_t profile_unique;
+static uint32_t profile_samples;
+static uint32_t profile_sleep;
+static uint32_t profile_dropped;
+static bool profile_swo_enabled;
+static uint32_t profile_interval;
+
+static SemaphoreHandle_t profile_map_mutex;
+static struct profile_map profile_symbols;
+
+static inline uint32_t profile_hash(uint32_t pc)
+{
+	/* Thumb instructions are halfword aligned, so bit 0 carries nothing */
+	return ((pc >> 1) * 2654435761u) >> (32 - __builtin_ctz(CONFIG_PROFILE_HASH_ENTRIES));
+}
+
+void profile_add_sample(uint32_t pc)
+{
+	uint32_t slot = profile_hash(pc);
+	int probes;
+
+	portENTER_CRITICAL_SAFE(&profile_lock);
+	profile_samples++;
+	if (pc == PROFILE_PC_SLEEP) {
+		profile_sleep++;
+		portEXIT_CRITICAL_SAFE(&profile_lock);
+		return;
+	}
+	for (probes = 0; probes < PROFILE_MAX_PROBES; probes++) {
+		struct profile_bucket *b = &profile_table[slot];
+		if (b->count == 0) {
+			b->pc = pc;
+			b->count = 1;
+			profile_unique++;
+			break;
+		}
+		if (b->pc == pc) {
+			b->count++;
+			break;
+		}
+		slot = (slot + 1) & PROFILE_HASH_MASK;
+	}
+	if (probes == PROFILE_MAX_PROBES) {
+		profile_dropped++;
+	}
+	portEXIT_CRITICAL_SAFE(&profile_lock);
+}
+
+void profile_reset(void)
+{
+	portENTER_CRITICAL(&profile_lock);
+	memset(profile_table, 0, sizeof(profile_table));
+	profile_unique = 0;
+	profile_samples = 0;
+	profile_sleep = 0;
+	profile_dropped = 0;
+	portEXIT_CRITICAL(&profile_lock);
+}
+
+bool profile_swo_active(void)
+{
+	return profile_swo_enabled;
+}
+
+void profile_init(void)
+{
+	profile_map_mutex = xSemaphoreCreateMutex();
+}
+
+static int profile_bucket_cmp(const void *a, const void *b)
+{
+	const struct profile_bucket *ba = a;
+	const struct profile_bucket *bb = b;
+	if (ba->count != bb->count) {
+		return (ba->count < bb->count) ? 1 : -1;
+	}
+	return (ba->pc < bb->pc) ? -1 : (ba->pc > bb->pc);
+}
+
+/* Copy the used part of the table out, sorted by count. The caller frees the
+ * result.
+ */
+static struct profile_bucket *profile_snapshot(size_t *count, uint32_t *samples, uint32_t *sleep, uint32_t *dropped)
+{
+	struct profile_bucket *snapshot = malloc(sizeof(profile_table));
+	size_t used = 0;
+	int i;
+
+	if (!snapshot) {
+		return NULL;
+	}
+
+	portENTER_CRITICAL(&profile_lock);
+	for (i = 0; i < CONFIG_PROFILE_HASH_ENTRIES; i++) {
+		if (profile_table[i].count) {
+			snapshot[used++] = profile_table[i];
+		}
+	}
+	*samples = profile_samples;
+	*sleep = profile_sleep;
+	*dropped = profile_dropped;
+	portEXIT_CRITICAL(&profile_lock);
+
+	qsort(snapshot, used, sizeof(*snapshot), profile_bucket_cmp);
+	*count = used;
+	return snapshot;
+}
+
+/* Index of the symbol containing pc, or -1 */
+static int profile_symbol_lookup(const struct profile_map *map, uint32_t pc)
+{
+	int lo = 0;
+	int hi = (int)map->count - 1;
+	int found = -1;
+
+	pc &= ~1;
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (map->symbols[mid].addr <= pc) {
+			found = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	if (found >= 0 && pc - map->symbols[found].addr >= map->symbols[found].size) {
+		return -1;
+	}
+	return found;
+}
+
+static unsigned int profile_permille(uint32_t count, uint32_t total)
+{
+	return total ? (uint32_t)(((uint64_t)count * 1000) / total) : 0;
+}
+
+static void profile_report(profile_print_fn print, void *ctx, int limit, bool by_symbol)
+{
+	size_t count;
+	uint32_t samples, sleep, dropped;
+	struct profile_bucket *snapshot = profile_snapshot(&count, &samples, &sleep, &dropped);
+	size_t i;
+
+	if (!snapshot) {
+		print(ctx, "Out of memory\n");
+		return;
+	}
+
+	print(ctx, "# samples %u, sleeping %u, dropped %u, unique %u", samples, sleep, dropped, count);
+	if (profile_interval) {
+		print(ctx, ", interval %u cycles", profile_interval);
+	}
+	print(ctx, "\n");
+
+	xSemaphoreTake(profile_map_mutex, portMAX_DELAY);
+	const struct profile_map *map = &profile_symbols;
+
+	if (by_symbol && map->count) {
+		/* Fold the histogram onto the symbol table. The extra slot on the
+		 * end collects samples that fall outside every symbol.
+		 */
+		struct profile_bucket *totals = calloc(map->count + 1, sizeof(*totals));
+		if (!totals) {
+			print(ctx, "Out of memory\n");
+			goto out;
+		}
+		for (i = 0; i <= map->count; i++) {
+			totals[i].pc = i;
+		}
+		for (i = 0; i < count; i++) {
+			int sym = profile_symbol_lookup(map, snapshot[i].pc);
+			totals[(sym < 0) ? map->count : (size_t)sym].count += snapshot[i].count;
+		}
+		qsort(totals, map->count + 1, sizeof(*totals), profile_bucket_cmp);
+
+		print(ctx, "# count    %%  start      end        symbol\n");
+		for (i = 0; i <= map->count && (limit <= 0 || (int)i < limit) && totals[i].count; i++) {
+			unsigned int pm = profile_permille(totals[i].count, samples);
+			if (totals[i].pc == map->count) {
+				print(ctx, "%7u %2u.%u  -          -          (unknown)\n", totals[i].count, pm / 10, pm % 10);
+				continue;
+			}
+			const struct profile_symbol *s = &map->symbols[totals[i].pc];
+			print(ctx, "%7u %2u.%u  0x%08x 0x%08x %s\n", totals[i].count, pm / 10, pm % 10, s->addr,
+				s->addr + s->size, map->names + s->name);
+		}
+		free(totals);
+	} else {
+		print(ctx, "# count    %%  pc\n");
+		for (i = 0; i < count && (limit <= 0 || (int)i < limit); i++) {
+			unsigned int pm = profile_permille(snapshot[i].count, samples);
+			int sym = map->count ? profile_symbol_lookup(map, snapshot[i].pc) : -1;
+			if (sym < 0) {
+				print(ctx, "%7u %2u.%u  0x%08x\n", snapshot[i].count, pm / 10, pm % 10, snapshot[i].pc);
+			} else {
+				print(ctx, "%7u %2u.%u  0x%08x %s+0x%x\n", snapshot[i].count, pm / 10, pm % 10, snapshot[i].pc,
+					map->names + map->symbols[sym].name, (snapshot[i].pc & ~1) - map->symbols[sym].addr);
+			}
+		}
+	}
+
+out:
+	xSemaphoreGive(profile_map_mutex);
+	free(snapshot);
+}
+
+/* Work out POSTPRESET and CYCTAP for the requested interval. Samples are
+ * taken every (POSTPRESET + 1) * (64 or 1024) cycles.
+ */
+static uint32_t profile_dwt_interval(uint32_t cycles, uint32_t *ctrl)
+{
+	uint32_t tap = (cycles > 16 * 64) ? 1024 : 64;
+	uint32_t postpreset = (cycles + tap / 2) / tap;
+
+	if (postpreset < 1) {
+		postpreset = 1;
+	} else if (postpreset > 16) {
+		postpreset = 16;
+	}
+
+	*ctrl &= ~(DWT_CTRL_POSTPRESET | DWT_CTRL_CYCTAP);
+	*ctrl |= ((postpreset - 1) << 1) | ((tap == 1024) ? DWT_CTRL_CYCTAP : 0);
+	*ctrl |= DWT_CTRL_CYCCNTENA | DWT_CTRL_PCSAMPLENA;
+	return postpreset * tap;
+}
+
+static bool profile_start(target *t, uint32_t cycles, uint32_t traceclk, uint32_t baud)
+{
+	target_mem_write32(t, DEMCR, target_mem_read32(t, DEMCR) | DEMCR_TRCENA);
+
+	if (traceclk && baud) {
+		target_mem_write32(t, TPIU_SPPR, TPIU_SPPR_NRZ);
+		target_mem_write32(t, TPIU_ACPR, (traceclk / baud) - 1);
+		target_mem_write32(t, TPIU_FFCR, TPIU_FFCR_TRIGIN);
+	}
+
+	target_mem_write32(t, ITM_LAR, ITM_LAR_KEY);
+	target_mem_write32(t, ITM_TCR, ITM_TCR_BUSID | ITM_TCR_TXENA | ITM_TCR_SYNCENA | ITM_TCR_ITMENA);
+
+	uint32_t ctrl = target_mem_read32(t, DWT_CTRL);
+	profile_interval = profile_dwt_interval(cycles, &ctrl);
+	target_mem_write32(t, DWT_CTRL, ctrl);
+
+	if (target_check_error(t)) {
+		profile_interval = 0;
+		return false;
+	}
+
+	if (traceclk && baud) {
+		if (swo_active) {
+			traceswo_baud(baud);
+		} else {
+			traceswo_init(baud, 0);
+		}
+	}
+	profile_swo_enabled = true;
+	return true;
+}
+
+static void profile_stop(target *t)
+{
+	if (t) {
+		target_mem_write32(t, DWT_CTRL, target_mem_read32(t, DWT_CTRL) & ~DWT_CTRL_PCSAMPLENA);
+	}
+	profile_swo_enabled = false;
+}
+
+static void profile_gdb_print(void *ctx, const char *fmt, ...)
+{
+	(void)ctx;
+	char line[128];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	gdb_out(line);
+}
+
+bool cmd_profile(target *t, int argc, const char **argv)
+{
+	if (argc < 2 || !strcmp(argv[1], "show")) {
+		int limit = (argc > 2) ? atoi(argv[2]) : PROFILE_DEFAULT_LIMIT;
+		profile_report(profile_gdb_print, NULL, limit, true);
+		return true;
+	}
+
+	if (!strcmp(argv[1], "reset")) {
+		profile_reset();
+		gdb_out("Profile cleared\n");
+		return true;
+	}
+
+	if (!strcmp(argv[1], "stop")) {
+		profile_stop(t);
+		gdb_out("Profiling stopped\n");
+		return true;
+	}
+
+	if (!strcmp(argv[1], "start")) {
+		uint32_t cycles = (argc > 2) ? strtoul(argv[2], NULL, 0) : 1024;
+		uint32_t traceclk = (argc > 4) ? strtoul(argv[3], NULL, 0) : 0;
+		uint32_t baud = (argc > 4) ? strtoul(argv[4], NULL, 0) : 0;
+
+		if (!t) {
+			gdb_out("Attach to a target first\n");
+			return false;
+		}
+		if (!traceclk && !swo_active) {
+			gdb_out("SWO is not running. Use `monitor traceswo` first, or pass the trace clock and baud rate\n");
+			return false;
+		}
+		profile_reset();
+		if (!profile_start(t, cycles, traceclk, baud)) {
+			gdb_out("Unable to configure DWT PC sampling\n");
+			return false;
+		}
+		gdb_outf("Sampling the PC every %u cycles\n", profile_interval);
+		return true;
+	}
+
+	gdb_out("usage: monitor profile [start [cycles [traceclk_hz swo_baud]] | stop | reset | show [count]]\n");
+	return false;
+}
+
+struct profile_http_out {
+	httpd_req_t *req;
+	size_t len;
+	char buf[512];
+};
+
+static void profile_http_flush(struct profile_http_out *out)
+{
+	if (out->len) {
+		httpd_resp_send_chunk(out->req, out->buf, out->len);
+		out->len = 0;
+	}
+}
+
+static void profile_http_print(void *ctx, const char *fmt, ...)
+{
+	struct profile_http_out *out = ctx;
+	char line[128];
+	va_list ap;
+
+	va_start(ap, fmt);
+	int len = vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	if (len >= (int)sizeof(line)) {
+		len = sizeof(line) - 1;
+	}
+
+	if (out->len + len > sizeof(out->buf)) {
+		profile_http_flush(out);
+	}
+	memcpy(out->buf + out->len, line, len);
+	out->len += len;
+}
+
+esp_err_t cgi_profile(httpd_req_t *req)
+{
+	char querystring[64];
+	char value[12];
+	int limit = 0;
+	bool by_symbol = false;
+
+	if (httpd_req_get_url_query_str(req, querystring, sizeof(querystring)) == ESP_OK) {
+		if (httpd_query_key_value(querystring, "limit", value, sizeof(value)) == ESP_OK) {
+			limit = atoi(value);
+		}
+		if (httpd_query_key_value(querystring, "symbols", value, sizeof(value)) == ESP_OK) {
+			by_symbol = atoi(value) != 0;
+		}
+	}
+
+	struct profile_http_out *out = malloc(sizeof(*out));
+	if (!out) {
+		httpd_resp_send_500(req);
+		return ESP_FAIL;
+	}
+	out->req = req;
+	out->len = 0;
+
+	httpd_resp_set_type(req, "text/plain");
+	profile_report(profile_http_print, out, limit, by_symbol);
+	profile_http_flush(out);
+	httpd_resp_send_chunk(req, NULL, 0);
+	free(out);
+
+	if (httpd_req_get_url_query_str(req, querystring, sizeof(querystring)) == ESP_OK &&
+		httpd_query_key_value(querystring, "reset", value, sizeof(value)) == ESP_OK && atoi(value)) {
+		profile_reset();
+	}
+	return ESP_OK;
+}
+
+/* Split the next field off the front of `*line` */
+static char *profile_map_field(char **line)
+{
+	char *field = *line + strspn(*line, " \t");
+	char *end = field + strcspn(field, " \t");
+
+	*line = *end ? end + 1 : end;
+	*end = '\0';
+	return *field ? field : NULL;
+}
+
+/* Parse one line of `nm -S` or `nm` output:
+ *   08000130 00000040 T main
+ *   08000130 T main
+ * The name is the rest of the line, since `nm -C` demangles C++ names into
+ * ones with spaces such as `foo(int, char)`. Only code symbols are kept.
+ */
+static void profile_map_add_line(struct profile_map *map, char *line)
+{
+	char *addr = profile_map_field(&line);
+	char *size = NULL;
+	char *type = profile_map_field(&line);
+
+	if (type && strlen(type) != 1) {
+		size = type;
+		type = profile_map_field(&line);
+	}
+	if (!addr || !type || strlen(type) != 1 || !strchr("tTwW", type[0])) {
+		return;
+	}
+
+	char *name = line + strspn(line, " \t");
+	size_t name_len = strlen(name);
+	while (name_len > 0 && (name[name_len - 1] == ' ' || name[name_len - 1] == '\t')) {
+		name_len--;
+	}
+	if (name_len == 0) {
+		return;
+	}
+	name[name_len++] = '\0';
+	if (map->count >= PROFILE_MAX_SYMBOLS || map->names_len + name_len > PROFILE_MAX_NAME_POOL) {
+		return;
+	}
+
+	struct profile_symbol *s = &map->symbols[map->count++];
+	s->addr = strtoul(addr, NULL, 16) & ~1;
+	s->size = size ? strtoul(size, NULL, 16) : 0;
+	s->name = map->names_len;
+	memcpy(map->names + map->names_len, name, name_len);
+	map->names_len += name_len;
+}
+
+static int profile_symbol_cmp(const void *a, const void *b)
+{
+	const struct profile_symbol *sa = a;
+	const struct profile_symbol *sb = b;
+	return (sa->addr < sb->addr) ? -1 : (sa->addr > sb->addr);
+}
+
+static void profile_map_finish(struct profile_map *map)
+{
+	size_t i;
+
+	qsort(map->symbols, map->count, sizeof(*map->symbols), profile_symbol_cmp);
+
+	/* Symbols without a size run up to the next one */
+	for (i = 0; i < map->count; i++) {
+		if (map->symbols[i].size == 0 && i + 1 < map->count) {
+			map->symbols[i].size = map->symbols[i + 1].addr - map->symbols[i].addr;
+		}
+	}
+}
+
+static void profile_map_free(struct profile_map *map)
+{
+	free(map->symbols);
+	free(map->names);
+	memset(map, 0, sizeof(*map));
+}
+
+esp_err_t cgi_profile_map(httpd_req_t *req)
+{
+	struct profile_map map = {};
+	char buf[256];
+	size_t used = 0;
+	int remaining = req->content_len;
+
+	map.symbols = malloc(PROFILE_MAX_SYMBOLS * sizeof(*map.symbols));
+	map.names = malloc(PROFILE_MAX_NAME_POOL);
+	if (!map.symbols || !map.names) {
+		profile_map_free(&map);
+		httpd_resp_send_500(req);
+		return ESP_FAIL;
+	}
+
+	// Lines are handled as they arrive, and a partial line at the end of a
+	// read is moved to the front of the buffer to be finished by the next.
+	while (remaining > 0) {
+		int ret = httpd_req_recv(req, buf + used, sizeof(buf) - used - 1);
+		if (ret == HTTPD_SOCK_ERR_TIMEOUT) {
+			continue;
+		}
+		if (ret <= 0) {
+			profile_map_free(&map);
+			return ESP_FAIL;
+		}
+		remaining -= ret;
+		used += ret;
+		buf[used] = '\0';
+
+		char *line = buf;
+		char *eol;
+		while ((eol = strpbrk(line, "\r\n")) != NULL) {
+			*eol = '\0';
+			profile_map_add_line(&map, line);
+			line = eol + 1;
+		}
+
+		used = strlen(line);
+		if (used == sizeof(buf) - 1) {
+			// Overlong line, nothing useful can be in it
+			used = 0;
+		}
+		memmove(buf, line, used);
+	}
+	if (used) {
+		buf[used] = '\0';
+		profile_map_add_line(&map, buf);
+	}
+	profile_map_finish(&map);
+
+	xSemaphoreTake(profile_map_mutex, portMAX_DELAY);
+	profile_map_free(&profile_symbols);
+	profile_symbols = map;
+	xSemaphoreGive(profile_map_mutex);
+
+	ESP_LOGI(TAG, "loaded %u symbols", map.count);
+	snprintf(buf, sizeof(buf), "{\"symbols\": %u}", map.count);
+	httpd_resp_set_type(req, "text/json");
+	httpd_resp_sendstr(req, buf);
+	return ESP_OK;
+}
@@ -0,0 +1,32 @@
+#ifndef FARPATCH_PROFILE_H__
+#define FARPATCH_PROFILE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <esp_http_server.h>
+
+#include "target.h"
+
+/* Recorded in place of a PC when the core was asleep at the sample point */
+#define PROFILE_PC_SLEEP 0xffffffff
+
+void profile_init(void);
+
+/* Add one PC sample to the histogram. Safe to call from any task. */
+void profile_add_sample(uint32_t pc);
+
+/* Clear the histogram and all sample counters */
+void profile_reset(void);
+
+/* True while the target has been told to emit PC samples over SWO */
+bool profile_swo_active(void);
+
+/* GDB `monitor profile` */
+bool cmd_profile(target *t, int argc, const char **argv);
+
+/* GET /profile dumps the histogram, POST /profile/map uploads symbols */
+esp_err_t cgi_profile(httpd_req_t *req);
+esp_err_t cgi_profile_map(httpd_req_t *req);
+
+#endif /* FARPATCH_PROFILE_H__ */
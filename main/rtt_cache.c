@@ -0,0 +1,317 @@
+/*
+ * Fast RTT control block discovery.
+ *
+ * Searching target RAM for the "SEGGER RTT" identifier over SWD is slow, and
+ * blackmagic repeats the search after every reset or reattach. This keeps the
+ * last known control block address for each target in NVS, keyed by the
+ * target IDCODE and driver, and verifies it with a single read when the
+ * target comes back. If that fails, target RAM is read in large blocks and
+ * searched in probe memory instead.
+ *
+ * In either case the result is handed to blackmagic by narrowing its RTT
+ * search window to the control block, and the user's window is restored as
+ * soon as blackmagic reports the control block as found.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "nvs_flash.h"
+
+#include "general.h"
+#include "target.h"
+#include "target_internal.h"
+#include "rtt.h"
+
+#include "rtt_cache.h"
+
+#define TAG "rtt-cache"
+
+#define RTT_DEFAULT_IDENT "SEGGER RTT"
+
+/* Size of each target memory read during a full scan */
+#define RTT_CACHE_BLOCK_SIZE 1024
+
+/* Size of the search window handed to blackmagic once the block is known */
+#define RTT_CACHE_WINDOW_SIZE 64
+
+/* Minimum time between attempts to verify the cached address */
+#define RTT_CACHE_RETRY_MS 100
+
+/* Minimum time between full scans of target RAM */
+#define RTT_CACHE_SCAN_INTERVAL_MS 1000
+
+/* How long blackmagic gets to accept a narrowed window before it is reset */
+#define RTT_CACHE_WINDOW_HOLD_MS 1000
+
+extern nvs_handle h_nvs_conf;
+
+static target *cached_target;
+static uint32_t cached_key;
+static uint32_t cached_addr;
+static uint32_t last_attempt_ms;
+static uint32_t last_scan_ms;
+
+static bool window_overridden;
+static uint32_t window_narrowed_ms;
+static bool saved_flag_ram;
+static uint32_t saved_ram_start;
+static uint32_t saved_ram_end;
+
+static uint8_t scan_buffer[RTT_CACHE_BLOCK_SIZE + sizeof(rtt_ident)];
+
+static const char *rtt_cache_ident(void)
+{
+	return rtt_ident[0] ? rtt_ident : RTT_DEFAULT_IDENT;
+}
+
+/* FNV-1a over everything that identifies where a control block will live */
+static uint32_t rtt_cache_key(target *t)
+{
+	uint32_t hash = 0x811c9dc5;
+	const char *driver = target_driver_name(t);
+	const char *ident = rtt_cache_ident();
+	uint32_t idcode = t->idcode;
+	size_t i;
+
+	for (i = 0; i < sizeof(idcode); i++) {
+		hash = (hash ^ ((idcode >> (i * 8)) & 0xff)) * 0x01000193;
+	}
+	while (driver && *driver) {
+		hash = (hash ^ (uint8_t)*driver++) * 0x01000193;
+	}
+	while (*ident) {
+		hash = (hash ^ (uint8_t)*ident++) * 0x01000193;
+	}
+	return hash;
+}
+
+static void rtt_cache_nvs_name(uint32_t key, char *name, size_t len)
+{
+	snprintf(name, len, "rtt%08x", key);
+}
+
+static uint32_t rtt_cache_load(uint32_t key)
+{
+	char name[16];
+	uint32_t addr = 0;
+
+	rtt_cache_nvs_name(key, name, sizeof(name));
+	if (nvs_get_u32(h_nvs_conf, name, &addr) != ESP_OK) {
+		return 0;
+	}
+	return addr;
+}
+
+static void rtt_cache_store(uint32_t key, uint32_t addr)
+{
+	char name[16];
+
+	rtt_cache_nvs_name(key, name, sizeof(name));
+	if (nvs_set_u32(h_nvs_conf, name, addr) == ESP_OK) {
+		nvs_commit(h_nvs_conf);
+	}
+	ESP_LOGI(TAG, "remembering control block at 0x%08x for target %08x", addr, key);
+}
+
+/* Point the blackmagic search at a single control block */
+static void rtt_cache_narrow_window(uint32_t addr)
+{
+	if (!window_overridden) {
+		saved_flag_ram = rtt_flag_ram;
+		saved_ram_start = rtt_ram_start;
+		saved_ram_end = rtt_ram_end;
+		window_overridden = true;
+	}
+	window_narrowed_ms = platform_time_ms();
+	rtt_flag_ram = true;
+	rtt_ram_start = addr;
+	rtt_ram_end = addr + RTT_CACHE_WINDOW_SIZE;
+}
+
+static void rtt_cache_restore_window(void)
+{
+	if (!window_overridden) {
+		return;
+	}
+	rtt_flag_ram = saved_flag_ram;
+	rtt_ram_start = saved_ram_start;
+	rtt_ram_end = saved_ram_end;
+	window_overridden = false;
+}
+
+/* True if the user restricted the search and addr lies outside of it */
+static bool rtt_cache_outside_user_window(uint32_t addr)
+{
+	bool flag_ram = window_overridden ? saved_flag_ram : rtt_flag_ram;
+	uint32_t start = window_overridden ? saved_ram_start : rtt_ram_start;
+	uint32_t end = window_overridden ? saved_ram_end : rtt_ram_end;
+
+	return flag_ram && (addr < start || addr >= end);
+}
+
+static bool rtt_cache_verify(target *t, uint32_t addr)
+{
+	const char *ident = rtt_cache_ident();
+	size_t len = strlen(ident);
+	char buffer[sizeof(rtt_ident)];
+
+	if (len > sizeof(buffer)) {
+		len = sizeof(buffer);
+	}
+	if (target_mem_read(t, buffer, addr, len)) {
+		return false;
+	}
+	return memcmp(buffer, ident, len) == 0;
+}
+
+static const uint8_t *rtt_cache_find(const uint8_t *haystack, size_t len, const char *needle, size_t needle_len)
+{
+	const uint8_t *end = haystack + len;
+	const uint8_t *p = haystack;
+
+	while ((size_t)(end - p) >= needle_len) {
+		p = memchr(p, needle[0], end - p - needle_len + 1);
+		if (!p) {
+			return NULL;
+		}
+		if (!memcmp(p, needle, needle_len)) {
+			return p;
+		}
+		p++;
+	}
+	return NULL;
+}
+
+/* Read [start, end) in large blocks and search for the identifier locally.
+ * The tail of each block is carried over so that matches which straddle a
+ * block boundary are still found.
+ */
+static uint32_t rtt_cache_scan_range(target *t, uint32_t start, uint32_t end)
+{
+	const char *ident = rtt_cache_ident();
+	size_t ident_len = strlen(ident);
+	size_t carry = 0;
+	uint32_t addr = start;
+
+	while (addr < end) {
+		size_t len = end - addr;
+		if (len > RTT_CACHE_BLOCK_SIZE) {
+			len = RTT_CACHE_BLOCK_SIZE;
+		}
+		if (target_mem_read(t, scan_buffer + carry, addr, len)) {
+			return 0;
+		}
+
+		size_t avail = carry + len;
+		const uint8_t *match = rtt_cache_find(scan_buffer, avail, ident, ident_len);
+		if (match) {
+			return addr - carry + (match - scan_buffer);
+		}
+
+		carry = (avail < ident_len - 1) ? avail : ident_len - 1;
+		memmove(scan_buffer, scan_buffer + avail - carry, carry);
+		addr += len;
+	}
+	return 0;
+}
+
+static uint32_t rtt_cache_scan(target *t)
+{
+	uint32_t addr = 0;
+	uint32_t start_ms = platform_time_ms();
+
+	if (window_overridden ? saved_flag_ram : rtt_flag_ram) {
+		addr = rtt_cache_scan_range(t, window_overridden ? saved_ram_start : rtt_ram_start,
+			window_overridden ? saved_ram_end : rtt_ram_end);
+	} else {
+		struct target_ram *r;
+		for (r = t->ram; r && !addr; r = r->next) {
+			addr = rtt_cache_scan_range(t, r->start, r->start + r->length);
+		}
+	}
+
+	ESP_LOGI(TAG, "scanned target ram in %d ms, control block %s 0x%08x", platform_time_ms() - start_ms,
+		addr ? "at" : "not found", addr);
+	return addr;
+}
+
+static target *rtt_cache_attached_target(void)
+{
+	target *t;
+	for (t = target_list; t; t = t->next) {
+		if (t->attached) {
+			return t;
+		}
+	}
+	return NULL;
+}
+
+void rtt_cache_poll(void)
+{
+	target *t = rtt_enabled ? rtt_cache_attached_target() : NULL;
+
+	if (!t) {
+		rtt_cache_restore_window();
+		return;
+	}
+
+	if (t != cached_target) {
+		rtt_cache_restore_window();
+		cached_target = t;
+		cached_key = rtt_cache_key(t);
+		cached_addr = rtt_cache_load(cached_key);
+		last_attempt_ms = 0;
+		last_scan_ms = 0;
+	}
+
+	if (rtt_found) {
+		rtt_cache_restore_window();
+		if (rtt_cbaddr && rtt_cbaddr != cached_addr) {
+			cached_addr = rtt_cbaddr;
+			rtt_cache_store(cached_key, cached_addr);
+		}
+		return;
+	}
+
+	uint32_t now = platform_time_ms();
+	if (window_overridden) {
+		if (now - window_narrowed_ms < RTT_CACHE_WINDOW_HOLD_MS) {
+			return;
+		}
+		/* blackmagic had its chance at the narrowed window and didn't accept
+		 * it, so start over from the user's window.
+		 */
+		rtt_cache_restore_window();
+	}
+	if (now - last_attempt_ms < RTT_CACHE_RETRY_MS) {
+		return;
+	}
+	last_attempt_ms = now;
+
+	if (cached_addr && !rtt_cache_outside_user_window(cached_addr) && rtt_cache_verify(t, cached_addr)) {
+		rtt_cache_narrow_window(cached_addr);
+		return;
+	}
+
+	if (last_scan_ms && (now - last_scan_ms < RTT_CACHE_SCAN_INTERVAL_MS)) {
+		return;
+	}
+	last_scan_ms = now;
+
+	uint32_t addr = rtt_cache_scan(t);
+	if (addr) {
+		rtt_cache_narrow_window(addr);
+	}
+}
+
+void rtt_cache_target_lost(target *t)
+{
+	if (t != cached_target) {
+		return;
+	}
+	rtt_cache_restore_window();
+	cached_target = NULL;
+}
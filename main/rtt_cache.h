@@ -0,0 +1,16 @@
+#ifndef FARPATCH_RTT_CACHE_H__
+#define FARPATCH_RTT_CACHE_H__
+
+#include "target.h"
+
+/* Locate the RTT control block of the attached target, preferring the address
+ * remembered from a previous session. Once located, the blackmagic RTT search
+ * window is narrowed to the control block so that the next `poll_rtt()` only
+ * needs a single read. Must be called from the task that runs `poll_rtt()`.
+ */
+void rtt_cache_poll(void);
+
+/* Forget any state tied to a target that is being destroyed. */
+void rtt_cache_target_lost(target *t);
+
+#endif /* FARPATCH_RTT_CACHE_H__ */
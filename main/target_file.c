@@ -0,0 +1,704 @@
+/*
+ * Target memory as files.
+ *
+ * Reading memory over SWD is slow next to sending it over the network, and
+ * doing the two in turn leaves each idle while the other runs. A task
+ * instead copies target memory into a few buffers ahead of the caller, who
+ * only waits if the network gets ahead of the debug port.
+ *
+ * Writing works the other way round. The caller fills one half of the
+ * buffer memory while the task erases and programs the other, so the
+ * transfer runs at network or flash speed, whichever is lower. Sectors are
+ * erased just ahead of the data, so only the ones the image covers are
+ * touched. Once everything is written, the task reads the image back and
+ * compares its CRC with that of the data it was given.
+ *
+ * While reading, the debug port is locked for one block at a time, so a
+ * GDB session can carry on between reads just as it does around PC
+ * sampling. The flash drivers keep state from one write to the next, so
+ * programming holds the lock from start to finish.
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
+
+#include "general.h"
+#include "exception.h"
+#include "gdb_if.h"
+#include "target.h"
+#include "target_internal.h"
+
+#include "target_file.h"
+
+#define TAG "target-file"
+
+#define TARGET_FILE_TASK_PRIO 2
+
+/* Target memory is read in blocks of this size, this many ahead */
+#define TARGET_FILE_BLOCK_SIZE 4096
+#define TARGET_FILE_BLOCKS     4
+/* and written from two halves of the same memory */
+#define TARGET_FILE_WRITE_BLOCK_SIZE (TARGET_FILE_BLOCKS * TARGET_FILE_BLOCK_SIZE / 2)
+#define TARGET_FILE_WRITE_BLOCKS     2
+
+#define TARGET_FILE_FLASH    "flash.bin"
+#define TARGET_FILE_FLASH_AT "flash@"
+#define TARGET_FILE_MEM      "mem@"
+
+struct target_file_block {
+	uint8_t *data;
+	/* 0 if the target couldn't be read. When writing, a block without data
+	   tells the task there is nothing more to come. */
+	size_t len;
+};
+
+enum target_file_mode {
+	TARGET_FILE_CLOSED,
+	TARGET_FILE_READ,
+	TARGET_FILE_WRITE,
+};
+
+static QueueHandle_t free_blocks;
+static QueueHandle_t full_blocks;
+/* Given once the file has been resolved, and again once the task is done */
+static SemaphoreHandle_t task_opened;
+static SemaphoreHandle_t task_finished;
+static TaskHandle_t task_pid;
+
+static enum target_file_mode file_mode;
+static portMUX_TYPE file_mode_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint8_t *block_memory;
+static struct target_file_block current;
+static size_t current_pos;
+
+/* Shared with the task */
+static const char *open_name;
+static volatile esp_err_t task_err;
+static volatile bool task_stop;
+static uint32_t file_addr;
+static uint32_t file_size;
+static uint32_t file_remaining;
+static uint32_t file_written;
+static uint32_t file_crc;
+/* Bytes the caller has handed over, not all of which may be written yet */
+static uint32_t file_received;
+
+/* Filled in by the task as it goes */
+static struct target_file_stats file_stats;
+
+/* The target being used, and whether the task attached to it itself */
+static target *file_target;
+static bool file_target_owned;
+
+static void target_file_destroy_callback(struct target_controller *tc, target *t)
+{
+	(void)tc;
+	if (file_target == t) {
+		file_target = NULL;
+	}
+}
+
+static void target_file_printf(struct target_controller *tc, const char *fmt, va_list ap)
+{
+	char line[128];
+	(void)tc;
+	vsnprintf(line, sizeof(line), fmt, ap);
+	ESP_LOGI(TAG, "%s", line);
+}
+
+static struct target_controller target_file_controller = {
+	.destroy_callback = target_file_destroy_callback,
+	.printf = target_file_printf,
+};
+
+/* Called with the debug port locked */
+static target *target_file_acquire(void)
+{
+	target *t;
+
+	for (t = target_list; t; t = t->next) {
+		if (t->attached) {
+			file_target_owned = false;
+			return t;
+		}
+	}
+
+	if (adiv5_swdp_scan(0) <= 0) {
+		ESP_LOGW(TAG, "no target found on the debug port");
+		return NULL;
+	}
+	t = target_attach_n(1, &target_file_controller);
+	if (!t) {
+		ESP_LOGW(TAG, "unable to attach to the target");
+		return NULL;
+	}
+	file_target_owned = true;
+	return t;
+}
+
+/* Called with the debug port locked */
+static void target_file_release(void)
+{
+	if (file_target && file_target_owned) {
+		target_detach(file_target);
+	}
+	file_target = NULL;
+	file_target_owned = false;
+}
+
+static struct target_flash *target_file_flash_at(target *t, uint32_t addr)
+{
+	struct target_flash *f;
+
+	for (f = t->flash; f; f = f->next) {
+		if (addr >= f->start && addr - f->start < f->length) {
+			return f;
+		}
+	}
+	return NULL;
+}
+
+/* The flash from `addr` up to the first gap between regions */
+static uint32_t target_file_flash_span(target *t, uint32_t addr)
+{
+	struct target_flash *f;
+	uint32_t end = addr;
+
+	while ((f = target_file_flash_at(t, end))) {
+		end = f->start + f->length;
+	}
+	return end - addr;
+}
+
+/* Flash regions aren't kept in order, so find the lowest */
+static esp_err_t target_file_flash_start(target *t, uint32_t *addr)
+{
+	struct target_flash *f;
+	struct target_flash *lowest = NULL;
+
+	for (f = t->flash; f; f = f->next) {
+		if (!lowest || f->start < lowest->start) {
+			lowest = f;
+		}
+	}
+	if (!lowest) {
+		return ESP_ERR_NOT_FOUND;
+	}
+	*addr = lowest->start;
+	return ESP_OK;
+}
+
+static esp_err_t target_file_parse_number(const char *spec, char terminator, uint32_t *value, const char **rest)
+{
+	char *end;
+
+	unsigned long v = strtoul(spec, &end, 0);
+	if (end == spec || *end != terminator) {
+		return ESP_ERR_NOT_FOUND;
+	}
+	*value = v;
+	*rest = end + 1;
+	return ESP_OK;
+}
+
+static esp_err_t target_file_resolve(target *t, const char *name)
+{
+	const char *rest;
+	uint32_t len;
+
+	name += strlen(TARGET_FILE_PREFIX);
+	bool whole_flash = !strcmp(name, TARGET_FILE_FLASH);
+	if (whole_flash || !strncmp(name, TARGET_FILE_FLASH_AT, strlen(TARGET_FILE_FLASH_AT))) {
+		esp_err_t err = whole_flash
+			? target_file_flash_start(t, &file_addr)
+			: target_file_parse_number(name + strlen(TARGET_FILE_FLASH_AT), '\0', &file_addr, &rest);
+		if (err != ESP_OK) {
+			return ESP_ERR_NOT_FOUND;
+		}
+		len = target_file_flash_span(t, file_addr);
+		if (len == 0) {
+			ESP_LOGE(TAG, "no flash at 0x%08x", file_addr);
+			return ESP_ERR_NOT_FOUND;
+		}
+		if (file_mode == TARGET_FILE_READ) {
+			file_size = len;
+		} else if (file_size > len) {
+			ESP_LOGE(TAG, "%u bytes don't fit in the %u bytes of flash at 0x%08x", file_size, len, file_addr);
+			return ESP_ERR_INVALID_SIZE;
+		}
+		return ESP_OK;
+	}
+	if (file_mode == TARGET_FILE_READ && !strncmp(name, TARGET_FILE_MEM, strlen(TARGET_FILE_MEM))) {
+		if (target_file_parse_number(name + strlen(TARGET_FILE_MEM), '+', &file_addr, &rest) != ESP_OK ||
+			target_file_parse_number(rest, '\0', &len, &rest) != ESP_OK || len == 0 ||
+			file_addr + (uint64_t)len > 0x100000000ULL) {
+			return ESP_ERR_NOT_FOUND;
+		}
+		file_size = len;
+		return ESP_OK;
+	}
+	return ESP_ERR_NOT_FOUND;
+}
+
+/* Fill free blocks from the target until the file has all been read or
+   target_file_close() asks to stop */
+static void target_file_read_ahead(void)
+{
+	struct target_file_block block;
+	uint32_t pos = 0;
+
+	while (pos < file_size && !task_stop) {
+		xQueueReceive(free_blocks, &block, portMAX_DELAY);
+		if (task_stop) {
+			break;
+		}
+
+		block.len = MIN(file_size - pos, TARGET_FILE_BLOCK_SIZE);
+		bool failed = true;
+		platform_target_lock();
+		if (file_target) {
+			struct exception e;
+			TRY_CATCH (e, EXCEPTION_ALL) {
+				failed = target_mem_read(file_target, block.data, file_addr + pos, block.len);
+			}
+			failed = failed || e.type;
+		}
+		platform_target_unlock();
+
+		if (failed) {
+			ESP_LOGE(TAG, "unable to read %u bytes at 0x%08x", block.len, file_addr + pos);
+			task_err = ESP_FAIL;
+			block.len = 0;
+			xQueueSend(full_blocks, &block, portMAX_DELAY);
+			break;
+		}
+		pos += block.len;
+		xQueueSend(full_blocks, &block, portMAX_DELAY);
+	}
+}
+
+/* Erase whole sectors from where the last erase stopped up to `end` */
+static int target_file_erase_to(uint32_t *erased, uint32_t end)
+{
+	while (*erased < end) {
+		struct target_flash *f = target_file_flash_at(file_target, *erased);
+		if (!f) {
+			return -1;
+		}
+		uint32_t offset = MIN(end - f->start, f->length);
+		uint32_t stop = f->start + MIN(offset + (f->blocksize - offset % f->blocksize) % f->blocksize, f->length);
+		if (target_flash_erase(file_target, *erased, stop - *erased)) {
+			return -1;
+		}
+		*erased = stop;
+	}
+	return 0;
+}
+
+/* Read the image back and check it against the CRC of what was written */
+static esp_err_t target_file_verify(uint8_t *buf)
+{
+	uint32_t crc = 0;
+	uint32_t pos;
+
+	for (pos = 0; pos < file_written; pos += TARGET_FILE_BLOCK_SIZE) {
+		size_t len = MIN(file_written - pos, TARGET_FILE_BLOCK_SIZE);
+		if (target_mem_read(file_target, buf, file_addr + pos, len)) {
+			return ESP_FAIL;
+		}
+		crc = esp_rom_crc32_le(crc, buf, len);
+	}
+	if (crc != file_crc) {
+		ESP_LOGE(TAG, "flash CRC is 0x%08x, expected 0x%08x", crc, file_crc);
+		return ESP_ERR_INVALID_CRC;
+	}
+	return ESP_OK;
+}
+
+/* Program each block the caller fills until it sends one without data.
+   The debug port stays locked throughout. */
+static void target_file_program(void)
+{
+	struct target_file_block block;
+	struct exception e;
+	uint32_t erased = file_addr;
+	int64_t erase_us = 0;
+	int64_t write_us = 0;
+	int64_t verify_us = 0;
+	int64_t start;
+
+	struct target_flash *f = target_file_flash_at(file_target, file_addr);
+	erased -= (file_addr - f->start) % f->blocksize;
+
+	while (1) {
+		xQueueReceive(full_blocks, &block, portMAX_DELAY);
+		if (!block.data) {
+			break;
+		}
+
+		/* After a failure, keep recycling buffers so the caller never blocks */
+		if (task_err == ESP_OK && file_target) {
+			bool failed = true;
+			TRY_CATCH (e, EXCEPTION_ALL) {
+				start = esp_timer_get_time();
+				failed = target_file_erase_to(&erased, file_addr + file_written + block.len);
+				erase_us += esp_timer_get_time() - start;
+				if (!failed) {
+					start = esp_timer_get_time();
+					failed = target_flash_write(file_target, file_addr + file_written, block.data, block.len);
+					write_us += esp_timer_get_time() - start;
+				}
+			}
+			if (failed || e.type) {
+				ESP_LOGE(TAG, "unable to program %u bytes at 0x%08x", block.len, file_addr + file_written);
+				task_err = ESP_FAIL;
+			} else {
+				file_crc = esp_rom_crc32_le(file_crc, block.data, block.len);
+				file_written += block.len;
+			}
+		} else if (task_err == ESP_OK) {
+			task_err = ESP_FAIL;
+		}
+
+		block.len = 0;
+		xQueueSend(free_blocks, &block, portMAX_DELAY);
+	}
+
+	if (!file_target) {
+		return;
+	}
+	TRY_CATCH (e, EXCEPTION_ALL) {
+		/* Always let the drivers write out their buffers and lock the flash */
+		start = esp_timer_get_time();
+		if (target_flash_done(file_target) && task_err == ESP_OK) {
+			task_err = ESP_FAIL;
+		}
+		write_us += esp_timer_get_time() - start;
+
+		if (task_err == ESP_OK && !task_stop) {
+			start = esp_timer_get_time();
+			task_err = target_file_verify(block_memory);
+			verify_us = esp_timer_get_time() - start;
+			ESP_LOGI(TAG, "%u bytes to 0x%08x, erase %u ms, program %u ms, verify %u ms, CRC 0x%08x", file_written,
+				file_addr, (uint32_t)(erase_us / 1000), (uint32_t)(write_us / 1000), (uint32_t)(verify_us / 1000),
+				file_crc);
+		}
+		if (task_err == ESP_OK && !task_stop) {
+			target_reset(file_target);
+		}
+	}
+	if (e.type) {
+		ESP_LOGE(TAG, "target lost while finishing %s", open_name);
+		task_err = ESP_FAIL;
+	}
+	file_stats.bytes = file_written;
+	file_stats.erase_ms = erase_us / 1000;
+	file_stats.program_ms = write_us / 1000;
+	file_stats.verify_ms = verify_us / 1000;
+}
+
+static void target_file_task(void *ignored)
+{
+	void *tls[2] = {};
+	vTaskSetThreadLocalStoragePointer(NULL, GDB_TLS_INDEX, tls); // used for exception handling
+
+	while (1) {
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+		esp_err_t err = ESP_ERR_NOT_FOUND;
+		int64_t start = esp_timer_get_time();
+		memset(&file_stats, 0, sizeof(file_stats));
+		platform_target_lock();
+		struct exception e;
+		TRY_CATCH (e, EXCEPTION_ALL) {
+			file_target = target_file_acquire();
+			if (file_target) {
+				strlcpy(file_stats.driver, target_driver_name(file_target), sizeof(file_stats.driver));
+				err = target_file_resolve(file_target, open_name);
+			}
+		}
+		if (e.type) {
+			ESP_LOGE(TAG, "target lost while opening %s", open_name);
+			file_target = NULL;
+			err = ESP_FAIL;
+		}
+		if (file_mode == TARGET_FILE_READ || err != ESP_OK) {
+			platform_target_unlock();
+		}
+		file_stats.attach_ms = (esp_timer_get_time() - start) / 1000;
+
+		task_err = err;
+		xSemaphoreGive(task_opened);
+		if (err == ESP_OK) {
+			if (file_mode == TARGET_FILE_READ) {
+				target_file_read_ahead();
+			} else {
+				target_file_program();
+				platform_target_unlock();
+			}
+		}
+
+		platform_target_lock();
+		TRY_CATCH (e, EXCEPTION_ALL) {
+			target_file_release();
+		}
+		file_target = NULL;
+		platform_target_unlock();
+		xSemaphoreGive(task_finished);
+	}
+}
+
+static esp_err_t target_file_start_task(void)
+{
+	if (task_pid) {
+		return ESP_OK;
+	}
+	free_blocks = xQueueCreate(TARGET_FILE_BLOCKS, sizeof(struct target_file_block));
+	full_blocks = xQueueCreate(TARGET_FILE_BLOCKS + 1, sizeof(struct target_file_block));
+	task_opened = xSemaphoreCreateBinary();
+	task_finished = xSemaphoreCreateBinary();
+	if (!free_blocks || !full_blocks || !task_opened || !task_finished) {
+		return ESP_ERR_NO_MEM;
+	}
+	if (xTaskCreate(target_file_task, "target_file", 4096, NULL, TARGET_FILE_TASK_PRIO, &task_pid) != pdPASS) {
+		return ESP_ERR_NO_MEM;
+	}
+	return ESP_OK;
+}
+
+static void target_file_set_mode(enum target_file_mode mode)
+{
+	portENTER_CRITICAL(&file_mode_lock);
+	file_mode = mode;
+	portEXIT_CRITICAL(&file_mode_lock);
+}
+
+/* Release the buffers once the task is done with them */
+static void target_file_free(void)
+{
+	xQueueReset(full_blocks);
+	xQueueReset(free_blocks);
+	memset(&current, 0, sizeof(current));
+	free(block_memory);
+	block_memory = NULL;
+	target_file_set_mode(TARGET_FILE_CLOSED);
+}
+
+/* Hand `name` to the task and wait for it to find the target and work out
+   where the file is. `size` is what a written file is expected to be. */
+static esp_err_t target_file_start(const char *name, enum target_file_mode mode, uint32_t size)
+{
+	size_t block_size = (mode == TARGET_FILE_READ) ? TARGET_FILE_BLOCK_SIZE : TARGET_FILE_WRITE_BLOCK_SIZE;
+	int blocks = (mode == TARGET_FILE_READ) ? TARGET_FILE_BLOCKS : TARGET_FILE_WRITE_BLOCKS;
+	int i;
+
+	if (strncmp(name, TARGET_FILE_PREFIX, strlen(TARGET_FILE_PREFIX))) {
+		return ESP_ERR_NOT_FOUND;
+	}
+
+	/* The TFTP and HTTP servers run in different tasks, so the file is
+	   claimed before anything else is touched */
+	portENTER_CRITICAL(&file_mode_lock);
+	bool busy = file_mode != TARGET_FILE_CLOSED;
+	if (!busy) {
+		file_mode = mode;
+	}
+	portEXIT_CRITICAL(&file_mode_lock);
+	if (busy) {
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	esp_err_t err = target_file_start_task();
+	if (err != ESP_OK) {
+		target_file_set_mode(TARGET_FILE_CLOSED);
+		return err;
+	}
+
+	block_memory = malloc(TARGET_FILE_BLOCKS * TARGET_FILE_BLOCK_SIZE);
+	if (!block_memory) {
+		target_file_set_mode(TARGET_FILE_CLOSED);
+		return ESP_ERR_NO_MEM;
+	}
+	for (i = 0; i < blocks; i++) {
+		struct target_file_block block = {.data = block_memory + i * block_size};
+		xQueueSend(free_blocks, &block, 0);
+	}
+	memset(&current, 0, sizeof(current));
+	current_pos = 0;
+	file_written = 0;
+	file_received = 0;
+	file_crc = 0;
+	task_stop = false;
+	open_name = name;
+	file_size = size;
+
+	xTaskNotifyGive(task_pid);
+	xSemaphoreTake(task_opened, portMAX_DELAY);
+	if (task_err != ESP_OK) {
+		err = task_err;
+		target_file_close();
+		return err;
+	}
+	return ESP_OK;
+}
+
+esp_err_t target_file_open(const char *name, uint32_t *size)
+{
+	esp_err_t err = target_file_start(name, TARGET_FILE_READ, 0);
+	if (err != ESP_OK) {
+		return err;
+	}
+
+	ESP_LOGI(TAG, "reading %u bytes from 0x%08x", file_size, file_addr);
+	file_remaining = file_size;
+	*size = file_size;
+	return ESP_OK;
+}
+
+esp_err_t target_file_read(void *buf, size_t len, size_t *copied)
+{
+	uint8_t *out = buf;
+
+	*copied = 0;
+	if (file_mode != TARGET_FILE_READ) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	len = MIN(len, file_remaining);
+
+	while (*copied < len) {
+		if (!current.data) {
+			xQueueReceive(full_blocks, &current, portMAX_DELAY);
+			current_pos = 0;
+			if (current.len == 0) {
+				xQueueSend(free_blocks, &current, 0);
+				memset(&current, 0, sizeof(current));
+				return task_err;
+			}
+		}
+
+		size_t count = MIN(len - *copied, current.len - current_pos);
+		memcpy(out + *copied, current.data + current_pos, count);
+		*copied += count;
+		current_pos += count;
+		if (current_pos == current.len) {
+			xQueueSend(free_blocks, &current, 0);
+			memset(&current, 0, sizeof(current));
+		}
+	}
+	file_remaining -= len;
+	return ESP_OK;
+}
+
+esp_err_t target_file_create(const char *name, uint32_t size)
+{
+	esp_err_t err = target_file_start(name, TARGET_FILE_WRITE, size);
+	if (err != ESP_OK) {
+		return err;
+	}
+
+	ESP_LOGI(TAG, "programming %u bytes at 0x%08x", size, file_addr);
+	return ESP_OK;
+}
+
+esp_err_t target_file_write(const void *data, size_t len)
+{
+	const uint8_t *in = data;
+
+	if (file_mode != TARGET_FILE_WRITE) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	if (file_size && len > file_size - file_received) {
+		return ESP_ERR_INVALID_SIZE;
+	}
+
+	while (len) {
+		if (task_err != ESP_OK) {
+			return task_err;
+		}
+		if (!current.data) {
+			xQueueReceive(free_blocks, &current, portMAX_DELAY);
+		}
+
+		size_t count = MIN(len, TARGET_FILE_WRITE_BLOCK_SIZE - current.len);
+		memcpy(current.data + current.len, in, count);
+		current.len += count;
+		file_received += count;
+		in += count;
+		len -= count;
+		if (current.len == TARGET_FILE_WRITE_BLOCK_SIZE) {
+			xQueueSend(full_blocks, &current, portMAX_DELAY);
+			memset(&current, 0, sizeof(current));
+		}
+	}
+	return ESP_OK;
+}
+
+esp_err_t target_file_commit(void)
+{
+	struct target_file_block end = {0};
+
+	if (file_mode != TARGET_FILE_WRITE) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	/* A short image is abandoned rather than verified and run */
+	if (file_size && file_received != file_size) {
+		ESP_LOGE(TAG, "expected %u bytes, got %u", file_size, file_received);
+		target_file_close();
+		return ESP_ERR_INVALID_SIZE;
+	}
+	if (current.len) {
+		xQueueSend(full_blocks, &current, portMAX_DELAY);
+		memset(&current, 0, sizeof(current));
+	}
+	xQueueSend(full_blocks, &end, portMAX_DELAY);
+	xSemaphoreTake(task_finished, portMAX_DELAY);
+
+	esp_err_t err = task_err;
+	target_file_free();
+	return err;
+}
+
+void target_file_close(void)
+{
+	struct target_file_block block;
+
+	if (file_mode == TARGET_FILE_CLOSED) {
+		return;
+	}
+
+	task_stop = true;
+	if (file_mode == TARGET_FILE_WRITE) {
+		/* Programming stops at the end marker, whatever came before it */
+		struct target_file_block end = {0};
+		xQueueSend(full_blocks, &end, portMAX_DELAY);
+	} else if (current.data) {
+		xQueueSend(free_blocks, &current, 0);
+	}
+	memset(&current, 0, sizeof(current));
+
+	/* Keep handing blocks back until the reader notices it should stop */
+	while (xSemaphoreTake(task_finished, pdMS_TO_TICKS(10)) != pdTRUE) {
+		while (file_mode == TARGET_FILE_READ && xQueueReceive(full_blocks, &block, 0) == pdTRUE) {
+			xQueueSend(free_blocks, &block, 0);
+		}
+	}
+	target_file_free();
+}
+
+void target_file_get_stats(struct target_file_stats *stats)
+{
+	*stats = file_stats;
+}
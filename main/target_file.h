@@ -0,0 +1,77 @@
+#ifndef FARPATCH_TARGET_FILE_H__
+#define FARPATCH_TARGET_FILE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <esp_err.h>
+
+/* Names under this prefix are views of the target's address space rather
+ * than files on the probe:
+ *
+ *   target/flash.bin      the target's flash, from its lowest address up to
+ *                         the first gap between regions
+ *   target/flash@ADDR     the same from ADDR, in C notation (0x for hex)
+ *   target/mem@ADDR+LEN   LEN bytes from ADDR, which can only be read
+ *
+ * The target GDB has attached to is used if there is one. Otherwise the
+ * debug port is scanned and the first target found is attached for as
+ * long as the file is open.
+ */
+#define TARGET_FILE_PREFIX "target/"
+
+struct target_file_stats {
+	/* Driver of the target that was used, empty if there was none */
+	char driver[32];
+	uint32_t bytes;
+	/* Time spent finding and attaching to the target, then in each phase of
+	   programming it */
+	uint32_t attach_ms;
+	uint32_t erase_ms;
+	uint32_t program_ms;
+	uint32_t verify_ms;
+};
+
+/* Start reading `name` (including the prefix), returning its size. Target
+   memory is read ahead in the background, a block at a time, so reads
+   overlap with whatever the caller does with the data. Only one file can
+   be open at a time. ESP_ERR_NOT_FOUND if the name is not recognised or
+   there is no target.
+ */
+esp_err_t target_file_open(const char *name, uint32_t *size);
+
+/* Copy the next `len` bytes of the file, waiting for them to be read from
+   the target. Fewer are copied only at the end of the file. ESP_FAIL if the
+   target could not be read.
+ */
+esp_err_t target_file_read(void *buf, size_t len, size_t *copied);
+
+/* Start programming flash from the address `name` gives. `size` is checked
+   against the flash there, and may be 0 if it isn't known. Only the sectors
+   the data ends up covering are erased. The debug port is held until the
+   file is committed or closed.
+ */
+esp_err_t target_file_create(const char *name, uint32_t size);
+
+/* Queue data to be programmed. Returns once it has been copied, unless both
+   buffers are waiting for flash. A programming failure is reported by the
+   next call.
+ */
+esp_err_t target_file_write(const void *data, size_t len);
+
+/* Program anything still buffered, then read the image back and compare
+   its CRC with that of the data written. If it matches the target is
+   reset. ESP_ERR_INVALID_CRC if it doesn't.
+ */
+esp_err_t target_file_commit(void);
+
+/* Stop reading, or abandon programming, and let go of the target */
+void target_file_close(void);
+
+/* What the most recent file was opened or programmed on, and how long each
+   step took. Valid from when the file is opened, and complete once it is
+   committed.
+ */
+void target_file_get_stats(struct target_file_stats *stats);
+
+#endif /* FARPATCH_TARGET_FILE_H__ */
@@ -0,0 +1,287 @@
+/*
+ * Storage for the offline programming image.
+ *
+ * The first sector of the partition holds a header describing the image,
+ * and the image itself follows it. Storing an image erases the header
+ * first and writes it again last, so the partition only ever describes an
+ * image that was received in full and matched its digest.
+ *
+ * Uploads and runs happen on different tasks, so the image is claimed
+ * before it is touched: by one upload storing a new image, or by any
+ * number of readers describing or programming the stored one.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include <freertos/FreeRTOS.h>
+
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
+#include "mbedtls/sha256.h"
+
+#include "target_image.h"
+
+#define TAG "target-image"
+
+#define TARGET_IMAGE_PARTITION_LABEL   "target"
+#define TARGET_IMAGE_PARTITION_SUBTYPE 0x40
+#define TARGET_IMAGE_MAGIC             0x49545046 /* "FPTI" */
+#define TARGET_IMAGE_SECTOR_SIZE       4096
+#define TARGET_IMAGE_DATA_OFFSET       TARGET_IMAGE_SECTOR_SIZE
+
+struct target_image_header {
+	uint32_t magic;
+	uint32_t header_size;
+	struct target_image_info info;
+	/* Of everything above */
+	uint32_t crc;
+};
+
+enum target_image_state {
+	TARGET_IMAGE_UNCHECKED,
+	TARGET_IMAGE_NONE,
+	TARGET_IMAGE_VALID,
+	TARGET_IMAGE_CORRUPT,
+};
+
+static const esp_partition_t *image_part;
+static enum target_image_state image_state;
+static struct target_image_info image_info;
+
+/* Who has the image. An upload needs it to itself, and the first reader
+   after boot does too while it checks the digest. */
+static portMUX_TYPE image_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool writing;
+static uint32_t readers;
+
+static uint32_t write_pos;
+static mbedtls_sha256_context write_sha;
+
+static esp_partition_mmap_handle_t map_handle;
+static bool mapped;
+
+static const esp_partition_t *target_image_partition(void)
+{
+	if (!image_part) {
+		image_part = esp_partition_find_first(
+			ESP_PARTITION_TYPE_DATA, TARGET_IMAGE_PARTITION_SUBTYPE, TARGET_IMAGE_PARTITION_LABEL);
+		if (!image_part) {
+			ESP_LOGE(TAG, "no \"%s\" partition", TARGET_IMAGE_PARTITION_LABEL);
+		}
+	}
+	return image_part;
+}
+
+static uint32_t target_image_header_crc(const struct target_image_header *header)
+{
+	return esp_rom_crc32_le(0, (const uint8_t *)header, offsetof(struct target_image_header, crc));
+}
+
+static void target_image_end_write(void)
+{
+	portENTER_CRITICAL(&image_lock);
+	writing = false;
+	portEXIT_CRITICAL(&image_lock);
+}
+
+esp_err_t target_image_begin(const struct target_image_info *info)
+{
+	const esp_partition_t *part = target_image_partition();
+	if (!part) {
+		return ESP_ERR_NOT_FOUND;
+	}
+	if (info->size == 0 || info->size > part->size - TARGET_IMAGE_DATA_OFFSET) {
+		ESP_LOGE(TAG, "%u byte image doesn't fit in %u bytes", info->size, part->size - TARGET_IMAGE_DATA_OFFSET);
+		return ESP_ERR_INVALID_SIZE;
+	}
+
+	portENTER_CRITICAL(&image_lock);
+	bool busy = writing || readers > 0;
+	if (!busy) {
+		writing = true;
+	}
+	portEXIT_CRITICAL(&image_lock);
+	if (busy) {
+		ESP_LOGE(TAG, "the image is in use");
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	int64_t start = esp_timer_get_time();
+	uint32_t erase_len = TARGET_IMAGE_DATA_OFFSET + info->size;
+	erase_len = (erase_len + TARGET_IMAGE_SECTOR_SIZE - 1) & ~(TARGET_IMAGE_SECTOR_SIZE - 1);
+	image_state = TARGET_IMAGE_NONE;
+	esp_err_t err = esp_partition_erase_range(part, 0, erase_len);
+	if (err != ESP_OK) {
+		ESP_LOGE(TAG, "unable to erase the image partition: %s", esp_err_to_name(err));
+		target_image_end_write();
+		return err;
+	}
+	ESP_LOGI(TAG, "erased %u bytes in %u ms", erase_len, (uint32_t)((esp_timer_get_time() - start) / 1000));
+
+	image_info = *info;
+	memset(image_info.sha256, 0, sizeof(image_info.sha256));
+	write_pos = 0;
+	mbedtls_sha256_init(&write_sha);
+	mbedtls_sha256_starts(&write_sha, 0);
+	return ESP_OK;
+}
+
+esp_err_t target_image_write(const void *data, size_t len)
+{
+	if (!writing) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	if (len > image_info.size - write_pos) {
+		return ESP_ERR_INVALID_SIZE;
+	}
+
+	esp_err_t err = esp_partition_write(image_part, TARGET_IMAGE_DATA_OFFSET + write_pos, data, len);
+	if (err != ESP_OK) {
+		return err;
+	}
+	mbedtls_sha256_update(&write_sha, data, len);
+	write_pos += len;
+	return ESP_OK;
+}
+
+esp_err_t target_image_finish(const uint8_t expected[TARGET_IMAGE_DIGEST_SIZE])
+{
+	struct target_image_header header = {
+		.magic = TARGET_IMAGE_MAGIC,
+		.header_size = sizeof(header),
+	};
+
+	if (!writing) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	if (write_pos != image_info.size) {
+		ESP_LOGE(TAG, "expected %u bytes, got %u", image_info.size, write_pos);
+		target_image_abort();
+		return ESP_ERR_INVALID_SIZE;
+	}
+	mbedtls_sha256_finish(&write_sha, image_info.sha256);
+	mbedtls_sha256_free(&write_sha);
+	if (expected && memcmp(expected, image_info.sha256, TARGET_IMAGE_DIGEST_SIZE)) {
+		ESP_LOGE(TAG, "image SHA-256 doesn't match");
+		target_image_end_write();
+		return ESP_ERR_INVALID_CRC;
+	}
+
+	header.info = image_info;
+	header.crc = target_image_header_crc(&header);
+	esp_err_t err = esp_partition_write(image_part, 0, &header, sizeof(header));
+	if (err == ESP_OK) {
+		image_state = TARGET_IMAGE_VALID;
+		ESP_LOGI(TAG, "stored %u byte image for 0x%08x", image_info.size, image_info.addr);
+	}
+	target_image_end_write();
+	return err;
+}
+
+void target_image_abort(void)
+{
+	if (writing) {
+		mbedtls_sha256_free(&write_sha);
+		target_image_end_write();
+	}
+}
+
+/* Read the header and hash the image it describes */
+static enum target_image_state target_image_check(void)
+{
+	struct target_image_header header;
+	uint8_t digest[TARGET_IMAGE_DIGEST_SIZE];
+	const void *data;
+
+	if (esp_partition_read(image_part, 0, &header, sizeof(header)) != ESP_OK || header.magic != TARGET_IMAGE_MAGIC) {
+		return TARGET_IMAGE_NONE;
+	}
+	if (header.header_size != sizeof(header) || header.crc != target_image_header_crc(&header) ||
+		header.info.size > image_part->size - TARGET_IMAGE_DATA_OFFSET) {
+		ESP_LOGE(TAG, "image header is corrupt");
+		return TARGET_IMAGE_CORRUPT;
+	}
+	image_info = header.info;
+
+	int64_t start = esp_timer_get_time();
+	if (target_image_map(&data) != ESP_OK) {
+		return TARGET_IMAGE_CORRUPT;
+	}
+	mbedtls_sha256(data, image_info.size, digest, 0);
+	target_image_unmap();
+	if (memcmp(digest, image_info.sha256, sizeof(digest))) {
+		ESP_LOGE(TAG, "image SHA-256 doesn't match");
+		return TARGET_IMAGE_CORRUPT;
+	}
+	ESP_LOGI(TAG, "%u byte image for 0x%08x checked in %u ms", image_info.size, image_info.addr,
+		(uint32_t)((esp_timer_get_time() - start) / 1000));
+	return TARGET_IMAGE_VALID;
+}
+
+esp_err_t target_image_get(struct target_image_info *info)
+{
+	if (!target_image_partition()) {
+		return ESP_ERR_NOT_FOUND;
+	}
+
+	portENTER_CRITICAL(&image_lock);
+	bool busy = writing || (image_state == TARGET_IMAGE_UNCHECKED && readers > 0);
+	if (!busy) {
+		readers++;
+	}
+	portEXIT_CRITICAL(&image_lock);
+	if (busy) {
+		return ESP_ERR_INVALID_STATE;
+	}
+
+	if (image_state == TARGET_IMAGE_UNCHECKED) {
+		image_state = target_image_check();
+	}
+
+	switch (image_state) {
+	case TARGET_IMAGE_VALID:
+		*info = image_info;
+		return ESP_OK;
+	case TARGET_IMAGE_CORRUPT:
+		target_image_put();
+		return ESP_ERR_INVALID_CRC;
+	default:
+		target_image_put();
+		return ESP_ERR_NOT_FOUND;
+	}
+}
+
+void target_image_put(void)
+{
+	portENTER_CRITICAL(&image_lock);
+	if (readers > 0) {
+		readers--;
+	}
+	portEXIT_CRITICAL(&image_lock);
+}
+
+esp_err_t target_image_map(const void **data)
+{
+	if (mapped || !image_part) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	esp_err_t err = esp_partition_mmap(
+		image_part, TARGET_IMAGE_DATA_OFFSET, image_info.size, ESP_PARTITION_MMAP_DATA, data, &map_handle);
+	if (err != ESP_OK) {
+		ESP_LOGE(TAG, "unable to map the image: %s", esp_err_to_name(err));
+		return err;
+	}
+	mapped = true;
+	return ESP_OK;
+}
+
+void target_image_unmap(void)
+{
+	if (mapped) {
+		esp_partition_munmap(map_handle);
+		mapped = false;
+	}
+}
@@ -0,0 +1,62 @@
+#ifndef FARPATCH_TARGET_IMAGE_H__
+#define FARPATCH_TARGET_IMAGE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <esp_err.h>
+
+/* A target image kept on the probe for offline programming, stored in the
+ * "target" data partition. Only one image is kept. Its description is
+ * written after the data, so an interrupted upload leaves no image rather
+ * than a partial one.
+ */
+
+#define TARGET_IMAGE_DIGEST_SIZE 32
+#define TARGET_IMAGE_NAME_SIZE   32
+
+struct target_image_info {
+	/* Where in the target's flash the image goes */
+	uint32_t addr;
+	uint32_t size;
+	uint8_t sha256[TARGET_IMAGE_DIGEST_SIZE];
+	/* If set, only targets whose driver name starts with this are programmed */
+	char target[TARGET_IMAGE_NAME_SIZE];
+	/* Anything the uploader wants to see in the status, such as a file name */
+	char label[TARGET_IMAGE_NAME_SIZE];
+};
+
+/* Start replacing the stored image with one described by `info`, whose
+   sha256 is ignored. The old image is erased straight away. ESP_ERR_NOT_FOUND
+   if there is no partition for it, ESP_ERR_INVALID_SIZE if it won't fit and
+   ESP_ERR_INVALID_STATE if it is being stored or read already.
+ */
+esp_err_t target_image_begin(const struct target_image_info *info);
+
+esp_err_t target_image_write(const void *data, size_t len);
+
+/* Check the image is complete and, if `expected` isn't NULL, that it has
+   that SHA-256, then record it. ESP_ERR_INVALID_CRC if the digest differs.
+ */
+esp_err_t target_image_finish(const uint8_t expected[TARGET_IMAGE_DIGEST_SIZE]);
+
+/* Give up on the image being stored, leaving none */
+void target_image_abort(void);
+
+/* Describe the stored image and keep it from being replaced until
+   target_image_put(). The first call after boot checks the data against its
+   SHA-256. ESP_ERR_NOT_FOUND if there is no image, ESP_ERR_INVALID_CRC if it
+   has been corrupted, and ESP_ERR_INVALID_STATE while one is being stored
+   or checked. Only ESP_OK needs a target_image_put().
+ */
+esp_err_t target_image_get(struct target_image_info *info);
+void target_image_put(void);
+
+/* Map the stored image, between target_image_get() and target_image_put().
+   The pointer stays valid until target_image_unmap().
+ */
+esp_err_t target_image_map(const void **data);
+void target_image_unmap(void);
+
+#endif /* FARPATCH_TARGET_IMAGE_H__ */
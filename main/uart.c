@@ -17,6 +17,7 @@
 #include "general.h"
 
 #include "CBUF.h"
+#include "baud_detect.h"
 #include "http.h"
 #include "tinyprintf.h"
 #include "uart.h"
@@ -222,6 +223,10 @@ static void uart_config(void)
 	extern nvs_handle h_nvs_conf;
 	uint32_t baud = 115200;
 	nvs_get_u32(h_nvs_conf, "uartbaud", &baud);
+	bool autobaud = (baud == BAUD_AUTO);
+	if (autobaud) {
+		baud = 115200;
+	}
 
 	uart_config_t uart_config = {
 		.baud_rate = baud,
@@ -246,6 +251,10 @@ static void uart_config(void)
 
 	ESP_ERROR_CHECK(uart_intr_config(CONFIG_TARGET_UART_IDX, &uart_intr));
 	uart_set_baudrate(CONFIG_TARGET_UART_IDX, baud);
+
+	if (autobaud) {
+		baud_detect_start(CONFIG_TARGET_UART_IDX, NULL, NULL);
+	}
 }
 
 static void IRAM_ATTR uart_rx_task(void *parameters)
@@ -267,6 +276,7 @@ static void IRAM_ATTR uart_rx_task(void *parameters)
 				uart_overrun_cnt++;
 			} else if (evt.type == UART_FRAME_ERR) {
 				uart_frame_error_cnt++;
+				baud_detect_frame_error(CONFIG_TARGET_UART_IDX);
 			} else if (evt.type == UART_BUFFER_FULL) {
 				uart_queue_full_cnt++;
 			}
@@ -278,6 +288,10 @@ static void IRAM_ATTR uart_rx_task(void *parameters)
 			}
 
 			uart_rx_count += count;
+			if (baud_detect_is_measuring(CONFIG_TARGET_UART_IDX)) {
+				// Data received at the wrong rate is noise.
+				continue;
+			}
 			http_term_broadcast_data(buf, count);
 
 			if (tcp_client_sock) {
@@ -1,18 +1,21 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include <esp_http_server.h>
 #include "lwip/sockets.h"
 #include "websocket.h"
+#include "wsmux.h"
 #include "driver/uart.h"
 
 #include <esp_log.h>
 
-static int debug_handles[8];
-static int rtt_handles[8];
-static int uart_handles[8];
 extern httpd_handle_t http_daemon;
 
 struct websocket_config {
-	int *handles;
-	uint32_t handle_count;
+	enum wsmux_channel channel;
+	/* Pass each frame to recv_cb in one piece rather than a buffer at a time */
+	bool whole_frames;
 	void (*recv_cb)(httpd_handle_t handle, httpd_req_t *req, uint8_t *data, int len);
 };
 
@@ -29,59 +32,68 @@ static void on_uart_receive(httpd_handle_t server, httpd_req_t *req, uint8_t *da
 
 static void on_debug_receive(httpd_handle_t server, httpd_req_t *req, uint8_t *data, int len)
 {
-	ESP_LOGI(__func__, "received text from debug channel: %s", data);
+	ESP_LOGI(__func__, "received text from debug channel: %.*s", len, data);
+}
+
+static void on_swo_receive(httpd_handle_t server, httpd_req_t *req, uint8_t *data, int len)
+{
+	// SWO is output-only
 }
 
 const struct websocket_config debug_websocket = {
-	.handles = debug_handles,
-	.handle_count = sizeof(debug_handles) / sizeof(debug_handles[0]),
+	.channel = WSMUX_CHANNEL_DEBUG,
 	.recv_cb = on_debug_receive,
 };
 
 const struct websocket_config uart_websocket = {
-	.handles = uart_handles,
-	.handle_count = sizeof(uart_handles) / sizeof(uart_handles[0]),
+	.channel = WSMUX_CHANNEL_UART,
 	.recv_cb = on_uart_receive,
 };
 
 const struct websocket_config rtt_websocket = {
-	.handles = rtt_handles,
-	.handle_count = sizeof(rtt_handles) / sizeof(rtt_handles[0]),
+	.channel = WSMUX_CHANNEL_RTT,
 	.recv_cb = on_rtt_receive,
 };
 
-static void websocket_broadcast(httpd_handle_t hd, int *handles, int handle_max, uint8_t *buffer, size_t count)
-{
-	if (hd == NULL) {
-		return;
-	}
-	httpd_ws_frame_t ws_pkt;
-	memset(&ws_pkt, 0, sizeof(httpd_ws_frame_t));
+const struct websocket_config swo_websocket = {
+	.channel = WSMUX_CHANNEL_SWO,
+	.recv_cb = on_swo_receive,
+};
 
-	int i;
-	for (i = 0; i < handle_max; i++) {
-		if (handles[i] == 0) {
-			continue;
-		}
-		ws_pkt.payload = buffer;
-		ws_pkt.len = count;
-		ws_pkt.type = HTTPD_WS_TYPE_BINARY;
-		int ret = httpd_ws_send_frame_async(hd, handles[i], &ws_pkt);
-		if (ret != ESP_OK) {
-			ESP_LOGE(__func__, "sockfd %d (index %d) is invalid! connection closed?", handles[i], i);
-			handles[i] = 0;
-		}
-	}
-}
+const struct websocket_config mux_websocket = {
+	.channel = WSMUX_CHANNEL_CONTROL,
+	.whole_frames = true,
+	.recv_cb = wsmux_receive,
+};
+
+const struct websocket_config pcsample_websocket = {
+	.channel = WSMUX_CHANNEL_PCSAMPLE,
+	.recv_cb = on_swo_receive,
+};
 
 void http_term_broadcast_data(uint8_t *data, size_t len)
 {
-	websocket_broadcast(http_daemon, uart_handles, sizeof(uart_handles) / sizeof(uart_handles[0]), data, len);
+	wsmux_publish(WSMUX_CHANNEL_UART, data, len, 0);
 }
 
 void http_term_broadcast_rtt(uint8_t *data, size_t len)
 {
-	websocket_broadcast(http_daemon, rtt_handles, sizeof(rtt_handles) / sizeof(rtt_handles[0]), data, len);
+	wsmux_publish(WSMUX_CHANNEL_RTT, data, len, 0);
+}
+
+void http_term_broadcast_swo(uint8_t *data, size_t len)
+{
+	wsmux_publish(WSMUX_CHANNEL_SWO, data, len, 0);
+}
+
+void http_term_broadcast_pcsample(uint8_t *data, size_t len)
+{
+	wsmux_publish(WSMUX_CHANNEL_PCSAMPLE, data, len, 0);
+}
+
+void http_term_broadcast_ota(uint8_t *data, size_t len)
+{
+	wsmux_publish(WSMUX_CHANNEL_OTA, data, len, WSMUX_FLAG_END);
 }
 
 void http_debug_putc(uint8_t c, int flush)
@@ -91,11 +103,78 @@ void http_debug_putc(uint8_t c, int flush)
 
 	buf[bufsize++] = c;
 	if (flush || (bufsize == sizeof(buf))) {
-		websocket_broadcast(http_daemon, debug_handles, sizeof(debug_handles) / sizeof(debug_handles[0]), buf, bufsize);
+		wsmux_publish(WSMUX_CHANNEL_DEBUG, buf, bufsize, 0);
 		bufsize = 0;
 	}
 }
 
+/* Frames are received into a fixed pool of buffers. A frame takes as many
+ * adjacent buffers as it needs; anything bigger than the whole pool comes
+ * from the heap, up to CONFIG_WEBSOCKET_MAX_FRAME_SIZE. Larger frames get
+ * the connection closed rather than a buffer.
+ */
+#define WEBSOCKET_RX_POOL_SIZE (CONFIG_WEBSOCKET_RX_BUFFERS * CONFIG_WEBSOCKET_RX_BUFFER_SIZE)
+
+#define WEBSOCKET_CLOSE_TOO_BIG        1009
+#define WEBSOCKET_CLOSE_INTERNAL_ERROR 1011
+
+static uint8_t rx_pool[CONFIG_WEBSOCKET_RX_BUFFERS][CONFIG_WEBSOCKET_RX_BUFFER_SIZE];
+static uint32_t rx_pool_used;
+static struct websocket_rx_stats rx_stats;
+
+static uint32_t websocket_rx_mask(int first, size_t len)
+{
+	int count = (len + CONFIG_WEBSOCKET_RX_BUFFER_SIZE - 1) / CONFIG_WEBSOCKET_RX_BUFFER_SIZE;
+	return (uint32_t)(((1ULL << count) - 1) << first);
+}
+
+static uint8_t *websocket_rx_alloc(size_t len)
+{
+	int i;
+
+	if (len <= WEBSOCKET_RX_POOL_SIZE) {
+		for (i = 0; i < CONFIG_WEBSOCKET_RX_BUFFERS; i++) {
+			if ((i * CONFIG_WEBSOCKET_RX_BUFFER_SIZE) + len > WEBSOCKET_RX_POOL_SIZE) {
+				break;
+			}
+			uint32_t mask = websocket_rx_mask(i, len);
+			if (!(rx_pool_used & mask)) {
+				rx_pool_used |= mask;
+				rx_stats.hits++;
+				return rx_pool[i];
+			}
+		}
+	}
+	rx_stats.misses++;
+	return malloc(len);
+}
+
+static void websocket_rx_free(uint8_t *buffer, size_t len)
+{
+	if (buffer >= rx_pool[0] && buffer < rx_pool[0] + WEBSOCKET_RX_POOL_SIZE) {
+		rx_pool_used &= ~websocket_rx_mask((buffer - rx_pool[0]) / CONFIG_WEBSOCKET_RX_BUFFER_SIZE, len);
+	} else {
+		free(buffer);
+	}
+}
+
+static void websocket_close(httpd_req_t *req, uint16_t code)
+{
+	uint8_t payload[2] = {code >> 8, code & 0xff};
+	httpd_ws_frame_t ws_pkt;
+
+	memset(&ws_pkt, 0, sizeof(httpd_ws_frame_t));
+	ws_pkt.type = HTTPD_WS_TYPE_CLOSE;
+	ws_pkt.payload = payload;
+	ws_pkt.len = sizeof(payload);
+	httpd_ws_send_frame(req, &ws_pkt);
+}
+
+void websocket_rx_get_stats(struct websocket_rx_stats *stats)
+{
+	*stats = rx_stats;
+}
+
 esp_err_t cgi_websocket(httpd_req_t *req)
 {
 	esp_err_t ret;
@@ -105,16 +184,13 @@ esp_err_t cgi_websocket(httpd_req_t *req)
 	if (req->method == HTTP_GET) {
 		int sockfd = httpd_req_to_sockfd(req);
 		ESP_LOGI(__func__, "handshake done on %s, the new connection was opened with sockfd %d", req->uri, sockfd);
-		int i;
-		for (i = 0; i < cfg->handle_count; i++) {
-			if (cfg->handles[i] == 0) {
-				int opt = 1;
-				setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, (void *)&opt, sizeof(opt));
-				cfg->handles[i] = sockfd;
-				return ESP_OK;
-			}
+		if (wsmux_add_client(sockfd, cfg->channel) != ESP_OK) {
+			ESP_LOGE(__func__, "no free sockets to handle this connection");
+			return ESP_OK;
 		}
-		ESP_LOGE(__func__, "no free sockets to handle this connection");
+		// Frames are already coalesced by the broadcaster
+		int opt = 1;
+		setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, (void *)&opt, sizeof(opt));
 		return ESP_OK;
 	}
 
@@ -132,36 +208,46 @@ esp_err_t cgi_websocket(httpd_req_t *req)
 		return ESP_OK;
 	}
 
-	uint8_t *buffer = NULL;
-	uint8_t stack_buffer[256];
-	if (ws_pkt.len < sizeof(stack_buffer)) {
-		ws_pkt.payload = stack_buffer;
-	} else {
-		buffer = malloc(ws_pkt.len);
-		ws_pkt.payload = buffer;
+	if (ws_pkt.len > CONFIG_WEBSOCKET_MAX_FRAME_SIZE) {
+		ESP_LOGW(__func__, "closing sockfd %d after a %u byte frame", httpd_req_to_sockfd(req), ws_pkt.len);
+		rx_stats.oversize++;
+		websocket_close(req, WEBSOCKET_CLOSE_TOO_BIG);
+		return ESP_FAIL;
+	}
+
+	uint8_t *buffer = websocket_rx_alloc(ws_pkt.len);
+	if (!buffer) {
+		websocket_close(req, WEBSOCKET_CLOSE_INTERNAL_ERROR);
+		return ESP_ERR_NO_MEM;
 	}
+	ws_pkt.payload = buffer;
 	ret = httpd_ws_recv_frame(req, &ws_pkt, ws_pkt.len);
 	if (ret != ESP_OK) {
 		ESP_LOGE(__func__, "httpd_ws_recv_frame frame unable to receive data: %d", ret);
-		if (buffer) {
-			free(buffer);
-		}
+		websocket_rx_free(buffer, ws_pkt.len);
 		return ret;
 	}
 
 	// ESP_LOGI(__func__, "Packet type: %d", ws_pkt.type);
 
 	void (*recv_func)(httpd_handle_t handle, httpd_req_t * req, uint8_t * data, int len) = cfg->recv_cb;
-	if (recv_func) {
-		// ESP_LOGI(__func__, "going to call rect_func at %p", recv_func);
+	if (!recv_func) {
+		ESP_LOGE(__func__, "receive function was NULL");
+	} else if (cfg->whole_frames) {
 		recv_func(http_daemon, req, ws_pkt.payload, ws_pkt.len);
 	} else {
-		ESP_LOGE(__func__, "receive function was NULL");
-	}
-
-	if (buffer) {
-		free(buffer);
+		// Hand the data over a buffer at a time, so that callbacks only
+		// ever see bounded chunks however large the frame was
+		size_t offset;
+		for (offset = 0; offset < ws_pkt.len; offset += CONFIG_WEBSOCKET_RX_BUFFER_SIZE) {
+			size_t len = ws_pkt.len - offset;
+			if (len > CONFIG_WEBSOCKET_RX_BUFFER_SIZE) {
+				len = CONFIG_WEBSOCKET_RX_BUFFER_SIZE;
+			}
+			recv_func(http_daemon, req, ws_pkt.payload + offset, len);
+		}
 	}
 
+	websocket_rx_free(buffer, ws_pkt.len);
 	return ESP_OK;
 }
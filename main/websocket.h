@@ -4,13 +4,26 @@
 #include <stdint.h>
 
 esp_err_t cgi_websocket(httpd_req_t *req);
+
+struct websocket_rx_stats {
+	uint32_t hits;     /* frames received into the buffer pool */
+	uint32_t misses;   /* frames too big for the pool, received into the heap */
+	uint32_t oversize; /* frames over CONFIG_WEBSOCKET_MAX_FRAME_SIZE, which closed the connection */
+};
+void websocket_rx_get_stats(struct websocket_rx_stats *stats);
 void http_debug_putc(uint8_t c, int flush);
 void http_term_broadcast_rtt(uint8_t *data, size_t len);
 void http_term_broadcast_data(uint8_t *data, size_t len);
+void http_term_broadcast_swo(uint8_t *data, size_t len);
+void http_term_broadcast_pcsample(uint8_t *data, size_t len);
+void http_term_broadcast_ota(uint8_t *data, size_t len);
 
 struct websocket_config;
 extern const struct websocket_config debug_websocket;
 extern const struct websocket_config uart_websocket;
 extern const struct websocket_config rtt_websocket;
+extern const struct websocket_config swo_websocket;
+extern const struct websocket_config pcsample_websocket;
+extern const struct websocket_config mux_websocket;
 
 #endif /* _FP_WEBSOCKET_H_ */
\ No newline at end of file
@@ -0,0 +1,252 @@
+/*
+ * The web UI partition.
+ *
+ * The partition is mapped whole while the web UI is mounted, and frogfs and
+ * the routing table both work straight out of the mapping. An update unmaps
+ * it, writes the new image sector by sector, erasing just ahead of the data
+ * so an upload of unknown size costs no more erasing than it needs, and
+ * then maps and checks it as at boot. A partial image never passes its
+ * SHA-256, so an interrupted update leaves the fallback page rather than a
+ * broken UI.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_timer.h"
+#include "mbedtls/sha256.h"
+
+#include "frogfs_routes.h"
+#include "webui.h"
+
+#define TAG "webui"
+
+#define WEBUI_PARTITION_LABEL   "webui"
+#define WEBUI_PARTITION_SUBTYPE 0x41
+#define WEBUI_MAGIC             0x49555046 /* "FPUI" */
+#define WEBUI_SECTOR_SIZE       4096
+#define WEBUI_DIGEST_SIZE       32
+
+/* Written by pack_image() in tools/frogfs_routes.py. Offsets are from the
+   start of the partition. */
+struct webui_header {
+	uint32_t magic;
+	uint32_t header_size;
+	uint32_t routes_offset;
+	uint32_t routes_len;
+	uint32_t frogfs_offset;
+	uint32_t frogfs_len;
+	/* Of everything from the end of the header to the end of the frogfs image */
+	uint8_t sha256[WEBUI_DIGEST_SIZE];
+};
+
+static SemaphoreHandle_t webui_mutex;
+static const esp_partition_t *webui_part;
+static frogfs_fs_t *webui_frogfs;
+static frogfs_config_t webui_frogfs_config;
+static esp_partition_mmap_handle_t map_handle;
+static bool mapped;
+
+static bool updating;
+static size_t update_size;
+static uint32_t update_pos;
+static uint32_t update_erased;
+
+/* Check that the mapped partition holds an image that is complete within
+   its first `limit` bytes */
+static esp_err_t webui_check(const uint8_t *base, size_t limit, struct webui_header *header)
+{
+	uint8_t digest[WEBUI_DIGEST_SIZE];
+
+	if (limit < sizeof(*header)) {
+		return ESP_ERR_INVALID_CRC;
+	}
+	memcpy(header, base, sizeof(*header));
+	if (header->magic != WEBUI_MAGIC) {
+		ESP_LOGW(TAG, "no web UI image");
+		return ESP_ERR_INVALID_CRC;
+	}
+	if (header->header_size != sizeof(*header) || header->routes_offset < header->header_size ||
+		header->routes_offset > limit || header->routes_len > limit - header->routes_offset ||
+		header->frogfs_offset < header->routes_offset + header->routes_len || header->frogfs_offset > limit ||
+		header->frogfs_len > limit - header->frogfs_offset) {
+		ESP_LOGE(TAG, "web UI header is corrupt");
+		return ESP_ERR_INVALID_CRC;
+	}
+
+	int64_t start = esp_timer_get_time();
+	mbedtls_sha256(base + header->header_size, header->frogfs_offset + header->frogfs_len - header->header_size,
+		digest, 0);
+	if (memcmp(digest, header->sha256, sizeof(digest))) {
+		ESP_LOGE(TAG, "web UI SHA-256 doesn't match");
+		return ESP_ERR_INVALID_CRC;
+	}
+	ESP_LOGI(TAG, "%u byte web UI checked in %u ms", header->frogfs_offset + header->frogfs_len,
+		(uint32_t)((esp_timer_get_time() - start) / 1000));
+	return ESP_OK;
+}
+
+static void webui_unmount(void)
+{
+	frogfs_routes_deinit();
+	if (webui_frogfs) {
+		frogfs_deinit(webui_frogfs);
+		webui_frogfs = NULL;
+	}
+	if (mapped) {
+		esp_partition_munmap(map_handle);
+		mapped = false;
+	}
+}
+
+/* Map the partition and mount the image in its first `limit` bytes */
+static esp_err_t webui_mount(size_t limit)
+{
+	struct webui_header header;
+	const void *base;
+
+	esp_err_t err = esp_partition_mmap(webui_part, 0, webui_part->size, ESP_PARTITION_MMAP_DATA, &base, &map_handle);
+	if (err != ESP_OK) {
+		ESP_LOGE(TAG, "unable to map the web UI: %s", esp_err_to_name(err));
+		return err;
+	}
+	mapped = true;
+
+	err = webui_check(base, limit, &header);
+	if (err != ESP_OK) {
+		webui_unmount();
+		return err;
+	}
+
+	webui_frogfs_config.addr = (const uint8_t *)base + header.frogfs_offset;
+	webui_frogfs = frogfs_init(&webui_frogfs_config);
+	if (!webui_frogfs ||
+		!frogfs_routes_init(webui_frogfs, (const uint8_t *)base + header.routes_offset, header.routes_len)) {
+		ESP_LOGE(TAG, "unable to mount the web UI");
+		webui_unmount();
+		return ESP_ERR_INVALID_CRC;
+	}
+	return ESP_OK;
+}
+
+void webui_init(void)
+{
+	webui_mutex = xSemaphoreCreateMutex();
+	webui_part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, WEBUI_PARTITION_SUBTYPE, WEBUI_PARTITION_LABEL);
+	if (!webui_part) {
+		ESP_LOGE(TAG, "no \"%s\" partition", WEBUI_PARTITION_LABEL);
+		return;
+	}
+	if (webui_mount(webui_part->size) != ESP_OK) {
+		ESP_LOGW(TAG, "serving the fallback page");
+	}
+}
+
+void webui_lock(void)
+{
+	xSemaphoreTake(webui_mutex, portMAX_DELAY);
+}
+
+void webui_unlock(void)
+{
+	xSemaphoreGive(webui_mutex);
+}
+
+frogfs_fs_t *webui_fs(void)
+{
+	return webui_frogfs;
+}
+
+esp_err_t webui_update_begin(size_t size)
+{
+	if (!webui_part) {
+		return ESP_ERR_NOT_FOUND;
+	}
+	if (size > webui_part->size) {
+		ESP_LOGE(TAG, "%u byte web UI doesn't fit in %u bytes", size, webui_part->size);
+		return ESP_ERR_INVALID_SIZE;
+	}
+
+	webui_lock();
+	if (updating) {
+		webui_unlock();
+		return ESP_ERR_INVALID_STATE;
+	}
+	webui_unmount();
+	updating = true;
+	webui_unlock();
+
+	update_size = size;
+	update_pos = 0;
+	update_erased = 0;
+	return ESP_OK;
+}
+
+esp_err_t webui_update_write(const void *data, size_t len)
+{
+	if (!updating) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	if (len > webui_part->size - update_pos || (update_size && len > update_size - update_pos)) {
+		return ESP_ERR_INVALID_SIZE;
+	}
+
+	uint32_t end = update_pos + len;
+	if (end > update_erased) {
+		uint32_t erase_end = (end + WEBUI_SECTOR_SIZE - 1) & ~(WEBUI_SECTOR_SIZE - 1);
+		esp_err_t err = esp_partition_erase_range(webui_part, update_erased, erase_end - update_erased);
+		if (err != ESP_OK) {
+			ESP_LOGE(TAG, "unable to erase the web UI: %s", esp_err_to_name(err));
+			return err;
+		}
+		update_erased = erase_end;
+	}
+
+	esp_err_t err = esp_partition_write(webui_part, update_pos, data, len);
+	if (err != ESP_OK) {
+		return err;
+	}
+	update_pos = end;
+	return ESP_OK;
+}
+
+esp_err_t webui_update_finish(void)
+{
+	esp_err_t err;
+
+	if (!updating) {
+		return ESP_ERR_INVALID_STATE;
+	}
+	if (update_size && update_pos != update_size) {
+		ESP_LOGE(TAG, "expected %u bytes, got %u", update_size, update_pos);
+		webui_update_abort();
+		return ESP_ERR_INVALID_SIZE;
+	}
+
+	webui_lock();
+	err = webui_mount(update_pos);
+	updating = false;
+	webui_unlock();
+	if (err == ESP_OK) {
+		ESP_LOGI(TAG, "web UI updated");
+	}
+	return err;
+}
+
+void webui_update_abort(void)
+{
+	webui_lock();
+	if (updating) {
+		updating = false;
+		// Nothing was erased, so the old one is still there
+		if (update_erased == 0) {
+			webui_mount(webui_part->size);
+		}
+	}
+	webui_unlock();
+}
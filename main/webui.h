@@ -0,0 +1,49 @@
+#ifndef FARPATCH_WEBUI_H__
+#define FARPATCH_WEBUI_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <esp_err.h>
+
+#include "frogfs/frogfs.h"
+
+/* The web UI is kept in the "webui" data partition rather than linked into
+ * the firmware, so it can be replaced on its own. The partition holds the
+ * image built by tools/frogfs_routes.py: a header with a SHA-256, the URL
+ * routing table and the frogfs image. It is checked and mounted at boot,
+ * and the web server falls back to a page of its own if that fails.
+ */
+
+/* Mount the web UI, if there is a valid one */
+void webui_init(void);
+
+/* Hold the lock while using the mounted image or its routes, since an update
+   unmounts it */
+void webui_lock(void);
+void webui_unlock(void);
+
+/* The mounted image, or NULL if there is no valid web UI. The lock must be
+   held. */
+frogfs_fs_t *webui_fs(void);
+
+/* Start replacing the web UI with an image of `size` bytes, or of unknown
+   size if 0. The current one is unmounted straight away and is gone once the
+   first block is written. ESP_ERR_NOT_FOUND if there is no partition for it,
+   ESP_ERR_INVALID_SIZE if it won't fit.
+ */
+esp_err_t webui_update_begin(size_t size);
+
+esp_err_t webui_update_write(const void *data, size_t len);
+
+/* Check the new image and mount it. ESP_ERR_INVALID_SIZE if fewer bytes
+   arrived than were announced, ESP_ERR_INVALID_CRC if it isn't a web UI
+   image or fails its SHA-256.
+ */
+esp_err_t webui_update_finish(void);
+
+/* Give up on the update, leaving no web UI if anything was written */
+void webui_update_abort(void);
+
+#endif /* FARPATCH_WEBUI_H__ */
@@ -0,0 +1,476 @@
+/*
+ * Multiplexed websocket.
+ *
+ * The UART, RTT, debug log, SWO, PC sample and status streams all share a
+ * single websocket at /ws, so a browser with every page open holds one
+ * connection rather than one per stream. See wsmux.h for the framing.
+ *
+ * The plain /terminal, /rtt, /debugws, /swo and /pcsample/stream sockets are
+ * clients too. They are subscribed to a single channel and receive only its
+ * payload, without any record headers.
+ *
+ * Writers append to a shared pending buffer. A write to the same channel as
+ * the previous record extends that record rather than starting a new one,
+ * so a stream of single characters from the UART becomes one record. A
+ * broadcaster task sends the buffer once CONFIG_WEBSOCKET_LATENCY_MS has
+ * passed since the first write, or as soon as it holds
+ * CONFIG_WEBSOCKET_FLUSH_THRESHOLD bytes. A client whose socket still has
+ * more than half of its send buffer in flight is skipped for that frame
+ * rather than stalling everyone else, and the next records it receives are
+ * flagged as having lost data.
+ *
+ * Sockets are tracked in wsmux_registry.c, which the broadcaster reads
+ * without locking. Statistics are kept per registry slot by the
+ * broadcaster, and start over when the slot goes to a new socket.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <freertos/timers.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "driver/uart.h"
+#include "lwip/sockets.h"
+
+#include "http.h"
+#include "wsmux.h"
+#include "wsmux_registry.h"
+
+#define TAG "wsmux"
+
+/* Must stay below 64 KiB, since a record length is 16 bits */
+#define WSMUX_BUFFER_SIZE 2048
+
+/* How long a writer waits for room before dropping data */
+#define WSMUX_FULL_WAIT_MS 20
+
+#define WSMUX_STATUS_INTERVAL_MS 1000
+
+/* Frame rates are measured since the same output last showed them, so
+   polling /status doesn't disturb the rates in the periodic push */
+enum wsmux_rate_output {
+	WSMUX_RATE_REQUEST,
+	WSMUX_RATE_PUSH,
+	WSMUX_RATE_OUTPUTS,
+};
+
+/* Kept per registry slot, and reset when the slot's generation changes */
+struct wsmux_client_stats {
+	uint32_t generation;
+	bool lost;
+	uint32_t frames;
+	uint32_t bytes;
+	uint32_t drops;
+	uint32_t rate_frames[WSMUX_RATE_OUTPUTS];
+};
+
+static struct wsmux_client_stats *client_stats;
+static uint32_t rate_time_ms[WSMUX_RATE_OUTPUTS];
+
+static httpd_handle_t wsmux_server;
+static TaskHandle_t broadcaster_pid;
+static esp_timer_handle_t flush_timer;
+static TimerHandle_t status_timer;
+
+static SemaphoreHandle_t pending_lock;
+static uint8_t pending[WSMUX_BUFFER_SIZE];
+static size_t pending_len;
+static size_t pending_last;
+static bool pending_has_last;
+static uint32_t pending_channels;
+static uint32_t lost_channels;
+
+/* Only used by the broadcaster task */
+static uint8_t frame[WSMUX_BUFFER_SIZE];
+static uint8_t subset[WSMUX_BUFFER_SIZE];
+static struct wsmux_subscriber *subscribers;
+
+static void wsmux_write_header(uint8_t *hdr, uint8_t channel, uint8_t flags, uint16_t len)
+{
+	hdr[0] = channel;
+	hdr[1] = flags;
+	hdr[2] = len & 0xff;
+	hdr[3] = len >> 8;
+}
+
+/* Copy the records in `src` that `client` is subscribed to into `dst`.
+ * Raw clients get just the payloads.
+ */
+static size_t wsmux_filter(uint8_t *dst, const uint8_t *src, size_t len, const struct wsmux_subscriber *client, bool lost)
+{
+	size_t in = 0;
+	size_t out = 0;
+	while (in + WSMUX_HEADER_SIZE <= len) {
+		size_t payload = src[in + 2] | (src[in + 3] << 8);
+		if (client->subscriptions & (1 << src[in])) {
+			if (client->raw) {
+				memcpy(dst + out, src + in + WSMUX_HEADER_SIZE, payload);
+				out += payload;
+			} else {
+				memcpy(dst + out, src + in, WSMUX_HEADER_SIZE + payload);
+				if (lost) {
+					dst[out + 1] |= WSMUX_FLAG_LOST;
+				}
+				out += WSMUX_HEADER_SIZE + payload;
+			}
+		}
+		in += WSMUX_HEADER_SIZE + payload;
+	}
+	return out;
+}
+
+/* lwIP only reports a socket as writable while at least half of its send
+ * buffer is free, which makes a convenient budget for a slow client.
+ */
+static bool wsmux_client_writable(int fd)
+{
+	fd_set writefds;
+	struct timeval timeout = {0, 0};
+	FD_ZERO(&writefds);
+	FD_SET(fd, &writefds);
+	return select(fd + 1, NULL, &writefds, NULL, &timeout) > 0;
+}
+
+static void wsmux_send(
+	const struct wsmux_subscriber *client, struct wsmux_client_stats *stats, const uint8_t *data, size_t len)
+{
+	httpd_ws_frame_t ws_pkt;
+
+	if (len == 0) {
+		return;
+	}
+	if (!wsmux_client_writable(client->fd)) {
+		stats->drops++;
+		stats->lost = true;
+		return;
+	}
+
+	memset(&ws_pkt, 0, sizeof(ws_pkt));
+	ws_pkt.payload = (uint8_t *)data;
+	ws_pkt.len = len;
+	ws_pkt.type = HTTPD_WS_TYPE_BINARY;
+	if (httpd_ws_send_frame_async(wsmux_server, client->fd, &ws_pkt) != ESP_OK) {
+		ESP_LOGE(TAG, "sockfd %d is invalid! connection closed?", client->fd);
+		wsmux_registry_remove(client->fd);
+		return;
+	}
+	stats->frames++;
+	stats->bytes += len;
+	stats->lost = false;
+}
+
+static void wsmux_flush(void)
+{
+	size_t len;
+	uint32_t channels;
+	int i;
+
+	xSemaphoreTake(pending_lock, portMAX_DELAY);
+	len = pending_len;
+	channels = pending_channels;
+	memcpy(frame, pending, len);
+	pending_len = 0;
+	pending_has_last = false;
+	pending_channels = 0;
+	xSemaphoreGive(pending_lock);
+
+	if (len == 0) {
+		return;
+	}
+
+	wsmux_registry_snapshot(subscribers);
+	for (i = 0; i < wsmux_registry_capacity(); i++) {
+		const struct wsmux_subscriber *client = &subscribers[i];
+		struct wsmux_client_stats *stats = &client_stats[i];
+		if (client->fd == 0 || !(client->subscriptions & channels)) {
+			continue;
+		}
+		if (stats->generation != client->generation) {
+			memset(stats, 0, sizeof(*stats));
+			stats->generation = client->generation;
+		}
+		if (!client->raw && !stats->lost && (client->subscriptions & channels) == channels) {
+			wsmux_send(client, stats, frame, len);
+		} else {
+			wsmux_send(client, stats, subset, wsmux_filter(subset, frame, len, client, stats->lost));
+		}
+	}
+}
+
+static void wsmux_broadcaster_task(void *arg)
+{
+	(void)arg;
+	while (1) {
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		wsmux_flush();
+	}
+}
+
+static void wsmux_flush_timer_cb(void *arg)
+{
+	(void)arg;
+	xTaskNotifyGive(broadcaster_pid);
+}
+
+/* Append as much of `data` as fits, advancing `data` and `len` past it.
+ * Called with pending_lock held.
+ */
+static bool wsmux_append(uint8_t channel, const uint8_t **data, size_t *len, uint8_t flags)
+{
+	size_t space = sizeof(pending) - pending_len;
+	size_t count = *len;
+
+	if (lost_channels & (1 << channel)) {
+		flags |= WSMUX_FLAG_LOST;
+	}
+
+	if (flags == 0 && pending_has_last && pending[pending_last] == channel && pending[pending_last + 1] == 0) {
+		uint8_t *hdr = &pending[pending_last];
+		if (count > space) {
+			count = space;
+		}
+		if (count == 0) {
+			return false;
+		}
+		wsmux_write_header(hdr, channel, 0, (hdr[2] | (hdr[3] << 8)) + count);
+	} else {
+		if (space < WSMUX_HEADER_SIZE || (space == WSMUX_HEADER_SIZE && count)) {
+			return false;
+		}
+		if (count > space - WSMUX_HEADER_SIZE) {
+			count = space - WSMUX_HEADER_SIZE;
+		}
+		// Only the piece that completes the write carries the end marker
+		if (count < *len) {
+			flags &= ~WSMUX_FLAG_END;
+		}
+		pending_last = pending_len;
+		pending_has_last = true;
+		wsmux_write_header(&pending[pending_len], channel, flags, count);
+		pending_len += WSMUX_HEADER_SIZE;
+	}
+
+	if (count) {
+		memcpy(&pending[pending_len], *data, count);
+		pending_len += count;
+		*data += count;
+		*len -= count;
+	}
+	pending_channels |= 1 << channel;
+	lost_channels &= ~(1 << channel);
+	return true;
+}
+
+void wsmux_publish(enum wsmux_channel channel, const uint8_t *data, size_t len, uint8_t flags)
+{
+	TickType_t deadline = xTaskGetTickCount() + pdMS_TO_TICKS(WSMUX_FULL_WAIT_MS);
+
+	if (!broadcaster_pid || !wsmux_has_subscribers(channel) || (len == 0 && flags == 0)) {
+		return;
+	}
+
+	while (1) {
+		xSemaphoreTake(pending_lock, portMAX_DELAY);
+		bool was_empty = (pending_len == 0);
+		bool appended = wsmux_append(channel, &data, &len, flags);
+		if (!appended && (int32_t)(xTaskGetTickCount() - deadline) >= 0) {
+			lost_channels |= 1 << channel;
+			xSemaphoreGive(pending_lock);
+			return;
+		}
+		size_t pending_now = pending_len;
+		xSemaphoreGive(pending_lock);
+
+		if (was_empty && appended) {
+			esp_timer_start_once(flush_timer, CONFIG_WEBSOCKET_LATENCY_MS * 1000);
+		}
+		if (!appended || len > 0 || pending_now >= CONFIG_WEBSOCKET_FLUSH_THRESHOLD) {
+			xTaskNotifyGive(broadcaster_pid);
+		}
+		if (appended && len == 0) {
+			return;
+		}
+		if (!appended) {
+			vTaskDelay(1);
+		}
+	}
+}
+
+bool wsmux_has_subscribers(enum wsmux_channel channel)
+{
+	return (wsmux_registry_channels() & (1 << channel)) != 0;
+}
+
+static void wsmux_status_out(void *ctx, const char *data, size_t len)
+{
+	(void)ctx;
+	wsmux_publish(WSMUX_CHANNEL_STATUS, (const uint8_t *)data, len, 0);
+}
+
+static void wsmux_status_work(void *arg)
+{
+	(void)arg;
+	http_status_write(wsmux_status_out, NULL);
+	wsmux_publish(WSMUX_CHANNEL_STATUS, NULL, 0, WSMUX_FLAG_END);
+}
+
+static void wsmux_status_timer_cb(TimerHandle_t timer)
+{
+	(void)timer;
+	if (wsmux_has_subscribers(WSMUX_CHANNEL_STATUS)) {
+		httpd_queue_work(wsmux_server, wsmux_status_work, NULL);
+	}
+}
+
+static void wsmux_control(httpd_req_t *req, const uint8_t *data, size_t len)
+{
+	uint8_t reply[WSMUX_HEADER_SIZE + 5];
+	uint32_t channels = 0;
+	uint32_t subscriptions;
+	size_t i;
+
+	if (len < 1) {
+		return;
+	}
+	for (i = 1; i < len; i++) {
+		if (data[i] != WSMUX_CHANNEL_CONTROL && data[i] < WSMUX_CHANNEL_COUNT) {
+			channels |= 1 << data[i];
+		}
+	}
+	if (wsmux_registry_update(httpd_req_to_sockfd(req), (data[0] == WSMUX_OP_SUBSCRIBE) ? channels : 0,
+			(data[0] == WSMUX_OP_UNSUBSCRIBE) ? channels : 0, &subscriptions) != ESP_OK) {
+		return;
+	}
+
+	wsmux_write_header(reply, WSMUX_CHANNEL_CONTROL, WSMUX_FLAG_END, 5);
+	reply[WSMUX_HEADER_SIZE] = WSMUX_OP_SUBSCRIPTIONS;
+	reply[WSMUX_HEADER_SIZE + 1] = subscriptions;
+	reply[WSMUX_HEADER_SIZE + 2] = subscriptions >> 8;
+	reply[WSMUX_HEADER_SIZE + 3] = subscriptions >> 16;
+	reply[WSMUX_HEADER_SIZE + 4] = subscriptions >> 24;
+
+	httpd_ws_frame_t ws_pkt;
+	memset(&ws_pkt, 0, sizeof(ws_pkt));
+	ws_pkt.payload = reply;
+	ws_pkt.len = sizeof(reply);
+	ws_pkt.type = HTTPD_WS_TYPE_BINARY;
+	httpd_ws_send_frame(req, &ws_pkt);
+}
+
+void wsmux_receive(httpd_handle_t server, httpd_req_t *req, uint8_t *data, int len)
+{
+	(void)server;
+	int offset = 0;
+
+	while (offset + WSMUX_HEADER_SIZE <= len) {
+		uint8_t channel = data[offset];
+		int record_len = data[offset + 2] | (data[offset + 3] << 8);
+		uint8_t *payload = &data[offset + WSMUX_HEADER_SIZE];
+
+		if (offset + WSMUX_HEADER_SIZE + record_len > len) {
+			ESP_LOGW(TAG, "truncated record on channel %d", channel);
+			return;
+		}
+		offset += WSMUX_HEADER_SIZE + record_len;
+
+		switch (channel) {
+		case WSMUX_CHANNEL_CONTROL:
+			wsmux_control(req, payload, record_len);
+			break;
+		case WSMUX_CHANNEL_UART:
+			uart_write_bytes(CONFIG_TARGET_UART_IDX, payload, record_len);
+			break;
+		case WSMUX_CHANNEL_RTT: {
+			void rtt_append_data(const uint8_t *data, int len);
+			rtt_append_data(payload, record_len);
+			break;
+		}
+		default:
+			// The remaining channels are output-only
+			break;
+		}
+	}
+}
+
+esp_err_t wsmux_add_client(int fd, enum wsmux_channel channel)
+{
+	bool raw = (channel != WSMUX_CHANNEL_CONTROL);
+	return wsmux_registry_add(fd, raw, raw ? (1 << channel) : 0);
+}
+
+void wsmux_remove_client(int fd)
+{
+	wsmux_registry_remove(fd);
+}
+
+void wsmux_write_status(http_status_out_t out, void *ctx)
+{
+	char buffer[128];
+	enum wsmux_rate_output output = (out == wsmux_status_out) ? WSMUX_RATE_PUSH : WSMUX_RATE_REQUEST;
+	uint32_t now = xTaskGetTickCount() * portTICK_PERIOD_MS;
+	uint32_t elapsed = now - rate_time_ms[output];
+	int capacity = wsmux_registry_capacity();
+	int i;
+
+	struct wsmux_subscriber *snapshot = malloc(capacity * sizeof(*snapshot));
+	if (!snapshot) {
+		return;
+	}
+	wsmux_registry_snapshot(snapshot);
+
+	rate_time_ms[output] = now;
+	out(ctx, "websocket clients:\n", 19);
+	for (i = 0; i < capacity; i++) {
+		const struct wsmux_subscriber *client = &snapshot[i];
+		struct wsmux_client_stats *stats = &client_stats[i];
+		struct wsmux_client_stats current = {0};
+
+		if (client->fd == 0) {
+			continue;
+		}
+		// Until the broadcaster gets to a new socket, the slot still
+		// holds the previous one's numbers
+		if (stats->generation == client->generation) {
+			current = *stats;
+			stats->rate_frames[output] = current.frames;
+		}
+		uint32_t rate = elapsed ? ((current.frames - current.rate_frames[output]) * 1000) / elapsed : 0;
+		int len = snprintf(buffer, sizeof(buffer),
+			"\tfd: %2d, mode: %3s, channels: 0x%02x, frames/s: %4u, bytes/frame: %5u, drops: %u\n", client->fd,
+			client->raw ? "raw" : "mux", client->subscriptions, rate,
+			current.frames ? current.bytes / current.frames : 0, current.drops);
+		out(ctx, buffer, len);
+	}
+	free(snapshot);
+}
+
+void wsmux_init(httpd_handle_t server)
+{
+	const esp_timer_create_args_t timer_args = {
+		.callback = wsmux_flush_timer_cb,
+		.name = "wsmux_flush",
+	};
+
+	pending_lock = xSemaphoreCreateMutex();
+	status_timer =
+		xTimerCreate("wsmux_status", pdMS_TO_TICKS(WSMUX_STATUS_INTERVAL_MS), pdTRUE, NULL, wsmux_status_timer_cb);
+	subscribers = calloc(CONFIG_WEBSOCKET_MAX_CLIENTS, sizeof(*subscribers));
+	client_stats = calloc(CONFIG_WEBSOCKET_MAX_CLIENTS, sizeof(*client_stats));
+	if (!pending_lock || !status_timer || !subscribers || !client_stats ||
+		wsmux_registry_init(CONFIG_WEBSOCKET_MAX_CLIENTS) != ESP_OK ||
+		esp_timer_create(&timer_args, &flush_timer) != ESP_OK) {
+		ESP_LOGE(TAG, "unable to allocate websocket multiplexer");
+		return;
+	}
+	wsmux_server = server;
+	xTimerStart(status_timer, 0);
+	xTaskCreate(wsmux_broadcaster_task, "ws_broadcast", 3072, NULL, 4, &broadcaster_pid);
+}
@@ -0,0 +1,74 @@
+#ifndef FARPATCH_WSMUX_H__
+#define FARPATCH_WSMUX_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <esp_http_server.h>
+
+#include "http.h"
+
+/* Every message on the /ws websocket is a sequence of records:
+ *
+ *   uint8_t  channel
+ *   uint8_t  flags
+ *   uint16_t length (little endian)
+ *   uint8_t  payload[length]
+ *
+ * A client only receives channels it has subscribed to. Records on the
+ * control channel manage subscriptions: the payload is an opcode followed
+ * by one or more channel numbers. The server answers each request with
+ * WSMUX_OP_SUBSCRIPTIONS and a little endian bitmask of the channels that
+ * are now active. Records on any other channel are treated as input for
+ * that channel, e.g. keystrokes for the target UART.
+ */
+enum wsmux_channel {
+	WSMUX_CHANNEL_CONTROL = 0,
+	WSMUX_CHANNEL_UART = 1,
+	WSMUX_CHANNEL_RTT = 2,
+	WSMUX_CHANNEL_DEBUG = 3,
+	WSMUX_CHANNEL_SWO = 4,
+	WSMUX_CHANNEL_PCSAMPLE = 5,
+	WSMUX_CHANNEL_STATUS = 6,
+	/* Firmware update progress, one JSON object per message */
+	WSMUX_CHANNEL_OTA = 7,
+	WSMUX_CHANNEL_COUNT,
+};
+
+#define WSMUX_HEADER_SIZE 4
+
+/* Last record of a message that must be read as a whole, e.g. a status report */
+#define WSMUX_FLAG_END 0x01
+/* Data on this channel was dropped before this record */
+#define WSMUX_FLAG_LOST 0x02
+
+#define WSMUX_OP_SUBSCRIBE     1
+#define WSMUX_OP_UNSUBSCRIBE   2
+#define WSMUX_OP_SUBSCRIPTIONS 3
+
+void wsmux_init(httpd_handle_t server);
+
+/* Queue `len` bytes for every client subscribed to `channel`. Small writes
+ * are coalesced and sent together within CONFIG_WEBSOCKET_LATENCY_MS.
+ */
+void wsmux_publish(enum wsmux_channel channel, const uint8_t *data, size_t len, uint8_t flags);
+
+/* True if at least one client is subscribed to `channel` */
+bool wsmux_has_subscribers(enum wsmux_channel channel);
+
+/* Register a websocket. With WSMUX_CHANNEL_CONTROL it is a /ws client that
+ * picks its own channels; otherwise it gets the raw payload of `channel`.
+ */
+esp_err_t wsmux_add_client(int fd, enum wsmux_channel channel);
+
+/* Forget a socket. Called from the httpd close callback. */
+void wsmux_remove_client(int fd);
+
+/* Handles frames received on /ws */
+void wsmux_receive(httpd_handle_t server, httpd_req_t *req, uint8_t *data, int len);
+
+/* Per-client statistics for the /status report */
+void wsmux_write_status(http_status_out_t out, void *ctx);
+
+#endif /* FARPATCH_WSMUX_H__ */
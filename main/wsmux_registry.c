@@ -0,0 +1,143 @@
+/*
+ * Websocket subscriber registry.
+ *
+ * Sockets come and go on the httpd task while the broadcaster walks the
+ * list from its own task. Updates are rare and tiny, so writers serialise
+ * on a spinlock and bump a sequence count around each change. Readers copy
+ * the table without taking any lock, and copy it again if the count was odd
+ * or moved while they were reading. The spinlock also keeps a writer from
+ * being preempted halfway through, so a reader never waits for long.
+ */
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <freertos/FreeRTOS.h>
+
+#include "wsmux_registry.h"
+
+static struct wsmux_subscriber *registry;
+static int registry_capacity;
+static uint32_t registry_generation;
+static atomic_uint registry_seq;
+static atomic_uint registry_channels;
+static portMUX_TYPE registry_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void wsmux_registry_write_begin(void)
+{
+	portENTER_CRITICAL(&registry_lock);
+	atomic_store_explicit(&registry_seq, atomic_load_explicit(&registry_seq, memory_order_relaxed) + 1,
+		memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+static void wsmux_registry_write_end(void)
+{
+	uint32_t channels = 0;
+	int i;
+	for (i = 0; i < registry_capacity; i++) {
+		if (registry[i].fd) {
+			channels |= registry[i].subscriptions;
+		}
+	}
+	atomic_store_explicit(&registry_channels, channels, memory_order_relaxed);
+	atomic_store_explicit(&registry_seq, atomic_load_explicit(&registry_seq, memory_order_relaxed) + 1,
+		memory_order_release);
+	portEXIT_CRITICAL(&registry_lock);
+}
+
+static struct wsmux_subscriber *wsmux_registry_find(int fd)
+{
+	int i;
+	for (i = 0; i < registry_capacity; i++) {
+		if (registry[i].fd == fd) {
+			return &registry[i];
+		}
+	}
+	return NULL;
+}
+
+esp_err_t wsmux_registry_init(int capacity)
+{
+	registry = calloc(capacity, sizeof(*registry));
+	if (!registry) {
+		return ESP_ERR_NO_MEM;
+	}
+	registry_capacity = capacity;
+	return ESP_OK;
+}
+
+int wsmux_registry_capacity(void)
+{
+	return registry_capacity;
+}
+
+esp_err_t wsmux_registry_add(int fd, bool raw, uint32_t subscriptions)
+{
+	esp_err_t ret = ESP_ERR_NO_MEM;
+
+	wsmux_registry_write_begin();
+	struct wsmux_subscriber *sub = wsmux_registry_find(0);
+	if (sub) {
+		sub->raw = raw;
+		sub->subscriptions = subscriptions;
+		sub->generation = ++registry_generation;
+		sub->fd = fd;
+		ret = ESP_OK;
+	}
+	wsmux_registry_write_end();
+	return ret;
+}
+
+void wsmux_registry_remove(int fd)
+{
+	if (fd == 0) {
+		return;
+	}
+	wsmux_registry_write_begin();
+	struct wsmux_subscriber *sub = wsmux_registry_find(fd);
+	if (sub) {
+		memset(sub, 0, sizeof(*sub));
+	}
+	wsmux_registry_write_end();
+}
+
+esp_err_t wsmux_registry_update(int fd, uint32_t set, uint32_t clear, uint32_t *subscriptions)
+{
+	esp_err_t ret = ESP_ERR_NOT_FOUND;
+
+	if (fd == 0) {
+		return ret;
+	}
+	wsmux_registry_write_begin();
+	struct wsmux_subscriber *sub = wsmux_registry_find(fd);
+	if (sub) {
+		sub->subscriptions = (sub->subscriptions | set) & ~clear;
+		*subscriptions = sub->subscriptions;
+		ret = ESP_OK;
+	}
+	wsmux_registry_write_end();
+	return ret;
+}
+
+void wsmux_registry_snapshot(struct wsmux_subscriber *out)
+{
+	unsigned int before;
+	unsigned int after;
+
+	do {
+		before = atomic_load_explicit(&registry_seq, memory_order_acquire);
+		if (before & 1) {
+			continue;
+		}
+		memcpy(out, registry, registry_capacity * sizeof(*registry));
+		atomic_thread_fence(memory_order_acquire);
+		after = atomic_load_explicit(&registry_seq, memory_order_relaxed);
+	} while ((before & 1) || before != after);
+}
+
+uint32_t wsmux_registry_channels(void)
+{
+	return atomic_load_explicit(&registry_channels, memory_order_relaxed);
+}
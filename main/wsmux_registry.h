@@ -0,0 +1,35 @@
+#ifndef FARPATCH_WSMUX_REGISTRY_H__
+#define FARPATCH_WSMUX_REGISTRY_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <esp_err.h>
+
+struct wsmux_subscriber {
+	int fd;
+	bool raw;
+	uint32_t subscriptions;
+	/* Changes whenever the slot is given to a new socket */
+	uint32_t generation;
+};
+
+esp_err_t wsmux_registry_init(int capacity);
+int wsmux_registry_capacity(void);
+
+esp_err_t wsmux_registry_add(int fd, bool raw, uint32_t subscriptions);
+void wsmux_registry_remove(int fd);
+
+/* Set and then clear channel bits for `fd`, returning the resulting mask */
+esp_err_t wsmux_registry_update(int fd, uint32_t set, uint32_t clear, uint32_t *subscriptions);
+
+/* Copy every slot into `out`, which must hold wsmux_registry_capacity()
+ * entries. Unused slots have an fd of 0. Never blocks, so broadcasters can
+ * call it from any task.
+ */
+void wsmux_registry_snapshot(struct wsmux_subscriber *out);
+
+/* Union of the channels all subscribers want */
+uint32_t wsmux_registry_channels(void);
+
+#endif /* FARPATCH_WSMUX_REGISTRY_H__ */
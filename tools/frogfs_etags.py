@@ -0,0 +1,69 @@
+#!/usr/bin/env python3
+"""Work out the strong ETags for the files that go into frogfs.
+
+Each ETag is derived from the file contents and the frogfs filter
+configuration, so it changes whenever the bytes served for that path can
+change. tools/frogfs_routes.py builds the routing table from these; run
+this on its own to list what the probe will send:
+
+    tools/frogfs_etags.py html frogfs_config.yaml
+"""
+
+import argparse
+import fnmatch
+import hashlib
+import os
+import re
+import sys
+
+
+def discarded_patterns(config):
+    """Globs that the frogfs configuration drops from the image"""
+    patterns = []
+    for line in config.decode().splitlines():
+        m = re.match(r"\s*'([^']+)'\s*:\s*(.*)$", line)
+        if m and 'discard' in m.group(2):
+            patterns.append(m.group(1))
+    return patterns
+
+
+def collect(root, discard):
+    """The files frogfs packs, as (path relative to root, path on disk)"""
+    for dirpath, dirnames, filenames in os.walk(root):
+        dirnames.sort()
+        for name in sorted(filenames):
+            path = os.path.join(dirpath, name)
+            rel = os.path.relpath(path, root).replace(os.sep, '/')
+            if any(fnmatch.fnmatch(rel, p) or fnmatch.fnmatch(name, p) for p in discard):
+                continue
+            yield rel, path
+
+
+def etag(config, path):
+    """The quoted ETag for the file at `path`"""
+    h = hashlib.sha256(config)
+    with open(path, 'rb') as f:
+        h.update(f.read())
+    return '"{}"'.format(h.hexdigest()[:16])
+
+
+def etags(root, config):
+    """(URL, ETag) for every file in the image, sorted by URL"""
+    return sorted(('/' + rel, etag(config, path)) for rel, path in collect(root, discarded_patterns(config)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('root', help='directory that is packed into frogfs')
+    parser.add_argument('config', help='frogfs filter configuration')
+    args = parser.parse_args()
+
+    with open(args.config, 'rb') as f:
+        config = f.read()
+    for url, tag in etags(args.root, config):
+        print(url, tag)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,185 @@
+#!/usr/bin/env python3
+"""Build the web UI partition image: a URL routing table and the frogfs image.
+
+Every URL the web server answers from frogfs gets an entry, including the
+directory aliases that lead to an index.html. The entries are placed with
+a minimal perfect hash (hash and displace), so a request resolves with
+one lookup in the displacement table, one slot and one string compare.
+
+Each file also records its MIME type and the strong ETag that
+tools/frogfs_etags.py works out for it.
+
+The table goes in the partition with the files it describes, so the web UI
+can be updated without touching the firmware:
+
+    curl -T build/webui.bin http://192.168.4.1/webui/image
+
+The hash has to match frogfs_route_hash() in main/frogfs_routes.c, and the
+layout what main/webui.c and main/frogfs_routes.c expect.
+"""
+
+import argparse
+import hashlib
+import struct
+import sys
+
+from frogfs_etags import collect, discarded_patterns, etag
+
+FNV_PRIME = 0x01000193
+FNV_OFFSET = 0x811c9dc5
+
+IMAGE_MAGIC = 0x49555046  # "FPUI"
+IMAGE_HEADER = struct.Struct('<IIIIII32s')
+FROGFS_ALIGN = 16
+ROUTES_HEADER = struct.Struct('<HH')
+ROUTE_FILE = struct.Struct('<III')
+ROUTE_SLOT = struct.Struct('<IHh')
+
+MIME_TYPES = {
+    'htm': 'text/html',
+    'html': 'text/html',
+    'css': 'text/css',
+    'js': 'text/javascript',
+    'txt': 'text/plain',
+    'jpg': 'image/jpeg',
+    'jpeg': 'image/jpeg',
+    'png': 'image/png',
+    'svg': 'image/svg+xml',
+    'xml': 'text/xml',
+    'json': 'application/json',
+    'woff': 'font/woff',
+    'woff2': 'font/woff2',
+}
+DEFAULT_MIME_TYPE = 'text/html'
+
+
+def route_hash(seed, key):
+    h = seed if seed else FNV_OFFSET
+    for c in key.encode():
+        h = ((h ^ c) * FNV_PRIME) & 0xffffffff
+    return h
+
+
+def mime_type(path):
+    ext = path.rsplit('.', 1)[-1].lower() if '.' in path else ''
+    return MIME_TYPES.get(ext, DEFAULT_MIME_TYPE)
+
+
+def place(keys):
+    """Hash and displace. Returns (displacement table, slot per key)."""
+    size = 1
+    while size < len(keys):
+        size *= 2
+
+    buckets = [[] for _ in range(size)]
+    for key in keys:
+        buckets[route_hash(0, key) % size].append(key)
+
+    displace = [0] * size
+    slots = [None] * size
+    for bucket in sorted(buckets, key=len, reverse=True):
+        if len(bucket) <= 1:
+            break
+        seed = 1
+        while True:
+            chosen = [route_hash(seed, key) % size for key in bucket]
+            if len(set(chosen)) == len(chosen) and all(slots[s] is None for s in chosen):
+                break
+            seed += 1
+            if seed > 0x7fff:
+                raise RuntimeError('unable to place routes')
+        displace[route_hash(0, bucket[0]) % size] = seed
+        for key, slot in zip(bucket, chosen):
+            slots[slot] = key
+
+    # Single key buckets go straight into a free slot, stored as -(slot + 1)
+    free = [i for i, key in enumerate(slots) if key is None]
+    for bucket in buckets:
+        if len(bucket) == 1:
+            slot = free.pop()
+            displace[route_hash(0, bucket[0]) % size] = -(slot + 1)
+            slots[slot] = bucket[0]
+
+    return displace, slots
+
+
+def pack_routes(files, routes, displace, slots):
+    """The routing table as main/frogfs_routes.c reads it: a count of files
+    and slots, then per file the offsets of its path, MIME type and ETag, then
+    per slot the offset of its URL (0 if empty), its file and its
+    displacement, then the strings those offsets point at."""
+    strings = bytearray()
+    string_offsets = {}
+    base = ROUTES_HEADER.size + len(files) * ROUTE_FILE.size + len(slots) * ROUTE_SLOT.size
+
+    def string(s):
+        if s not in string_offsets:
+            string_offsets[s] = base + len(strings)
+            strings.extend(s.encode() + b'\0')
+        return string_offsets[s]
+
+    out = bytearray(ROUTES_HEADER.pack(len(files), len(slots)))
+    for rel, mime, tag in files:
+        out += ROUTE_FILE.pack(string(rel), string(mime), string(tag))
+    for key, d in zip(slots, displace):
+        if key is None:
+            out += ROUTE_SLOT.pack(0, 0, d)
+        else:
+            out += ROUTE_SLOT.pack(string(key), routes[key], d)
+    return bytes(out + strings)
+
+
+def pack_image(routes, frogfs):
+    """The partition image main/webui.c mounts: a header, the routing table,
+    then the frogfs image, which is aligned for frogfs to map in place"""
+    routes_offset = IMAGE_HEADER.size
+    frogfs_offset = (routes_offset + len(routes) + FROGFS_ALIGN - 1) & ~(FROGFS_ALIGN - 1)
+    body = routes + bytes(frogfs_offset - routes_offset - len(routes)) + frogfs
+    digest = hashlib.sha256(body).digest()
+    header = IMAGE_HEADER.pack(IMAGE_MAGIC, IMAGE_HEADER.size, routes_offset, len(routes), frogfs_offset,
+                               len(frogfs), digest)
+    return header + body
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('root', help='directory that is packed into frogfs')
+    parser.add_argument('config', help='frogfs filter configuration')
+    parser.add_argument('frogfs', help='frogfs image built from the same directory')
+    parser.add_argument('output', help='partition image to write')
+    args = parser.parse_args()
+
+    with open(args.config, 'rb') as f:
+        config = f.read()
+
+    files = []
+    routes = {}
+    for rel, path in collect(args.root, discarded_patterns(config)):
+        index = len(files)
+        files.append(('/' + rel, mime_type(rel), etag(config, path)))
+
+        routes['/' + rel] = index
+        if rel == 'index.html' or rel.endswith('/index.html'):
+            directory = rel[:-len('index.html')]
+            routes['/' + directory] = index
+            if directory:
+                routes['/' + directory.rstrip('/')] = index
+
+    displace, slots = place(sorted(routes))
+
+    with open(args.frogfs, 'rb') as f:
+        image = pack_image(pack_routes(files, routes, displace, slots), f.read())
+
+    try:
+        with open(args.output, 'rb') as f:
+            if f.read() == image:
+                return 0
+    except OSError:
+        pass
+    with open(args.output, 'wb') as f:
+        f.write(image)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
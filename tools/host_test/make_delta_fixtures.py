@@ -0,0 +1,31 @@
+#!/usr/bin/env python3
+"""Write the images and patch test_ota_delta_patch.c applies: old.bin and
+new.bin, update.delta made by tools/ota_delta.py between them, and
+other.bin, an unrelated image the patch must refuse."""
+
+import os
+import random
+import sys
+
+from test_ota_delta import app_image, edited, firmware_like, ota_delta
+
+
+def main():
+    out = sys.argv[1]
+    os.makedirs(out, exist_ok=True)
+    rng = random.Random(1)
+    body = firmware_like(rng, 60000)
+    old = app_image(body)
+    new = app_image(edited(rng, body))
+    other = app_image(firmware_like(random.Random(2), 60000))
+    patch = ota_delta.encode(ota_delta.diff(old, new), len(new), ota_delta.image_digest(old))
+    if ota_delta.apply(old, patch) != new:
+        sys.exit('ota_delta.py made a patch it can\'t apply')
+
+    for name, data in (('old.bin', old), ('new.bin', new), ('other.bin', other), ('update.delta', patch)):
+        with open(os.path.join(out, name), 'wb') as f:
+            f.write(data)
+
+
+if __name__ == '__main__':
+    main()
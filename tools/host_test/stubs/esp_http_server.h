@@ -0,0 +1,34 @@
+#ifndef HOST_TEST_ESP_HTTP_SERVER_H
+#define HOST_TEST_ESP_HTTP_SERVER_H
+
+/* A request whose body and response live in memory. Tests define the
+   functions below. */
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "esp_err.h"
+
+#define HTTPD_SOCK_ERR_FAIL    -1
+#define HTTPD_SOCK_ERR_TIMEOUT -3
+
+typedef struct httpd_req {
+	const char *uri;
+	size_t content_len;
+	/* Test side */
+	const char *body;
+	size_t body_pos;
+	char *out;
+	size_t out_len;
+} httpd_req_t;
+
+int httpd_req_recv(httpd_req_t *req, char *buf, size_t len);
+esp_err_t httpd_req_get_url_query_str(httpd_req_t *req, char *buf, size_t len);
+esp_err_t httpd_query_key_value(const char *query, const char *key, char *val, size_t len);
+esp_err_t httpd_resp_set_type(httpd_req_t *req, const char *type);
+esp_err_t httpd_resp_send_chunk(httpd_req_t *req, const char *buf, ssize_t len);
+esp_err_t httpd_resp_sendstr(httpd_req_t *req, const char *str);
+esp_err_t httpd_resp_sendstr_chunk(httpd_req_t *req, const char *str);
+esp_err_t httpd_resp_send_500(httpd_req_t *req);
+
+#endif
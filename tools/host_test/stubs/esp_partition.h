@@ -0,0 +1,28 @@
+#ifndef HOST_TEST_ESP_PARTITION_H
+#define HOST_TEST_ESP_PARTITION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+typedef struct {
+	uint32_t address;
+	uint32_t size;
+	char label[17];
+} esp_partition_t;
+
+typedef uint32_t esp_partition_mmap_handle_t;
+
+typedef enum {
+	ESP_PARTITION_MMAP_DATA,
+	ESP_PARTITION_MMAP_INST,
+} esp_partition_mmap_memory_t;
+
+/* Provided by the test */
+esp_err_t esp_partition_mmap(const esp_partition_t *partition, size_t offset, size_t size,
+	esp_partition_mmap_memory_t memory, const void **out_ptr, esp_partition_mmap_handle_t *out_handle);
+void esp_partition_munmap(esp_partition_mmap_handle_t handle);
+esp_err_t esp_partition_get_sha256(const esp_partition_t *partition, uint8_t *sha_256);
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef HOST_TEST_ESP_ROM_CRC_H
+#define HOST_TEST_ESP_ROM_CRC_H
+
+#include <stdint.h>
+
+uint32_t esp_rom_crc32_le(uint32_t crc, uint8_t const *buf, uint32_t len);
+
+#endif
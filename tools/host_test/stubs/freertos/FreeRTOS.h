@@ -0,0 +1,38 @@
+#ifndef HOST_TEST_FREERTOS_H
+#define HOST_TEST_FREERTOS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+
+#define pdTRUE  1
+#define pdFALSE 0
+#define portMAX_DELAY 0xffffffffu
+#define pdMS_TO_TICKS(ms) (ms)
+
+#ifdef HOST_TEST_THREADED
+/* Tests that run firmware code from several threads get real spinlocks */
+#include <pthread.h>
+
+typedef pthread_mutex_t portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED PTHREAD_MUTEX_INITIALIZER
+
+#define portENTER_CRITICAL(mux)      pthread_mutex_lock(mux)
+#define portEXIT_CRITICAL(mux)       pthread_mutex_unlock(mux)
+#define portENTER_CRITICAL_SAFE(mux) pthread_mutex_lock(mux)
+#define portEXIT_CRITICAL_SAFE(mux)  pthread_mutex_unlock(mux)
+#else
+typedef int portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED 0
+
+#define portENTER_CRITICAL(mux)      ((void)(mux))
+#define portEXIT_CRITICAL(mux)       ((void)(mux))
+#define portENTER_CRITICAL_SAFE(mux) ((void)(mux))
+#define portEXIT_CRITICAL_SAFE(mux)  ((void)(mux))
+#endif
+
+#endif
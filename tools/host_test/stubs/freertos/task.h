@@ -0,0 +1,13 @@
+#ifndef HOST_TEST_FREERTOS_TASK_H
+#define HOST_TEST_FREERTOS_TASK_H
+
+#include "freertos/FreeRTOS.h"
+
+#define portTICK_PERIOD_MS 1
+
+static inline TickType_t xTaskGetTickCount(void)
+{
+	return 0;
+}
+
+#endif
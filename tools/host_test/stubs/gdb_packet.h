@@ -0,0 +1,7 @@
+#ifndef HOST_TEST_GDB_PACKET_H
+#define HOST_TEST_GDB_PACKET_H
+
+void gdb_out(const char *buf);
+void gdb_outf(const char *fmt, ...);
+
+#endif
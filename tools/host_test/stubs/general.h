@@ -0,0 +1,8 @@
+#ifndef HOST_TEST_GENERAL_H
+#define HOST_TEST_GENERAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#endif
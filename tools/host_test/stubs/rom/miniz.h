@@ -0,0 +1,32 @@
+#ifndef HOST_TEST_ROM_MINIZ_H
+#define HOST_TEST_ROM_MINIZ_H
+
+/* The part of the ROM's miniz 1.15 API the firmware uses. Tests provide
+   tinfl_decompress(). */
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+	TINFL_STATUS_BAD_PARAM = -3,
+	TINFL_STATUS_ADLER32_MISMATCH = -2,
+	TINFL_STATUS_FAILED = -1,
+	TINFL_STATUS_DONE = 0,
+	TINFL_STATUS_NEEDS_MORE_INPUT = 1,
+	TINFL_STATUS_HAS_MORE_OUTPUT = 2,
+} tinfl_status;
+
+typedef struct {
+	uint32_t state;
+	void *impl;
+} tinfl_decompressor;
+
+#define TINFL_LZ_DICT_SIZE        32768
+#define TINFL_FLAG_HAS_MORE_INPUT 2
+
+#define tinfl_init(r) ((r)->state = 0)
+
+tinfl_status tinfl_decompress(tinfl_decompressor *r, const uint8_t *pIn_buf_next, size_t *pIn_buf_size,
+	uint8_t *pOut_buf_start, uint8_t *pOut_buf_next, size_t *pOut_buf_size, const uint32_t decomp_flags);
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef HOST_TEST_TARGET_H
+#define HOST_TEST_TARGET_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct target_s target;
+
+uint32_t target_mem_read32(target *t, uint32_t addr);
+void target_mem_write32(target *t, uint32_t addr, uint32_t value);
+bool target_check_error(target *t);
+
+#endif
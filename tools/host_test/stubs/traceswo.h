@@ -0,0 +1,9 @@
+#ifndef HOST_TEST_TRACESWO_H
+#define HOST_TEST_TRACESWO_H
+
+#include <stdint.h>
+
+void traceswo_init(uint32_t baudrate, uint32_t swo_chan_bitmask);
+void traceswo_baud(unsigned int baud);
+
+#endif
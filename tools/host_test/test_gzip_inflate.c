@@ -0,0 +1,256 @@
+/*
+ * Runs gzip streams through the streaming inflater in pieces of every
+ * awkward size, and through gzip_inflate_send() whole.
+ *
+ * The decompressor is zlib standing in for the tinfl in ROM. Like the
+ * miniz 1.15 tinfl, it can report up to `read_ahead` bytes past the end of
+ * the deflate data as consumed, since the ROM keeps whatever it pulled
+ * into its bit buffer.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "../../main/gzip_inflate.c"
+
+static size_t read_ahead;
+static z_stream zs;
+static bool zs_active;
+
+tinfl_status tinfl_decompress(tinfl_decompressor *r, const uint8_t *pIn_buf_next, size_t *pIn_buf_size,
+	uint8_t *pOut_buf_start, uint8_t *pOut_buf_next, size_t *pOut_buf_size, const uint32_t decomp_flags)
+{
+	if (r->state == 0) {
+		if (zs_active) {
+			inflateEnd(&zs);
+		}
+		memset(&zs, 0, sizeof(zs));
+		assert(inflateInit2(&zs, -15) == Z_OK);
+		zs_active = true;
+		r->state = 1;
+	}
+	size_t out_size = *pOut_buf_size;
+
+	zs.next_in = (Bytef *)pIn_buf_next;
+	zs.avail_in = *pIn_buf_size;
+	zs.next_out = pOut_buf_next;
+	zs.avail_out = out_size;
+	int ret = inflate(&zs, Z_NO_FLUSH);
+	*pIn_buf_size -= zs.avail_in;
+	*pOut_buf_size = out_size - zs.avail_out;
+
+	if (ret == Z_STREAM_END) {
+		*pIn_buf_size += (zs.avail_in < read_ahead) ? zs.avail_in : read_ahead;
+		return TINFL_STATUS_DONE;
+	}
+	if (ret != Z_OK && ret != Z_BUF_ERROR) {
+		return TINFL_STATUS_FAILED;
+	}
+	if (*pOut_buf_size == out_size && out_size) {
+		return TINFL_STATUS_HAS_MORE_OUTPUT;
+	}
+	return TINFL_STATUS_NEEDS_MORE_INPUT;
+}
+
+uint32_t esp_rom_crc32_le(uint32_t crc, uint8_t const *buf, uint32_t len)
+{
+	return crc32(crc, buf, len);
+}
+
+esp_err_t httpd_resp_send_chunk(httpd_req_t *req, const char *buf, ssize_t len)
+{
+	req->out = realloc(req->out, req->out_len + len);
+	memcpy(req->out + req->out_len, buf, len);
+	req->out_len += len;
+	return ESP_OK;
+}
+
+esp_err_t httpd_resp_sendstr_chunk(httpd_req_t *req, const char *str)
+{
+	return str ? httpd_resp_send_chunk(req, str, strlen(str)) : ESP_OK;
+}
+
+esp_err_t httpd_resp_send_500(httpd_req_t *req)
+{
+	return ESP_FAIL;
+}
+
+struct sink {
+	uint8_t *data;
+	size_t len;
+	size_t cap;
+};
+
+static esp_err_t sink_out(void *ctx, const uint8_t *data, size_t len)
+{
+	struct sink *sink = ctx;
+	assert(sink->len + len <= sink->cap);
+	memcpy(sink->data + sink->len, data, len);
+	sink->len += len;
+	return ESP_OK;
+}
+
+/* Compressible, but not so much that it all fits in one window */
+static uint8_t *make_plain(size_t len)
+{
+	uint8_t *plain = malloc(len);
+	uint32_t x = 1;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		x = x * 1103515245 + 12345;
+		plain[i] = (i % 3000 < 2000) ? (uint8_t)"farpatch "[i % 9] : (x >> 16) & 0x3f;
+	}
+	return plain;
+}
+
+static uint8_t *make_gzip(const uint8_t *plain, size_t len, const char *name, size_t *gz_len)
+{
+	z_stream def = {0};
+	gz_header header = {0};
+	size_t cap = compressBound(len) + 64;
+	uint8_t *gz = malloc(cap);
+
+	assert(deflateInit2(&def, 9, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+	if (name) {
+		header.name = (Bytef *)name;
+		header.hcrc = 1;
+		assert(deflateSetHeader(&def, &header) == Z_OK);
+	}
+	def.next_in = (Bytef *)plain;
+	def.avail_in = len;
+	def.next_out = gz;
+	def.avail_out = cap;
+	assert(deflate(&def, Z_FINISH) == Z_STREAM_END);
+	*gz_len = cap - def.avail_out;
+	deflateEnd(&def);
+	return gz;
+}
+
+/* Feed `gz` in pieces of `chunk` bytes, returning the first error */
+static esp_err_t inflate_chunked(const uint8_t *gz, size_t gz_len, size_t chunk, struct sink *sink)
+{
+	struct gzip_inflater *inflater = gzip_inflater_new(sink_out, sink);
+	esp_err_t err = ESP_OK;
+	size_t pos;
+
+	assert(inflater);
+	for (pos = 0; pos < gz_len && err == ESP_OK; pos += chunk) {
+		size_t len = (gz_len - pos < chunk) ? gz_len - pos : chunk;
+		err = gzip_inflater_write(inflater, gz + pos, len);
+	}
+	if (err == ESP_OK) {
+		err = gzip_inflater_finish(inflater);
+	}
+	gzip_inflater_free(inflater);
+	return err;
+}
+
+static void test_stream(const char *name)
+{
+	static const size_t chunks[] = {1, 2, 7, 8, 9, 10, 255, 256, 4096, 8192, 1 << 20};
+	const size_t plain_len = 100000;
+	uint8_t *plain = make_plain(plain_len);
+	size_t gz_len;
+	uint8_t *gz = make_gzip(plain, plain_len, name, &gz_len);
+	struct sink sink = {.data = malloc(plain_len), .cap = plain_len};
+	size_t i;
+
+	for (i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++) {
+		sink.len = 0;
+		assert(inflate_chunked(gz, gz_len, chunks[i], &sink) == ESP_OK);
+		assert(sink.len == plain_len && !memcmp(sink.data, plain, plain_len));
+	}
+
+	// Every split of the last few bytes between two writes
+	for (i = gz_len - 20; i < gz_len; i++) {
+		struct gzip_inflater *inflater = gzip_inflater_new(sink_out, &sink);
+		sink.len = 0;
+		assert(gzip_inflater_write(inflater, gz, i) == ESP_OK);
+		assert(gzip_inflater_write(inflater, gz + i, gz_len - i) == ESP_OK);
+		assert(gzip_inflater_finish(inflater) == ESP_OK);
+		assert(sink.len == plain_len);
+		gzip_inflater_free(inflater);
+	}
+
+	// Cut short, in the deflate data and in the trailer
+	sink.len = 0;
+	assert(inflate_chunked(gz, gz_len - 100, 512, &sink) == ESP_ERR_INVALID_SIZE);
+	for (i = 1; i <= GZIP_TRAILER_SIZE; i++) {
+		sink.len = 0;
+		assert(inflate_chunked(gz, gz_len - i, 512, &sink) != ESP_OK);
+	}
+
+	// A damaged CRC, and a length that doesn't match
+	gz[gz_len - 8] ^= 1;
+	sink.len = 0;
+	assert(inflate_chunked(gz, gz_len, 512, &sink) == ESP_ERR_INVALID_CRC);
+	gz[gz_len - 8] ^= 1;
+	gz[gz_len - 1] ^= 1;
+	sink.len = 0;
+	assert(inflate_chunked(gz, gz_len, 512, &sink) == ESP_ERR_INVALID_CRC);
+	gz[gz_len - 1] ^= 1;
+
+	// Anything after the trailer
+	for (i = 1; i <= 16; i++) {
+		uint8_t *longer = malloc(gz_len + i);
+		memcpy(longer, gz, gz_len);
+		memset(longer + gz_len, 0x5a, i);
+		sink.len = 0;
+		assert(inflate_chunked(longer, gz_len + i, 512, &sink) != ESP_OK);
+		free(longer);
+	}
+
+	// Not gzip at all
+	sink.len = 0;
+	assert(inflate_chunked(plain, 4096, 512, &sink) == ESP_ERR_INVALID_ARG);
+
+	free(sink.data);
+	free(gz);
+	free(plain);
+}
+
+static void test_send(void)
+{
+	const size_t plain_len = 70000;
+	uint8_t *plain = make_plain(plain_len);
+	size_t gz_len;
+	uint8_t *gz = make_gzip(plain, plain_len, "index.html", &gz_len);
+	httpd_req_t req = {0};
+	struct gzip_inflate_stats stats;
+
+	assert(gzip_inflate_send(&req, gz, gz_len) == ESP_OK);
+	assert(req.out_len == plain_len && !memcmp(req.out, plain, plain_len));
+	free(req.out);
+
+	memset(&req, 0, sizeof(req));
+	assert(gzip_inflate_send(&req, plain, 100) == ESP_FAIL);
+	assert(req.out_len == 0);
+
+	gzip_inflate_get_stats(&stats);
+	assert(stats.requests == 2 && stats.failures == 1);
+	assert(stats.bytes_out == plain_len);
+	assert(stats.work_size == sizeof(struct gzip_inflate_work));
+
+	free(gz);
+	free(plain);
+}
+
+int main(void)
+{
+	gzip_inflate_init();
+
+	for (read_ahead = 0; read_ahead <= 4; read_ahead++) {
+		test_stream(NULL);
+		test_stream("firmware.bin");
+	}
+	test_send();
+
+	if (zs_active) {
+		inflateEnd(&zs);
+	}
+	printf("gzip inflate: ok\n");
+	return 0;
+}
@@ -0,0 +1,153 @@
+/*
+ * Feeds SWO byte streams, as captured from the UART, through the ITM decoder
+ * and checks what comes out. Every stream is also fed one byte at a time and
+ * split at every offset, as the receive task sees it in arbitrary chunks.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "itm_decode.h"
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(*(a)))
+
+struct capture {
+	char text[32][64];
+	size_t text_len[32];
+	uint32_t pcs[16];
+	size_t pc_len[16];
+	int pc_count;
+};
+
+static void stimulus(void *ctx, uint8_t port, const uint8_t *data, size_t len)
+{
+	struct capture *c = ctx;
+	memcpy(c->text[port] + c->text_len[port], data, len);
+	c->text_len[port] += len;
+}
+
+static void hardware(void *ctx, uint8_t id, uint32_t value, size_t len)
+{
+	struct capture *c = ctx;
+	if (id == ITM_HW_PC_SAMPLE) {
+		c->pc_len[c->pc_count] = len;
+		c->pcs[c->pc_count++] = value;
+	}
+}
+
+/* printf("Hi!\n") on port 0 as byte and word writes, with a sync packet,
+   local timestamps and a global timestamp mixed in */
+static const uint8_t stream_printf[] = {
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x80,       /* sync */
+	0x01, 'H',                                /* port 0, 1 byte */
+	0xc0, 0x85, 0x01,                         /* local timestamp with continuation */
+	0x01, 'i',
+	0x30,                                     /* local timestamp, single byte */
+	0x94, 0x81, 0x82, 0x03,                   /* global timestamp 1 */
+	0x03, '!', '\n', 0x00, 0x00,              /* port 0, 4 bytes with zero padding */
+	0x09, 'x',                                /* port 1, 1 byte */
+	0x02, 'o', 'k',                           /* port 0, 2 bytes */
+};
+
+/* PC samples from the DWT, including one taken while the core slept */
+static const uint8_t stream_pc[] = {
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x80,
+	0x17, 0x34, 0x12, 0x00, 0x08,             /* PC 0x08001234 */
+	0x15, 0x00,                               /* sleeping */
+	0x70,                                     /* overflow */
+	0x17, 0x01, 0x00, 0x00, 0x20,             /* PC 0x20000001 */
+};
+
+/* Line noise before the first sync, then a packet cut short by a new sync.
+   Zeros are valid payload, so the sync finishes the packet before it is
+   recognised. */
+static const uint8_t stream_resync[] = {
+	0xff, 0x5a, 0x13, 0x77,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x80,
+	0x03, 'A', 'B',                           /* 4 byte packet, cut short */
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x80,
+	0x01, 'C',
+};
+
+static void feed(struct itm_decoder *d, const uint8_t *data, size_t len, size_t split)
+{
+	if (split == 0) {
+		size_t i;
+		for (i = 0; i < len; i++) {
+			itm_decode(d, data + i, 1);
+		}
+		return;
+	}
+	itm_decode(d, data, split);
+	itm_decode(d, data + split, len - split);
+}
+
+static void test_printf(size_t split)
+{
+	struct capture c = {0};
+	struct itm_decoder d;
+
+	itm_decoder_init(&d, stimulus, hardware, &c);
+	feed(&d, stream_printf, sizeof(stream_printf), split);
+	assert(c.text_len[0] == 8 && !memcmp(c.text[0], "Hi!\n\0\0ok", 8));
+	assert(c.text_len[1] == 1 && c.text[1][0] == 'x');
+	assert(d.stimulus_packets == 5);
+	assert(d.syncs == 1);
+	assert(d.reserved == 0);
+
+	/* traceswo_setmask() with only port 1 */
+	memset(&c, 0, sizeof(c));
+	itm_decoder_init(&d, stimulus, hardware, &c);
+	itm_decoder_set_mask(&d, 1 << 1);
+	feed(&d, stream_printf, sizeof(stream_printf), split);
+	assert(c.text_len[0] == 0);
+	assert(c.text_len[1] == 1);
+	assert(d.filtered_packets == 4);
+}
+
+static void test_pc(size_t split)
+{
+	struct capture c = {0};
+	struct itm_decoder d;
+
+	itm_decoder_init(&d, stimulus, hardware, &c);
+	feed(&d, stream_pc, sizeof(stream_pc), split);
+	assert(c.pc_count == 3);
+	assert(c.pcs[0] == 0x08001234 && c.pc_len[0] == 4);
+	assert(c.pcs[1] == 0 && c.pc_len[1] == 1);
+	assert(c.pcs[2] == 0x20000001);
+	assert(d.hardware_packets == 3);
+	assert(d.overflows == 1);
+	assert(d.stimulus_packets == 0);
+}
+
+static void test_resync(size_t split)
+{
+	struct capture c = {0};
+	struct itm_decoder d;
+
+	itm_decoder_init(&d, stimulus, hardware, &c);
+	feed(&d, stream_resync, sizeof(stream_resync), split);
+	assert(d.syncs == 2);
+	assert(c.text_len[0] == 5 && !memcmp(c.text[0], "AB\0\0C", 5));
+	/* The noise decodes as a hardware packet, never as port data */
+	assert(d.stimulus_packets == 2);
+}
+
+int main(void)
+{
+	size_t split;
+
+	for (split = 0; split < sizeof(stream_printf); split++) {
+		test_printf(split);
+	}
+	for (split = 0; split < sizeof(stream_pc); split++) {
+		test_pc(split);
+	}
+	for (split = 0; split < sizeof(stream_resync); split++) {
+		test_resync(split);
+	}
+	printf("itm_decode: ok\n");
+	return 0;
+}
@@ -0,0 +1,145 @@
+#!/usr/bin/env python3
+"""Round trips tools/ota_delta.py patches between synthetic app images, and
+checks that damaged patches and patches for another image are refused."""
+
+import gzip
+import hashlib
+import os
+import random
+import subprocess
+import sys
+import tempfile
+import unittest
+
+TOOLS = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..')
+sys.path.insert(0, TOOLS)
+
+import ota_delta  # noqa: E402
+
+
+def app_image(body):
+    """An image esptool would accept: magic, hash_appended set, and the SHA-256 on the end"""
+    header = bytearray(24)
+    header[0] = ota_delta.IMAGE_MAGIC
+    header[23] = 1
+    image = bytes(header) + body
+    return image + hashlib.sha256(image).digest()
+
+
+def firmware_like(rng, size):
+    """Runs of repeated and random bytes, so that matches exist but aren't trivial"""
+    out = bytearray()
+    while len(out) < size:
+        if rng.random() < 0.5:
+            out += bytes([rng.randrange(256)]) * rng.randrange(1, 64)
+        else:
+            out += bytes(rng.randrange(256) for _ in range(rng.randrange(16, 256)))
+    return bytes(out[:size])
+
+
+def edited(rng, body):
+    """What a rebuild does to an image: code moves, a few bytes change, some is added"""
+    body = bytearray(body)
+    for _ in range(20):
+        pos = rng.randrange(len(body))
+        body[pos:pos] = bytes(rng.randrange(256) for _ in range(rng.randrange(1, 200)))
+    for _ in range(20):
+        pos = rng.randrange(len(body) - 100)
+        del body[pos:pos + rng.randrange(1, 100)]
+    for _ in range(200):
+        body[rng.randrange(len(body))] = rng.randrange(256)
+    body += bytes(rng.randrange(256) for _ in range(1000))
+    return bytes(body)
+
+
+class OtaDeltaTest(unittest.TestCase):
+    @classmethod
+    def setUpClass(cls):
+        rng = random.Random(1)
+        body = firmware_like(rng, 60000)
+        cls.old = app_image(body)
+        cls.new = app_image(edited(rng, body))
+        cls.patch = ota_delta.encode(ota_delta.diff(cls.old, cls.new), len(cls.new),
+                                     ota_delta.image_digest(cls.old))
+
+    def test_round_trip(self):
+        self.assertEqual(ota_delta.apply(self.old, self.patch), self.new)
+        self.assertEqual(ota_delta.apply(self.old, gzip.compress(self.patch)), self.new)
+        self.assertLess(len(gzip.compress(self.patch)), len(self.new) // 4)
+
+    def test_identical(self):
+        patch = ota_delta.encode(ota_delta.diff(self.old, self.old), len(self.old),
+                                 ota_delta.image_digest(self.old))
+        self.assertEqual(ota_delta.apply(self.old, patch), self.old)
+
+    def test_command_line(self):
+        with tempfile.TemporaryDirectory() as tmp:
+            paths = {name: os.path.join(tmp, name) for name in ('old.bin', 'new.bin', 'update.delta.gz', 'out.bin')}
+            with open(paths['old.bin'], 'wb') as f:
+                f.write(self.old)
+            with open(paths['new.bin'], 'wb') as f:
+                f.write(self.new)
+            tool = os.path.join(TOOLS, 'ota_delta.py')
+            subprocess.run([sys.executable, tool, 'diff', paths['old.bin'], paths['new.bin'],
+                            paths['update.delta.gz']], check=True, stdout=subprocess.DEVNULL)
+            with open(paths['update.delta.gz'], 'rb') as f:
+                self.assertEqual(f.read(2), b'\x1f\x8b')
+            subprocess.run([sys.executable, tool, 'apply', paths['old.bin'], paths['update.delta.gz'],
+                            paths['out.bin']], check=True, stdout=subprocess.DEVNULL)
+            with open(paths['out.bin'], 'rb') as f:
+                self.assertEqual(f.read(), self.new)
+
+            # The wrong source fails with a message, not a traceback
+            result = subprocess.run([sys.executable, tool, 'apply', paths['new.bin'], paths['update.delta.gz'],
+                                     paths['out.bin']], stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+            self.assertEqual(result.returncode, 1)
+            self.assertIn(b'different image', result.stderr)
+
+    def test_wrong_source(self):
+        other = app_image(firmware_like(random.Random(2), 60000))
+        with self.assertRaisesRegex(ota_delta.PatchError, 'different image'):
+            ota_delta.apply(other, self.patch)
+        # A source whose appended digest doesn't match its contents
+        damaged = bytearray(self.old)
+        damaged[100] ^= 1
+        with self.assertRaisesRegex(ota_delta.PatchError, 'does not match'):
+            ota_delta.apply(bytes(damaged), self.patch)
+        with self.assertRaisesRegex(ota_delta.PatchError, 'not an app image'):
+            ota_delta.apply(b'\0' * 1000, self.patch)
+
+    def test_truncated(self):
+        for length in (0, 10, ota_delta.HEADER.size, ota_delta.HEADER.size + 5, len(self.patch) // 2,
+                       len(self.patch) - 1):
+            with self.subTest(length=length), self.assertRaises(ota_delta.PatchError):
+                ota_delta.apply(self.old, self.patch[:length])
+
+    def test_trailing_data(self):
+        with self.assertRaisesRegex(ota_delta.PatchError, 'after the end'):
+            ota_delta.apply(self.old, self.patch + b'\0')
+
+    def test_bad_magic(self):
+        with self.assertRaisesRegex(ota_delta.PatchError, 'not a delta patch'):
+            ota_delta.apply(self.old, b'XXXX' + self.patch[4:])
+
+    def test_corrupted(self):
+        """A damaged patch is refused, or rebuilds an image whose appended SHA-256
+        no longer matches, which the probe checks before booting it. Damage to
+        a field that isn't used, such as the last record's seek, changes nothing."""
+        rng = random.Random(3)
+        positions = list(range(4, ota_delta.HEADER.size + 3 * ota_delta.CONTROL.size))
+        positions += rng.sample(range(len(self.patch)), 300)
+        for pos in positions:
+            patch = bytearray(self.patch)
+            patch[pos] ^= 1 << rng.randrange(8)
+            with self.subTest(pos=pos):
+                try:
+                    rebuilt = ota_delta.apply(self.old, bytes(patch))
+                except ota_delta.PatchError:
+                    continue
+                if rebuilt != self.new:
+                    with self.assertRaises(ota_delta.PatchError):
+                        ota_delta.image_digest(rebuilt)
+
+
+if __name__ == '__main__':
+    unittest.main()
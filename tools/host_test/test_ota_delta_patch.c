@@ -0,0 +1,241 @@
+/*
+ * Applies a patch made by tools/ota_delta.py with the probe's patcher, in
+ * pieces of every awkward size, and checks that patches which are cut
+ * short, run on, or were made for another image are refused.
+ *
+ * The source partition is an image in memory, padded out with erased
+ * flash, and its digest is the SHA-256 appended to the image as it is for
+ * an app partition. make_delta_fixtures.py writes the images and patch to
+ * FIXTURES first.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../main/ota_delta.c"
+
+#define SOURCE_PARTITION_SIZE 0x20000
+
+struct blob {
+	uint8_t *data;
+	size_t len;
+};
+
+struct sink {
+	uint8_t *data;
+	size_t len;
+	size_t cap;
+};
+
+static uint8_t source_flash[SOURCE_PARTITION_SIZE];
+static size_t source_len;
+static const esp_partition_t source_part = {.address = 0x10000, .size = SOURCE_PARTITION_SIZE, .label = "ota_0"};
+static int maps;
+
+esp_err_t esp_partition_mmap(const esp_partition_t *partition, size_t offset, size_t size,
+	esp_partition_mmap_memory_t memory, const void **out_ptr, esp_partition_mmap_handle_t *out_handle)
+{
+	assert(partition == &source_part && offset + size <= partition->size);
+	*out_ptr = source_flash + offset;
+	*out_handle = 1;
+	maps++;
+	return ESP_OK;
+}
+
+void esp_partition_munmap(esp_partition_mmap_handle_t handle)
+{
+	assert(handle == 1);
+	maps--;
+}
+
+esp_err_t esp_partition_get_sha256(const esp_partition_t *partition, uint8_t *sha_256)
+{
+	memcpy(sha_256, source_flash + source_len - OTA_DELTA_DIGEST_SIZE, OTA_DELTA_DIGEST_SIZE);
+	return ESP_OK;
+}
+
+static struct blob load(const char *name)
+{
+	char path[256];
+	struct blob blob;
+
+	snprintf(path, sizeof(path), "%s/%s", FIXTURES, name);
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		fprintf(stderr, "%s is missing, run make_delta_fixtures.py\n", path);
+		exit(1);
+	}
+	fseek(f, 0, SEEK_END);
+	blob.len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	blob.data = malloc(blob.len);
+	assert(fread(blob.data, 1, blob.len, f) == blob.len);
+	fclose(f);
+	return blob;
+}
+
+static void set_source(const struct blob *image)
+{
+	assert(image->len <= sizeof(source_flash));
+	memset(source_flash, 0xff, sizeof(source_flash));
+	memcpy(source_flash, image->data, image->len);
+	source_len = image->len;
+}
+
+/* Every byte the patcher produces comes from a byte of the patch, so the
+   output can never be longer than the patch */
+static esp_err_t sink_out(void *ctx, const uint8_t *data, size_t len)
+{
+	struct sink *sink = ctx;
+	assert(sink->len + len <= sink->cap);
+	memcpy(sink->data + sink->len, data, len);
+	sink->len += len;
+	return ESP_OK;
+}
+
+/* Feed `len` bytes of `patch` in pieces of `chunk`, returning the first error */
+static esp_err_t apply_chunked(const uint8_t *patch, size_t len, size_t chunk, struct sink *sink)
+{
+	struct ota_delta *delta = ota_delta_new(&source_part, sink_out, sink);
+	esp_err_t err = ESP_OK;
+	size_t pos;
+
+	assert(delta && maps == 1);
+	sink->len = 0;
+	for (pos = 0; pos < len && err == ESP_OK; pos += chunk) {
+		err = ota_delta_write(delta, patch + pos, (len - pos < chunk) ? len - pos : chunk);
+	}
+	if (err == ESP_OK) {
+		err = ota_delta_finish(delta);
+	}
+	ota_delta_free(delta);
+	assert(maps == 0);
+	return err;
+}
+
+static void put_u32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+/* Start a patch for the source, returning its length so far */
+static size_t make_header(uint8_t *patch, uint32_t target_size)
+{
+	memcpy(patch, OTA_DELTA_MAGIC, 4);
+	put_u32(patch + 4, target_size);
+	esp_partition_get_sha256(&source_part, patch + 8);
+	return OTA_DELTA_HEADER_SIZE;
+}
+
+/* Add a record to a patch `len` bytes long, with `data_len` zero bytes of
+   diff and extra data after it */
+static size_t add_record(uint8_t *patch, size_t len, uint32_t diff_len, uint32_t extra_len, int32_t seek,
+	size_t data_len)
+{
+	put_u32(patch + len, diff_len);
+	put_u32(patch + len + 4, extra_len);
+	put_u32(patch + len + 8, seek);
+	memset(patch + len + OTA_DELTA_CONTROL_SIZE, 0, data_len);
+	return len + OTA_DELTA_CONTROL_SIZE + data_len;
+}
+
+static void test_apply(const struct blob *patch, const struct blob *new, struct sink *sink)
+{
+	static const size_t chunks[] = {1, 2, 3, 7, 11, 12, 13, 39, 40, 41, 255, 256, 257, 4096, 1 << 20};
+	size_t i;
+
+	assert(ota_delta_detect(patch->data, patch->len));
+	assert(ota_delta_detect(patch->data, 2));
+	assert(!ota_delta_detect((const uint8_t *)"\x1f\x8b", 2));
+
+	for (i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++) {
+		assert(apply_chunked(patch->data, patch->len, chunks[i], sink) == ESP_OK);
+		assert(sink->len == new->len && !memcmp(sink->data, new->data, new->len));
+	}
+}
+
+static void test_refused(const struct blob *patch, struct sink *sink)
+{
+	uint8_t *copy = malloc(patch->len + 16);
+	size_t i;
+
+	// Cut short in the header, in a control record and in the data
+	const size_t cuts[] = {0, 1, 10, OTA_DELTA_HEADER_SIZE - 1, OTA_DELTA_HEADER_SIZE, OTA_DELTA_HEADER_SIZE + 5,
+		OTA_DELTA_HEADER_SIZE + OTA_DELTA_CONTROL_SIZE + 1, patch->len / 2, patch->len - 1};
+	for (i = 0; i < sizeof(cuts) / sizeof(cuts[0]); i++) {
+		assert(apply_chunked(patch->data, cuts[i], 512, sink) == ESP_ERR_INVALID_SIZE);
+	}
+
+	// Anything after the last record
+	memcpy(copy, patch->data, patch->len);
+	for (i = 1; i <= 16; i++) {
+		memset(copy + patch->len, 0, i);
+		assert(apply_chunked(copy, patch->len + i, 512, sink) == ESP_ERR_INVALID_SIZE);
+		assert(apply_chunked(copy, patch->len + i, 1, sink) == ESP_ERR_INVALID_SIZE);
+	}
+
+	// Not a patch, and nothing is produced from it
+	memcpy(copy, "XXXX", 4);
+	assert(apply_chunked(copy, patch->len, 512, sink) == ESP_ERR_INVALID_ARG && sink->len == 0);
+
+	// Records that would run past the image or outside the source. Each is
+	// followed by data, so a missing check reads or writes out of bounds.
+	size_t len = add_record(copy, make_header(copy, 100), 101, 0, 0, 101);
+	assert(apply_chunked(copy, len, 512, sink) == ESP_ERR_INVALID_SIZE && sink->len == 0);
+	len = add_record(copy, make_header(copy, 100), 50, 51, 0, 101);
+	assert(apply_chunked(copy, len, 512, sink) == ESP_ERR_INVALID_SIZE && sink->len == 0);
+	len = add_record(copy, make_header(copy, 0xffffffff), 0xffffffff, 0xffffffff, 0, 16);
+	assert(apply_chunked(copy, len, 512, sink) == ESP_ERR_INVALID_SIZE && sink->len == 0);
+	len = add_record(copy, make_header(copy, 100), 0, 0, SOURCE_PARTITION_SIZE - 5, 0);
+	len = add_record(copy, len, 10, 0, 0, 10);
+	assert(apply_chunked(copy, len, 512, sink) == ESP_ERR_INVALID_SIZE && sink->len == 0);
+	len = add_record(copy, make_header(copy, 100), 10, 0, -11, 10);
+	len = add_record(copy, len, 0, 10, 0, 10);
+	assert(apply_chunked(copy, len, 512, sink) == ESP_ERR_INVALID_SIZE && sink->len == 10);
+
+	// Damage anywhere is refused, or rebuilds something of no more than the
+	// patch's length for the image digest to catch
+	srand(3);
+	for (i = 0; i < 2000; i++) {
+		size_t pos = (i < OTA_DELTA_HEADER_SIZE + 3 * OTA_DELTA_CONTROL_SIZE) ? i : rand() % patch->len;
+		memcpy(copy, patch->data, patch->len);
+		copy[pos] ^= 1 << (rand() % 8);
+		apply_chunked(copy, patch->len, 1 + rand() % 1000, sink);
+	}
+
+	free(copy);
+}
+
+static void test_wrong_source(const struct blob *patch, const struct blob *other, struct sink *sink)
+{
+	set_source(other);
+	assert(apply_chunked(patch->data, patch->len, 1, sink) == ESP_ERR_INVALID_VERSION && sink->len == 0);
+	assert(apply_chunked(patch->data, patch->len, 4096, sink) == ESP_ERR_INVALID_VERSION && sink->len == 0);
+}
+
+int main(void)
+{
+	struct blob old = load("old.bin");
+	struct blob new = load("new.bin");
+	struct blob other = load("other.bin");
+	struct blob patch = load("update.delta");
+	struct sink sink = {.data = malloc(patch.len), .cap = patch.len};
+
+	set_source(&old);
+	test_apply(&patch, &new, &sink);
+	test_refused(&patch, &sink);
+	test_wrong_source(&patch, &other, &sink);
+
+	free(sink.data);
+	free(patch.data);
+	free(other.data);
+	free(new.data);
+	free(old.data);
+	printf("ota delta patcher: ok\n");
+	return 0;
+}
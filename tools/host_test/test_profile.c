@@ -0,0 +1,244 @@
+/*
+ * Feeds synthetic ITM PC sample streams through the decoder into the
+ * profiler, the way the SWO receive task does, and checks the histogram
+ * and the symbolised report.
+ */
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "itm_decode.h"
+#include "../../main/profile.c"
+
+int swo_active;
+
+uint32_t target_mem_read32(target *t, uint32_t addr) { return 0; }
+void target_mem_write32(target *t, uint32_t addr, uint32_t value) {}
+bool target_check_error(target *t) { return false; }
+void traceswo_init(uint32_t baudrate, uint32_t swo_chan_bitmask) {}
+void traceswo_baud(unsigned int baud) {}
+void gdb_out(const char *buf) { fputs(buf, stdout); }
+void gdb_outf(const char *fmt, ...) {}
+
+static const char *query;
+static size_t recv_chunk;
+
+int httpd_req_recv(httpd_req_t *req, char *buf, size_t len)
+{
+	size_t left = req->content_len - req->body_pos;
+	len = len < recv_chunk ? len : recv_chunk;
+	len = len < left ? len : left;
+	memcpy(buf, req->body + req->body_pos, len);
+	req->body_pos += len;
+	return len;
+}
+
+esp_err_t httpd_req_get_url_query_str(httpd_req_t *req, char *buf, size_t len)
+{
+	if (!query) {
+		return ESP_ERR_NOT_FOUND;
+	}
+	snprintf(buf, len, "%s", query);
+	return ESP_OK;
+}
+
+esp_err_t httpd_query_key_value(const char *qs, const char *key, char *val, size_t len)
+{
+	size_t key_len = strlen(key);
+	const char *p = qs;
+	while (p && *p) {
+		if (!strncmp(p, key, key_len) && p[key_len] == '=') {
+			p += key_len + 1;
+			snprintf(val, len, "%.*s", (int)strcspn(p, "&"), p);
+			return ESP_OK;
+		}
+		p = strchr(p, '&');
+		p = p ? p + 1 : NULL;
+	}
+	return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t httpd_resp_set_type(httpd_req_t *req, const char *type) { return ESP_OK; }
+esp_err_t httpd_resp_send_500(httpd_req_t *req) { return ESP_OK; }
+
+esp_err_t httpd_resp_send_chunk(httpd_req_t *req, const char *buf, ssize_t len)
+{
+	if (buf) {
+		req->out = realloc(req->out, req->out_len + len + 1);
+		memcpy(req->out + req->out_len, buf, len);
+		req->out_len += len;
+		req->out[req->out_len] = '\0';
+	}
+	return ESP_OK;
+}
+
+esp_err_t httpd_resp_sendstr(httpd_req_t *req, const char *str)
+{
+	return httpd_resp_send_chunk(req, str, strlen(str));
+}
+
+/* Same as swo_hardware_cb() in traceswo.c */
+static void hardware(void *ctx, uint8_t id, uint32_t value, size_t len)
+{
+	if (id == ITM_HW_PC_SAMPLE) {
+		profile_add_sample((len == 4) ? value : PROFILE_PC_SLEEP);
+	}
+}
+
+struct stream {
+	uint8_t data[8192];
+	size_t len;
+};
+
+static void emit_pc(struct stream *s, uint32_t pc, int times)
+{
+	while (times-- > 0) {
+		s->data[s->len++] = 0x17;
+		s->data[s->len++] = pc;
+		s->data[s->len++] = pc >> 8;
+		s->data[s->len++] = pc >> 16;
+		s->data[s->len++] = pc >> 24;
+	}
+}
+
+static void emit_sleep(struct stream *s, int times)
+{
+	while (times-- > 0) {
+		s->data[s->len++] = 0x15;
+		s->data[s->len++] = 0x00;
+	}
+}
+
+static void emit_sync(struct stream *s)
+{
+	static const uint8_t sync[] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x80};
+	memcpy(s->data + s->len, sync, sizeof(sync));
+	s->len += sizeof(sync);
+}
+
+static char *report(const char *qs)
+{
+	httpd_req_t req = {.uri = "/profile"};
+	query = qs;
+	cgi_profile(&req);
+	query = NULL;
+	return req.out;
+}
+
+static void upload_map(const char *map, size_t chunk)
+{
+	httpd_req_t req = {.uri = "/profile/map", .body = map, .content_len = strlen(map)};
+	recv_chunk = chunk;
+	assert(cgi_profile_map(&req) == ESP_OK);
+	free(req.out);
+}
+
+static const char nm_output[] = "08000100 00000100 T main\r\n"
+								"08000200 00000080 t loop\r\n"
+								"20000000 00000004 D counter\r\n" /* data, ignored */
+								"08000400 W SysTick_Handler\n"    /* no size, runs to the next */
+								"08000480 00000010 T idle\n"
+								"08000800 00000040 T foo(int, char)\n"       /* demangled C++ */
+								"08000580 t (anonymous namespace)::bar() \n" /* and without a size */
+								"garbage\n"
+								"08000600 00000020 T last_without_newline";
+
+static void test_histogram(void)
+{
+	struct itm_decoder d;
+	struct stream s = {0};
+	char *out;
+
+	profile_reset();
+	emit_sync(&s);
+	emit_pc(&s, 0x08000210, 50);
+	emit_pc(&s, 0x08000105, 30); /* Thumb bit set */
+	emit_sleep(&s, 5);
+	emit_pc(&s, 0x08000440, 15);
+	emit_pc(&s, 0x08000810, 3);
+	emit_pc(&s, 0x08000584, 2);
+	emit_sync(&s);
+	emit_pc(&s, 0x08010000, 1);
+
+	itm_decoder_init(&d, NULL, hardware, NULL);
+	itm_decode(&d, s.data, s.len);
+
+	out = report(NULL);
+	assert(strstr(out, "# samples 106, sleeping 5, dropped 0, unique 6\n"));
+	assert(strstr(out, "# count    %  pc\n     50 47.1  0x08000210\n     30 28.3  0x08000105\n"
+					   "     15 14.1  0x08000440\n      3  2.8  0x08000810\n      2  1.8  0x08000584\n"
+					   "      1  0.9  0x08010000\n"));
+	free(out);
+
+	/* The same PCs by symbol, once a map is loaded in awkward pieces */
+	upload_map(nm_output, 7);
+	assert(profile_symbols.count == 7);
+	out = report("symbols=1");
+	assert(strstr(out, "     50 47.1  0x08000200 0x08000280 loop\n"
+					   "     30 28.3  0x08000100 0x08000200 main\n"
+					   "     15 14.1  0x08000400 0x08000480 SysTick_Handler\n"
+					   "      3  2.8  0x08000800 0x08000840 foo(int, char)\n"
+					   "      2  1.8  0x08000580 0x08000600 (anonymous namespace)::bar()\n"
+					   "      1  0.9  -          -          (unknown)\n"));
+	free(out);
+
+	/* By address, each PC is placed within its symbol */
+	out = report("limit=2");
+	assert(strstr(out, "0x08000210 loop+0x10\n"));
+	assert(strstr(out, "0x08000105 main+0x4\n"));
+	assert(!strstr(out, "SysTick"));
+	free(out);
+
+	/* ?reset=1 clears it after the report */
+	free(report("reset=1"));
+	out = report(NULL);
+	assert(strstr(out, "# samples 0, sleeping 0, dropped 0, unique 0\n"));
+	free(out);
+}
+
+static void test_full_table(void)
+{
+	uint32_t pc;
+	uint32_t colliding[PROFILE_MAX_PROBES + 1];
+	int n = 0;
+
+	/* A PC that hashes to a crowded slot is dropped before the table fills */
+	profile_reset();
+	for (pc = 0x08000000; n < PROFILE_MAX_PROBES + 1; pc += 2) {
+		if (profile_hash(pc) == 0) {
+			colliding[n++] = pc;
+		}
+	}
+	for (n = 0; n < PROFILE_MAX_PROBES + 1; n++) {
+		profile_add_sample(colliding[n]);
+	}
+	assert(profile_unique == PROFILE_MAX_PROBES);
+	assert(profile_dropped == 1);
+	/* Ones already in the table are still counted */
+	profile_add_sample(colliding[0]);
+	assert(profile_dropped == 1);
+
+	/* Filling the whole table drops the rest, and no sample probes more
+	   than PROFILE_MAX_PROBES slots */
+	profile_reset();
+	for (pc = 0x08000000; pc < 0x08000000 + 2 * 4 * CONFIG_PROFILE_HASH_ENTRIES; pc += 2) {
+		profile_add_sample(pc);
+	}
+	assert(profile_samples == 4 * CONFIG_PROFILE_HASH_ENTRIES);
+	assert(profile_unique <= CONFIG_PROFILE_HASH_ENTRIES);
+	assert(profile_unique + profile_dropped == profile_samples);
+	assert(profile_dropped >= 3 * CONFIG_PROFILE_HASH_ENTRIES);
+}
+
+int main(void)
+{
+	profile_init();
+	test_histogram();
+	test_full_table();
+	profile_map_free(&profile_symbols);
+	printf("profile: ok\n");
+	return 0;
+}
@@ -0,0 +1,222 @@
+/*
+ * Hammers the websocket subscriber registry from several threads at once:
+ * writers keep adding, updating and removing their own sockets while
+ * readers take lock-free snapshots, the way the broadcaster does. Every
+ * slot a writer fills is self-describing, so a snapshot that caught a
+ * writer halfway through shows up as a slot that doesn't add up.
+ *
+ * The registry's copy yields in the middle of a slot, a different one each
+ * time, and writers yield between changes, so that readers are caught out
+ * by writers even on a host with a single CPU.
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void *slow_memcpy(void *dst, const void *src, size_t len);
+
+#define memcpy slow_memcpy
+#include "../../main/wsmux_registry.c"
+#undef memcpy
+
+/* Only the snapshot copies, so this is always a run of slots */
+static void *slow_memcpy(void *dst, const void *src, size_t len)
+{
+	static atomic_uint copies;
+	volatile uint8_t *d = dst;
+	const volatile uint8_t *s = src;
+	size_t slots = len / sizeof(struct wsmux_subscriber);
+	size_t yield_at = (atomic_fetch_add(&copies, 1) % slots) * sizeof(struct wsmux_subscriber) +
+		sizeof(struct wsmux_subscriber) / 2;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (i == yield_at) {
+			sched_yield();
+		}
+		d[i] = s[i];
+	}
+	return dst;
+}
+
+#define CAPACITY      8
+#define WRITERS       3
+#define FDS_PER_WRITER 3
+#define READERS       3
+#define WRITER_ROUNDS 100000
+
+/* The low bits of a slot's subscriptions always hold its fd, and updates
+   only touch the bits above */
+#define FD_MASK     0xffffu
+#define UPDATE_BITS 0xff0000u
+
+static atomic_int writers_done;
+static atomic_ulong snapshots;
+
+static int writer_fd(int writer, int n)
+{
+	return writer * 16 + n + 1;
+}
+
+static void check_slot(const struct wsmux_subscriber *sub)
+{
+	if (sub->fd == 0) {
+		assert(!sub->raw && sub->subscriptions == 0 && sub->generation == 0);
+		return;
+	}
+	assert(sub->fd > 0 && sub->fd <= writer_fd(WRITERS - 1, FDS_PER_WRITER - 1));
+	assert((sub->subscriptions & FD_MASK) == (uint32_t)sub->fd);
+	assert((sub->subscriptions & ~(FD_MASK | UPDATE_BITS)) == 0);
+	assert(sub->raw == (sub->fd & 1));
+	assert(sub->generation != 0);
+}
+
+static void check_snapshot(const struct wsmux_subscriber *snap)
+{
+	int i, j;
+	for (i = 0; i < CAPACITY; i++) {
+		check_slot(&snap[i]);
+		for (j = 0; j < i; j++) {
+			assert(snap[i].fd == 0 || snap[i].fd != snap[j].fd);
+			assert(snap[i].fd == 0 || snap[i].generation != snap[j].generation);
+		}
+	}
+}
+
+static void *writer(void *arg)
+{
+	int id = (int)(intptr_t)arg;
+	bool added[FDS_PER_WRITER] = {0};
+	unsigned int seed = id;
+	int round;
+
+	for (round = 0; round < WRITER_ROUNDS; round++) {
+		int n = rand_r(&seed) % FDS_PER_WRITER;
+		int fd = writer_fd(id, n);
+		uint32_t subscriptions;
+
+		switch (rand_r(&seed) % 3) {
+		case 0:
+			if (!added[n]) {
+				esp_err_t ret = wsmux_registry_add(fd, fd & 1, fd);
+				// More sockets than slots, so the table fills up at times
+				assert(ret == ESP_OK || ret == ESP_ERR_NO_MEM);
+				added[n] = (ret == ESP_OK);
+			}
+			break;
+		case 1: {
+			uint32_t set = (rand_r(&seed) & 0xff) << 16;
+			uint32_t clear = (rand_r(&seed) & 0xff) << 16;
+			esp_err_t ret = wsmux_registry_update(fd, set, clear, &subscriptions);
+			assert(ret == (added[n] ? ESP_OK : ESP_ERR_NOT_FOUND));
+			if (ret == ESP_OK) {
+				assert((subscriptions & FD_MASK) == (uint32_t)fd);
+			}
+			break;
+		}
+		default:
+			wsmux_registry_remove(fd);
+			added[n] = false;
+			break;
+		}
+		sched_yield();
+	}
+	for (int n = 0; n < FDS_PER_WRITER; n++) {
+		wsmux_registry_remove(writer_fd(id, n));
+	}
+	atomic_fetch_add(&writers_done, 1);
+	return NULL;
+}
+
+static void *reader(void *arg)
+{
+	struct wsmux_subscriber snap[CAPACITY];
+	(void)arg;
+
+	while (atomic_load(&writers_done) < WRITERS) {
+		wsmux_registry_snapshot(snap);
+		check_snapshot(snap);
+		atomic_fetch_add(&snapshots, 1);
+	}
+	return NULL;
+}
+
+static void test_single_threaded(void)
+{
+	struct wsmux_subscriber snap[CAPACITY];
+	uint32_t subscriptions;
+	int fd;
+
+	for (fd = 1; fd <= CAPACITY; fd++) {
+		assert(wsmux_registry_add(fd, false, 1u << fd) == ESP_OK);
+	}
+	assert(wsmux_registry_add(CAPACITY + 1, false, 1) == ESP_ERR_NO_MEM);
+	assert(wsmux_registry_channels() == 0x1fe);
+
+	assert(wsmux_registry_update(3, 1, 1u << 3, &subscriptions) == ESP_OK);
+	assert(subscriptions == 1);
+	assert(wsmux_registry_update(CAPACITY + 1, 1, 0, &subscriptions) == ESP_ERR_NOT_FOUND);
+	assert(wsmux_registry_update(0, 1, 0, &subscriptions) == ESP_ERR_NOT_FOUND);
+	assert(wsmux_registry_channels() == 0x1f7);
+
+	wsmux_registry_snapshot(snap);
+	uint32_t generation = snap[2].generation;
+	wsmux_registry_remove(3);
+	assert(wsmux_registry_add(3, true, 1u << 3) == ESP_OK);
+	wsmux_registry_snapshot(snap);
+	assert(snap[2].fd == 3 && snap[2].raw && snap[2].generation != generation);
+
+	for (fd = 1; fd <= CAPACITY; fd++) {
+		wsmux_registry_remove(fd);
+	}
+	// Removing an fd that isn't there, or the empty-slot marker, is harmless
+	wsmux_registry_remove(1);
+	wsmux_registry_remove(0);
+	assert(wsmux_registry_channels() == 0);
+}
+
+static void test_concurrent(void)
+{
+	struct wsmux_subscriber snap[CAPACITY];
+	pthread_t writers[WRITERS];
+	pthread_t readers[READERS];
+	int i;
+
+	for (i = 0; i < READERS; i++) {
+		assert(pthread_create(&readers[i], NULL, reader, NULL) == 0);
+	}
+	for (i = 0; i < WRITERS; i++) {
+		assert(pthread_create(&writers[i], NULL, writer, (void *)(intptr_t)i) == 0);
+	}
+	for (i = 0; i < WRITERS; i++) {
+		pthread_join(writers[i], NULL);
+	}
+	for (i = 0; i < READERS; i++) {
+		pthread_join(readers[i], NULL);
+	}
+
+	wsmux_registry_snapshot(snap);
+	for (i = 0; i < CAPACITY; i++) {
+		assert(snap[i].fd == 0);
+	}
+	assert(wsmux_registry_channels() == 0);
+	assert(atomic_load(&snapshots) > 0);
+	printf("%d writers x %d rounds against %lu snapshots\n", WRITERS, WRITER_ROUNDS, atomic_load(&snapshots));
+}
+
+int main(void)
+{
+	assert(wsmux_registry_init(CAPACITY) == ESP_OK);
+	assert(wsmux_registry_capacity() == CAPACITY);
+
+	test_single_threaded();
+	test_concurrent();
+	printf("wsmux registry: ok\n");
+	return 0;
+}
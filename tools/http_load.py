@@ -0,0 +1,146 @@
+#!/usr/bin/env python3
+"""Measure web UI page load latency against a running probe.
+
+Each simulated browser keeps one persistent connection open, fetches a
+page and every script and stylesheet it references, then starts over.
+Page load latency is reported for each level of concurrency, along with the
+bytes received and how many responses came with a Content-Length or in
+chunks.
+
+    tools/http_load.py 192.168.4.1
+    tools/http_load.py blackmagic.local --page /rtt.html --loads 20
+
+To compare serving stored files from the mapped image against the chunked
+frogfs_fread() path, run the same command against a build with
+CONFIG_HTTP_FROGFS_ZERO_COPY on and one with it off.
+"""
+
+import argparse
+import http.client
+import re
+import statistics
+import sys
+import threading
+import time
+
+ASSET_RE = re.compile(r'(?:src|href)\s*=\s*["\']([^"\':]+\.(?:js|css))["\']', re.IGNORECASE)
+
+
+class Browser:
+    def __init__(self, host, port, timeout):
+        self.host = host
+        self.port = port
+        self.timeout = timeout
+        self.conn = None
+        self.connections = 0
+        self.bytes = 0
+        self.sized = 0
+        self.chunked = 0
+
+    def get(self, path):
+        for attempt in range(2):
+            if self.conn is None:
+                self.conn = http.client.HTTPConnection(self.host, self.port, timeout=self.timeout)
+                self.connections += 1
+            try:
+                self.conn.request('GET', path, headers={'Accept-Encoding': 'gzip'})
+                response = self.conn.getresponse()
+                body = response.read()
+                self.bytes += len(body)
+                if response.getheader('Transfer-Encoding', '').lower() == 'chunked':
+                    self.chunked += 1
+                else:
+                    self.sized += 1
+                if response.getheader('Connection', '').lower() == 'close':
+                    self.close()
+                return response.status, body
+            except (http.client.HTTPException, OSError):
+                # The server may have closed an idle connection
+                self.close()
+                if attempt:
+                    raise
+        return None, b''
+
+    def close(self):
+        if self.conn is not None:
+            self.conn.close()
+            self.conn = None
+
+
+def assets(page):
+    return sorted(set(ASSET_RE.findall(page.decode('utf-8', 'replace'))))
+
+
+def run_browser(args, results, errors, browsers):
+    browser = Browser(args.host, args.port, args.timeout)
+    for _ in range(args.loads):
+        start = time.monotonic()
+        try:
+            status, body = browser.get(args.page)
+            if status != 200:
+                errors.append(status)
+                continue
+            # A gzipped page can't be scanned, so fall back to the known set
+            names = assets(body) if not body.startswith(b'\x1f\x8b') else args.assets
+            for name in names:
+                path = name if name.startswith('/') else '/' + name
+                status, _ = browser.get(path)
+                if status not in (200, 304):
+                    errors.append(status)
+        except (http.client.HTTPException, OSError) as e:
+            errors.append(str(e))
+            continue
+        results.append(time.monotonic() - start)
+    browser.close()
+    browsers.append(browser)
+
+
+def run(args, concurrency):
+    results = []
+    errors = []
+    browsers = []
+    threads = [threading.Thread(target=run_browser, args=(args, results, errors, browsers))
+               for _ in range(concurrency)]
+    start = time.monotonic()
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    elapsed = time.monotonic() - start
+
+    if results:
+        results.sort()
+        p95 = results[min(len(results) - 1, int(len(results) * 0.95))]
+        received = sum(b.bytes for b in browsers)
+        print('{:3d} browsers: {:4d} loads in {:6.2f}s  median {:6.0f} ms  p95 {:6.0f} ms  max {:6.0f} ms  '
+              'connections {:4d}  errors {}'.format(concurrency, len(results), elapsed,
+                                                    statistics.median(results) * 1000, p95 * 1000,
+                                                    results[-1] * 1000, sum(b.connections for b in browsers),
+                                                    len(errors)))
+        print('             {:8.0f} KiB at {:6.0f} KiB/s  responses: {} with Content-Length, {} chunked'.format(
+            received / 1024, received / 1024 / elapsed, sum(b.sized for b in browsers),
+            sum(b.chunked for b in browsers)))
+    else:
+        print('{:3d} browsers: no successful loads, errors {}'.format(concurrency, errors[:4]))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('host', help='address of the probe')
+    parser.add_argument('--port', type=int, default=80)
+    parser.add_argument('--page', default='/index.html', help='page to load')
+    parser.add_argument('--assets', nargs='*',
+                        default=['/xterm.css', '/xterm.js', '/xterm-addon-fit.js'],
+                        help='assets to fetch when the page cannot be scanned for them')
+    parser.add_argument('--loads', type=int, default=10, help='page loads per browser')
+    parser.add_argument('--concurrency', type=int, nargs='*', default=[1, 4, 16])
+    parser.add_argument('--timeout', type=float, default=10.0)
+    args = parser.parse_args()
+
+    for concurrency in args.concurrency:
+        run(args, concurrency)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,223 @@
+#!/usr/bin/env python3
+"""Make and apply delta patches for OTA updates.
+
+A patch rebuilds a new firmware image from the one running on the probe,
+and is usually a small fraction of the size once compressed. The format
+is described in main/ota_delta.h. Send the patch like a full image:
+
+    tools/ota_delta.py diff old/farpatch.bin build/farpatch.bin update.delta.gz
+    curl -T update.delta.gz tftp://192.168.4.1/firmware.bin.gz
+
+`diff` applies the patch it made and checks the result before writing it.
+`apply` does the same as the probe, for checking patches made elsewhere:
+
+    tools/ota_delta.py apply old/farpatch.bin update.delta.gz rebuilt.bin
+
+Patches are gzip compressed when the output name ends in .gz.
+"""
+
+import argparse
+import gzip
+import hashlib
+import struct
+import sys
+
+MAGIC = b'FPD1'
+HEADER = struct.Struct('<4sI32s')
+CONTROL = struct.Struct('<IIi')
+DIGEST_SIZE = 32
+IMAGE_MAGIC = 0xe9
+
+# Exact matches shorter than this aren't worth a record of their own
+SEED_LEN = 16
+INDEX_STRIDE = 4
+MIN_MATCH = 32
+
+
+class PatchError(Exception):
+    pass
+
+
+def image_digest(image):
+    """The SHA-256 esptool appends, which the probe compares against"""
+    if len(image) < 24 + DIGEST_SIZE or image[0] != IMAGE_MAGIC or image[23] != 1:
+        raise PatchError('source is not an app image with an appended SHA-256')
+    digest = image[-DIGEST_SIZE:]
+    if hashlib.sha256(image[:-DIGEST_SIZE]).digest() != digest:
+        raise PatchError('source image SHA-256 does not match its appended digest')
+    return digest
+
+
+def build_index(old):
+    index = {}
+    for i in range(0, len(old) - SEED_LEN + 1, INDEX_STRIDE):
+        index.setdefault(old[i:i + SEED_LEN], i)
+    return index
+
+
+def match_len(old, o, new, n, limit):
+    length = 0
+    while length < limit and old[o + length] == new[n + length]:
+        length += 1
+    return length
+
+
+def forward_extent(old, opos, new, npos, limit):
+    """Length of new[npos:] worth diffing against old[opos:], as bsdiff picks it:
+    the longest prefix in which more than half the bytes match"""
+    limit = min(limit, len(old) - opos)
+    score = best = length = 0
+    for i in range(limit):
+        if old[opos + i] == new[npos + i]:
+            score += 1
+        if score * 2 - (i + 1) > best * 2 - length:
+            best, length = score, i + 1
+    return length
+
+
+def backward_extent(old, opos, new, npos, limit):
+    """Like forward_extent, going back from old[opos] and new[npos]"""
+    limit = min(limit, opos)
+    score = best = length = 0
+    for i in range(1, limit + 1):
+        if old[opos - i] == new[npos - i]:
+            score += 1
+        if score * 2 - i > best * 2 - length:
+            best, length = score, i
+    return length
+
+
+def diff(old, new):
+    index = build_index(old)
+    records = []
+    npos = opos = 0
+    scan = 0
+
+    def emit(seed_new, seed_old):
+        nonlocal npos, opos
+        gap = seed_new - npos
+        lenf = forward_extent(old, opos, new, npos, gap)
+        lenb = backward_extent(old, seed_old, new, seed_new, gap - lenf) if seed_old is not None else 0
+        diff_bytes = bytes((new[npos + i] - old[opos + i]) & 0xff for i in range(lenf))
+        extra = new[npos + lenf:seed_new - lenb]
+        next_opos = (seed_old - lenb) if seed_old is not None else opos + lenf
+        records.append((diff_bytes, extra, next_opos - (opos + lenf)))
+        npos = seed_new - lenb
+        opos = next_opos
+
+    while scan + SEED_LEN <= len(new):
+        # Still following the current alignment, so nothing new to record
+        aligned = opos + (scan - npos)
+        if aligned + SEED_LEN <= len(old) and old[aligned:aligned + SEED_LEN] == new[scan:scan + SEED_LEN]:
+            scan += SEED_LEN
+            continue
+
+        o = index.get(new[scan:scan + SEED_LEN])
+        if o is None:
+            scan += 1
+            continue
+        length = match_len(old, o, new, scan, min(len(old) - o, len(new) - scan))
+        if length < MIN_MATCH:
+            scan += 1
+            continue
+        emit(scan, o)
+        scan += length
+
+    emit(len(new), None)
+    return records
+
+
+def encode(records, target_size, source_digest):
+    out = bytearray(HEADER.pack(MAGIC, target_size, source_digest))
+    for diff_bytes, extra, seek in records:
+        out += CONTROL.pack(len(diff_bytes), len(extra), seek)
+        out += diff_bytes
+        out += extra
+    return bytes(out)
+
+
+def apply(old, patch):
+    """Rebuild the image the way main/ota_delta.c does"""
+    if patch[:2] == b'\x1f\x8b':
+        patch = gzip.decompress(patch)
+    if len(patch) < HEADER.size:
+        raise PatchError('patch is truncated')
+    magic, target_size, source_digest = HEADER.unpack_from(patch)
+    if magic != MAGIC:
+        raise PatchError('not a delta patch')
+    if image_digest(old) != source_digest:
+        raise PatchError('patch was made for a different image')
+
+    new = bytearray()
+    pos = HEADER.size
+    opos = 0
+    while len(new) < target_size:
+        if pos + CONTROL.size > len(patch):
+            raise PatchError('patch is truncated')
+        diff_len, extra_len, seek = CONTROL.unpack_from(patch, pos)
+        pos += CONTROL.size
+        if len(new) + diff_len + extra_len > target_size or opos + diff_len > len(old):
+            raise PatchError('record out of range at offset %d' % pos)
+        if pos + diff_len + extra_len > len(patch):
+            raise PatchError('patch is truncated')
+        new += bytes((old[opos + i] + patch[pos + i]) & 0xff for i in range(diff_len))
+        pos += diff_len
+        new += patch[pos:pos + extra_len]
+        pos += extra_len
+        opos += diff_len + seek
+        if opos < 0:
+            raise PatchError('record seeks before the start of the source')
+    if pos != len(patch):
+        raise PatchError('unexpected data after the end of the patch')
+    return bytes(new)
+
+
+def cmd_diff(args):
+    old = open(args.old, 'rb').read()
+    new = open(args.new, 'rb').read()
+    records = diff(old, new)
+    patch = encode(records, len(new), image_digest(old))
+    if apply(old, patch) != new:
+        raise PatchError('patch does not rebuild the new image')
+    if args.patch.endswith('.gz'):
+        patch = gzip.compress(patch, 9)
+    with open(args.patch, 'wb') as f:
+        f.write(patch)
+    copied = sum(len(d) for d, _, _ in records)
+    print('%d records, %d bytes diffed, %d bytes literal, patch %d bytes (%.1f%% of %d)' %
+          (len(records), copied, len(new) - copied, len(patch), 100.0 * len(patch) / len(new), len(new)))
+
+
+def cmd_apply(args):
+    old = open(args.old, 'rb').read()
+    patch = open(args.patch, 'rb').read()
+    new = apply(old, patch)
+    with open(args.out, 'wb') as f:
+        f.write(new)
+    print('rebuilt %d bytes, sha256 %s' % (len(new), hashlib.sha256(new).hexdigest()))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest='command', required=True)
+    p = sub.add_parser('diff', help='make a patch from OLD to NEW')
+    p.add_argument('old')
+    p.add_argument('new')
+    p.add_argument('patch')
+    p.set_defaults(func=cmd_diff)
+    p = sub.add_parser('apply', help='rebuild an image from OLD and a patch')
+    p.add_argument('old')
+    p.add_argument('patch')
+    p.add_argument('out')
+    p.set_defaults(func=cmd_apply)
+    args = parser.parse_args()
+    try:
+        args.func(args)
+    except PatchError as e:
+        print('error: %s' % e, file=sys.stderr)
+        return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
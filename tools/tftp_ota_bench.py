@@ -0,0 +1,204 @@
+#!/usr/bin/env python3
+"""Time a TFTP firmware upload to a running probe.
+
+Uploads an image as firmware.bin and reports seconds per MB for each
+combination of block size and window size given. The built-in client
+speaks RFC 2347 option negotiation (blksize, tsize and windowsize,
+plus sha256 with --sha256 so the probe checks the whole file against it);
+--curl sends the same image with curl's TFTP client instead, which
+supports blksize only. --http does a single HTTP PUT to /flash/upload
+instead, to compare the two.
+
+A gzipped image (gzip -9 -k build/farpatch.bin) is inflated by the
+probe as it arrives. Seconds per MB are then given for both the data sent
+and the image it unpacks to.
+
+Each successful upload makes the probe reboot into the new image, so
+wait for it to come back between runs, which --settle does.
+
+    tools/tftp_ota_bench.py 192.168.4.1 build/farpatch.bin
+    tools/tftp_ota_bench.py blackmagic.local build/farpatch.bin --blksize 512 1468 --windowsize 1 4 8
+    tools/tftp_ota_bench.py 192.168.4.1 build/farpatch.bin --curl --blksize 1468
+    tools/tftp_ota_bench.py 192.168.4.1 build/farpatch.bin --http --sha256
+"""
+
+import argparse
+import gzip
+import hashlib
+import http.client
+import json
+import socket
+import struct
+import subprocess
+import sys
+import time
+
+OP_WRQ = 2
+OP_DATA = 3
+OP_ACK = 4
+OP_ERROR = 5
+OP_OACK = 6
+
+
+class TftpError(Exception):
+    pass
+
+
+def parse_oack(payload):
+    fields = payload.split(b'\0')[:-1]
+    return {fields[i].decode().lower(): fields[i + 1].decode() for i in range(0, len(fields) - 1, 2)}
+
+
+def image_sha256(image):
+    # The probe hashes the image as written to flash, after inflating it
+    return hashlib.sha256(gzip.decompress(image) if image[:2] == b'\x1f\x8b' else image).hexdigest()
+
+
+def upload(host, port, image, blksize, windowsize, timeout, retries, sha256=False):
+    """Send `image` as firmware.bin, returning the number of retransmitted windows"""
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.settimeout(timeout)
+    options = {'blksize': blksize, 'windowsize': windowsize, 'tsize': len(image)}
+    compressed = image[:2] == b'\x1f\x8b'
+    if sha256:
+        options['sha256'] = image_sha256(image)
+    wrq = struct.pack('!H', OP_WRQ) + (b'firmware.bin.gz' if compressed else b'firmware.bin') + b'\0octet\0'
+    wrq += b''.join(b'%s\0%s\0' % (k.encode(), str(v).encode()) for k, v in options.items())
+
+    # Wait for the OACK (or plain ACK 0 from a server without options)
+    for attempt in range(retries):
+        sock.sendto(wrq, (host, port))
+        try:
+            packet, peer = sock.recvfrom(2048)
+            break
+        except socket.timeout:
+            continue
+    else:
+        raise TftpError('no answer to WRQ')
+
+    opcode = struct.unpack('!H', packet[:2])[0]
+    if opcode == OP_ERROR:
+        raise TftpError(packet[4:-1].decode(errors='replace'))
+    if opcode == OP_OACK:
+        accepted = parse_oack(packet[2:])
+        blksize = int(accepted.get('blksize', 512))
+        windowsize = int(accepted.get('windowsize', 1))
+    elif opcode == OP_ACK:
+        blksize, windowsize = 512, 1
+    else:
+        raise TftpError('unexpected opcode %d' % opcode)
+
+    blocks = len(image) // blksize + 1
+    acked = 0
+    resends = 0
+    failures = 0
+    while acked < blocks:
+        # Send a window starting after the last block the server ACKed
+        for n in range(acked + 1, min(acked + windowsize, blocks) + 1):
+            data = image[(n - 1) * blksize:n * blksize]
+            sock.sendto(struct.pack('!HH', OP_DATA, n & 0xffff) + data, peer)
+        try:
+            while True:
+                packet, _ = sock.recvfrom(2048)
+                opcode, value = struct.unpack('!HH', packet[:4])
+                if opcode == OP_ERROR:
+                    raise TftpError(packet[4:-1].decode(errors='replace'))
+                if opcode != OP_ACK:
+                    continue
+                # Block numbers wrap, so find the ACK relative to the window
+                ahead = (value - acked) & 0xffff
+                if ahead <= windowsize:
+                    if ahead == 0:
+                        resends += 1
+                    acked += ahead
+                    failures = 0
+                    break
+        except socket.timeout:
+            failures += 1
+            resends += 1
+            if failures > retries:
+                raise TftpError('timed out at block %d' % (acked + 1))
+    return resends
+
+
+def upload_curl(host, port, path, blksize):
+    subprocess.run(['curl', '--silent', '--show-error', '--tftp-blksize', str(blksize), '-T', path,
+                    'tftp://%s:%d/firmware.bin' % (host, port)], check=True)
+
+
+def upload_http(host, image, timeout, sha256=False):
+    headers = {'Content-Type': 'application/octet-stream'}
+    if sha256:
+        headers['X-SHA256'] = image_sha256(image)
+    conn = http.client.HTTPConnection(host, timeout=timeout * 10)
+    try:
+        conn.request('PUT', '/flash/upload', body=image, headers=headers)
+        response = conn.getresponse()
+        body = response.read().decode(errors='replace')
+    except OSError as e:
+        raise TftpError('HTTP upload failed: %s' % e)
+    finally:
+        conn.close()
+    try:
+        result = json.loads(body)
+    except ValueError:
+        result = {'success': False, 'error': body.strip()}
+    if response.status != 200 or not result.get('success'):
+        raise TftpError('HTTP %d: %s' % (response.status, result.get('error', body)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('host')
+    parser.add_argument('image')
+    parser.add_argument('--port', type=int, default=69)
+    parser.add_argument('--blksize', type=int, nargs='+', default=[512, 1468])
+    parser.add_argument('--windowsize', type=int, nargs='+', default=[1, 4, 8])
+    parser.add_argument('--timeout', type=float, default=2.0)
+    parser.add_argument('--retries', type=int, default=5)
+    parser.add_argument('--settle', type=float, default=15.0, help='seconds to wait for the reboot between runs')
+    parser.add_argument('--sha256', action='store_true', help='send the SHA-256 of the image as an option')
+    parser.add_argument('--curl', action='store_true', help='upload with curl instead of the built-in client')
+    parser.add_argument('--http', action='store_true', help='upload with an HTTP PUT instead of TFTP')
+    args = parser.parse_args()
+
+    with open(args.image, 'rb') as f:
+        image = f.read()
+    megabytes = len(image) / (1024 * 1024)
+    if image[:2] == b'\x1f\x8b':
+        image_megabytes = len(gzip.decompress(image)) / (1024 * 1024)
+    else:
+        image_megabytes = megabytes
+
+    if args.http:
+        runs = [(0, 0)]
+    elif args.curl:
+        runs = [(b, 1) for b in args.blksize]
+    else:
+        runs = [(b, w) for b in args.blksize for w in args.windowsize]
+    print('%-8s %-10s %8s %8s %10s %8s' % ('blksize', 'windowsize', 'seconds', 's/MB', 'image s/MB', 'resends'))
+    for i, (blksize, windowsize) in enumerate(runs):
+        if i:
+            time.sleep(args.settle)
+        start = time.monotonic()
+        try:
+            if args.http:
+                upload_http(args.host, image, args.timeout, args.sha256)
+                resends = '-'
+            elif args.curl:
+                upload_curl(args.host, args.port, args.image, blksize)
+                resends = '-'
+            else:
+                resends = upload(args.host, args.port, image, blksize, windowsize, args.timeout, args.retries,
+                                 args.sha256)
+        except (TftpError, subprocess.CalledProcessError) as e:
+            print('%-8d %-10d failed: %s' % (blksize, windowsize, e))
+            continue
+        elapsed = time.monotonic() - start
+        print('%-8d %-10d %8.2f %8.2f %10.2f %8s' % (blksize, windowsize, elapsed, elapsed / megabytes,
+                                                    elapsed / image_megabytes, resends))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())